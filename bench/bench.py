@@ -0,0 +1,145 @@
+#!/usr/bin/env python3
+#
+# Cold start benchmark of IpAddressExpress.
+#
+# Runs the binary many times against local stand-in ipservices and reports the minimum,
+# median and 99th percentile of every phase of a run in milliseconds. The phases are
+# printed by the binary with --timings, process is the wall time of the process minus the
+# time measured inside main: starting the process, loading libraries and exiting.
+# The public ip address of the stand-ins changes every run, so every run confirms the
+# change and runs the posthook. The stand-ins use plain http, so tls is always 0.
+#
+# Usage: bench.py [--runs n] [--out results.json] [binary] [-- extra arguments]
+#
+import argparse
+import json
+import os
+import subprocess
+import sqlite3
+import sys
+import tempfile
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+PHASES = ["process", "dbopen", "lockwait", "selector", "curlinit", "dns", "connect", "tls", "ttfb",
+          "parse", "lookups", "dbwrite", "posthook", "total", "wall"]
+NUMSTANDINS = 3
+publicip = "192.0.2.1"
+
+
+class StandInHandler(BaseHTTPRequestHandler):
+    def do_GET(self):
+        body = (publicip + "\n").encode()
+        self.send_response(200)
+        self.send_header("Content-Type", "text/plain")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, format, *args):
+        pass
+
+
+def start_standins():
+    ports = []
+    for _ in range(NUMSTANDINS):
+        server = ThreadingHTTPServer(("127.0.0.1", 0), StandInHandler)
+        threading.Thread(target=server.serve_forever, daemon=True).start()
+        ports.append(server.server_address[1])
+    return ports
+
+
+def setup_database(binary, workdir, ports):
+    # An existing database without tables gets the schema but not the default ipservices.
+    dbpath = os.path.join(workdir, "ipaddressexpress.db")
+    open(dbpath, "w").close()
+    subprocess.run([binary, "--showlastrun"], cwd=workdir, stdout=subprocess.DEVNULL, check=True)
+    db = sqlite3.connect(dbpath)
+    for nr, port in enumerate(ports):
+        db.execute("INSERT INTO ipservice (nr, protocoltype, url) VALUES (?, 1, ?)",
+                   (nr, "http://127.0.0.1:%d/" % port))
+    db.execute("INSERT INTO config (name, valueint) VALUES ('lasturlnr', -2)")
+    db.commit()
+    db.close()
+
+
+def run_once(binary, workdir, extraargs):
+    args = [binary, "--unsafehttp", "--timings", "--posthook", "/bin/true"] + extraargs
+    start = time.perf_counter()
+    proc = subprocess.run(args, cwd=workdir, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE,
+                          text=True)
+    wallms = (time.perf_counter() - start) * 1000
+    timings = None
+    for line in proc.stderr.splitlines():
+        if line.startswith("{"):
+            timings = json.loads(line)
+    if proc.returncode != 0 or timings is None:
+        sys.exit("Run failed (exit code %d):\n%s" % (proc.returncode, proc.stderr))
+    timings["wall"] = wallms
+    timings["process"] = wallms - timings["total"]
+    return timings
+
+
+def percentile(values, pct):
+    ordered = sorted(values)
+    rank = max(0, min(len(ordered) - 1, int(round(pct / 100.0 * len(ordered) + 0.5)) - 1))
+    return ordered[rank]
+
+
+def git_revision():
+    try:
+        return subprocess.run(["git", "rev-parse", "--short", "HEAD"], capture_output=True,
+                              text=True, check=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def main():
+    global publicip
+    argv = sys.argv[1:]
+    extraargs = []
+    if "--" in argv:
+        extraargs = argv[argv.index("--") + 1:]
+        argv = argv[:argv.index("--")]
+    parser = argparse.ArgumentParser(description="Cold start benchmark of IpAddressExpress.")
+    parser.add_argument("binary", nargs="?", default="./ipaddressexpress")
+    parser.add_argument("--runs", type=int, default=50)
+    parser.add_argument("--out", default="bench_results.json")
+    options = parser.parse_args(argv)
+    binary = os.path.abspath(options.binary)
+    ports = start_standins()
+    samples = {phase: [] for phase in PHASES}
+    with tempfile.TemporaryDirectory() as workdir:
+        setup_database(binary, workdir, ports)
+        # The first run has nothing to compare with, it is not measured.
+        run_once(binary, workdir, extraargs)
+        for run in range(options.runs):
+            publicip = "192.0.2.%d" % (run % 2 + 2)
+            timings = run_once(binary, workdir, extraargs)
+            for phase in PHASES:
+                samples[phase].append(timings[phase])
+
+    results = {
+        "binary": binary,
+        "revision": git_revision(),
+        "args": extraargs,
+        "runs": options.runs,
+        "phases": {phase: {"min": round(min(values), 3),
+                           "p50": round(percentile(values, 50), 3),
+                           "p99": round(percentile(values, 99), 3)}
+                   for phase, values in samples.items()},
+    }
+    with open(options.out, "w") as out:
+        json.dump(results, out, indent=2)
+        out.write("\n")
+
+    print("%-10s %10s %10s %10s" % ("phase (ms)", "min", "p50", "p99"))
+    for phase in PHASES:
+        stats = results["phases"][phase]
+        print("%-10s %10.3f %10.3f %10.3f" % (phase, stats["min"], stats["p50"], stats["p99"]))
+    print("Results written to %s." % options.out)
+
+
+if __name__ == "__main__":
+    main()
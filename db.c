@@ -22,263 +22,1398 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <time.h>
+#include <arpa/inet.h>
 #include <sqlite3.h>
+#include "db.h"
+#include "statefile.h"
 
 #define MAXLENURL          1023
 #define MAXLENCONFIGSTR    255
 #define MAXPRIORITY        9
+#define MINLATENCYSAMPLES  3
+#define BREAKERBASEWAIT    60
+#define BUSYTIMEOUTMS      5000
+#define SCHEMAVERSION      4
+
+/* The statements that are prepared once per connection, see get_statement(). */
+enum DbStatement {
+        STMTADDIPSERVICE,
+        STMTCOUNTALLIPSERVICES,
+        STMTCOUNTAVAILABLEIPSERVICES,
+        STMTGETURLIPSERVICE,
+        STMTOPENBREAKER,
+        STMTCLOSEBREAKER,
+        STMTDISABLEFOREVER,
+        STMTADDIPSERVICESTATS,
+        STMTINCREMENTCOUNTERS,
+        STMTGETSCORES,
+        STMTUPDATELATENCY,
+        STMTGETLATENCYP99,
+        STMTGETLATENCYP95,
+        STMTSAVEDNSCACHE,
+        STMTDELETEDNSCACHE,
+        STMTDELETEEXPIREDDNSCACHE,
+        STMTGETDNSCACHE,
+        STMTDELETETLSSESSIONS,
+        STMTADDTLSSESSION,
+        STMTGETTLSSESSIONS,
+        STMTGETEGRESSPROXY,
+        STMTSAVEEGRESSPROXY,
+        STMTGETCONFIGINT,
+        STMTGETCONFIGSTR,
+        STMTSETCONFIGINT,
+        STMTSETCONFIGSTR,
+        STMTCONFIGEXISTS,
+        STMTBEGIN,
+        STMTCOMMIT,
+        NUMSTATEMENTS
+};
+
+/*
+ * A database connection together with its prepared statements, or a state file.
+ * Once the state file is in use the database is closed until the ipservices in the
+ * database are edited and the state file has to be built again.
+ */
+struct DbContext {
+        sqlite3 *db;
+        sqlite3_stmt *stmts[NUMSTATEMENTS];
+        char *dbfilename;
+        char *statefilename;
+        struct StateFile *state;
+};
+
+/**
+ * Check if the state file is used instead of the database.
+ */
+static bool use_statefile(struct DbContext *dbctx)
+{
+        return dbctx->db == NULL;
+}
+
+/**
+ * Check if an ipservice from the state file is available, closed or half-open.
+ * @param allowedprotocoltypes Bitmask with bit (1 << protocoltype) set for the allowed protocols.
+ * @param families             FAMILYIPV4 or FAMILYIPV6, the address family to look up.
+ */
+static bool is_available(const struct StateService *service, int allowedprotocoltypes, int families)
+{
+        return (service->disabled == 0 ||
+                (service->disabled == 1 && service->retryafter != 0 &&
+                 service->retryafter <= time(NULL))) &&
+               ((1 << service->protocoltype) & allowedprotocoltypes) != 0 &&
+               (service->families & families) != 0;
+}
+
+/**
+ * Open the database file, creating it if it does not exist.
+ * The database is switched to write-ahead logging with synchronous NORMAL, so a commit
+ * appends to the log without waiting for a sync and readers are never blocked by a writer.
+ * A power loss can lose the last commits, but never corrupts the database.
+ * @return false if the database could not be opened.
+ */
+static bool open_sqlite(struct DbContext *dbctx)
+{
+        if (sqlite3_open(dbctx->dbfilename, &dbctx->db) != SQLITE_OK) {
+                sqlite3_close(dbctx->db);
+                dbctx->db = NULL;
+                return false;
+        }
+
+        sqlite3_busy_timeout(dbctx->db, BUSYTIMEOUTMS);
+        if (sqlite3_exec(dbctx->db, "PRAGMA journal_mode = WAL; PRAGMA synchronous = NORMAL;",
+                         NULL, NULL, NULL) != SQLITE_OK) {
+                fprintf(stderr, "Error setting journal mode: %s\n", sqlite3_errmsg(dbctx->db));
+        }
+
+        return true;
+}
+
+/**
+ * Finalize all prepared statements and close the database.
+ */
+static void close_sqlite(struct DbContext *dbctx)
+{
+        for (int i = 0; i < NUMSTATEMENTS; ++i) {
+                sqlite3_finalize(dbctx->stmts[i]);
+                dbctx->stmts[i] = NULL;
+        }
+
+        sqlite3_close(dbctx->db);
+        dbctx->db = NULL;
+}
+
+/**
+ * Open the database, or the state file if statefilename is set and the state file was built
+ * from the database as it is now. Without a usable state file the database is opened and
+ * the state file is built from it on the first commit_transaction().
+ * @param filename      The path of the database file.
+ * @param statefilename The path of the state file, or NULL to only use the database.
+ * @return The database context, or NULL if the database could not be opened.
+ */
+struct DbContext * db_open(const char *filename, const char *statefilename)
+{
+        struct DbContext *dbctx = calloc(1, sizeof(struct DbContext));
+        if (dbctx == NULL) {
+                return NULL;
+        }
+
+        dbctx->dbfilename = malloc(strlen(filename) + 1);
+        strcpy(dbctx->dbfilename, filename);
+        if (statefilename != NULL) {
+                dbctx->statefilename = malloc(strlen(statefilename) + 1);
+                strcpy(dbctx->statefilename, statefilename);
+                dbctx->state = statefile_open(statefilename);
+                if (dbctx->state != NULL && statefile_is_built_from(dbctx->state, filename)) {
+                        return dbctx;
+                }
+        }
+
+        if (!open_sqlite(dbctx)) {
+                db_close(dbctx);
+                return NULL;
+        }
+
+        return dbctx;
+}
+
+/**
+ * Close the database or state file. Changes to the state file since the last
+ * commit_transaction() are not saved.
+ */
+void db_close(struct DbContext *dbctx)
+{
+        if (dbctx == NULL) {
+                return;
+        }
+
+        if (!use_statefile(dbctx)) {
+                close_sqlite(dbctx);
+        }
+
+        statefile_close(dbctx->state);
+        free(dbctx->dbfilename);
+        free(dbctx->statefilename);
+        free(dbctx);
+}
+
+/**
+ * Get a prepared statement, the statement is only compiled the first time it is used.
+ * Every statement has to be handed back with release_statement() before it is used again.
+ * @param stmtid The statement, a value of enum DbStatement.
+ * @param sql    The SQL of the statement.
+ * @return The statement, or NULL if the SQL could not be compiled.
+ */
+static sqlite3_stmt * get_statement(struct DbContext *dbctx, enum DbStatement stmtid, const char *sql)
+{
+        if (dbctx->stmts[stmtid] == NULL &&
+            sqlite3_prepare_v3(dbctx->db, sql, -1, SQLITE_PREPARE_PERSISTENT,
+                               &dbctx->stmts[stmtid], NULL) != SQLITE_OK) {
+                fprintf(stderr, "Error preparing statement: %s\n", sqlite3_errmsg(dbctx->db));
+                sqlite3_finalize(dbctx->stmts[stmtid]);
+                dbctx->stmts[stmtid] = NULL;
+        }
+
+        return dbctx->stmts[stmtid];
+}
+
+/**
+ * Hand back a statement from get_statement(). Resetting ends the read of a statement
+ * that still has rows, and clearing the bindings drops the pointers to bound text.
+ */
+static void release_statement(sqlite3_stmt *stmt)
+{
+        if (stmt != NULL) {
+                sqlite3_reset(stmt);
+                sqlite3_clear_bindings(stmt);
+        }
+}
+
+/**
+ * Build the state file from the ipservices, statistics, saved addresses and config in the
+ * database. What changed while running is taken over from the previous state file, and
+ * then the database is closed.
+ * TLS sessions are not kept in the state file.
+ * @return false if the state file could not be built, the database is then kept in use.
+ */
+static bool build_statefile(struct DbContext *dbctx)
+{
+        struct StateFile *state = statefile_new(dbctx->statefilename);
+        if (state == NULL) {
+                return false;
+        }
+
+        bool built = true;
+        sqlite3_stmt *stmt = NULL;
+        sqlite3_prepare_v2(dbctx->db,
+                           "SELECT i.`nr`, i.`disabled`, i.`protocoltype`, i.`url`, i.`priority`, \
+ IFNULL(i.`lasterroron`, 0), i.`consecutivefailures`, IFNULL(i.`retryafter`, 0), \
+ IFNULL(s.`samples`, 0), IFNULL(s.`srttms`, 0), IFNULL(s.`rttvarms`, 0), \
+ IFNULL(s.`connectsrttms`, 0), IFNULL(s.`connectrttvarms`, 0), \
+ IFNULL(s.`failures`, 0), IFNULL(s.`disagreements`, 0), i.`families` \
+ FROM `ipservice` i LEFT JOIN `ipservicestats` s ON s.`nr` = i.`nr` ORDER BY i.`nr`;",
+                           -1,
+                           &stmt,
+                           NULL);
+        while (built && sqlite3_step(stmt) == SQLITE_ROW) {
+                struct StateService service;
+                const char *url = (const char *)sqlite3_column_text(stmt, 3);
+                if (url == NULL || strlen(url) > STATEMAXLENURL) {
+                        fprintf(stderr, "Url of ipservice %d too long for the state file.\n",
+                                sqlite3_column_int(stmt, 0));
+                        continue;
+                }
+
+                memset(&service, 0, sizeof(service));
+                service.nr = sqlite3_column_int(stmt, 0);
+                service.disabled = sqlite3_column_int(stmt, 1);
+                service.dbdisabled = service.disabled;
+                service.protocoltype = sqlite3_column_int(stmt, 2);
+                strcpy(service.url, url);
+                service.priority = sqlite3_column_int(stmt, 4);
+                service.lasterroron = sqlite3_column_int64(stmt, 5);
+                service.consecutivefailures = sqlite3_column_int(stmt, 6);
+                service.retryafter = sqlite3_column_int64(stmt, 7);
+                service.samples = sqlite3_column_int(stmt, 8);
+                service.srttms = sqlite3_column_int(stmt, 9);
+                service.rttvarms = sqlite3_column_int(stmt, 10);
+                service.connectsrttms = sqlite3_column_int(stmt, 11);
+                service.connectrttvarms = sqlite3_column_int(stmt, 12);
+                service.failures = sqlite3_column_int(stmt, 13);
+                service.disagreements = sqlite3_column_int(stmt, 14);
+                service.families = sqlite3_column_int(stmt, 15);
+                built = statefile_add_service(state, &service);
+        }
+
+        sqlite3_finalize(stmt);
+        if (dbctx->state != NULL) {
+                statefile_copy_runtime(state, dbctx->state);
+        } else {
+                sqlite3_prepare_v2(dbctx->db,
+                                   "SELECT `name`, `valueint`, `valuestr` FROM `config`;",
+                                   -1,
+                                   &stmt,
+                                   NULL);
+                while (sqlite3_step(stmt) == SQLITE_ROW) {
+                        const char *name = (const char *)sqlite3_column_text(stmt, 0);
+                        const char *valuestr = (const char *)sqlite3_column_text(stmt, 2);
+                        struct StateConfig *config = NULL;
+                        if (name != NULL) {
+                                config = statefile_find_config(state, name, true);
+                        }
+
+                        if (config != NULL) {
+                                config->valueint = sqlite3_column_int(stmt, 1);
+                                if (valuestr != NULL && strlen(valuestr) <= STATEMAXLENCONFIGSTR) {
+                                        strcpy(config->valuestr, valuestr);
+                                }
+                        }
+                }
+
+                sqlite3_finalize(stmt);
+                sqlite3_prepare_v2(dbctx->db,
+                                   "SELECT `host`, `port`, `address`, `expireson` FROM `dnscache` \
+ WHERE `expireson` > ?1 LIMIT ?2;",
+                                   -1,
+                                   &stmt,
+                                   NULL);
+                sqlite3_bind_int(stmt, 1, (int)time(NULL));
+                sqlite3_bind_int(stmt, 2, STATEMAXDNSCACHE);
+                struct StateDnsCache *dnscache = statefile_dnscache(state);
+                for (int i = 0; i < STATEMAXDNSCACHE && sqlite3_step(stmt) == SQLITE_ROW; ++i) {
+                        const char *host = (const char *)sqlite3_column_text(stmt, 0);
+                        const char *address = (const char *)sqlite3_column_text(stmt, 2);
+                        if (host == NULL || address == NULL || strlen(host) > STATEMAXLENHOST ||
+                            strlen(address) >= sizeof(dnscache[i].address)) {
+                                continue;
+                        }
+
+                        strcpy(dnscache[i].host, host);
+                        dnscache[i].port = sqlite3_column_int(stmt, 1);
+                        strcpy(dnscache[i].address, address);
+                        dnscache[i].expireson = sqlite3_column_int64(stmt, 3);
+                }
+
+                sqlite3_finalize(stmt);
+        }
+
+        if (!built) {
+                statefile_close(state);
+                return false;
+        }
+
+        // Closing the database can still write to it, so the database is only looked at after.
+        close_sqlite(dbctx);
+        statefile_set_built_from(state, dbctx->dbfilename);
+        statefile_close(dbctx->state);
+        dbctx->state = state;
+        return true;
+}
+
+/**
+ * Start a transaction, so all following changes are written to disk at once on
+ * commit_transaction() instead of one sync for every change.
+ * The write lock is only taken on the first change.
+ * When the state file is used and the database has been edited since the state file was
+ * built, the database is opened to build the state file again.
+ */
+int begin_transaction(struct DbContext *dbctx)
+{
+        int retcode;
+        if (use_statefile(dbctx)) {
+                if (statefile_is_built_from(dbctx->state, dbctx->dbfilename) || !open_sqlite(dbctx) ||
+                    build_statefile(dbctx)) {
+                        return SQLITE_DONE;
+                }
+
+                fprintf(stderr, "Error building state file.\n");
+        }
+
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTBEGIN, "BEGIN;");
+        retcode = sqlite3_step(stmt);
+        if (retcode != SQLITE_DONE) {
+                fprintf(stderr, "Error starting transaction: %s\n", sqlite3_errmsg(dbctx->db));
+        }
+
+        release_statement(stmt);
+        return retcode;
+}
+
+/**
+ * Write all changes since begin_transaction() to disk.
+ * If a state file should be used but the database is open, the state file is built after
+ * the commit and used from then on.
+ */
+int commit_transaction(struct DbContext *dbctx)
+{
+        int retcode = SQLITE_DONE;
+        if (use_statefile(dbctx)) {
+                if (!statefile_save(dbctx->state)) {
+                        fprintf(stderr, "Error saving state file.\n");
+                        return SQLITE_IOERR;
+                }
+
+                return SQLITE_DONE;
+        }
+
+        if (!sqlite3_get_autocommit(dbctx->db)) {
+                sqlite3_stmt *stmt = get_statement(dbctx, STMTCOMMIT, "COMMIT;");
+                retcode = sqlite3_step(stmt);
+                if (retcode != SQLITE_DONE) {
+                        fprintf(stderr, "Error committing transaction: %s\n", sqlite3_errmsg(dbctx->db));
+                }
+
+                release_statement(stmt);
+        }
+
+        if (retcode == SQLITE_DONE && dbctx->statefilename != NULL && !build_statefile(dbctx)) {
+                fprintf(stderr, "Error building state file.\n");
+        }
+
+        return retcode;
+}
+
+/**
+ * Create table ipservice with all ipservices to possible use.
+ * @param verbosemode Print a message if ipservice table is successfully created.
+ */
+static int create_table_ipservice(struct DbContext *dbctx, bool verbosemode)
+{
+        int retcode;
+        sqlite3_stmt *stmt = NULL;
+        sqlite3_prepare_v2(dbctx->db, "CREATE TABLE IF NOT EXISTS `ipservice` ( \
+ `nr` INT PRIMARY KEY NOT NULL, \
+ `disabled` TINYINT NOT NULL DEFAULT 0, \
+ `protocoltype` TINYINT NOT NULL, \
+ `url` TEXT(1023) NOT NULL, \
+ `priority` TINYINT(10) NOT NULL DEFAULT 1, \
+ `lastErrorOn` NUMERIC, \
+ `consecutivefailures` INT NOT NULL DEFAULT 0, \
+ `retryafter` NUMERIC );", -1, &stmt, NULL);
+        retcode = sqlite3_step(stmt);
+        if (retcode != SQLITE_DONE) {
+                fprintf(stderr, "Error creating ipservice table: %s\n", sqlite3_errmsg(dbctx->db));
+        } else if (verbosemode) {
+                fprintf(stdout, "Table ipservice succesfully created.\n");
+        }
+
+        sqlite3_finalize(stmt);
+        return retcode;
+}
+
+
+/**
+ * Add a column to a table created by an older version of this program.
+ * @param table      The name of the table.
+ * @param column     The name of the column.
+ * @param definition The type and constraints of the column.
+ * @return true if the column has been added.
+ */
+static bool add_column_if_missing(struct DbContext *dbctx, const char *table, const char *column,
+                                  const char *definition)
+{
+        char sql[256];
+        sqlite3_stmt *stmt = NULL;
+        snprintf(sql, sizeof(sql), "SELECT `%s` FROM `%s` LIMIT 0;", column, table);
+        if (sqlite3_prepare_v2(dbctx->db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+                sqlite3_finalize(stmt);
+                return false;
+        }
+
+        sqlite3_finalize(stmt);
+        snprintf(sql, sizeof(sql), "ALTER TABLE `%s` ADD COLUMN `%s` %s;", table, column, definition);
+        stmt = NULL;
+        sqlite3_prepare_v2(dbctx->db, sql, -1, &stmt, NULL);
+        bool added = sqlite3_step(stmt) == SQLITE_DONE;
+        if (!added) {
+                fprintf(stderr, "Error adding column %s to %s: %s\n", column, table, sqlite3_errmsg(dbctx->db));
+        }
+
+        sqlite3_finalize(stmt);
+        return added;
+}
+
+/**
+ * Add the circuit breaker columns to an ipservice table created by an older version.
+ * Temporary disabled ipservices keep waiting until errorwait after their last error,
+ * ipservices disabled without a timestamp are disabled forever.
+ * @param errorwait The number of seconds temporary disabled ipservices used to wait.
+ */
+static int upgrade_table_ipservice(struct DbContext *dbctx, int errorwait)
+{
+        int retcode = SQLITE_DONE;
+        sqlite3_stmt *stmt = NULL;
+        if (add_column_if_missing(dbctx, "ipservice", "consecutivefailures", "INT NOT NULL DEFAULT 0") &&
+            add_column_if_missing(dbctx, "ipservice", "retryafter", "NUMERIC")) {
+                sqlite3_prepare_v2(dbctx->db,
+                                   "UPDATE `ipservice` SET `disabled` = CASE WHEN `lasterroron` IS NULL \
+ THEN 2 ELSE 1 END, `retryafter` = `lasterroron` + ?1, `consecutivefailures` = 1 WHERE `disabled` = 1;",
+                                   -1,
+                                   &stmt,
+                                   NULL);
+                sqlite3_bind_int(stmt, 1, errorwait);
+                retcode = sqlite3_step(stmt);
+                if (retcode != SQLITE_DONE) {
+                        fprintf(stderr, "Error upgrading ipservice: %s\n", sqlite3_errmsg(dbctx->db));
+                }
+
+                sqlite3_finalize(stmt);
+        }
+
+        sqlite3_prepare_v2(dbctx->db,
+                           "CREATE INDEX IF NOT EXISTS `ipservice_breaker` ON `ipservice` (`disabled`, `retryafter`);",
+                           -1,
+                           &stmt,
+                           NULL);
+        sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+        return retcode;
+}
+
+/**
+ * Add an https/http or dns ip service to the ipservice database table.
+ * if disabled is true then the ipservice has a persistent error and should not be used anymore.
+ * @param urlnr        The ipservice number.
+ * @param url          The url or address of the ipservice.
+ * @param disabled     Is the ipservice disabled.
+ * @param protocoltype The protocol type to use. 0 for dns, protocoltype = 1 for http,
+                       protocoltype = 2 for https and protocoltype = 3 for stun.
+ * @param priority     The priority of the ipservice to use. From 1(most favourable) till 10(least favourable to use) at most.
+ * @param families     The address families the ipservice can look up, FAMILYIPV4 and/or FAMILYIPV6.
+ * @param verbosemode  Print a message if ipservice is succesfully added to database.
+ */
+int add_ipservice(struct DbContext *dbctx, int urlnr, char * url, bool disabled, int protocoltype, int priority,
+                  int families, bool verbosemode)
+{
+        if (use_statefile(dbctx)) {
+                fprintf(stderr, "Ipservices can only be added to the database, not to the state file.\n");
+                return SQLITE_MISUSE;
+        }
+
+        if (protocoltype < 0 || protocoltype > 3) {
+                exit(EXIT_FAILURE);
+        }
+
+        if (priority < 1 || priority > MAXPRIORITY) {
+                exit(EXIT_FAILURE);
+
+        }
+
+        if (strlen(url) >= MAXLENURL) {
+            printf("Url too long, maximum %d character allowed.\n", MAXLENURL);
+            return 1;
+        }
+
+        int retcode;
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTADDIPSERVICE,
+                                           "INSERT INTO `ipservice` (`nr`, `disabled`, `protocoltype`, `url`, `priority`, \
+ `families`) VALUES (?1, ?2, ?3, ?4, ?5, ?6);");
+        sqlite3_bind_int(stmt, 1, urlnr);
+        sqlite3_bind_int(stmt, 2, disabled ? 2 : 0);
+        sqlite3_bind_int(stmt, 3, protocoltype);
+        sqlite3_bind_text(stmt, 4, url, -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 5, priority);
+        sqlite3_bind_int(stmt, 6, families);
+        retcode = sqlite3_step(stmt);
+        if (retcode != SQLITE_DONE) {
+                printf("ERROR inserting data: %s\n", sqlite3_errmsg(dbctx->db));
+        } else if (verbosemode) {
+                fprintf(stdout, "Added ipservice record.\n");
+        }
+
+        release_statement(stmt);
+        return retcode;
+}
+
+/**
+ * Get the number of ipservices in the ipservice table.
+ */
+int get_count_all_ipservices(struct DbContext *dbctx)
+{
+        int cntall = 0;
+        if (use_statefile(dbctx)) {
+                return statefile_count_services(dbctx->state);
+        }
+
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTCOUNTALLIPSERVICES,
+                                           "SELECT COUNT(`nr`) FROM `ipservice` LIMIT 1;");
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+                cntall = sqlite3_column_int(stmt, 0);
+        }
+
+        release_statement(stmt);
+        return cntall;
+}
+
+/**
+ * Get the number of available ipservices, closed or half-open.
+ * @param allowedprotocoltypes Bitmask with bit (1 << protocoltype) set for the allowed protocols.
+ * @param families             FAMILYIPV4 or FAMILYIPV6, the address family to look up.
+ */
+int get_count_available_ipservices(struct DbContext *dbctx, int allowedprotocoltypes, int families)
+{
+        int cntavailable = 0;
+        if (use_statefile(dbctx)) {
+                for (int i = 0; i < statefile_count_services(dbctx->state); ++i) {
+                        if (is_available(statefile_get_service(dbctx->state, i), allowedprotocoltypes,
+                                         families)) {
+                                ++cntavailable;
+                        }
+                }
+
+                return cntavailable;
+        }
+
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTCOUNTAVAILABLEIPSERVICES,
+                                           "SELECT COUNT(`nr`) FROM `ipservice` WHERE (`disabled` = 0 OR `disabled` = 1 AND `retryafter` <= ?2) \
+ AND ((1 << `protocoltype`) & ?1) != 0 AND (`families` & ?3) != 0 LIMIT 1;");
+        sqlite3_bind_int(stmt, 1, allowedprotocoltypes);
+        sqlite3_bind_int(stmt, 2, (int)time(NULL));
+        sqlite3_bind_int(stmt, 3, families);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+                cntavailable = sqlite3_column_int(stmt, 0);
+        }
+
+        release_statement(stmt);
+        return cntavailable;
+}
+
+/**
+ * Get the url for a ipservice number.
+ * @param urlnr The ipservice number to get the url from.
+ */
+const char * get_url_ipservice(struct DbContext *dbctx, int urlnr)
+{
+        const char *url;
+        char *urlipservice;
+        int sizeurlipservice = MAXLENURL * sizeof(char);
+        urlipservice = malloc(sizeurlipservice);
+        if (use_statefile(dbctx)) {
+                struct StateService *service = statefile_find_service(dbctx->state, urlnr);
+                strcpy(urlipservice, service != NULL ? service->url : "");
+                return urlipservice;
+        }
+
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTGETURLIPSERVICE,
+                                           "SELECT `url` FROM `ipservice` WHERE `nr` = ?1 LIMIT 1;");
+        sqlite3_bind_int(stmt, 1, urlnr);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+                url = (const char *)sqlite3_column_text(stmt, 0);
+        } else {
+                url = "";
+        }
+
+        strcpy(urlipservice, url);
+        release_statement(stmt);
+        return urlipservice;
+}
+
+/**
+ * Open the circuit breaker of an ipservice after a failure, so it is not chosen until
+ * retryafter. The wait doubles with every consecutive failure, starting at BREAKERBASEWAIT
+ * seconds up to maxwait seconds, and is randomly shortened by up to half so ipservices that
+ * failed at the same moment are not all retried at the same moment.
+ * A failed retry of an ipservice in half-open state opens the breaker again for longer.
+ * @param urlnr   The number of the ipservice that failed.
+ * @param minwait The least number of seconds to wait, for example from a Retry-After header.
+ * @param maxwait The most number of seconds to wait, unless minwait is longer.
+ */
+int open_breaker_ipservice(struct DbContext *dbctx, int urlnr, int minwait, int maxwait)
+{
+        int retcode;
+        if (use_statefile(dbctx)) {
+                struct StateService *service = statefile_find_service(dbctx->state, urlnr);
+                if (service != NULL && service->disabled != 2) {
+                        unsigned int random;
+                        sqlite3_randomness(sizeof(random), &random);
+                        int64_t wait = (int64_t)BREAKERBASEWAIT << (service->consecutivefailures < 20 ?
+                                                                    service->consecutivefailures : 20);
+                        wait = (wait < maxwait ? wait : maxwait) * (50 + random % 51) / 100;
+                        service->disabled = 1;
+                        service->lasterroron = time(NULL);
+                        service->consecutivefailures++;
+                        service->retryafter = service->lasterroron + (wait > minwait ? wait : minwait);
+                        statefile_changed(dbctx->state);
+                }
+
+                return SQLITE_DONE;
+        }
+
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTOPENBREAKER,
+                                           "UPDATE `ipservice` SET `disabled` = 1, `lasterroron` = ?1, \
+ `consecutivefailures` = `consecutivefailures` + 1, \
+ `retryafter` = ?1 + MAX(?3, MIN(?4, ?5 << MIN(`consecutivefailures`, 20)) * (50 + ABS(RANDOM() % 51)) / 100) \
+ WHERE `nr` = ?2 AND `disabled` != 2;");
+        sqlite3_bind_int(stmt, 1, (int)time(NULL));
+        sqlite3_bind_int(stmt, 2, urlnr);
+        sqlite3_bind_int(stmt, 3, minwait);
+        sqlite3_bind_int(stmt, 4, maxwait);
+        sqlite3_bind_int(stmt, 5, BREAKERBASEWAIT);
+        retcode = sqlite3_step(stmt);
+        if (retcode != SQLITE_DONE) {
+                fprintf(stderr, "Error updating ipservice: %s\n", sqlite3_errmsg(dbctx->db));
+        }
+
+        release_statement(stmt);
+        return retcode;
+}
+
+/**
+ * Close the circuit breaker of an ipservice after a successful lookup.
+ * Only writes if the ipservice had failed before.
+ * @param urlnr The number of the ipservice that answered.
+ */
+int close_breaker_ipservice(struct DbContext *dbctx, int urlnr)
+{
+        int retcode;
+        if (use_statefile(dbctx)) {
+                struct StateService *service = statefile_find_service(dbctx->state, urlnr);
+                if (service != NULL && (service->disabled == 1 ||
+                                        (service->disabled == 0 && service->consecutivefailures > 0))) {
+                        service->disabled = 0;
+                        service->consecutivefailures = 0;
+                        service->retryafter = 0;
+                        statefile_changed(dbctx->state);
+                }
+
+                return SQLITE_DONE;
+        }
+
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTCLOSEBREAKER,
+                                           "UPDATE `ipservice` SET `disabled` = 0, `consecutivefailures` = 0, `retryafter` = NULL \
+ WHERE `nr` = ?1 AND `disabled` = 1 OR `nr` = ?1 AND `disabled` = 0 AND `consecutivefailures` > 0;");
+        sqlite3_bind_int(stmt, 1, urlnr);
+        retcode = sqlite3_step(stmt);
+        if (retcode != SQLITE_DONE) {
+                fprintf(stderr, "Error updating ipservice: %s\n", sqlite3_errmsg(dbctx->db));
+        }
+
+        release_statement(stmt);
+        return retcode;
+}
+
+/**
+ * Disable an ipservice forever.
+ * @param urlnr The number of the ipservice to disable.
+ */
+int disable_forever_ipservice(struct DbContext *dbctx, int urlnr)
+{
+        int retcode;
+        if (use_statefile(dbctx)) {
+                struct StateService *service = statefile_find_service(dbctx->state, urlnr);
+                if (service != NULL) {
+                        service->disabled = 2;
+                        statefile_changed(dbctx->state);
+                }
+
+                return SQLITE_DONE;
+        }
+
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTDISABLEFOREVER,
+                                           "UPDATE `ipservice` SET `disabled` = 2 WHERE `nr` = ?1;");
+        sqlite3_bind_int(stmt, 1, urlnr);
+        retcode = sqlite3_step(stmt);
+        if (retcode != SQLITE_DONE) {
+                fprintf(stderr, "Error updating ipservice: %s\n", sqlite3_errmsg(dbctx->db));
+        }
+
+        release_statement(stmt);
+        return retcode;
+}
+
+/**
+ * Create table ipservicestats with the measured latency of every ipservice.
+ * The latency is kept as a smoothed mean and mean deviation in milliseconds, the same way
+ * TCP estimates the round trip time (RFC 6298), for both the connect time and the total time.
+ * Next to that the number of failed lookups and the number of times the ipservice disagreed
+ * with the other ipservices are counted.
+ * @param verbosemode Print a message if ipservicestats table is successfully created.
+ */
+static int create_table_ipservicestats(struct DbContext *dbctx, bool verbosemode)
+{
+        int retcode;
+        sqlite3_stmt *stmt = NULL;
+        sqlite3_prepare_v2(dbctx->db, "CREATE TABLE IF NOT EXISTS `ipservicestats` ( \
+ `nr` INT PRIMARY KEY NOT NULL, \
+ `samples` INT NOT NULL DEFAULT 0, \
+ `srttms` INT NOT NULL DEFAULT 0, \
+ `rttvarms` INT NOT NULL DEFAULT 0, \
+ `connectsrttms` INT NOT NULL DEFAULT 0, \
+ `connectrttvarms` INT NOT NULL DEFAULT 0, \
+ `failures` INT NOT NULL DEFAULT 0, \
+ `disagreements` INT NOT NULL DEFAULT 0 );", -1, &stmt, NULL);
+        retcode = sqlite3_step(stmt);
+        if (retcode != SQLITE_DONE) {
+                fprintf(stderr, "Error creating ipservicestats table: %s\n", sqlite3_errmsg(dbctx->db));
+        } else if (verbosemode) {
+                fprintf(stdout, "Table ipservicestats succesfully created.\n");
+        }
+
+        sqlite3_finalize(stmt);
+        // Tables created by an older version miss the counters.
+        add_column_if_missing(dbctx, "ipservicestats", "failures", "INT NOT NULL DEFAULT 0");
+        add_column_if_missing(dbctx, "ipservicestats", "disagreements", "INT NOT NULL DEFAULT 0");
+        return retcode;
+}
+
+/**
+ * Add to the failure and disagreement counters of ipservicestats.
+ * @param urlnr         The ipservice number.
+ * @param failures      The number to add to the failed lookups.
+ * @param disagreements The number to add to the disagreements.
+ */
+static int increment_counters_ipservicestats(struct DbContext *dbctx, int urlnr, int failures,
+                                            int disagreements)
+{
+        int retcode;
+        if (use_statefile(dbctx)) {
+                struct StateService *service = statefile_find_service(dbctx->state, urlnr);
+                if (service != NULL) {
+                        service->failures += failures;
+                        service->disagreements += disagreements;
+                        statefile_changed(dbctx->state);
+                }
+
+                return SQLITE_DONE;
+        }
+
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTADDIPSERVICESTATS,
+                                           "INSERT OR IGNORE INTO `ipservicestats` (`nr`) VALUES (?1);");
+        sqlite3_bind_int(stmt, 1, urlnr);
+        sqlite3_step(stmt);
+        release_statement(stmt);
+        stmt = get_statement(dbctx, STMTINCREMENTCOUNTERS,
+                             "UPDATE `ipservicestats` SET `failures` = `failures` + ?2, \
+ `disagreements` = `disagreements` + ?3 WHERE `nr` = ?1;");
+        sqlite3_bind_int(stmt, 1, urlnr);
+        sqlite3_bind_int(stmt, 2, failures);
+        sqlite3_bind_int(stmt, 3, disagreements);
+        retcode = sqlite3_step(stmt);
+        if (retcode != SQLITE_DONE) {
+                fprintf(stderr, "Error updating ipservicestats: %s\n", sqlite3_errmsg(dbctx->db));
+        }
+
+        release_statement(stmt);
+        return retcode;
+}
+
+/**
+ * Count a failed lookup of an ipservice.
+ * @param urlnr The ipservice number.
+ */
+int add_failure_ipservice(struct DbContext *dbctx, int urlnr)
+{
+        return increment_counters_ipservicestats(dbctx, urlnr, 1, 0);
+}
+
+/**
+ * Count an ip address of an ipservice that was different from the ip address the other
+ * ipservices agreed on.
+ * @param urlnr The ipservice number.
+ */
+int add_disagreement_ipservice(struct DbContext *dbctx, int urlnr)
+{
+        return increment_counters_ipservicestats(dbctx, urlnr, 0, 1);
+}
+
+/**
+ * Get the available ipservices together with their measured statistics, in one query.
+ * @param scores               Array that is filled with the ipservices.
+ * @param maxscores            The size of the scores array.
+ * @param allowedprotocoltypes Bitmask with bit (1 << protocoltype) set for the allowed protocols.
+ * @param families             FAMILYIPV4 or FAMILYIPV6, the address family to look up.
+ * @return The number of ipservices filled.
+ */
+int get_scores_ipservices(struct DbContext *dbctx, struct IpServiceScore scores[], int maxscores,
+                          int allowedprotocoltypes, int families)
+{
+        int i = 0;
+        if (use_statefile(dbctx)) {
+                for (int n = 0; n < statefile_count_services(dbctx->state) && i < maxscores; ++n) {
+                        struct StateService *service = statefile_get_service(dbctx->state, n);
+                        if (!is_available(service, allowedprotocoltypes, families)) {
+                                continue;
+                        }
+
+                        scores[i].urlnr = service->nr;
+                        scores[i].priority = service->priority;
+                        scores[i].samples = service->samples;
+                        scores[i].p95ms = -1;
+                        if (service->samples >= MINLATENCYSAMPLES) {
+                                scores[i].p95ms = service->srttms + 2 * service->rttvarms;
+                        }
+
+                        scores[i].failures = service->failures;
+                        scores[i].disagreements = service->disagreements;
+                        ++i;
+                }
+
+                return i;
+        }
+
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTGETSCORES,
+                                           "SELECT i.`nr`, i.`priority`, IFNULL(s.`samples`, 0), \
+ CASE WHEN s.`samples` >= ?1 THEN s.`srttms` + 2 * s.`rttvarms` ELSE -1 END, \
+ IFNULL(s.`failures`, 0), IFNULL(s.`disagreements`, 0) \
+ FROM `ipservice` i LEFT JOIN `ipservicestats` s ON s.`nr` = i.`nr` \
+ WHERE (i.`disabled` = 0 OR i.`disabled` = 1 AND i.`retryafter` <= ?4) \
+ AND ((1 << i.`protocoltype`) & ?2) != 0 AND (i.`families` & ?5) != 0 LIMIT ?3;");
+        sqlite3_bind_int(stmt, 1, MINLATENCYSAMPLES);
+        sqlite3_bind_int(stmt, 5, families);
+        sqlite3_bind_int(stmt, 2, allowedprotocoltypes);
+        sqlite3_bind_int(stmt, 3, maxscores);
+        sqlite3_bind_int(stmt, 4, (int)time(NULL));
+        while (sqlite3_step(stmt) == SQLITE_ROW && i < maxscores) {
+                scores[i].urlnr = sqlite3_column_int(stmt, 0);
+                scores[i].priority = sqlite3_column_int(stmt, 1);
+                scores[i].samples = sqlite3_column_int(stmt, 2);
+                scores[i].p95ms = sqlite3_column_int(stmt, 3);
+                scores[i].failures = sqlite3_column_int(stmt, 4);
+                scores[i].disagreements = sqlite3_column_int(stmt, 5);
+                ++i;
+        }
+
+        release_statement(stmt);
+        return i;
+}
+
+/**
+ * Add a latency measurement of an ipservice to the smoothed latency of that ipservice.
+ * @param urlnr     The ipservice number.
+ * @param totalms   The time in milliseconds the whole request took.
+ * @param connectms The time in milliseconds connecting took, including the TLS handshake.
+ */
+int update_latency_ipservice(struct DbContext *dbctx, int urlnr, int totalms, int connectms)
+{
+        int retcode;
+        if (use_statefile(dbctx)) {
+                struct StateService *service = statefile_find_service(dbctx->state, urlnr);
+                if (service == NULL) {
+                        return SQLITE_DONE;
+                }
+
+                if (service->samples == 0) {
+                        service->srttms = totalms;
+                        service->rttvarms = totalms / 2;
+                        service->connectsrttms = connectms;
+                        service->connectrttvarms = connectms / 2;
+                } else {
+                        service->rttvarms = (3 * service->rttvarms + abs(service->srttms - totalms)) / 4;
+                        service->srttms = (7 * service->srttms + totalms) / 8;
+                        service->connectrttvarms = (3 * service->connectrttvarms +
+                                                    abs(service->connectsrttms - connectms)) / 4;
+                        service->connectsrttms = (7 * service->connectsrttms + connectms) / 8;
+                }
+
+                service->samples++;
+                statefile_changed(dbctx->state);
+                return SQLITE_DONE;
+        }
+
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTADDIPSERVICESTATS,
+                                           "INSERT OR IGNORE INTO `ipservicestats` (`nr`) VALUES (?1);");
+        sqlite3_bind_int(stmt, 1, urlnr);
+        sqlite3_step(stmt);
+        release_statement(stmt);
+        // All expressions use the values from before the update.
+        stmt = get_statement(dbctx, STMTUPDATELATENCY,
+                             "UPDATE `ipservicestats` SET `samples` = `samples` + 1, \
+ `srttms` = CASE WHEN `samples` = 0 THEN ?2 ELSE (7 * `srttms` + ?2) / 8 END, \
+ `rttvarms` = CASE WHEN `samples` = 0 THEN ?2 / 2 ELSE (3 * `rttvarms` + ABS(`srttms` - ?2)) / 4 END, \
+ `connectsrttms` = CASE WHEN `samples` = 0 THEN ?3 ELSE (7 * `connectsrttms` + ?3) / 8 END, \
+ `connectrttvarms` = CASE WHEN `samples` = 0 THEN ?3 / 2 \
+ ELSE (3 * `connectrttvarms` + ABS(`connectsrttms` - ?3)) / 4 END \
+ WHERE `nr` = ?1;");
+        sqlite3_bind_int(stmt, 1, urlnr);
+        sqlite3_bind_int(stmt, 2, totalms);
+        sqlite3_bind_int(stmt, 3, connectms);
+        retcode = sqlite3_step(stmt);
+        if (retcode != SQLITE_DONE) {
+                fprintf(stderr, "Error updating ipservicestats: %s\n", sqlite3_errmsg(dbctx->db));
+        }
+
+        release_statement(stmt);
+        return retcode;
+}
+
+/**
+ * Get an estimate of the 99th percentile of the total and connect latency of an ipservice.
+ * Like the retransmission timeout of TCP this is the mean plus four mean deviations.
+ * @param urlnr       The ipservice number.
+ * @param connectp99ms Set to the connect latency in milliseconds.
+ * @return The total latency in milliseconds, or -1 if there are not enough measurements yet.
+ */
+int get_latency_p99_ipservice(struct DbContext *dbctx, int urlnr, int *connectp99ms)
+{
+        int p99ms = -1;
+        if (use_statefile(dbctx)) {
+                struct StateService *service = statefile_find_service(dbctx->state, urlnr);
+                if (service != NULL && service->samples >= MINLATENCYSAMPLES) {
+                        p99ms = service->srttms + 4 * service->rttvarms;
+                        *connectp99ms = service->connectsrttms + 4 * service->connectrttvarms;
+                }
+
+                return p99ms;
+        }
+
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTGETLATENCYP99,
+                                           "SELECT `srttms` + 4 * `rttvarms`, `connectsrttms` + 4 * `connectrttvarms` \
+ FROM `ipservicestats` WHERE `nr` = ?1 AND `samples` >= ?2 LIMIT 1;");
+        sqlite3_bind_int(stmt, 1, urlnr);
+        sqlite3_bind_int(stmt, 2, MINLATENCYSAMPLES);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+                p99ms = sqlite3_column_int(stmt, 0);
+                *connectp99ms = sqlite3_column_int(stmt, 1);
+        }
+
+        release_statement(stmt);
+        return p99ms;
+}
+
+/**
+ * Get an estimate of the 95th percentile of the total latency of an ipservice.
+ * For a normal distribution the 95th percentile is about the mean plus two mean deviations.
+ * @param urlnr The ipservice number.
+ * @return The latency in milliseconds, or -1 if there are not enough measurements yet.
+ */
+int get_latency_p95_ipservice(struct DbContext *dbctx, int urlnr)
+{
+        int p95ms = -1;
+        if (use_statefile(dbctx)) {
+                struct StateService *service = statefile_find_service(dbctx->state, urlnr);
+                if (service != NULL && service->samples >= MINLATENCYSAMPLES) {
+                        p95ms = service->srttms + 2 * service->rttvarms;
+                }
+
+                return p95ms;
+        }
+
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTGETLATENCYP95,
+                                           "SELECT `srttms` + 2 * `rttvarms` FROM `ipservicestats` \
+ WHERE `nr` = ?1 AND `samples` >= ?2 LIMIT 1;");
+        sqlite3_bind_int(stmt, 1, urlnr);
+        sqlite3_bind_int(stmt, 2, MINLATENCYSAMPLES);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+                p95ms = sqlite3_column_int(stmt, 0);
+        }
+
+        release_statement(stmt);
+        return p95ms;
+}
 
 /**
- * Create table ipservice with all ipservices to possible use.
- * @param verbosemode Print a message if ipservice table is successfully created.
+ * Create table dnscache with the addresses of ipservice hosts saved for the next run.
+ * @param verbosemode Print a message if dnscache table is successfully created.
  */
-int create_table_ipservice(sqlite3 *db, bool verbosemode)
+static int create_table_dnscache(struct DbContext *dbctx, bool verbosemode)
 {
         int retcode;
         sqlite3_stmt *stmt = NULL;
-        sqlite3_prepare_v2(db, "CREATE TABLE IF NOT EXISTS `ipservice` ( \
- `nr` INT PRIMARY KEY NOT NULL, \
- `disabled` TINYINT NOT NULL DEFAULT 0, \
- `protocoltype` TINYINT NOT NULL, \
- `url` TEXT(1023) NOT NULL, \
- `priority` TINYINT(10) NOT NULL DEFAULT 1, \
- `lastErrorOn` NUMERIC );", -1, &stmt, NULL);
+        sqlite3_prepare_v2(dbctx->db, "CREATE TABLE IF NOT EXISTS `dnscache` ( \
+ `host` TEXT(255) NOT NULL, \
+ `port` INT NOT NULL, \
+ `address` TEXT(45) NOT NULL, \
+ `expireson` NUMERIC NOT NULL, \
+ PRIMARY KEY (`host`, `port`) );", -1, &stmt, NULL);
         retcode = sqlite3_step(stmt);
         if (retcode != SQLITE_DONE) {
-                fprintf(stderr, "Error creating ipservice table: %s\n", sqlite3_errmsg(db));
+                fprintf(stderr, "Error creating dnscache table: %s\n", sqlite3_errmsg(dbctx->db));
         } else if (verbosemode) {
-                fprintf(stdout, "Table ipservice succesfully created.\n");
+                fprintf(stdout, "Table dnscache succesfully created.\n");
         }
 
         sqlite3_finalize(stmt);
         return retcode;
 }
 
-
 /**
- * Add an https/http or dns ip service to the ipservice database table.
- * if disabled is true then the ipservice has a persistent error and should not be used anymore.
- * @param urlnr        The ipservice number.
- * @param url          The url or address of the ipservice.
- * @param disabled     Is the ipservice disabled.
- * @param protocoltype The protocol type to use. 0 for dns(not yet implemented), protocoltype = 1 for http,
-                       and protocoltype = 2 for https.
- * @param priority     The priority of the ipservice to use. From 1(most favourable) till 10(least favourable to use) at most.
- * @param verbosemode  Print a message if ipservice is succesfully added to database.
+ * Save the address a host resolved to, unless there is already an address saved for the host.
+ * The saved address is kept until it expires so reusing it does not extend its lifetime.
+ * @param host      The host name from the url of the ipservice.
+ * @param port      The port from the url of the ipservice.
+ * @param address   The ip address the host resolved to.
+ * @param expireson Unix timestamp after which the address has to be resolved again.
  */
-int add_ipservice(sqlite3 *db, int urlnr, char * url, bool disabled, int protocoltype, int priority, bool verbosemode)
+int save_dnscache(struct DbContext *dbctx, const char *host, long port, const char *address, int expireson)
 {
-        if (protocoltype < 0 || protocoltype > 2) {
-                exit(EXIT_FAILURE);
-        }
+        int retcode;
+        if (use_statefile(dbctx)) {
+                struct StateDnsCache *dnscache = statefile_dnscache(dbctx->state);
+                struct StateDnsCache *unused = NULL;
+                for (int i = 0; i < STATEMAXDNSCACHE; ++i) {
+                        if (dnscache[i].host[0] == '\0' || dnscache[i].expireson <= time(NULL)) {
+                                unused = unused != NULL ? unused : &dnscache[i];
+                        } else if (strcmp(dnscache[i].host, host) == 0 && dnscache[i].port == port) {
+                                return SQLITE_DONE;
+                        }
+                }
 
-        if (priority < 1 || priority > MAXPRIORITY) {
-                exit(EXIT_FAILURE);
+                if (unused == NULL || strlen(host) > STATEMAXLENHOST ||
+                    strlen(address) >= sizeof(unused->address)) {
+                        return SQLITE_FULL;
+                }
 
+                strcpy(unused->host, host);
+                unused->port = port;
+                strcpy(unused->address, address);
+                unused->expireson = expireson;
+                statefile_changed(dbctx->state);
+                return SQLITE_DONE;
         }
 
-        if (strlen(url) >= MAXLENURL) {
-            printf("Url too long, maximum %d character allowed.\n", MAXLENURL);
-            return 1;
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTSAVEDNSCACHE,
+                                           "INSERT OR IGNORE INTO `dnscache` (`host`, `port`, `address`, `expireson`) \
+ VALUES (?1, ?2, ?3, ?4);");
+        sqlite3_bind_text(stmt, 1, host, -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 2, (int)port);
+        sqlite3_bind_text(stmt, 3, address, -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 4, expireson);
+        retcode = sqlite3_step(stmt);
+        if (retcode != SQLITE_DONE) {
+                fprintf(stderr, "Error storing dnscache: %s\n", sqlite3_errmsg(dbctx->db));
         }
 
+        release_statement(stmt);
+        return retcode;
+}
+
+/**
+ * Forget the saved address of a host.
+ * @param host The host name from the url of the ipservice.
+ * @param port The port from the url of the ipservice.
+ */
+int delete_dnscache(struct DbContext *dbctx, const char *host, long port)
+{
         int retcode;
-        sqlite3_stmt *stmt = NULL;
-        sqlite3_prepare_v2(db, "INSERT INTO `ipservice` (`nr`, `disabled`, `protocoltype`, `url`, `priority`)\
- VALUES (?1, ?2, ?3, ?4, ?5);", -1, &stmt, NULL);
-        sqlite3_bind_int(stmt, 1, urlnr);
-        sqlite3_bind_int(stmt, 2, disabled);
-        sqlite3_bind_int(stmt, 3, protocoltype);
-        sqlite3_bind_text(stmt, 4, url, -1, SQLITE_STATIC);
-        sqlite3_bind_int(stmt, 5, priority);
+        if (use_statefile(dbctx)) {
+                struct StateDnsCache *dnscache = statefile_dnscache(dbctx->state);
+                for (int i = 0; i < STATEMAXDNSCACHE; ++i) {
+                        if (strcmp(dnscache[i].host, host) == 0 && dnscache[i].port == port) {
+                                memset(&dnscache[i], 0, sizeof(struct StateDnsCache));
+                                statefile_changed(dbctx->state);
+                        }
+                }
+
+                return SQLITE_DONE;
+        }
+
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTDELETEDNSCACHE,
+                                           "DELETE FROM `dnscache` WHERE `host` = ?1 AND `port` = ?2;");
+        sqlite3_bind_text(stmt, 1, host, -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 2, (int)port);
         retcode = sqlite3_step(stmt);
         if (retcode != SQLITE_DONE) {
-                printf("ERROR inserting data: %s\n", sqlite3_errmsg(db));
-        } else if (verbosemode) {
-                fprintf(stdout, "Added ipservice record.\n");
+                fprintf(stderr, "Error deleting dnscache: %s\n", sqlite3_errmsg(dbctx->db));
         }
 
-        sqlite3_finalize(stmt);
+        release_statement(stmt);
         return retcode;
 }
 
 /**
- * Get the number of ipservices in the ipservice table.
+ * Remove the saved addresses that are expired.
  */
-int get_count_all_ipservices(sqlite3 *db)
+int delete_expired_dnscache(struct DbContext *dbctx)
 {
-        int cntall = 0;
-        sqlite3_stmt *stmt = NULL;
-        sqlite3_prepare_v2(db,
-                           "SELECT COUNT(`nr`) FROM `ipservice` LIMIT 1;",
-                           1023,
-                           &stmt,
-                           NULL);
-        if (sqlite3_step(stmt) == SQLITE_ROW) {
-                cntall = sqlite3_column_int(stmt, 0);
+        int retcode;
+        if (use_statefile(dbctx)) {
+                struct StateDnsCache *dnscache = statefile_dnscache(dbctx->state);
+                for (int i = 0; i < STATEMAXDNSCACHE; ++i) {
+                        if (dnscache[i].host[0] != '\0' && dnscache[i].expireson <= time(NULL)) {
+                                memset(&dnscache[i], 0, sizeof(struct StateDnsCache));
+                                statefile_changed(dbctx->state);
+                        }
+                }
+
+                return SQLITE_DONE;
         }
 
-        sqlite3_finalize(stmt);
-        return cntall;
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTDELETEEXPIREDDNSCACHE,
+                                           "DELETE FROM `dnscache` WHERE `expireson` <= ?1;");
+        sqlite3_bind_int(stmt, 1, (int)time(NULL));
+        retcode = sqlite3_step(stmt);
+        if (retcode != SQLITE_DONE) {
+                fprintf(stderr, "Error deleting expired dnscache: %s\n", sqlite3_errmsg(dbctx->db));
+        }
+
+        release_statement(stmt);
+        return retcode;
 }
 
 /**
- * Get the number of available ipservices.
- * @param allowedprotocoltypes The allowed protocols to use.
+ * Get the saved addresses of hosts that are not expired.
+ * @param entries    Array that is filled with the saved addresses.
+ * @param maxentries The size of the entries array.
+ * @return The number of entries filled.
  */
-int get_count_available_ipservices(sqlite3 *db, int allowedprotocoltypes)
+int get_dnscache(struct DbContext *dbctx, struct DnsCacheEntry entries[], int maxentries)
 {
-        int cntavailable = 0;
-        sqlite3_stmt *stmt = NULL;
-        sqlite3_prepare_v2(db,
-                           "SELECT COUNT(`nr`) FROM `ipservice` WHERE `disabled` = 0 AND protocoltype >= ?1 LIMIT 1;",
-                           -1,
-                           &stmt,
-                           NULL);
-        sqlite3_bind_int(stmt, 1, allowedprotocoltypes);
-        if (sqlite3_step(stmt) == SQLITE_ROW) {
-                cntavailable = sqlite3_column_int(stmt, 0);
+        int i = 0;
+        if (use_statefile(dbctx)) {
+                struct StateDnsCache *dnscache = statefile_dnscache(dbctx->state);
+                for (int n = 0; n < STATEMAXDNSCACHE && i < maxentries; ++n) {
+                        if (dnscache[n].host[0] != '\0' && dnscache[n].expireson > time(NULL)) {
+                                strcpy(entries[i].host, dnscache[n].host);
+                                entries[i].port = dnscache[n].port;
+                                strcpy(entries[i].address, dnscache[n].address);
+                                ++i;
+                        }
+                }
+
+                return i;
         }
 
-        sqlite3_finalize(stmt);
-        return cntavailable;
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTGETDNSCACHE,
+                                           "SELECT `host`, `port`, `address` FROM `dnscache` WHERE `expireson` > ?1 LIMIT ?2;");
+        sqlite3_bind_int(stmt, 1, (int)time(NULL));
+        sqlite3_bind_int(stmt, 2, maxentries);
+        while (sqlite3_step(stmt) == SQLITE_ROW && i < maxentries) {
+                const char *host = (const char *)sqlite3_column_text(stmt, 0);
+                const char *address = (const char *)sqlite3_column_text(stmt, 2);
+                if (host == NULL || address == NULL || strlen(host) > MAXLENHOST ||
+                    strlen(address) >= sizeof(entries[i].address)) {
+                        continue;
+                }
+
+                strcpy(entries[i].host, host);
+                entries[i].port = sqlite3_column_int(stmt, 1);
+                strcpy(entries[i].address, address);
+                ++i;
+        }
+
+        release_statement(stmt);
+        return i;
 }
 
 /**
- * Get the url for a ipservice number.
- * @param urlnr The ipservice number to get the url from.
+ * Create table tlssession with the TLS sessions saved for the next run.
+ * @param verbosemode Print a message if tlssession table is successfully created.
  */
-const char * get_url_ipservice(sqlite3 *db, int urlnr)
+static int create_table_tlssession(struct DbContext *dbctx, bool verbosemode)
 {
-        const char *url;
-        char *urlipservice;
-        int sizeurlipservice = MAXLENURL * sizeof(char);
-        urlipservice = malloc(sizeurlipservice);
+        int retcode;
         sqlite3_stmt *stmt = NULL;
-        sqlite3_prepare_v2(db,
-                           "SELECT `url` FROM `ipservice` WHERE `nr` = ?1 LIMIT 1;",
-                           sizeurlipservice,
-                           &stmt,
-                           NULL);
-        sqlite3_bind_int(stmt, 1, urlnr);
-        if (sqlite3_step(stmt) == SQLITE_ROW) {
-                url = sqlite3_column_text(stmt, 0);
-        } else {
-                url = "";
+        sqlite3_prepare_v2(dbctx->db, "CREATE TABLE IF NOT EXISTS `tlssession` ( \
+ `sessionkey` TEXT, \
+ `shmac` BLOB, \
+ `sdata` BLOB NOT NULL, \
+ `validuntil` NUMERIC NOT NULL );", -1, &stmt, NULL);
+        retcode = sqlite3_step(stmt);
+        if (retcode != SQLITE_DONE) {
+                fprintf(stderr, "Error creating tlssession table: %s\n", sqlite3_errmsg(dbctx->db));
+        } else if (verbosemode) {
+                fprintf(stdout, "Table tlssession succesfully created.\n");
         }
 
-        strcpy(urlipservice, url);
         sqlite3_finalize(stmt);
-        return urlipservice;
+        return retcode;
 }
 
 /**
- * Disable an ipservice.
- * @param urlnr        The number of the ipservice to disable.
- * @param addtimestamp Add a timestamp on the time the ipservice was disabled on.
+ * Remove all saved TLS sessions.
  */
-int update_disabled_ipsevice(sqlite3 *db, int urlnr, bool addtimestamp)
+int delete_tlssessions(struct DbContext *dbctx)
 {
-        int retcode = 0;
-        sqlite3_stmt *stmt = NULL;
-        if (addtimestamp) {
-                int timestampnow = (int)time(NULL);
-                sqlite3_prepare_v2(db,
-                                    "UPDATE `ipservice` SET `disabled`= 1, `lasterroron`= ?1\
- WHERE `nr`= ?2 LIMIT 1;",
-                                   -1,
-                                   &stmt,
-                                   NULL);
-                sqlite3_bind_int(stmt, 1, timestampnow);
-                sqlite3_bind_int(stmt, 2, urlnr);
-        } else {
-               sqlite3_prepare_v2(db,
-                                  "UPDATE `ipservice` SET `disabled`= 1 WHERE `nr`= ?2 LIMIT 1;",
-                                  -1,
-                                  &stmt,
-                                  NULL);
-               sqlite3_bind_int(stmt, 2, urlnr);
+        int retcode;
+        if (use_statefile(dbctx)) {
+                return SQLITE_DONE;
         }
 
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTDELETETLSSESSIONS,
+                                           "DELETE FROM `tlssession`;");
         retcode = sqlite3_step(stmt);
         if (retcode != SQLITE_DONE) {
-                fprintf(stderr, "Error updating ipservice: %s\n", sqlite3_errmsg(db));
+                fprintf(stderr, "Error deleting tlssessions: %s\n", sqlite3_errmsg(dbctx->db));
         }
 
-        sqlite3_finalize(stmt);
+        release_statement(stmt);
         return retcode;
 }
 
 /**
- * Get the priority of a ipservice.
- * @param urlnr The ipservice to get the priority from.
+ * Save a TLS session.
+ * @param sessionkey The session key from libcurl, can be NULL.
+ * @param shmac      The salted hash of the peer from libcurl, can be NULL.
+ * @param sdata      The TLS session data.
+ * @param validuntil Unix timestamp until when the TLS session can be used, or 0 if unknown.
  */
-const int get_priority_ipservice(sqlite3 *db, int urlnr)
+int add_tlssession(struct DbContext *dbctx, const char *sessionkey, const unsigned char *shmac, size_t shmaclen,
+                   const unsigned char *sdata, size_t sdatalen, long validuntil)
 {
-        int priority = -1;
-        sqlite3_stmt *stmt = NULL;
-        sqlite3_prepare_v2(db,
-                           "SELECT `priority` FROM `ipservice` WHERE `nr` = ?1 LIMIT 1;",
-                           255,
-                           &stmt,
-                           NULL);
-        sqlite3_bind_int(stmt, 1, urlnr);
-        if (sqlite3_step(stmt) == SQLITE_ROW) {
-                priority = sqlite3_column_int(stmt, 0);
+        int retcode;
+        if (use_statefile(dbctx)) {
+                return SQLITE_DONE;
         }
 
-        sqlite3_finalize(stmt);
-        return priority;
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTADDTLSSESSION,
+                                           "INSERT INTO `tlssession` (`sessionkey`, `shmac`, `sdata`, `validuntil`) \
+ VALUES (?1, ?2, ?3, ?4);");
+        sqlite3_bind_text(stmt, 1, sessionkey, -1, SQLITE_STATIC);
+        sqlite3_bind_blob(stmt, 2, shmac, (int)shmaclen, SQLITE_STATIC);
+        sqlite3_bind_blob(stmt, 3, sdata, (int)sdatalen, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 4, validuntil);
+        retcode = sqlite3_step(stmt);
+        if (retcode != SQLITE_DONE) {
+                fprintf(stderr, "Error storing tlssession: %s\n", sqlite3_errmsg(dbctx->db));
+        }
+
+        release_statement(stmt);
+        return retcode;
 }
 
 /**
- * Get a array with the numbers of ipservices requested.
- * @param urlnr
- * @param disabled
- * @param allowedprotocoltypes
+ * Get the saved TLS sessions that are still valid.
+ * The data is allocated and has to be freed with free_tlssessions.
+ * @param sessions    Array that is filled with the TLS sessions.
+ * @param maxsessions The size of the sessions array.
+ * @return The number of TLS sessions filled.
  */
-void get_urlnrs_ipservices(sqlite3 *db, int urlnrs[], int disabled, int allowedprotocoltypes)
+int get_tlssessions(struct DbContext *dbctx, struct TlsSession sessions[], int maxsessions)
 {
         int i = 0;
-        sqlite3_stmt *stmt = NULL;
-        sqlite3_prepare_v2(db,
-                            "SELECT `nr` FROM `ipservice` WHERE `disabled` = ?1 AND protocoltype >= ?2;",
-                            -1,
-                            &stmt,
-                            NULL);
-        sqlite3_bind_int(stmt, 1, disabled);
-        sqlite3_bind_int(stmt, 2, allowedprotocoltypes);
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-                int nr;
-                nr = sqlite3_column_int(stmt, 0);
-                urlnrs[i] = nr;
+        if (use_statefile(dbctx)) {
+                return 0;
+        }
+
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTGETTLSSESSIONS,
+                                           "SELECT `sessionkey`, `shmac`, `sdata` FROM `tlssession` \
+ WHERE `validuntil` = 0 OR `validuntil` > ?1 LIMIT ?2;");
+        sqlite3_bind_int(stmt, 1, (int)time(NULL));
+        sqlite3_bind_int(stmt, 2, maxsessions);
+        while (sqlite3_step(stmt) == SQLITE_ROW && i < maxsessions) {
+                const char *sessionkey = (const char *)sqlite3_column_text(stmt, 0);
+                sessions[i].sessionkey = NULL;
+                if (sessionkey != NULL) {
+                        sessions[i].sessionkey = malloc(strlen(sessionkey) + 1);
+                        strcpy(sessions[i].sessionkey, sessionkey);
+                }
+
+                sessions[i].shmaclen = sqlite3_column_bytes(stmt, 1);
+                sessions[i].shmac = NULL;
+                if (sessions[i].shmaclen > 0) {
+                        sessions[i].shmac = malloc(sessions[i].shmaclen);
+                        memcpy(sessions[i].shmac, sqlite3_column_blob(stmt, 1), sessions[i].shmaclen);
+                }
+
+                sessions[i].sdatalen = sqlite3_column_bytes(stmt, 2);
+                sessions[i].sdata = malloc(sessions[i].sdatalen + 1);
+                memcpy(sessions[i].sdata, sqlite3_column_blob(stmt, 2), sessions[i].sdatalen);
                 ++i;
         }
 
-        sqlite3_finalize(stmt);
+        release_statement(stmt);
+        return i;
 }
 
 /**
- * Re-enable all the expired temporary disabled ipservice with a SQL query.
- * @param blockseconds The number of seconds the disabling
+ * Free the TLS sessions returned by get_tlssessions.
  */
-int reenable_expired_disabled_ipservices(sqlite3 *db, int blockseconds)
+void free_tlssessions(struct TlsSession sessions[], int numsessions)
 {
-        int retcode = 0;
-        int timestampunblock = (int)time(NULL) - blockseconds;
-        sqlite3_stmt *stmt = NULL;
-        sqlite3_prepare_v2(db,
-                        "UPDATE `ipservice` SET `disabled` = 0 WHERE `disabled` = 1 AND `lasterroron` <= ?1;",
-                        -1,
-                        &stmt,
-                        NULL);
-        sqlite3_bind_int(stmt, 1, timestampunblock);
+        for (int i = 0; i < numsessions; ++i) {
+                free(sessions[i].sessionkey);
+                free(sessions[i].shmac);
+                free(sessions[i].sdata);
+        }
+}
+
+/**
+ * Get the egress ip address of a proxy confirmed by an earlier check.
+ * @param proxy  The proxy url as given in the proxy list.
+ * @param ipaddr Buffer of INET6_ADDRSTRLEN bytes, set to the ip address or to an empty string.
+ * @return true if the proxy has been checked before.
+ */
+bool get_egress_proxy(struct DbContext *dbctx, const char *proxy, char *ipaddr)
+{
+        ipaddr[0] = '\0';
+        if (use_statefile(dbctx)) {
+                return false;
+        }
+
+        bool found = false;
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTGETEGRESSPROXY,
+                                           "SELECT `ipaddr` FROM `proxyegress` WHERE `proxy` = ?1;");
+        sqlite3_bind_text(stmt, 1, proxy, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+                const char *value = (const char *)sqlite3_column_text(stmt, 0);
+                if (value != NULL && strlen(value) < INET6_ADDRSTRLEN) {
+                        strcpy(ipaddr, value);
+                        found = true;
+                }
+        }
+
+        release_statement(stmt);
+        return found;
+}
+
+/**
+ * Save the confirmed egress ip address of a proxy. The change time is only updated when the
+ * ip address differs from the saved one.
+ * @param proxy  The proxy url as given in the proxy list.
+ * @param ipaddr The confirmed egress ip address.
+ * @param now    The current unix time.
+ */
+int save_egress_proxy(struct DbContext *dbctx, const char *proxy, const char *ipaddr, int now)
+{
+        if (use_statefile(dbctx)) {
+                fprintf(stderr, "Proxy egress addresses can only be saved in the database.\n");
+                return SQLITE_MISUSE;
+        }
+
+        int retcode;
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTSAVEEGRESSPROXY,
+                                           "INSERT INTO `proxyegress` (`proxy`, `ipaddr`, `confirmedon`, `changedon`) \
+ VALUES (?1, ?2, ?3, ?3) ON CONFLICT (`proxy`) DO UPDATE SET `ipaddr` = excluded.`ipaddr`, \
+ `confirmedon` = excluded.`confirmedon`, \
+ `changedon` = CASE WHEN `ipaddr` = excluded.`ipaddr` THEN `changedon` ELSE excluded.`changedon` END;");
+        sqlite3_bind_text(stmt, 1, proxy, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, ipaddr, -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 3, now);
         retcode = sqlite3_step(stmt);
         if (retcode != SQLITE_DONE) {
-                fprintf(stderr, "Error on reenabling expired disabled ipservices: %s\n", sqlite3_errmsg(db));
+                fprintf(stderr, "Error saving proxy egress address: %s\n", sqlite3_errmsg(dbctx->db));
         }
 
-        sqlite3_finalize(stmt);
+        release_statement(stmt);
         return retcode;
 }
 
@@ -286,17 +1421,17 @@ int reenable_expired_disabled_ipservices(sqlite3 *db, int blockseconds)
  * Create config table.
  * @param verbosemode Print a message if config table is created succesfully.
  */
-int create_table_config(sqlite3 *db, bool verbosemode)
+static int create_table_config(struct DbContext *dbctx, bool verbosemode)
 {
         int retcode;
         sqlite3_stmt *stmt = NULL;
-        sqlite3_prepare_v2(db, "CREATE TABLE IF NOT EXISTS `config` ( \
- `name` TEXT, \
+        sqlite3_prepare_v2(dbctx->db, "CREATE TABLE IF NOT EXISTS `config` ( \
+ `name` TEXT PRIMARY KEY NOT NULL, \
  `valueint` INT, \
  `valuestr` TEXT(255) );", -1, &stmt, NULL);
         retcode = sqlite3_step(stmt);
         if (retcode != SQLITE_DONE) {
-                fprintf(stderr, "Error creating config table: %s\n", sqlite3_errmsg(db));
+                fprintf(stderr, "Error creating config table: %s\n", sqlite3_errmsg(dbctx->db));
         } else if (verbosemode) {
                 fprintf(stdout, "Table config succesfully created.\n");
         }
@@ -309,22 +1444,23 @@ int create_table_config(sqlite3 *db, bool verbosemode)
  * Get the config integer value with a certain name.
  * @param name The name to get the config integer value from.
  */
-int get_config_value_int(sqlite3 *db, char * name)
+int get_config_value_int(struct DbContext *dbctx, char * name)
 {
         int value_int = -1;
-        sqlite3_stmt *stmt = NULL;
-        sqlite3_prepare_v2(db,
-                           "SELECT `valueint` FROM `config` WHERE `name` = ?1 LIMIT 1;",
-                           -1,
-                           &stmt,
-                           NULL);
+        if (use_statefile(dbctx)) {
+                struct StateConfig *config = statefile_find_config(dbctx->state, name, false);
+                return config != NULL ? config->valueint : value_int;
+        }
+
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTGETCONFIGINT,
+                                           "SELECT `valueint` FROM `config` WHERE `name` = ?1 LIMIT 1;");
         sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
         while (sqlite3_step(stmt) == SQLITE_ROW) {
                 value_int = sqlite3_column_int(stmt, 0);
                 break;
         }
 
-        sqlite3_finalize(stmt);
+        release_statement(stmt);
         return value_int;
 }
 
@@ -332,167 +1468,294 @@ int get_config_value_int(sqlite3 *db, char * name)
  * Get the config string(char array) value.
  * @param name The name to get the string(char array) config value from.
  */
-char * get_config_value_str(sqlite3 *db, char * name)
+char * get_config_value_str(struct DbContext *dbctx, char * name)
 {
         int configstrlen = MAXLENCONFIGSTR * sizeof(char);
         char *configvaluestr;
         configvaluestr = malloc(configstrlen);
-        const char * value_str;
-        sqlite3_stmt *stmt = NULL;
-        sqlite3_prepare_v2(db,
-                           "SELECT `valuestr` FROM `config` \
- WHERE `name` = ?1 LIMIT 1;",
-                           -1,
-                           &stmt,
-                           NULL);
+        const char * value_str = "";
+        if (use_statefile(dbctx)) {
+                struct StateConfig *config = statefile_find_config(dbctx->state, name, false);
+                strcpy(configvaluestr, config != NULL ? config->valuestr : "");
+                return configvaluestr;
+        }
+
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTGETCONFIGSTR,
+                                           "SELECT `valuestr` FROM `config` \
+ WHERE `name` = ?1 LIMIT 1;");
         sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
         while (sqlite3_step(stmt) == SQLITE_ROW) {
-                value_str = sqlite3_column_text(stmt, 0);
+                value_str = (const char *)sqlite3_column_text(stmt, 0);
                 break;
         }
 
         strcpy(configvaluestr, value_str);
-        sqlite3_finalize(stmt);
+        release_statement(stmt);
         return configvaluestr;
 }
 
 /**
- * Add a new config value integer.
- * @param name        The lookup name of the config to add.
+ * Set the config integer value, adding the config if it does not exist yet.
+ * @param name        The lookup name of the config to set.
  * @param value       The integer configuration value.
- * @param verbosemode Print message if config added succesfully to database.
+ * @param verbosemode Print message if config saved succesfully to database.
  */
-int add_config_value_int(sqlite3 *db, char * name, int value, bool verbosemode)
+int set_config_value_int(struct DbContext *dbctx, char * name, int value, bool verbosemode)
 {
         int retcode;
-        sqlite3_stmt *stmt = NULL;
-        sqlite3_prepare_v2(db, "INSERT INTO `config` (`name`, `valueint`) \
- VALUES (?1, ?2);", -1, &stmt, NULL);
+        if (use_statefile(dbctx)) {
+                struct StateConfig *config = statefile_find_config(dbctx->state, name, true);
+                if (config == NULL) {
+                        fprintf(stderr, "Error storing config value: no room in state file\n");
+                        return SQLITE_FULL;
+                }
+
+                config->valueint = value;
+                statefile_changed(dbctx->state);
+                if (verbosemode) {
+                        fprintf(stdout, "Config: %s = %d  saved.\n", name, value);
+                }
+
+                return SQLITE_DONE;
+        }
+
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTSETCONFIGINT,
+                                           "INSERT INTO `config` (`name`, `valueint`) VALUES (?1, ?2) \
+ ON CONFLICT (`name`) DO UPDATE SET `valueint` = excluded.`valueint`;");
         sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
         sqlite3_bind_int(stmt, 2, value);
         retcode = sqlite3_step(stmt);
         if (retcode != SQLITE_DONE) {
-                fprintf(stderr, "Error storing config value: %s\n", sqlite3_errmsg(db));
+                fprintf(stderr, "Error storing config value: %s\n", sqlite3_errmsg(dbctx->db));
         } else if (verbosemode) {
                 fprintf(stdout, "Config: %s = %d  saved.\n", name, value);
         }
 
-        sqlite3_finalize(stmt);
+        release_statement(stmt);
         return retcode;
 }
 
 /**
- * Add a new config string value.
- * @param name        The lookup name of the config to add.
+ * Set the config string value, adding the config if it does not exist yet.
+ * @param name        The lookup name of the config to set.
  * @param value       The string(char array) configuration value.
- * @param verbosemode Print message if config added succesfully to database.
+ * @param verbosemode Print message if config saved succesfully to database.
  */
-int add_config_value_str(sqlite3 *db, char *name, char * value, bool verbosemode)
+int set_config_value_str(struct DbContext *dbctx, char * name, const char * value, bool verbosemode)
 {
+        if (strlen(value) > MAXLENCONFIGSTR) {
+                return -1;
+        }
+
+        if (use_statefile(dbctx)) {
+                struct StateConfig *config = statefile_find_config(dbctx->state, name, true);
+                if (config == NULL) {
+                        fprintf(stderr, "Error storing config value: no room in state file\n");
+                        return SQLITE_FULL;
+                }
+
+                strcpy(config->valuestr, value);
+                statefile_changed(dbctx->state);
+                if (verbosemode) {
+                        fprintf(stdout, "Config: %s = %s  saved.\n", name, value);
+                }
+
+                return SQLITE_DONE;
+        }
+
         int retcode;
-        sqlite3_stmt *stmt = NULL;
-        sqlite3_prepare_v2(db, "INSERT INTO `config` (`name`, `valuestr`) \
- VALUES (?1, ?2);", -1, &stmt, NULL);
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTSETCONFIGSTR,
+                                           "INSERT INTO `config` (`name`, `valuestr`) VALUES (?1, ?2) \
+ ON CONFLICT (`name`) DO UPDATE SET `valuestr` = excluded.`valuestr`;");
         sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
         sqlite3_bind_text(stmt, 2, value, -1, SQLITE_STATIC);
         retcode = sqlite3_step(stmt);
         if (retcode != SQLITE_DONE) {
-                fprintf(stderr, "Error storing config value: %s\n", sqlite3_errmsg(db));
+                fprintf(stderr, "Error storing config value: %s\n", sqlite3_errmsg(dbctx->db));
         } else if (verbosemode) {
                 fprintf(stdout, "Config: %s = %s  saved.\n", name, value);
         }
 
-        sqlite3_finalize(stmt);
+        release_statement(stmt);
         return retcode;
 }
 
 /**
- * Change the integer config value.
- * @param name        The lookup name of the config to add.
- * @param valuenew    The new integer configuration value.
- * @param verbosemode Print message if config updated succesfully in database.
+ * Check if configuration exists in database config table.
+ * @param name The lookup name of the config to check if it exists.
+ */
+bool is_config_exists(struct DbContext *dbctx, char *name)
+{
+        int value_int = 0;
+        if (use_statefile(dbctx)) {
+                return statefile_find_config(dbctx->state, name, false) != NULL;
+        }
+
+        sqlite3_stmt *stmt = get_statement(dbctx, STMTCONFIGEXISTS,
+                                           "SELECT COUNT(`name`) FROM `config` \
+ WHERE `name` = ?1 LIMIT 1;");
+        sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+                value_int = sqlite3_column_int(stmt, 0);
+                break;
+        }
+
+        release_statement(stmt);
+        if (value_int >= 1) {
+            return true;
+        } else {
+            return false;
+        }
+}
+
+/**
+ * Get the integer value of a pragma.
+ * @param sql The pragma statement.
+ * @return The value, or -1 if the pragma failed.
  */
-int update_config_value_int(sqlite3 *db, char * name, int valuenew, bool verbosemode)
+static int get_pragma_int(struct DbContext *dbctx, const char *sql)
 {
-        int retcode = 0;
+        int value = -1;
         sqlite3_stmt *stmt = NULL;
-        sqlite3_prepare_v2(db,
-                           "UPDATE `config` SET `valueint`= ?1\
- WHERE  `name`= ?2 LIMIT 1;",
-                          -1,
-                          &stmt,
-                          NULL);
-        sqlite3_bind_int(stmt, 1, valuenew);
-        sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
-        retcode = sqlite3_step(stmt);
-        if (retcode != SQLITE_DONE) {
-                fprintf(stderr, "Error storing config value: %s\n", sqlite3_errmsg(db));
-        } else if (verbosemode) {
-                fprintf(stdout, "Config: %s = %d  saved.\n", name, valuenew);
+        sqlite3_prepare_v2(dbctx->db, sql, -1, &stmt, NULL);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+                value = sqlite3_column_int(stmt, 0);
         }
 
         sqlite3_finalize(stmt);
-        return retcode;
+        return value;
 }
 
 /**
- * Change the string config value.
- * @param name        The lookup name of the config to add.
- * @param valuenew    The new string configuration value.
- * @param verbosemode Print message if config updated succesfully in database.
+ * Run SQL without result rows, for the one time schema changes.
+ * @param sql One or more SQL statements.
+ * @return true if all statements succeeded.
  */
-int update_config_value_str(sqlite3 *db, char * name, const char * valuenew, bool verbosemode)
+static bool exec_schema_sql(struct DbContext *dbctx, const char *sql)
 {
-        if (strlen(valuenew) > MAXLENCONFIGSTR) {
-                return -1;
+        char *errmsg = NULL;
+        if (sqlite3_exec(dbctx->db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+                fprintf(stderr, "Error changing database schema: %s\n", errmsg);
+                sqlite3_free(errmsg);
+                return false;
         }
 
-        int retcode;
-        sqlite3_stmt *stmt = NULL;
-        sqlite3_prepare_v2(db,
-                           "UPDATE `config` SET `valuestr`= ?1\
- WHERE `name`= ?2 LIMIT 1;",
-                           -1,
-                           &stmt,
-                           NULL);
-        sqlite3_bind_text(stmt, 1, valuenew, -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
-        retcode = sqlite3_step(stmt);
-        if (retcode != SQLITE_DONE) {
-                fprintf(stderr, "Error storing config value: %s\n", sqlite3_errmsg(db));
-        } else if (verbosemode) {
-                fprintf(stdout, "Config: %s = %s  saved.\n", name, valuenew);
-        }
+        return true;
+}
 
-        sqlite3_finalize(stmt);
-        return retcode;
+/**
+ * Version 1: all tables, for a new database or a database from before the schema was
+ * versioned that can miss tables and columns.
+ * @param errorwait   The number of seconds temporary disabled ipservices used to wait.
+ * @param verbosemode Print a message for every table created.
+ */
+static bool migrate_schema_v1(struct DbContext *dbctx, int errorwait, bool verbosemode)
+{
+        return create_table_ipservice(dbctx, verbosemode) == SQLITE_DONE &&
+               upgrade_table_ipservice(dbctx, errorwait) == SQLITE_DONE &&
+               create_table_ipservicestats(dbctx, verbosemode) == SQLITE_DONE &&
+               create_table_dnscache(dbctx, verbosemode) == SQLITE_DONE &&
+               create_table_tlssession(dbctx, verbosemode) == SQLITE_DONE &&
+               create_table_config(dbctx, verbosemode) == SQLITE_DONE;
 }
 
 /**
- * Check if configuration exists in database config table.
- * @param name The lookup name of the config to check if it exists.
+ * Version 2: the config name becomes the primary key, so a config is found without
+ * scanning the table and can be set with one upsert. When a name was added more than once
+ * the last added value is kept. The available ipservices are found through an index.
  */
-bool is_config_exists(sqlite3 *db, char *name)
+static bool migrate_schema_v2(struct DbContext *dbctx)
 {
-        int value_int = 0;
-        sqlite3_stmt *stmt = NULL;
-        sqlite3_prepare_v2(db,
-                           "SELECT COUNT(`name`) FROM `config` \
- WHERE `name` = ?1 LIMIT 1;",
-                           -1,
-                           &stmt,
-                           NULL);
-        sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-                value_int = sqlite3_column_int(stmt, 0);
-                break;
+        return exec_schema_sql(dbctx, "CREATE TABLE `configv2` ( \
+ `name` TEXT PRIMARY KEY NOT NULL, \
+ `valueint` INT, \
+ `valuestr` TEXT(255) ); \
+ INSERT OR REPLACE INTO `configv2` (`name`, `valueint`, `valuestr`) \
+ SELECT `name`, `valueint`, `valuestr` FROM `config` WHERE `name` IS NOT NULL ORDER BY `rowid`; \
+ DROP TABLE `config`; \
+ ALTER TABLE `configv2` RENAME TO `config`; \
+ CREATE INDEX IF NOT EXISTS `ipservice_available` ON `ipservice` (`disabled`, `protocoltype`);");
+}
+
+/**
+ * Version 3: the egress ip address of every proxy checked with --proxies.
+ */
+static bool migrate_schema_v3(struct DbContext *dbctx)
+{
+        return exec_schema_sql(dbctx, "CREATE TABLE IF NOT EXISTS `proxyegress` ( \
+ `proxy` TEXT PRIMARY KEY NOT NULL, \
+ `ipaddr` TEXT(45), \
+ `confirmedon` INT, \
+ `changedon` INT );");
+}
+
+/**
+ * Version 4: the address families every ipservice can look up, FAMILYIPV4 and/or FAMILYIPV6.
+ * All existing ipservices only look up IPv4 addresses. A database that already has its
+ * ipservices gets the https ipservices for IPv6 that a new database starts with, so
+ * --dualstack works after an upgrade. A new database is filled in by the caller.
+ */
+static bool migrate_schema_v4(struct DbContext *dbctx)
+{
+        return exec_schema_sql(dbctx, "ALTER TABLE `ipservice` ADD COLUMN `families` TINYINT NOT NULL DEFAULT 1; \
+ INSERT OR IGNORE INTO `ipservice` (`nr`, `disabled`, `protocoltype`, `url`, `priority`, `families`) \
+ SELECT `column1`, 0, 2, `column2`, 1, 2 FROM (VALUES \
+ (26, 'https://api6.ipify.org/'), \
+ (27, 'https://ipv6.icanhazip.com/'), \
+ (28, 'https://v6.ident.me/'), \
+ (29, 'https://v6.ipinfo.io/ip')) \
+ WHERE EXISTS (SELECT 1 FROM `ipservice`) AND `column2` NOT IN (SELECT `url` FROM `ipservice`);");
+}
+
+/**
+ * Bring the database schema up to date, one version at a time. Should be run in a
+ * transaction, so a failed upgrade leaves the database as it was.
+ * @param errorwait   The number of seconds temporary disabled ipservices used to wait.
+ * @param verbosemode Print a message for every table created and every upgrade.
+ * @return true if the schema is up to date.
+ */
+bool migrate_schema(struct DbContext *dbctx, int errorwait, bool verbosemode)
+{
+        if (use_statefile(dbctx)) {
+                return true;
         }
 
-        sqlite3_finalize(stmt);
-        if (value_int >= 1) {
-            return true;
-        } else {
-            return false;
+        // The user version is 0 for a new database and for a database from before the
+        // schema was versioned, a new database has no schema at all yet.
+        int version = get_pragma_int(dbctx, "PRAGMA user_version;");
+        if (version < 0 || version > SCHEMAVERSION) {
+                fprintf(stderr, "Unknown database schema version %d.\n", version);
+                return false;
         }
-}
 
+        bool newdatabase = get_pragma_int(dbctx, "PRAGMA schema_version;") == 0;
+        for (; version < SCHEMAVERSION; ++version) {
+                bool migrated = false;
+                switch (version) {
+                case 0:
+                        migrated = migrate_schema_v1(dbctx, errorwait, verbosemode && newdatabase);
+                        break;
+                case 1:
+                        migrated = migrate_schema_v2(dbctx);
+                        break;
+                case 2:
+                        migrated = migrate_schema_v3(dbctx);
+                        break;
+                case 3:
+                        migrated = migrate_schema_v4(dbctx);
+                        break;
+                }
+
+                char sql[32];
+                snprintf(sql, sizeof(sql), "PRAGMA user_version = %d;", version + 1);
+                if (!migrated || !exec_schema_sql(dbctx, sql)) {
+                        return false;
+                }
+
+                if (verbosemode && !newdatabase) {
+                        fprintf(stdout, "Database upgraded to version %d.\n", version + 1);
+                }
+        }
+
+        return true;
+}
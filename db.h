@@ -19,39 +19,106 @@
 #include <stdbool.h>
 #include <sqlite3.h>
 
-int create_table_ipservice(sqlite3 *db, bool verbosemode);
+#define MAXLENHOST 255
+#define FAMILYIPV4 1
+#define FAMILYIPV6 2
 
-int add_ipservice(sqlite3 *db, int urlnr, char * url, bool disabled, int protocoltype, int priority, bool verbosemode);
+/* An available ipservice with its measured statistics, to weigh how often it is chosen. */
+struct IpServiceScore {
+        int urlnr;
+        int priority;
+        int samples;
+        int p95ms;
+        int failures;
+        int disagreements;
+};
 
-int get_count_all_ipservices(sqlite3 *db);
+/* A saved address of an ipservice host. */
+struct DnsCacheEntry {
+        char host[MAXLENHOST + 1];
+        long port;
+        char address[46];
+};
 
-int get_count_available_ipservices(sqlite3 *db, int allowedprotocoltypes);
+/* A saved TLS session. */
+struct TlsSession {
+        char *sessionkey;
+        unsigned char *shmac;
+        size_t shmaclen;
+        unsigned char *sdata;
+        size_t sdatalen;
+};
 
-const char * get_url_ipservice(sqlite3 *db, int urlnr);
+struct DbContext;
 
-int update_disabled_ipsevice(sqlite3 *db, int urlnr, bool addtimestamp);
+struct DbContext * db_open(const char *filename, const char *statefilename);
 
-void get_disabled_ipservices(sqlite3 *db, int urlnrs_avoid[], bool verbosemode);
+void db_close(struct DbContext *dbctx);
 
-const int get_priority_ipservice(sqlite3 *db, int urlnr);
+int begin_transaction(struct DbContext *dbctx);
 
-void get_urlnrs_ipservices(sqlite3 *db, int urlnrs[], int disabled, int allowedprotocoltypes);
+int commit_transaction(struct DbContext *dbctx);
 
-int reenable_expired_disabled_ipservices(sqlite3 *db, int blockseconds);
+bool migrate_schema(struct DbContext *dbctx, int errorwait, bool verbosemode);
 
-int create_table_config(sqlite3 *db, bool verbosemode);
+int add_ipservice(struct DbContext *dbctx, int urlnr, char * url, bool disabled, int protocoltype, int priority,
+                  int families, bool verbosemode);
 
-int get_config_value_int(sqlite3 *db, char *name);
+int get_count_all_ipservices(struct DbContext *dbctx);
 
-char * get_config_value_str(sqlite3 *db, char *name);
+int get_count_available_ipservices(struct DbContext *dbctx, int allowedprotocoltypes, int families);
 
-int add_config_value_int(sqlite3 *db, char *name, int value, bool verbosemode);
+const char * get_url_ipservice(struct DbContext *dbctx, int urlnr);
 
-int add_config_value_str(sqlite3 *db, char *name, char * value, bool verbosemode);
+int open_breaker_ipservice(struct DbContext *dbctx, int urlnr, int minwait, int maxwait);
 
-int update_config_value_int(sqlite3 *db, char *name, int valuenew, bool verbosemode);
+int close_breaker_ipservice(struct DbContext *dbctx, int urlnr);
 
-int update_config_value_str(sqlite3 *db, char *name, const char * valuenew, bool verbosemode);
+int disable_forever_ipservice(struct DbContext *dbctx, int urlnr);
 
-bool is_config_exists(sqlite3 *db, char *name);
+void get_disabled_ipservices(struct DbContext *dbctx, int urlnrs_avoid[], bool verbosemode);
+
+int update_latency_ipservice(struct DbContext *dbctx, int urlnr, int totalms, int connectms);
+
+int add_failure_ipservice(struct DbContext *dbctx, int urlnr);
+
+int add_disagreement_ipservice(struct DbContext *dbctx, int urlnr);
+
+int get_scores_ipservices(struct DbContext *dbctx, struct IpServiceScore scores[], int maxscores,
+                          int allowedprotocoltypes, int families);
+
+int get_latency_p99_ipservice(struct DbContext *dbctx, int urlnr, int *connectp99ms);
+
+int get_latency_p95_ipservice(struct DbContext *dbctx, int urlnr);
+
+int save_dnscache(struct DbContext *dbctx, const char *host, long port, const char *address, int expireson);
+
+int delete_dnscache(struct DbContext *dbctx, const char *host, long port);
+
+int delete_expired_dnscache(struct DbContext *dbctx);
+
+int get_dnscache(struct DbContext *dbctx, struct DnsCacheEntry entries[], int maxentries);
+
+int delete_tlssessions(struct DbContext *dbctx);
+
+int add_tlssession(struct DbContext *dbctx, const char *sessionkey, const unsigned char *shmac, size_t shmaclen,
+                   const unsigned char *sdata, size_t sdatalen, long validuntil);
+
+int get_tlssessions(struct DbContext *dbctx, struct TlsSession sessions[], int maxsessions);
+
+void free_tlssessions(struct TlsSession sessions[], int numsessions);
+
+bool get_egress_proxy(struct DbContext *dbctx, const char *proxy, char *ipaddr);
+
+int save_egress_proxy(struct DbContext *dbctx, const char *proxy, const char *ipaddr, int now);
+
+int get_config_value_int(struct DbContext *dbctx, char *name);
+
+char * get_config_value_str(struct DbContext *dbctx, char *name);
+
+int set_config_value_int(struct DbContext *dbctx, char *name, int value, bool verbosemode);
+
+int set_config_value_str(struct DbContext *dbctx, char *name, const char * value, bool verbosemode);
+
+bool is_config_exists(struct DbContext *dbctx, char *name);
 
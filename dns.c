@@ -0,0 +1,327 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/random.h>
+#include <arpa/inet.h>
+#include "udp.h"
+#include "dns.h"
+
+#define DNSPORT          53
+#define DNSHEADERSIZE    12
+#define DNSFLAGQR        0x8000
+#define DNSFLAGTC        0x0200
+#define DNSFLAGRD        0x0100
+#define DNSRCODEMASK     0x000F
+#define DNSRCODENXDOMAIN 3
+
+/**
+ * Check if the url of an ipservice is a DNS url.
+ */
+bool is_dns_url(const char *url)
+{
+        return strncmp(url, "dns://", 6) == 0;
+}
+
+/**
+ * Read a 16 bit number in network byte order.
+ */
+static uint16_t read_uint16(const unsigned char *p)
+{
+        return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+/**
+ * Write a 16 bit number in network byte order.
+ */
+static void write_uint16(unsigned char *p, uint16_t value)
+{
+        p[0] = (unsigned char)(value >> 8);
+        p[1] = (unsigned char)(value & 0xFF);
+}
+
+/**
+ * Parse the query parameters type and class of a DNS url.
+ * @return false on an unknown parameter or value.
+ */
+static bool parse_dns_url_params(const char *params, uint16_t *qtype, uint16_t *qclass)
+{
+        while (*params != '\0') {
+                const char *end = strchr(params, '&');
+                size_t len = end != NULL ? (size_t)(end - params) : strlen(params);
+                if (len == 8 && strncasecmp(params, "type=TXT", 8) == 0) {
+                        *qtype = DNSTYPETXT;
+                } else if (len == 6 && strncasecmp(params, "type=A", 6) == 0) {
+                        *qtype = DNSTYPEA;
+                } else if (len == 8 && strncasecmp(params, "class=IN", 8) == 0) {
+                        *qclass = DNSCLASSIN;
+                } else if (len == 8 && strncasecmp(params, "class=CH", 8) == 0) {
+                        *qclass = DNSCLASSCH;
+                } else {
+                        return false;
+                }
+
+                params += len;
+                if (*params == '&') {
+                        ++params;
+                }
+        }
+
+        return true;
+}
+
+/**
+ * Encode a DNS name as labels in wire format, without compression. A trailing dot is allowed.
+ * @param p    Where to write the encoded name.
+ * @param size The size of p, MAXLENDNSNAME + 2 bytes is always enough.
+ * @return The length of the encoded name, or 0 if the name is not a valid DNS name.
+ */
+size_t dns_encode_name(unsigned char *p, size_t size, const char *name)
+{
+        size_t pos = 0;
+        const char *label = name;
+        if (strlen(name) > MAXLENDNSNAME + 1) {
+                return 0;
+        }
+
+        while (*label != '\0') {
+                const char *dot = strchr(label, '.');
+                size_t len = dot != NULL ? (size_t)(dot - label) : strlen(label);
+                if (len == 0 || len > 63 || pos + len + 2 > size) {
+                        return 0;
+                }
+
+                p[pos++] = (unsigned char)len;
+                memcpy(p + pos, label, len);
+                pos += len;
+                label += len;
+                if (*label == '.') {
+                        ++label;
+                }
+        }
+
+        p[pos++] = 0;
+        return pos;
+}
+
+/**
+ * Encode a DNS query message for a name, type and class.
+ * @return false if the name is not a valid DNS name.
+ */
+static bool build_dns_query(struct UdpQuery *query, const char *qname, uint16_t qtype,
+                            uint16_t qclass)
+{
+        unsigned char *p = query->querymsg;
+        uint16_t id;
+        if (getrandom(&id, sizeof(id), 0) != sizeof(id)) {
+                id = (uint16_t)rand();
+        }
+
+        memset(p, 0, DNSHEADERSIZE);
+        write_uint16(p, id);
+        write_uint16(p + 2, DNSFLAGRD);
+        write_uint16(p + 4, 1);
+        p += DNSHEADERSIZE;
+        size_t namelen = dns_encode_name(p, MAXSIZEUDPQUERY - DNSHEADERSIZE - 4, qname);
+        if (namelen == 0) {
+                return false;
+        }
+
+        p += namelen;
+        write_uint16(p, qtype);
+        write_uint16(p + 2, qclass);
+        p += 4;
+        query->querylen = (size_t)(p - query->querymsg);
+        return true;
+}
+
+/**
+ * Parse a DNS url of an ipservice and prepare the query.
+ * The format is dns://server[:port]/name[?type=A|TXT][&class=IN|CH], the server has to be
+ * an IPv4 address so no other DNS lookup is needed first.
+ * @return false if the url is not a valid DNS url.
+ */
+bool dns_parse_url(const char *url, struct UdpQuery *query)
+{
+        char server[INET_ADDRSTRLEN];
+        char qname[MAXLENDNSNAME + 1];
+        uint16_t qtype = DNSTYPEA;
+        uint16_t qclass = DNSCLASSIN;
+        udp_init_query(query);
+        if (!is_dns_url(url)) {
+                return false;
+        }
+
+        const char *hostpart = url + 6;
+        const char *slash = strchr(hostpart, '/');
+        if (slash == NULL) {
+                return false;
+        }
+
+        size_t hostlen = (size_t)(slash - hostpart);
+        const char *colon = memchr(hostpart, ':', hostlen);
+        size_t serverlen = colon != NULL ? (size_t)(colon - hostpart) : hostlen;
+        if (serverlen == 0 || serverlen >= sizeof(server)) {
+                return false;
+        }
+
+        memcpy(server, hostpart, serverlen);
+        server[serverlen] = '\0';
+        long port = DNSPORT;
+        if (colon != NULL) {
+                char *portend;
+                port = strtol(colon + 1, &portend, 10);
+                if (portend != slash || port <= 0 || port > 65535) {
+                        return false;
+                }
+        }
+
+        query->server.sin_family = AF_INET;
+        query->server.sin_port = htons((uint16_t)port);
+        if (inet_pton(AF_INET, server, &query->server.sin_addr) != 1) {
+                return false;
+        }
+
+        const char *name = slash + 1;
+        const char *params = strchr(name, '?');
+        size_t namelen = params != NULL ? (size_t)(params - name) : strlen(name);
+        if (namelen > 0 && name[namelen - 1] == '.') {
+                --namelen;
+        }
+
+        if (namelen == 0 || namelen > MAXLENDNSNAME) {
+                return false;
+        }
+
+        memcpy(qname, name, namelen);
+        qname[namelen] = '\0';
+        if (params != NULL && !parse_dns_url_params(params + 1, &qtype, &qclass)) {
+                return false;
+        }
+
+        return build_dns_query(query, qname, qtype, qclass);
+}
+
+/**
+ * Skip over a possibly compressed DNS name.
+ * @return false if the name runs past the end of the message.
+ */
+bool dns_skip_name(const unsigned char *msg, size_t msglen, size_t *pos)
+{
+        while (*pos < msglen) {
+                unsigned char len = msg[*pos];
+                if ((len & 0xC0) == 0xC0) {
+                        *pos += 2;
+                        return *pos <= msglen;
+                } else if ((len & 0xC0) != 0) {
+                        return false;
+                }
+
+                *pos += 1 + len;
+                if (len == 0) {
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+/**
+ * Parse a DNS reply to the query and copy the first A or TXT record in it to answer,
+ * the answer is empty if there is no such record.
+ * @return UDPANSWER, UDPNOANSWERYET if the reply is not for this query, or a UDPERROR code.
+ */
+int dns_parse_reply(const struct UdpQuery *query, const unsigned char *msg, size_t msglen,
+                    char *answer, size_t answersize)
+{
+        if (msglen < query->querylen || memcmp(msg, query->querymsg, 2) != 0) {
+                return UDPNOANSWERYET;
+        }
+
+        uint16_t flags = read_uint16(msg + 2);
+        uint16_t qtype = read_uint16(query->querymsg + query->querylen - 4);
+        uint16_t qclass = read_uint16(query->querymsg + query->querylen - 2);
+        if ((flags & DNSFLAGQR) == 0 || read_uint16(msg + 4) != 1) {
+                return UDPNOANSWERYET;
+        }
+
+        // The question has to be the one asked, DNS names compare case-insensitive.
+        for (size_t i = DNSHEADERSIZE; i < query->querylen; ++i) {
+                unsigned char a = msg[i];
+                unsigned char b = query->querymsg[i];
+                if (a != b && !(a >= 'A' && a <= 'Z' && a + 32 == b) &&
+                    !(b >= 'A' && b <= 'Z' && b + 32 == a)) {
+                        return UDPNOANSWERYET;
+                }
+        }
+
+        if ((flags & DNSRCODEMASK) == DNSRCODENXDOMAIN) {
+                return UDPERRORNAME;
+        } else if ((flags & DNSRCODEMASK) != 0) {
+                return UDPERRORREFUSED;
+        } else if ((flags & DNSFLAGTC) != 0) {
+                return UDPERRORRESPONSE;
+        }
+
+        answer[0] = '\0';
+        uint16_t numanswers = read_uint16(msg + 6);
+        size_t pos = query->querylen;
+        for (uint16_t n = 0; n < numanswers; ++n) {
+                if (!dns_skip_name(msg, msglen, &pos) || pos + 10 > msglen) {
+                        return UDPERRORRESPONSE;
+                }
+
+                uint16_t rtype = read_uint16(msg + pos);
+                uint16_t rclass = read_uint16(msg + pos + 2);
+                uint16_t rdlength = read_uint16(msg + pos + 8);
+                const unsigned char *rdata = msg + pos + 10;
+                pos += 10 + rdlength;
+                if (pos > msglen) {
+                        return UDPERRORRESPONSE;
+                }
+
+                if (rtype != qtype || rclass != qclass) {
+                        // For example a CNAME record.
+                        continue;
+                }
+
+                if (rtype == DNSTYPEA && rdlength == 4) {
+                        if (inet_ntop(AF_INET, rdata, answer, answersize) == NULL) {
+                                return UDPERRORRESPONSE;
+                        }
+                } else if (rtype == DNSTYPETXT && rdlength > 0 && rdata[0] < rdlength) {
+                        size_t len = rdata[0];
+                        if (len >= answersize) {
+                                len = answersize - 1;
+                        }
+
+                        memcpy(answer, rdata + 1, len);
+                        answer[len] = '\0';
+                } else {
+                        return UDPERRORRESPONSE;
+                }
+
+                break;
+        }
+
+        return UDPANSWER;
+}
@@ -0,0 +1,854 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include "dnsupdate.h"
+
+#define DNSHEADERSIZE      12
+#define DNSFLAGQR          0x8000
+#define DNSFLAGTC          0x0200
+#define DNSOPCODEUPDATE    (5 << 11)
+#define DNSOPCODEMASK      0x7800
+#define DNSRCODEMASK       0x000F
+#define DNSRCODENOTAUTH    9
+#define DNSTYPESOA         6
+#define DNSTYPEAAAA        28
+#define DNSTYPETSIG        250
+#define DNSCLASSANY        255
+#define DNSPORT            53
+#define TSIGALGORITHM      "hmac-sha256"
+#define TSIGFUDGE          300
+/* Without EDNS a DNS message over UDP is at most 512 bytes, a larger UPDATE is sent over TCP. */
+#define MAXSIZEUDPUPDATE   512
+#define MAXSIZEUPDATE      65535
+#define MAXSIZEUPDATEREPLY 4096
+#define UPDATERETRYMS      1000
+#define UPDATEMAXSENDS     3
+#define UPDATETCPTIMEOUTMS 5000
+#define MAXLENCONFIGLINE   1023
+
+/* The UPDATE message of one zone while it is sent. */
+struct ZoneUpdate {
+        const struct DnsUpdateZone *zone;
+        unsigned char *msg;
+        size_t msglen;
+        unsigned char mac[SHA256DIGESTSIZE];
+        int sockfd;
+        int numsent;
+        bool done;
+        bool updated;
+        bool truncated;
+};
+
+/* The fields of a TSIG record in a reply, pointing into the reply. */
+struct TsigRecord {
+        const unsigned char *algorithm;
+        size_t algorithmlen;
+        /* The time signed and the fudge, 8 bytes. */
+        const unsigned char *timefudge;
+        const unsigned char *mac;
+        size_t macsize;
+        /* The error, the other length and the other data. */
+        const unsigned char *errorother;
+        size_t otherlen;
+};
+
+static struct DnsUpdateZone *zones = NULL;
+static int numzones = 0;
+
+static const char *rcodenames[] = {
+        "NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED",
+        "YXDOMAIN", "YXRRSET", "NXRRSET", "NOTAUTH", "NOTZONE"
+};
+
+/* The TSIG errors from 16 on, see RFC 8945. */
+static const char *tsigerrornames[] = {
+        "BADSIG", "BADKEY", "BADTIME", "BADMODE", "BADNAME", "BADALG", "BADTRUNC"
+};
+
+/**
+ * Read a 16 bit number in network byte order.
+ */
+static uint16_t read_uint16(const unsigned char *p)
+{
+        return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+/**
+ * Write a 16 bit number in network byte order.
+ */
+static void write_uint16(unsigned char *p, uint16_t value)
+{
+        p[0] = (unsigned char)(value >> 8);
+        p[1] = (unsigned char)(value & 0xFF);
+}
+
+/**
+ * Write a 32 bit number in network byte order.
+ */
+static void write_uint32(unsigned char *p, uint32_t value)
+{
+        write_uint16(p, (uint16_t)(value >> 16));
+        write_uint16(p + 2, (uint16_t)(value & 0xFFFF));
+}
+
+/**
+ * Decode a base64 TSIG secret, like the secret of a BIND key file.
+ * @return The number of bytes decoded, or 0 if the secret is not valid base64 or too long.
+ */
+static size_t decode_base64(const char *text, unsigned char *out, size_t outsize)
+{
+        static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        uint32_t bits = 0;
+        int numbits = 0;
+        size_t len = 0;
+        for (const char *c = text; *c != '\0' && *c != '='; ++c) {
+                const char *digit = strchr(alphabet, *c);
+                if (digit == NULL) {
+                        return 0;
+                }
+
+                bits = (bits << 6) | (uint32_t)(digit - alphabet);
+                numbits += 6;
+                if (numbits >= 8) {
+                        numbits -= 8;
+                        if (len >= outsize) {
+                                return 0;
+                        }
+
+                        out[len++] = (unsigned char)(bits >> numbits);
+                }
+        }
+
+        return len;
+}
+
+/**
+ * Parse the address and optional port of a primary server, an IPv4 or IPv6 address.
+ * @return false if the address or port is not valid.
+ */
+static bool parse_server(struct DnsUpdateZone *zone, const char *address, const char *port)
+{
+        struct addrinfo hints;
+        struct addrinfo *result;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+        char defaultport[8];
+        snprintf(defaultport, sizeof(defaultport), "%d", DNSPORT);
+        if (getaddrinfo(address, port != NULL ? port : defaultport, &hints, &result) != 0) {
+                return false;
+        }
+
+        memcpy(&zone->server, result->ai_addr, result->ai_addrlen);
+        zone->serverlen = result->ai_addrlen;
+        freeaddrinfo(result);
+        return true;
+}
+
+/**
+ * Parse a number in a line of the file, the whole text has to be the number.
+ * @return false if text is not a decimal number, or out of range.
+ */
+static bool parse_number(const char *text, long *value)
+{
+        char *end;
+        errno = 0;
+        *value = strtol(text, &end, 10);
+        return end != text && *end == '\0' && errno == 0;
+}
+
+/**
+ * Read the zones and records to update from a file. Every line is one of:
+ *   server address [port]   The primary server of the zones that follow.
+ *   key name secret         The TSIG key (hmac-sha256) of the zones that follow, the
+ *                           secret in base64.
+ *   zone name               A zone, the records that follow are updated in it.
+ *   record name [ttl] [uplink] A name in the zone, by default with a ttl of 300 seconds.
+ * Empty lines and lines starting with # are skipped.
+ * @return false if the file can't be read or has an error, the line is printed.
+ */
+bool dnsupdate_read(const char *path)
+{
+        FILE *file = fopen(path, "re");
+        if (file == NULL) {
+                fprintf(stderr, "Can't open %s: %s.\n", path, strerror(errno));
+                return false;
+        }
+
+        dnsupdate_free();
+        zones = calloc(MAXDNSUPDATEZONES, sizeof(struct DnsUpdateZone));
+        if (zones == NULL) {
+                fclose(file);
+                return false;
+        }
+
+        // The server and key in effect for the next zone.
+        struct DnsUpdateZone current;
+        memset(&current, 0, sizeof(current));
+        char line[MAXLENCONFIGLINE + 1];
+        int linenr = 0;
+        bool valid = true;
+        while (valid && fgets(line, sizeof(line), file) != NULL) {
+                ++linenr;
+                char *saveptr;
+                char *keyword = strtok_r(line, " \t\r\n", &saveptr);
+                if (keyword == NULL || keyword[0] == '#') {
+                        continue;
+                }
+
+                char *arg1 = strtok_r(NULL, " \t\r\n", &saveptr);
+                char *arg2 = strtok_r(NULL, " \t\r\n", &saveptr);
+                char *arg3 = strtok_r(NULL, " \t\r\n", &saveptr);
+                if (strcmp(keyword, "server") == 0) {
+                        valid = arg1 != NULL && parse_server(&current, arg1, arg2);
+                } else if (strcmp(keyword, "key") == 0) {
+                        valid = arg1 != NULL && arg2 != NULL && strlen(arg1) <= MAXLENDNSNAME;
+                        if (valid) {
+                                for (size_t i = 0; arg1[i] != '\0'; ++i) {
+                                        current.keyname[i] = (char)tolower((unsigned char)arg1[i]);
+                                }
+
+                                current.keyname[strlen(arg1)] = '\0';
+                                current.secretlen = decode_base64(arg2, current.secret,
+                                                                  sizeof(current.secret));
+                                valid = current.secretlen > 0;
+                        }
+                } else if (strcmp(keyword, "zone") == 0) {
+                        valid = arg1 != NULL && strlen(arg1) <= MAXLENDNSNAME &&
+                                current.serverlen > 0 && numzones < MAXDNSUPDATEZONES;
+                        if (valid) {
+                                struct DnsUpdateZone *zone = &zones[numzones++];
+                                memcpy(zone, &current, sizeof(*zone));
+                                strcpy(zone->name, arg1);
+                        }
+                } else if (strcmp(keyword, "record") == 0) {
+                        struct DnsUpdateZone *zone = numzones > 0 ? &zones[numzones - 1] : NULL;
+                        valid = zone != NULL && arg1 != NULL && strlen(arg1) <= MAXLENDNSNAME &&
+                                zone->numrecords < MAXDNSUPDATERECORDS &&
+                                (arg3 == NULL || strlen(arg3) <= MAXLENDNSUPDATEUPLINK);
+                        if (valid) {
+                                struct DnsUpdateRecord *record = &zone->records[zone->numrecords++];
+                                strcpy(record->name, arg1);
+                                record->ttl = DEFAULTDNSUPDATETTL;
+                                strcpy(record->uplink, arg3 != NULL ? arg3 : "");
+                                valid = (arg2 == NULL || parse_number(arg2, &record->ttl)) &&
+                                        record->ttl >= 0 && record->ttl <= INT32_MAX;
+                        }
+                } else {
+                        valid = false;
+                }
+        }
+
+        fclose(file);
+        if (!valid) {
+                fprintf(stderr, "Error in %s on line %d.\n", path, linenr);
+                dnsupdate_free();
+        }
+
+        return valid;
+}
+
+/**
+ * Forget the zones read by dnsupdate_read().
+ */
+void dnsupdate_free(void)
+{
+        free(zones);
+        zones = NULL;
+        numzones = 0;
+}
+
+/**
+ * Add the TSIG variables that are signed after the message (RFC 8945, 4.3.3).
+ */
+static void sign_tsig_variables(struct HmacSha256 *hmac, const unsigned char *keyname,
+                                size_t keynamelen, const unsigned char *algorithm,
+                                size_t algorithmlen, const unsigned char *timefudge,
+                                const unsigned char *errorother, size_t errorotherlen)
+{
+        unsigned char classttl[6] = { 0, DNSCLASSANY, 0, 0, 0, 0 };
+        hmac_sha256_update(hmac, keyname, keynamelen);
+        hmac_sha256_update(hmac, classttl, sizeof(classttl));
+        hmac_sha256_update(hmac, algorithm, algorithmlen);
+        hmac_sha256_update(hmac, timefudge, 8);
+        hmac_sha256_update(hmac, errorother, errorotherlen);
+}
+
+/**
+ * Append a TSIG record that signs the message with the key of the zone.
+ * @return The length of the signed message, or 0 if it does not fit.
+ */
+static size_t add_tsig(struct ZoneUpdate *update, size_t msglen, size_t msgsize)
+{
+        const struct DnsUpdateZone *zone = update->zone;
+        unsigned char keyname[MAXLENDNSNAME + 2];
+        unsigned char algorithm[MAXLENDNSNAME + 2];
+        size_t keynamelen = dns_encode_name(keyname, sizeof(keyname), zone->keyname);
+        size_t algorithmlen = dns_encode_name(algorithm, sizeof(algorithm), TSIGALGORITHM);
+        size_t rdatalen = algorithmlen + 10 + SHA256DIGESTSIZE + 6;
+        if (keynamelen == 0 || msglen + keynamelen + 10 + rdatalen > msgsize) {
+                return 0;
+        }
+
+        // Time signed is 48 bits, the upper 16 bits stay 0 until the year 10889.
+        uint64_t now = (uint64_t)time(NULL);
+        unsigned char timefudge[8];
+        write_uint16(timefudge, (uint16_t)(now >> 32));
+        write_uint32(timefudge + 2, (uint32_t)now);
+        write_uint16(timefudge + 6, TSIGFUDGE);
+        unsigned char errorother[4] = { 0, 0, 0, 0 };
+        struct HmacSha256 hmac;
+        hmac_sha256_init(&hmac, zone->secret, zone->secretlen);
+        hmac_sha256_update(&hmac, update->msg, msglen);
+        sign_tsig_variables(&hmac, keyname, keynamelen, algorithm, algorithmlen, timefudge,
+                            errorother, sizeof(errorother));
+        hmac_sha256_final(&hmac, update->mac);
+
+        unsigned char *p = update->msg + msglen;
+        memcpy(p, keyname, keynamelen);
+        p += keynamelen;
+        write_uint16(p, DNSTYPETSIG);
+        write_uint16(p + 2, DNSCLASSANY);
+        write_uint32(p + 4, 0);
+        write_uint16(p + 8, (uint16_t)rdatalen);
+        p += 10;
+        memcpy(p, algorithm, algorithmlen);
+        p += algorithmlen;
+        memcpy(p, timefudge, sizeof(timefudge));
+        write_uint16(p + 8, SHA256DIGESTSIZE);
+        p += 10;
+        memcpy(p, update->mac, SHA256DIGESTSIZE);
+        p += SHA256DIGESTSIZE;
+        // Original id, error and other length.
+        memcpy(p, update->msg, 2);
+        memcpy(p + 2, errorother, sizeof(errorother));
+        p += 6;
+        write_uint16(update->msg + 10, 1);
+        return (size_t)(p - update->msg);
+}
+
+/**
+ * Append the update of one record of one address family: delete the A or AAAA records of the
+ * name and add the new address (RFC 2136, 2.5.2 and 2.5.1).
+ * @return The new length of the message, or 0 if it does not fit.
+ */
+static size_t add_record_update(unsigned char *msg, size_t msglen, size_t msgsize,
+                                const struct DnsUpdateRecord *record, int family,
+                                const char *ipaddr)
+{
+        unsigned char addr[16];
+        size_t addrlen = family == AF_INET6 ? 16 : 4;
+        unsigned char name[MAXLENDNSNAME + 2];
+        size_t namelen = dns_encode_name(name, sizeof(name), record->name);
+        if (namelen == 0 || inet_pton(family, ipaddr, addr) != 1 ||
+            msglen + 2 * (namelen + 10) + addrlen > msgsize) {
+                return 0;
+        }
+
+        uint16_t type = family == AF_INET6 ? DNSTYPEAAAA : DNSTYPEA;
+        unsigned char *p = msg + msglen;
+        memcpy(p, name, namelen);
+        p += namelen;
+        write_uint16(p, type);
+        write_uint16(p + 2, DNSCLASSANY);
+        write_uint32(p + 4, 0);
+        write_uint16(p + 8, 0);
+        p += 10;
+        memcpy(p, name, namelen);
+        p += namelen;
+        write_uint16(p, type);
+        write_uint16(p + 2, DNSCLASSIN);
+        write_uint32(p + 4, (uint32_t)record->ttl);
+        write_uint16(p + 8, (uint16_t)addrlen);
+        p += 10;
+        memcpy(p, addr, addrlen);
+        p += addrlen;
+        return (size_t)(p - msg);
+}
+
+/**
+ * Build the UPDATE message with all records of the zone for the uplink, signed if the zone
+ * has a key.
+ * @return The number of records in the message, -1 if the message could not be built.
+ */
+static int build_update(struct ZoneUpdate *update, const char *ipv4addr, const char *ipv6addr,
+                        const char *uplink)
+{
+        const struct DnsUpdateZone *zone = update->zone;
+        unsigned char *msg = update->msg;
+        uint16_t id;
+        if (getrandom(&id, sizeof(id), 0) != sizeof(id)) {
+                id = (uint16_t)rand();
+        }
+
+        memset(msg, 0, DNSHEADERSIZE);
+        write_uint16(msg, id);
+        write_uint16(msg + 2, DNSOPCODEUPDATE);
+        write_uint16(msg + 4, 1);
+        size_t msglen = DNSHEADERSIZE;
+        size_t namelen = dns_encode_name(msg + msglen, MAXLENDNSNAME + 2, zone->name);
+        if (namelen == 0) {
+                return -1;
+        }
+
+        msglen += namelen;
+        write_uint16(msg + msglen, DNSTYPESOA);
+        write_uint16(msg + msglen + 2, DNSCLASSIN);
+        msglen += 4;
+        int numrecords = 0;
+        int numupdates = 0;
+        for (int r = 0; r < zone->numrecords; ++r) {
+                const struct DnsUpdateRecord *record = &zone->records[r];
+                if (strcmp(record->uplink, uplink != NULL ? uplink : "") != 0) {
+                        continue;
+                }
+
+                ++numrecords;
+                if (ipv4addr != NULL) {
+                        msglen = add_record_update(msg, msglen, MAXSIZEUPDATE, record, AF_INET,
+                                                   ipv4addr);
+                        numupdates += 2;
+                }
+
+                if (ipv6addr != NULL && msglen > 0) {
+                        msglen = add_record_update(msg, msglen, MAXSIZEUPDATE, record, AF_INET6,
+                                                   ipv6addr);
+                        numupdates += 2;
+                }
+
+                if (msglen == 0) {
+                        return -1;
+                }
+        }
+
+        write_uint16(msg + 8, (uint16_t)numupdates);
+        if (zone->secretlen > 0) {
+                msglen = add_tsig(update, msglen, MAXSIZEUPDATE);
+                if (msglen == 0) {
+                        return -1;
+                }
+        }
+
+        update->msglen = msglen;
+        return numrecords;
+}
+
+/**
+ * Read the TSIG record at the end of the reply.
+ * @param tsigstart The offset of the TSIG record in the reply.
+ * @return false if there is no complete TSIG record.
+ */
+static bool parse_tsig(const unsigned char *reply, size_t replylen, size_t tsigstart,
+                       struct TsigRecord *tsig)
+{
+        size_t pos = tsigstart;
+        if (!dns_skip_name(reply, replylen, &pos) || pos + 10 > replylen ||
+            read_uint16(reply + pos) != DNSTYPETSIG) {
+                return false;
+        }
+
+        pos += 10;
+        size_t algorithmstart = pos;
+        if (!dns_skip_name(reply, replylen, &pos) || pos + 10 > replylen) {
+                return false;
+        }
+
+        tsig->algorithm = reply + algorithmstart;
+        tsig->algorithmlen = pos - algorithmstart;
+        tsig->timefudge = reply + pos;
+        tsig->macsize = read_uint16(reply + pos + 8);
+        pos += 10;
+        if (pos + tsig->macsize + 6 > replylen) {
+                return false;
+        }
+
+        tsig->mac = reply + pos;
+        pos += tsig->macsize;
+        tsig->errorother = reply + pos + 2;
+        tsig->otherlen = read_uint16(reply + pos + 4);
+        return pos + 6 + tsig->otherlen <= replylen;
+}
+
+/**
+ * Check the TSIG record at the end of the reply, signed with the MAC of the UPDATE.
+ * @param tsigstart The offset of the TSIG record in the reply.
+ * @return true if the reply is signed with the key of the zone.
+ */
+static bool verify_tsig(const struct ZoneUpdate *update, const unsigned char *reply,
+                        size_t replylen, size_t tsigstart)
+{
+        const struct DnsUpdateZone *zone = update->zone;
+        struct TsigRecord tsig;
+        if (!parse_tsig(reply, replylen, tsigstart, &tsig) || tsig.macsize != SHA256DIGESTSIZE) {
+                return false;
+        }
+
+        const unsigned char *timefudge = tsig.timefudge;
+        long timesigned = (long)read_uint16(timefudge) << 32 |
+                          (long)read_uint16(timefudge + 2) << 16 | read_uint16(timefudge + 4);
+        if (labs(timesigned - (long)time(NULL)) > read_uint16(timefudge + 6)) {
+                return false;
+        }
+
+        unsigned char keyname[MAXLENDNSNAME + 2];
+        size_t keynamelen = dns_encode_name(keyname, sizeof(keyname), zone->keyname);
+        // The reply is signed as it was before the TSIG record was added.
+        unsigned char header[DNSHEADERSIZE];
+        memcpy(header, reply, DNSHEADERSIZE);
+        write_uint16(header + 10, (uint16_t)(read_uint16(header + 10) - 1));
+        unsigned char requestmacsize[2];
+        write_uint16(requestmacsize, SHA256DIGESTSIZE);
+        struct HmacSha256 hmac;
+        hmac_sha256_init(&hmac, zone->secret, zone->secretlen);
+        hmac_sha256_update(&hmac, requestmacsize, sizeof(requestmacsize));
+        hmac_sha256_update(&hmac, update->mac, SHA256DIGESTSIZE);
+        hmac_sha256_update(&hmac, header, DNSHEADERSIZE);
+        hmac_sha256_update(&hmac, reply + DNSHEADERSIZE, tsigstart - DNSHEADERSIZE);
+        sign_tsig_variables(&hmac, keyname, keynamelen, tsig.algorithm, tsig.algorithmlen,
+                            timefudge, tsig.errorother, 4 + tsig.otherlen);
+        unsigned char expectedmac[SHA256DIGESTSIZE];
+        hmac_sha256_final(&hmac, expectedmac);
+        // Compare in constant time.
+        unsigned char diff = 0;
+        for (int i = 0; i < SHA256DIGESTSIZE; ++i) {
+                diff |= expectedmac[i] ^ tsig.mac[i];
+        }
+
+        return diff == 0;
+}
+
+/**
+ * Find the start of the last record of the additional section, where a TSIG record is.
+ * @return The offset of the record, or 0 if the reply has no additional record.
+ */
+static size_t find_last_additional(const unsigned char *reply, size_t replylen)
+{
+        int numzone = read_uint16(reply + 4);
+        int numrecords = read_uint16(reply + 6) + read_uint16(reply + 8) + read_uint16(reply + 10);
+        if (read_uint16(reply + 10) == 0) {
+                return 0;
+        }
+
+        size_t pos = DNSHEADERSIZE;
+        for (int i = 0; i < numzone; ++i) {
+                if (!dns_skip_name(reply, replylen, &pos)) {
+                        return 0;
+                }
+
+                pos += 4;
+        }
+
+        for (int i = 0; i < numrecords - 1; ++i) {
+                if (!dns_skip_name(reply, replylen, &pos) || pos + 10 > replylen) {
+                        return 0;
+                }
+
+                pos += 10 + read_uint16(reply + pos + 8);
+        }
+
+        return pos < replylen ? pos : 0;
+}
+
+/**
+ * Get the name of the TSIG error in the reply, for a NOTAUTH reply to a signed UPDATE.
+ * @return The name, or NULL if the reply has no TSIG error.
+ */
+static const char * get_tsig_error(const unsigned char *reply, size_t replylen, size_t tsigstart)
+{
+        struct TsigRecord tsig;
+        if (tsigstart == 0 || !parse_tsig(reply, replylen, tsigstart, &tsig)) {
+                return NULL;
+        }
+
+        int error = read_uint16(tsig.errorother);
+        if (error < 16 || error - 16 >= (int)(sizeof(tsigerrornames) / sizeof(tsigerrornames[0]))) {
+                return NULL;
+        }
+
+        return tsigerrornames[error - 16];
+}
+
+/**
+ * Check the reply of the server to the UPDATE and print why it failed. A reply that is not
+ * signed with the key is ignored, so a forged reply does not end the wait for the real one.
+ * A NOTAUTH reply is taken unsigned, a server that could not check the key can't sign it.
+ * @return false if the reply is not a reply to the UPDATE and has to be ignored.
+ */
+static bool check_reply(struct ZoneUpdate *update, const unsigned char *reply, size_t replylen,
+                        bool silentmode)
+{
+        if (replylen < DNSHEADERSIZE || memcmp(reply, update->msg, 2) != 0) {
+                return false;
+        }
+
+        uint16_t flags = read_uint16(reply + 2);
+        if ((flags & DNSFLAGQR) == 0 || (flags & DNSOPCODEMASK) != DNSOPCODEUPDATE) {
+                return false;
+        }
+
+        if ((flags & DNSFLAGTC) != 0) {
+                // Only makes the UPDATE go again over TCP, where the reply is checked.
+                update->done = true;
+                update->truncated = true;
+                return true;
+        }
+
+        int rcode = flags & DNSRCODEMASK;
+        size_t tsigstart = find_last_additional(reply, replylen);
+        if (update->zone->secretlen > 0 && rcode != DNSRCODENOTAUTH &&
+            (tsigstart == 0 || !verify_tsig(update, reply, replylen, tsigstart))) {
+                if (!silentmode) {
+                        fprintf(stderr, "DNS update of zone %s: ignored a reply not signed with the key.\n",
+                                update->zone->name);
+                }
+
+                return false;
+        }
+
+        update->done = true;
+        if (rcode != 0) {
+                if (!silentmode) {
+                        const char *tsigerror = rcode == DNSRCODENOTAUTH ?
+                                                get_tsig_error(reply, replylen, tsigstart) : NULL;
+                        fprintf(stderr, "DNS update of zone %s failed: %s%s%s.\n", update->zone->name,
+                                rcode < (int)(sizeof(rcodenames) / sizeof(rcodenames[0])) ?
+                                rcodenames[rcode] : "unknown error", tsigerror != NULL ? " " : "",
+                                tsigerror != NULL ? tsigerror : "");
+                }
+
+                return true;
+        }
+
+        update->updated = true;
+        return true;
+}
+
+/**
+ * Send an UPDATE over TCP and wait for the reply, for an UPDATE too big for UDP or a
+ * truncated reply.
+ */
+static void send_update_tcp(struct ZoneUpdate *update, bool silentmode)
+{
+        const struct DnsUpdateZone *zone = update->zone;
+        update->done = true;
+        update->truncated = false;
+        int sockfd = socket(zone->server.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (sockfd < 0) {
+                return;
+        }
+
+        struct timeval timeout = { UPDATETCPTIMEOUTMS / 1000, 0 };
+        setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        unsigned char lengthprefix[2];
+        write_uint16(lengthprefix, (uint16_t)update->msglen);
+        unsigned char *reply = malloc(MAXSIZEUPDATEREPLY);
+        size_t replylen = 0;
+        size_t expectedlen = 0;
+        if (reply != NULL && connect(sockfd, (struct sockaddr *)&zone->server, zone->serverlen) == 0 &&
+            send(sockfd, lengthprefix, 2, MSG_MORE | MSG_NOSIGNAL) == 2 &&
+            send(sockfd, update->msg, update->msglen, MSG_NOSIGNAL) == (ssize_t)update->msglen &&
+            recv(sockfd, lengthprefix, 2, MSG_WAITALL) == 2) {
+                expectedlen = read_uint16(lengthprefix);
+                if (expectedlen <= MAXSIZEUPDATEREPLY &&
+                    recv(sockfd, reply, expectedlen, MSG_WAITALL) == (ssize_t)expectedlen) {
+                        replylen = expectedlen;
+                }
+        }
+
+        if (replylen == 0) {
+                if (!silentmode) {
+                        fprintf(stderr, "DNS update of zone %s: no reply over TCP.\n", zone->name);
+                }
+        } else if (!check_reply(update, reply, replylen, silentmode) && !silentmode) {
+                fprintf(stderr, "DNS update of zone %s: invalid reply over TCP.\n", zone->name);
+        }
+
+        free(reply);
+        close(sockfd);
+}
+
+/**
+ * Send the UPDATE messages over UDP at the same time and wait for the replies, sending again
+ * every UPDATERETRYMS without a reply.
+ */
+static void send_updates_udp(struct ZoneUpdate updates[], int numupdates, bool silentmode)
+{
+        unsigned char reply[MAXSIZEUPDATEREPLY];
+        for (int round = 0; round < UPDATEMAXSENDS; ++round) {
+                struct pollfd pollfds[MAXDNSUPDATEZONES];
+                int pollindex[MAXDNSUPDATEZONES];
+                int numpollfds = 0;
+                for (int u = 0; u < numupdates; ++u) {
+                        struct ZoneUpdate *update = &updates[u];
+                        if (update->done || update->msglen > MAXSIZEUDPUPDATE) {
+                                continue;
+                        }
+
+                        if (update->sockfd < 0) {
+                                update->sockfd = socket(update->zone->server.ss_family,
+                                                        SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                                if (update->sockfd < 0 ||
+                                    connect(update->sockfd, (struct sockaddr *)&update->zone->server,
+                                            update->zone->serverlen) != 0) {
+                                        update->done = true;
+                                        continue;
+                                }
+                        }
+
+                        ++update->numsent;
+                        send(update->sockfd, update->msg, update->msglen, 0);
+                        pollfds[numpollfds].fd = update->sockfd;
+                        pollfds[numpollfds].events = POLLIN;
+                        pollindex[numpollfds++] = u;
+                }
+
+                long deadlinems = UPDATERETRYMS;
+                struct timespec start;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                int numwaiting = numpollfds;
+                while (numwaiting > 0 && deadlinems > 0) {
+                        if (poll(pollfds, numpollfds, (int)deadlinems) < 0 && errno != EINTR) {
+                                break;
+                        }
+
+                        for (int i = 0; i < numpollfds; ++i) {
+                                if ((pollfds[i].revents & (POLLIN | POLLERR)) == 0) {
+                                        continue;
+                                }
+
+                                struct ZoneUpdate *update = &updates[pollindex[i]];
+                                ssize_t replylen = recv(update->sockfd, reply, sizeof(reply), 0);
+                                if (replylen < 0 && errno != EAGAIN && errno != EINTR) {
+                                        // For example connection refused if nothing listens on the port.
+                                        if (!silentmode) {
+                                                fprintf(stderr, "DNS update of zone %s: %s.\n",
+                                                        update->zone->name, strerror(errno));
+                                        }
+
+                                        update->done = true;
+                                } else if (replylen > 0) {
+                                        check_reply(update, reply, (size_t)replylen, silentmode);
+                                }
+
+                                if (update->done) {
+                                        pollfds[i].fd = -1;
+                                        --numwaiting;
+                                }
+                        }
+
+                        struct timespec now;
+                        clock_gettime(CLOCK_MONOTONIC, &now);
+                        deadlinems = UPDATERETRYMS - ((now.tv_sec - start.tv_sec) * 1000L +
+                                                      (now.tv_nsec - start.tv_nsec) / 1000000L);
+                }
+
+                if (numwaiting == 0) {
+                        break;
+                }
+        }
+
+        for (int u = 0; u < numupdates; ++u) {
+                if (updates[u].sockfd >= 0) {
+                        close(updates[u].sockfd);
+                        updates[u].sockfd = -1;
+                }
+
+                if (!updates[u].done && updates[u].numsent > 0 && !silentmode) {
+                        fprintf(stderr, "DNS update of zone %s: no reply.\n", updates[u].zone->name);
+                }
+        }
+}
+
+/**
+ * Set the records read by dnsupdate_read() to the new public addresses, with one UPDATE
+ * message per zone. The UPDATE messages of all zones are sent at the same time over UDP, so
+ * the update takes one round trip. An UPDATE that is too big for UDP or gets a truncated
+ * reply is sent over TCP.
+ * @param ipv4addr The IPv4 address for the A records, or NULL to leave them.
+ * @param ipv6addr The IPv6 address for the AAAA records, or NULL to leave them.
+ * @param uplink   Update the records of this uplink, NULL for the default route.
+ * @return true if every zone with records of the uplink is updated.
+ */
+bool dnsupdate_send(const char *ipv4addr, const char *ipv6addr, const char *uplink,
+                    bool verbosemode, bool silentmode)
+{
+        struct ZoneUpdate updates[MAXDNSUPDATEZONES];
+        int numupdates = 0;
+        bool success = true;
+        for (int z = 0; z < numzones; ++z) {
+                struct ZoneUpdate *update = &updates[numupdates];
+                memset(update, 0, sizeof(*update));
+                update->zone = &zones[z];
+                update->sockfd = -1;
+                update->msg = malloc(MAXSIZEUPDATE);
+                int numrecords = update->msg != NULL ? build_update(update, ipv4addr, ipv6addr, uplink) : -1;
+                if (numrecords < 0) {
+                        if (!silentmode) {
+                                fprintf(stderr, "Can't build the DNS update of zone %s.\n", zones[z].name);
+                        }
+
+                        success = false;
+                }
+
+                if (numrecords <= 0) {
+                        free(update->msg);
+                        continue;
+                }
+
+                if (verbosemode) {
+                        printf("DNS update of %d record(s) in zone %s, %zu bytes.\n", numrecords,
+                               zones[z].name, update->msglen);
+                }
+
+                ++numupdates;
+        }
+
+        send_updates_udp(updates, numupdates, silentmode);
+        for (int u = 0; u < numupdates; ++u) {
+                if (updates[u].msglen > MAXSIZEUDPUPDATE || updates[u].truncated) {
+                        send_update_tcp(&updates[u], silentmode);
+                }
+
+                if (!updates[u].updated) {
+                        success = false;
+                } else if (verbosemode) {
+                        printf("DNS update of zone %s done.\n", updates[u].zone->name);
+                }
+
+                free(updates[u].msg);
+        }
+
+        return success;
+}
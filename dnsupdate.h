@@ -0,0 +1,60 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+#ifndef DNSUPDATE_H
+#define DNSUPDATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include "dns.h"
+#include "sha256.h"
+
+#define MAXDNSUPDATEZONES    16
+#define MAXDNSUPDATERECORDS  64
+#define MAXLENDNSUPDATEUPLINK 63
+#define DEFAULTDNSUPDATETTL  300
+
+/* A name whose A record, and AAAA record in dual-stack mode, is set to the public address. */
+struct DnsUpdateRecord {
+        char name[MAXLENDNSNAME + 1];
+        long ttl;
+        /* Only updated with the address of this uplink, empty for the default route. */
+        char uplink[MAXLENDNSUPDATEUPLINK + 1];
+};
+
+/* A zone with its primary server and TSIG key, all its records go in one UPDATE message. */
+struct DnsUpdateZone {
+        char name[MAXLENDNSNAME + 1];
+        struct sockaddr_storage server;
+        socklen_t serverlen;
+        /* The key name in lowercase, empty to send the UPDATE unsigned. */
+        char keyname[MAXLENDNSNAME + 1];
+        unsigned char secret[SHA256BLOCKSIZE];
+        size_t secretlen;
+        struct DnsUpdateRecord records[MAXDNSUPDATERECORDS];
+        int numrecords;
+};
+
+bool dnsupdate_read(const char *path);
+
+bool dnsupdate_send(const char *ipv4addr, const char *ipv6addr, const char *uplink,
+                    bool verbosemode, bool silentmode);
+
+void dnsupdate_free(void);
+
+#endif
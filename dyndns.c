@@ -0,0 +1,635 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <curl/curl.h>
+#include "dyndns.h"
+
+#define MAXSIZEDYNDNSREPLY     4096
+#define MAXLENDYNDNSREQUEST    4095
+#define MAXLENCONFIGLINE       1023
+#define DYNDNSTIMEOUTSECONDS   30L
+/* How a provider answered, a worse result replaces a better one. */
+#define DYNDNSOK               0
+#define DYNDNSHOSTFAILED       1
+#define DYNDNSFAILED           2
+#define DYNDNSRETRYLATER       3
+#define DYNDNSBLOCKED          4
+
+/* The requests to one provider while they are sent, one after the other on one curl session. */
+struct ProviderUpdate {
+        const struct DyndnsProvider *provider;
+        struct DyndnsBackoff *backoff;
+        CURL *curlsession;
+        /* The hosts of the uplink to update, as index in provider->hosts. */
+        int hostnrs[MAXDYNDNSHOSTS];
+        int numhosts;
+        /* The first host of the running request and the number of hosts in it. */
+        int first;
+        int numinrequest;
+        int maxhosts;
+        char reply[MAXSIZEDYNDNSREPLY + 1];
+        size_t replysize;
+        bool toobig;
+        int result;
+        long retryafter;
+};
+
+static struct DyndnsProvider *providers = NULL;
+static int numproviders = 0;
+
+/**
+ * Parse a number in a line of the file, the whole text has to be the number.
+ * @return false if text is not a decimal number, or out of range.
+ */
+static bool parse_number(const char *text, long *value)
+{
+        char *end;
+        errno = 0;
+        *value = strtol(text, &end, 10);
+        return end != text && *end == '\0' && errno == 0;
+}
+
+/**
+ * Read the providers and hostnames to update from a file. Every line is one of:
+ *   provider url [maxhosts] A dyndns2 update url, like https://members.dyndns.org/nic/update,
+ *                           sending at most maxhosts hostnames in one request(default 20).
+ *   login user password     The login of the provider above.
+ *   host name [uplink]      A hostname of the provider above.
+ * Empty lines and lines starting with # are skipped.
+ * @return false if the file can't be read or has an error, the line is printed.
+ */
+bool dyndns_read(const char *path)
+{
+        FILE *file = fopen(path, "re");
+        if (file == NULL) {
+                fprintf(stderr, "Can't open %s: %s.\n", path, strerror(errno));
+                return false;
+        }
+
+        dyndns_free();
+        providers = calloc(MAXDYNDNSPROVIDERS, sizeof(struct DyndnsProvider));
+        if (providers == NULL) {
+                fclose(file);
+                return false;
+        }
+
+        char line[MAXLENCONFIGLINE + 1];
+        int linenr = 0;
+        bool valid = true;
+        while (valid && fgets(line, sizeof(line), file) != NULL) {
+                ++linenr;
+                char *saveptr;
+                char *keyword = strtok_r(line, " \t\r\n", &saveptr);
+                if (keyword == NULL || keyword[0] == '#') {
+                        continue;
+                }
+
+                char *arg1 = strtok_r(NULL, " \t\r\n", &saveptr);
+                char *arg2 = strtok_r(NULL, " \t\r\n", &saveptr);
+                struct DyndnsProvider *provider = numproviders > 0 ? &providers[numproviders - 1] : NULL;
+                if (strcmp(keyword, "provider") == 0) {
+                        valid = arg1 != NULL && strlen(arg1) <= MAXLENDYNDNSURL &&
+                                numproviders < MAXDYNDNSPROVIDERS;
+                        if (valid) {
+                                provider = &providers[numproviders++];
+                                strcpy(provider->url, arg1);
+                                long maxhosts = DEFAULTDYNDNSMAXHOSTS;
+                                valid = (arg2 == NULL || parse_number(arg2, &maxhosts)) &&
+                                        maxhosts > 0 && maxhosts <= MAXDYNDNSHOSTS;
+                                provider->maxhosts = (int)maxhosts;
+                        }
+                } else if (strcmp(keyword, "login") == 0) {
+                        valid = provider != NULL && arg1 != NULL && arg2 != NULL &&
+                                strlen(arg1) <= MAXLENDYNDNSLOGIN && strlen(arg2) <= MAXLENDYNDNSLOGIN;
+                        if (valid) {
+                                strcpy(provider->user, arg1);
+                                strcpy(provider->password, arg2);
+                        }
+                } else if (strcmp(keyword, "host") == 0) {
+                        valid = provider != NULL && arg1 != NULL && strlen(arg1) <= MAXLENHOST &&
+                                provider->numhosts < MAXDYNDNSHOSTS &&
+                                (arg2 == NULL || strlen(arg2) <= MAXLENDYNDNSUPLINK);
+                        if (valid) {
+                                struct DyndnsHost *host = &provider->hosts[provider->numhosts++];
+                                strcpy(host->name, arg1);
+                                strcpy(host->uplink, arg2 != NULL ? arg2 : "");
+                        }
+                } else {
+                        valid = false;
+                }
+        }
+
+        fclose(file);
+        if (!valid) {
+                fprintf(stderr, "Error in %s on line %d.\n", path, linenr);
+                dyndns_free();
+        }
+
+        return valid;
+}
+
+/**
+ * Get the number of providers read by dyndns_read().
+ */
+int dyndns_count_providers(void)
+{
+        return numproviders;
+}
+
+/**
+ * Get the name the backoff of a provider is saved under, made from a hash of its url and user,
+ * so it stays with the provider when the file is edited.
+ * @param name Set to the name, LENDYNDNSBACKOFFNAME + 1 bytes.
+ */
+void dyndns_get_backoff_name(int providernr, char *name)
+{
+        // 32 bit FNV-1a.
+        uint32_t hash = 2166136261u;
+        const struct DyndnsProvider *provider = &providers[providernr];
+        const char *texts[] = { provider->url, "\n", provider->user };
+        for (int t = 0; t < 3; ++t) {
+                for (const char *c = texts[t]; *c != '\0'; ++c) {
+                        hash = (hash ^ (uint8_t)*c) * 16777619u;
+                }
+        }
+
+        snprintf(name, LENDYNDNSBACKOFFNAME + 1, "dyndns%08x", hash);
+}
+
+/**
+ * Forget the providers read by dyndns_read().
+ */
+void dyndns_free(void)
+{
+        free(providers);
+        providers = NULL;
+        numproviders = 0;
+}
+
+/**
+ * Curl write callback that collects the reply of a provider, a reply of more than
+ * MAXSIZEDYNDNSREPLY bytes aborts the transfer.
+ */
+static size_t write_reply(char *data, size_t size, size_t nmemb, void *userdata)
+{
+        struct ProviderUpdate *update = (struct ProviderUpdate *)userdata;
+        size_t numbytes = size * nmemb;
+        if (update->replysize + numbytes > MAXSIZEDYNDNSREPLY) {
+                update->toobig = true;
+                return 0;
+        }
+
+        memcpy(update->reply + update->replysize, data, numbytes);
+        update->replysize += numbytes;
+        update->reply[update->replysize] = '\0';
+        return numbytes;
+}
+
+/**
+ * Build the request url with the next hostnames of the provider, comma separated.
+ * @return false if the url does not fit.
+ */
+static bool build_request_url(struct ProviderUpdate *update, const char *ipv4addr,
+                              const char *ipv6addr, char *url)
+{
+        const struct DyndnsProvider *provider = update->provider;
+        const size_t urlsize = MAXLENDYNDNSREQUEST + 1;
+        size_t urllen = (size_t)snprintf(url, urlsize, "%s%chostname=", provider->url,
+                                         strchr(provider->url, '?') != NULL ? '&' : '?');
+        update->numinrequest = 0;
+        while (urllen < urlsize && update->first + update->numinrequest < update->numhosts &&
+               update->numinrequest < update->maxhosts) {
+                int hostnr = update->hostnrs[update->first + update->numinrequest];
+                char *escaped = curl_easy_escape(NULL, provider->hosts[hostnr].name, 0);
+                if (escaped == NULL) {
+                        return false;
+                }
+
+                urllen += (size_t)snprintf(url + urllen, urlsize - urllen, "%s%s",
+                                           update->numinrequest > 0 ? "," : "", escaped);
+                curl_free(escaped);
+                ++update->numinrequest;
+        }
+
+        // The IPv4 address goes in myip, an IPv6 address in myipv6 or in myip if it is the only one.
+        if (ipv4addr != NULL && urllen < urlsize) {
+                urllen += (size_t)snprintf(url + urllen, urlsize - urllen, "&myip=%s", ipv4addr);
+        }
+
+        if (ipv6addr != NULL && urllen < urlsize) {
+                urllen += (size_t)snprintf(url + urllen, urlsize - urllen, "&%s=%s",
+                                           ipv4addr != NULL ? "myipv6" : "myip", ipv6addr);
+        }
+
+        return urllen < urlsize;
+}
+
+/**
+ * Start the request with the next hostnames of the provider. The curl session is kept for
+ * all requests to the provider, so they go over the same connection.
+ * @return false if the request could not be started.
+ */
+static bool start_request(CURLM *multi, struct ProviderUpdate *update, const char *ipv4addr,
+                          const char *ipv6addr, const char *useragent, bool unsafehttp)
+{
+        char url[MAXLENDYNDNSREQUEST + 1];
+        if (!build_request_url(update, ipv4addr, ipv6addr, url)) {
+                return false;
+        }
+
+        if (update->curlsession == NULL) {
+                update->curlsession = curl_easy_init();
+                if (update->curlsession == NULL) {
+                        return false;
+                }
+        }
+
+        setup_curl_session(update->curlsession, url, NULL, useragent, unsafehttp);
+        curl_easy_setopt(update->curlsession, CURLOPT_WRITEFUNCTION, write_reply);
+        curl_easy_setopt(update->curlsession, CURLOPT_WRITEDATA, update);
+        curl_easy_setopt(update->curlsession, CURLOPT_PRIVATE, update);
+        curl_easy_setopt(update->curlsession, CURLOPT_TIMEOUT, DYNDNSTIMEOUTSECONDS);
+        // Keep the connection for the next request to the provider, also without a share handle.
+        curl_easy_setopt(update->curlsession, CURLOPT_FORBID_REUSE, 0L);
+        if (update->provider->user[0] != '\0') {
+                curl_easy_setopt(update->curlsession, CURLOPT_HTTPAUTH, (long)CURLAUTH_BASIC);
+                curl_easy_setopt(update->curlsession, CURLOPT_USERNAME, update->provider->user);
+                curl_easy_setopt(update->curlsession, CURLOPT_PASSWORD, update->provider->password);
+        }
+
+        update->replysize = 0;
+        update->reply[0] = '\0';
+        update->toobig = false;
+        return curl_multi_add_handle(multi, update->curlsession) == CURLM_OK;
+}
+
+/**
+ * Remember the worst answer of a provider.
+ */
+static void set_result(struct ProviderUpdate *update, int result)
+{
+        if (result > update->result) {
+                update->result = result;
+        }
+}
+
+/**
+ * Check if the first word of an answer of the provider is a certain return code.
+ * @param codelen The length of the first word.
+ */
+static bool is_code(const char *answer, size_t codelen, const char *code)
+{
+        return strlen(code) == codelen && strncmp(answer, code, codelen) == 0;
+}
+
+/**
+ * Check the answer of the provider to one hostname, see the return codes of the dyndns2
+ * protocol.
+ * @param answer The line of the reply for the hostname.
+ * @return false if no more requests should be sent to the provider.
+ */
+static bool check_answer(struct ProviderUpdate *update, const char *hostname, const char *answer,
+                         bool verbosemode, bool silentmode)
+{
+        size_t codelen = strcspn(answer, " \t");
+        if (is_code(answer, codelen, "good")) {
+                if (verbosemode) {
+                        printf("Dyndns update of %s: %s\n", hostname, answer);
+                }
+
+                return true;
+        }
+
+        if (is_code(answer, codelen, "nochg")) {
+                // Not an error, but asking again and again without a change counts as abuse.
+                if (verbosemode) {
+                        printf("Dyndns update of %s: %s, the address was already set.\n", hostname,
+                               answer);
+                }
+
+                return true;
+        }
+
+        if (!silentmode) {
+                fprintf(stderr, "Dyndns update of %s at %s failed: %s\n", hostname,
+                        update->provider->url, answer[0] != '\0' ? answer : "empty reply");
+        }
+
+        if (is_code(answer, codelen, "nohost") || is_code(answer, codelen, "notfqdn")) {
+                // Wrong for this hostname only, the other hostnames can still be updated and
+                // asking again for this one does not help until the file is fixed.
+                set_result(update, DYNDNSHOSTFAILED);
+                return true;
+        }
+
+        if (is_code(answer, codelen, "911") || is_code(answer, codelen, "dnserr")) {
+                set_result(update, DYNDNSRETRYLATER);
+                return false;
+        }
+
+        if (is_code(answer, codelen, "badauth") || is_code(answer, codelen, "badagent") ||
+            is_code(answer, codelen, "abuse") || is_code(answer, codelen, "!donator")) {
+                // The client must stop until the user steps in, asking again gets the account
+                // flagged for abuse.
+                set_result(update, DYNDNSBLOCKED);
+                return false;
+        }
+
+        if (is_code(answer, codelen, "numhost")) {
+                // Even alone the hostname is too many, like a round robin name.
+                set_result(update, DYNDNSHOSTFAILED);
+                return true;
+        }
+
+        set_result(update, DYNDNSFAILED);
+        return true;
+}
+
+/**
+ * Check the reply of the provider to a request, one line per hostname in the order of the
+ * request. A provider that answers one line for all hostnames is understood as well.
+ * @return false if no more requests should be sent to the provider.
+ */
+static bool finish_request(struct ProviderUpdate *update, CURLcode curlcode, bool verbosemode,
+                           bool silentmode)
+{
+        const struct DyndnsProvider *provider = update->provider;
+        long httpcode = 0;
+        curl_easy_getinfo(update->curlsession, CURLINFO_RESPONSE_CODE, &httpcode);
+        if (curlcode != CURLE_OK) {
+                if (!silentmode) {
+                        fprintf(stderr, "Dyndns update at %s failed: %s\n", provider->url,
+                                update->toobig ? "reply too big" : curl_easy_strerror(curlcode));
+                }
+
+                set_result(update, DYNDNSFAILED);
+                return false;
+        }
+
+        if (httpcode == 429 || httpcode >= 500) {
+                curl_off_t retryafter = 0;
+                if (curl_easy_getinfo(update->curlsession, CURLINFO_RETRY_AFTER, &retryafter) == CURLE_OK &&
+                    retryafter > update->retryafter) {
+                        update->retryafter = retryafter < DYNDNSMAXRETRYSECONDS ? (long)retryafter :
+                                             DYNDNSMAXRETRYSECONDS;
+                }
+
+                if (!silentmode) {
+                        fprintf(stderr, "Dyndns update at %s failed: HTTP status %ld.\n", provider->url,
+                                httpcode);
+                }
+
+                set_result(update, DYNDNSRETRYLATER);
+                return false;
+        }
+
+        if (httpcode != 200 && update->replysize == 0) {
+                if (!silentmode) {
+                        fprintf(stderr, "Dyndns update at %s failed: HTTP status %ld.\n", provider->url,
+                                httpcode);
+                }
+
+                set_result(update, httpcode == 401 || httpcode == 403 ? DYNDNSBLOCKED : DYNDNSFAILED);
+                return false;
+        }
+
+        char *lines[MAXDYNDNSHOSTS];
+        int numlines = 0;
+        char *saveptr;
+        for (char *line = strtok_r(update->reply, "\r\n", &saveptr);
+             line != NULL && numlines < MAXDYNDNSHOSTS; line = strtok_r(NULL, "\r\n", &saveptr)) {
+                line += strspn(line, " \t");
+                if (line[0] != '\0') {
+                        lines[numlines++] = line;
+                }
+        }
+
+        if (update->numinrequest > 1 && numlines > 0 &&
+            is_code(lines[0], strcspn(lines[0], " \t"), "numhost")) {
+                // Too many hostnames in the request, send them again in halves for this run.
+                update->maxhosts = update->numinrequest / 2;
+                if (verbosemode) {
+                        printf("%s takes fewer hostnames per request, trying %d.\n", provider->url,
+                               update->maxhosts);
+                }
+
+                update->numinrequest = 0;
+                return true;
+        }
+
+        bool proceed = true;
+        for (int i = 0; i < update->numinrequest && proceed; ++i) {
+                const char *answer = numlines == 0 ? "" : lines[i < numlines ? i : numlines - 1];
+                const char *hostname = provider->hosts[update->hostnrs[update->first + i]].name;
+                proceed = check_answer(update, hostname, answer, verbosemode, silentmode);
+        }
+
+        return proceed;
+}
+
+/**
+ * Wait before asking a provider again after it failed, the wait doubles with every failure
+ * in a row, up to DYNDNSMAXRETRYSECONDS. An update that did not reach the provider stays
+ * pending, so it is sent when the wait is over, also without a new change. A provider that
+ * refused the login or the client is blocked, it is not asked again until its url or user
+ * is changed in the file, which gives the backoff an other name.
+ */
+static void set_backoff(const struct ProviderUpdate *update, int now, bool silentmode)
+{
+        struct DyndnsBackoff *backoff = update->backoff;
+        struct DyndnsBackoff next = { 0, 0, false, false, true };
+        if (update->result == DYNDNSBLOCKED) {
+                if (!silentmode) {
+                        fprintf(stderr, "Dyndns updates at %s are stopped until its url or user is "
+                                "changed.\n", update->provider->url);
+                }
+
+                next.blocked = true;
+        } else if (update->result >= DYNDNSFAILED) {
+                next.pending = true;
+                next.failures = backoff->failures;
+                long waitseconds = 0;
+                if (update->result == DYNDNSRETRYLATER) {
+                        waitseconds = update->retryafter > DYNDNSRETRYSECONDS ? update->retryafter :
+                                      DYNDNSRETRYSECONDS;
+                }
+
+                if (waitseconds > 0) {
+                        ++next.failures;
+                        for (int f = 1; f < next.failures && waitseconds < DYNDNSMAXRETRYSECONDS; ++f) {
+                                waitseconds *= 2;
+                        }
+
+                        if (waitseconds > DYNDNSMAXRETRYSECONDS) {
+                                waitseconds = DYNDNSMAXRETRYSECONDS;
+                        }
+
+                        next.retryat = now + (int)waitseconds;
+                }
+        }
+
+        next.changed = next.retryat != backoff->retryat || next.failures != backoff->failures ||
+                       next.pending != backoff->pending || next.blocked != backoff->blocked;
+        *backoff = next;
+}
+
+/**
+ * Set the address of the hostnames of an uplink with every provider read by dyndns_read().
+ * The hostnames of a provider are sent comma separated in as few requests as the provider
+ * allows, one after the other over the same connection. The providers are asked at the same
+ * time. A provider that has to wait is not asked, its update is sent when the wait is over.
+ * A blocked provider is not asked at all.
+ * @param ipv4addr The new IPv4 address, or NULL.
+ * @param ipv6addr The new IPv6 address, or NULL.
+ * @param uplink   Update the hostnames of this uplink, NULL for the default route.
+ * @param changed  The address changed, false to only send the pending updates.
+ * @param backoffs The backoff of every provider for the uplink, updated with the answers.
+ * @return true if every hostname of the uplink that had to be updated is updated.
+ */
+bool dyndns_send(const char *ipv4addr, const char *ipv6addr, const char *uplink, bool changed,
+                 const char *useragent, bool unsafehttp, struct DyndnsBackoff backoffs[],
+                 bool verbosemode, bool silentmode)
+{
+        struct ProviderUpdate *updates = calloc(MAXDYNDNSPROVIDERS, sizeof(struct ProviderUpdate));
+        CURLM *multi = curl_multi_init();
+        if (updates == NULL || multi == NULL) {
+                free(updates);
+                curl_multi_cleanup(multi);
+                return false;
+        }
+
+        bool success = true;
+        int now = (int)time(NULL);
+        int numupdates = 0;
+        int numrunning = 0;
+        for (int p = 0; p < numproviders; ++p) {
+                struct ProviderUpdate *update = &updates[numupdates];
+                update->provider = &providers[p];
+                update->backoff = &backoffs[p];
+                update->maxhosts = providers[p].maxhosts;
+                for (int h = 0; h < providers[p].numhosts; ++h) {
+                        if (strcmp(providers[p].hosts[h].uplink, uplink != NULL ? uplink : "") == 0) {
+                                update->hostnrs[update->numhosts++] = h;
+                        }
+                }
+
+                if (update->numhosts == 0 || (!changed && !backoffs[p].pending)) {
+                        memset(update, 0, sizeof(struct ProviderUpdate));
+                        continue;
+                }
+
+                if (backoffs[p].blocked) {
+                        // Reported when it was blocked, the user has to step in.
+                        if (verbosemode) {
+                                printf("Dyndns updates at %s are stopped.\n", providers[p].url);
+                        }
+
+                        memset(update, 0, sizeof(struct ProviderUpdate));
+                        continue;
+                }
+
+                if (backoffs[p].retryat > now) {
+                        // A pending update waits quietly, a new change is sent when the wait is over.
+                        if (changed) {
+                                if (!silentmode) {
+                                        fprintf(stderr, "Dyndns update at %s postponed, asking again "
+                                                "in %d seconds.\n", providers[p].url,
+                                                backoffs[p].retryat - now);
+                                }
+
+                                success = false;
+                                backoffs[p].changed = backoffs[p].changed || !backoffs[p].pending;
+                                backoffs[p].pending = true;
+                        }
+
+                        memset(update, 0, sizeof(struct ProviderUpdate));
+                        continue;
+                }
+
+                ++numupdates;
+                if (start_request(multi, update, ipv4addr, ipv6addr, useragent, unsafehttp)) {
+                        ++numrunning;
+                } else {
+                        if (!silentmode) {
+                                fprintf(stderr, "Can't start the dyndns update at %s.\n", providers[p].url);
+                        }
+
+                        set_result(update, DYNDNSFAILED);
+                }
+        }
+
+        while (numrunning > 0) {
+                int stillrunning = 0;
+                curl_multi_perform(multi, &stillrunning);
+                CURLMsg *msg;
+                int msgsinqueue;
+                while ((msg = curl_multi_info_read(multi, &msgsinqueue)) != NULL) {
+                        if (msg->msg != CURLMSG_DONE) {
+                                continue;
+                        }
+
+                        struct ProviderUpdate *update;
+                        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&update);
+                        CURLcode curlcode = msg->data.result;
+                        curl_multi_remove_handle(multi, update->curlsession);
+                        --numrunning;
+                        bool proceed = finish_request(update, curlcode, verbosemode, silentmode);
+                        update->first += update->numinrequest;
+                        if (proceed && update->first < update->numhosts) {
+                                if (start_request(multi, update, ipv4addr, ipv6addr, useragent,
+                                                  unsafehttp)) {
+                                        ++numrunning;
+                                } else {
+                                        set_result(update, DYNDNSFAILED);
+                                }
+                        }
+                }
+
+                if (numrunning > 0) {
+                        curl_multi_wait(multi, NULL, 0, 1000, NULL);
+                }
+        }
+
+        for (int u = 0; u < numupdates; ++u) {
+                const struct ProviderUpdate *update = &updates[u];
+                if (update->curlsession != NULL) {
+                        curl_easy_cleanup(update->curlsession);
+                }
+
+                if (update->result != DYNDNSOK) {
+                        success = false;
+                }
+
+                set_backoff(update, now, silentmode);
+                if (update->result == DYNDNSOK && verbosemode) {
+                        printf("Dyndns update of %d hostname(s) at %s done.\n", update->numhosts,
+                               update->provider->url);
+                }
+        }
+
+        curl_multi_cleanup(multi);
+        free(updates);
+        return success;
+}
@@ -0,0 +1,81 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+#ifndef DYNDNS_H
+#define DYNDNS_H
+
+#include <stdbool.h>
+#include "lookup.h"
+
+#define MAXDYNDNSPROVIDERS     16
+#define MAXDYNDNSHOSTS         64
+#define MAXLENDYNDNSURL        255
+#define MAXLENDYNDNSLOGIN      127
+#define MAXLENDYNDNSUPLINK     63
+/* The dyndns2 protocol allows up to 20 hostnames in one request. */
+#define DEFAULTDYNDNSMAXHOSTS  20
+/* After a 911 or dnserr the dyndns2 protocol asks to wait at least 30 minutes. */
+#define DYNDNSRETRYSECONDS     1800
+#define DYNDNSMAXRETRYSECONDS  86400
+/* The length of the name of the backoff of a provider: dyndns with 8 hex digits. */
+#define LENDYNDNSBACKOFFNAME   14
+
+/* A hostname whose address is set with the provider. */
+struct DyndnsHost {
+        char name[MAXLENHOST + 1];
+        /* Only updated with the address of this uplink, empty for the default route. */
+        char uplink[MAXLENDYNDNSUPLINK + 1];
+};
+
+/* A dyndns2 update url with its login, its hostnames are sent over one connection. */
+struct DyndnsProvider {
+        char url[MAXLENDYNDNSURL + 1];
+        char user[MAXLENDYNDNSLOGIN + 1];
+        char password[MAXLENDYNDNSLOGIN + 1];
+        /* The most hostnames put in one request, 1 for a provider that takes one at a time. */
+        int maxhosts;
+        struct DyndnsHost hosts[MAXDYNDNSHOSTS];
+        int numhosts;
+};
+
+/* How long a provider is not asked for the hostnames of one uplink, kept between runs. */
+struct DyndnsBackoff {
+        /* Unix time before which the provider is not asked again, 0 if it can be asked. */
+        int retryat;
+        /* The number of failures in a row that made the provider wait. */
+        int failures;
+        /* The last update failed or was postponed, it is sent again when the wait is over. */
+        bool pending;
+        /* The provider refused the login or the client, it is never asked again on its own. */
+        bool blocked;
+        /* Set by dyndns_send() if the backoff has to be saved. */
+        bool changed;
+};
+
+bool dyndns_read(const char *path);
+
+int dyndns_count_providers(void);
+
+void dyndns_get_backoff_name(int providernr, char *name);
+
+bool dyndns_send(const char *ipv4addr, const char *ipv6addr, const char *uplink, bool changed,
+                 const char *useragent, bool unsafehttp, struct DyndnsBackoff backoffs[],
+                 bool verbosemode, bool silentmode);
+
+void dyndns_free(void);
+
+#endif
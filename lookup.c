@@ -0,0 +1,873 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <curl/curl.h>
+#include "dns.h"
+#include "stun.h"
+#include "lookup.h"
+
+static CURLSH *curlshare = NULL;
+static struct curl_slist *resolvelist = NULL;
+#ifdef CURLSSLOPT_EARLYDATA
+static bool earlydata = false;
+#endif
+static const char *sourceinterface = NULL;
+static int addressfamily = AF_INET;
+
+/**
+ * Curl write callback that collects the response body of an ipservice in a struct IpResponse.
+ * Returning less than the number of bytes received makes curl abort the transfer, so an
+ * ipservice that sends more than just an ip address costs no more than MAXSIZEIPADDRDOWNLOAD bytes,
+ * or MAXSIZEIPV6ADDRDOWNLOAD bytes when looking up the IPv6 address.
+ */
+size_t write_ipresponse(char *data, size_t size, size_t nmemb, void *userdata)
+{
+        struct IpResponse *response = (struct IpResponse *)userdata;
+        size_t numbytes = size * nmemb;
+        size_t maxsize = addressfamily == AF_INET6 ? MAXSIZEIPV6ADDRDOWNLOAD : MAXSIZEIPADDRDOWNLOAD;
+        if (response->size + numbytes > maxsize) {
+                response->toobig = true;
+                return 0;
+        }
+
+        memcpy(response->body + response->size, data, numbytes);
+        response->size += numbytes;
+        response->body[response->size] = '\0';
+        return numbytes;
+}
+
+/**
+ * Share the DNS cache, the connection cache and the TLS sessions between all requests made
+ * by this process, so a long running process does not start cold on every check.
+ */
+void lookup_share_init(void)
+{
+        curlshare = curl_share_init();
+        if (curlshare == NULL) {
+                return;
+        }
+
+        curl_share_setopt(curlshare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(curlshare, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        curl_share_setopt(curlshare, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+}
+
+/**
+ * Close the shared connections, free the share handle and forget the added addresses.
+ */
+void lookup_share_cleanup(void)
+{
+        if (curlshare != NULL) {
+                curl_share_cleanup(curlshare);
+                curlshare = NULL;
+        }
+
+        curl_slist_free_all(resolvelist);
+        resolvelist = NULL;
+}
+
+/**
+ * Use a known address for a host instead of resolving it with DNS.
+ * @param host    The host name used in the url of the ipservice.
+ * @param port    The port used in the url of the ipservice.
+ * @param address The ip address to connect to.
+ */
+void lookup_add_resolve(const char *host, long port, const char *address)
+{
+        char resolve[MAXLENHOST + INET6_ADDRSTRLEN + 16];
+        int cw = snprintf(resolve, sizeof(resolve), "%s:%ld:%s", host, port, address);
+        if (cw < 0 || cw >= (int)sizeof(resolve)) {
+                return;
+        }
+
+        struct curl_slist *newlist = curl_slist_append(resolvelist, resolve);
+        if (newlist != NULL) {
+                resolvelist = newlist;
+        }
+}
+
+/**
+ * Allow TLS 1.3 early data (0-RTT) when resuming a TLS session.
+ * An ipservice request is an idempotent GET so a replayed request does no harm.
+ * @return false if libcurl was build without support for early data.
+ */
+bool lookup_enable_earlydata(void)
+{
+#ifdef CURLSSLOPT_EARLYDATA
+        earlydata = true;
+        return true;
+#else
+        return false;
+#endif
+}
+
+/**
+ * Send all requests from one uplink of a host with several uplinks.
+ * @param interface The name of the network interface or the IPv4 source address to use,
+ *                  NULL for the default route.
+ */
+void lookup_set_interface(const char *interface)
+{
+        sourceinterface = interface;
+}
+
+/**
+ * Look up the public address of one address family, resolving and connecting over that family.
+ * Only http and https ipservices can look up an IPv6 address.
+ * @param family AF_INET(the default) or AF_INET6.
+ */
+void lookup_set_family(int family)
+{
+        addressfamily = family;
+}
+
+#ifdef CURL_VERSION_SSLS_EXPORT
+struct TlsSessionExport {
+        tls_session_cb callback;
+        void *userptr;
+};
+
+/**
+ * Curl callback for curl_easy_ssls_export that passes a TLS session on to the tls_session_cb.
+ */
+static CURLcode export_tls_session(CURL *curlsession, void *userptr, const char *sessionkey,
+                                   const unsigned char *shmac, size_t shmaclen,
+                                   const unsigned char *sdata, size_t sdatalen,
+                                   curl_off_t validuntil, int ietftlsid, const char *alpn,
+                                   size_t earlydatamax)
+{
+        (void)curlsession;
+        (void)ietftlsid;
+        (void)alpn;
+        (void)earlydatamax;
+        struct TlsSessionExport *sessionexport = (struct TlsSessionExport *)userptr;
+        sessionexport->callback(sessionexport->userptr, sessionkey, shmac, shmaclen, sdata, sdatalen,
+                                (long)validuntil);
+        return CURLE_OK;
+}
+#endif
+
+/**
+ * Check if TLS sessions can be imported and exported. This needs the share handle and a
+ * libcurl of version 8.12 or later that is build with ssls-export support.
+ */
+static bool is_tls_session_export_supported(void)
+{
+#ifdef CURL_VERSION_SSLS_EXPORT
+        return curlshare != NULL &&
+               (curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_SSLS_EXPORT) != 0;
+#else
+        return false;
+#endif
+}
+
+/**
+ * Add a TLS session saved by an earlier run to the shared TLS session cache,
+ * so the next handshake with that ipservice can be abbreviated.
+ * @return true if the TLS session is imported.
+ */
+bool lookup_import_tls_session(const char *sessionkey, const unsigned char *shmac, size_t shmaclen,
+                               const unsigned char *sdata, size_t sdatalen)
+{
+        if (!is_tls_session_export_supported()) {
+                return false;
+        }
+
+        bool imported = false;
+#ifdef CURL_VERSION_SSLS_EXPORT
+        CURL *curlsession = curl_easy_init();
+        if (curlsession == NULL) {
+                return false;
+        }
+
+        curl_easy_setopt(curlsession, CURLOPT_SHARE, curlshare);
+        imported = curl_easy_ssls_import(curlsession, sessionkey, shmac, shmaclen, sdata,
+                                         sdatalen) == CURLE_OK;
+        curl_easy_cleanup(curlsession);
+#else
+        (void)sessionkey;
+        (void)shmac;
+        (void)shmaclen;
+        (void)sdata;
+        (void)sdatalen;
+#endif
+        return imported;
+}
+
+/**
+ * Pass every TLS session in the shared TLS session cache to callback, to save them for the next run.
+ * @return false if TLS sessions cannot be exported.
+ */
+bool lookup_export_tls_sessions(tls_session_cb callback, void *userptr)
+{
+        if (!is_tls_session_export_supported()) {
+                return false;
+        }
+
+        bool exported = false;
+#ifdef CURL_VERSION_SSLS_EXPORT
+        CURL *curlsession = curl_easy_init();
+        if (curlsession == NULL) {
+                return false;
+        }
+
+        struct TlsSessionExport sessionexport;
+        sessionexport.callback = callback;
+        sessionexport.userptr = userptr;
+        curl_easy_setopt(curlsession, CURLOPT_SHARE, curlshare);
+        exported = curl_easy_ssls_export(curlsession, export_tls_session, &sessionexport) == CURLE_OK;
+        curl_easy_cleanup(curlsession);
+#else
+        (void)callback;
+        (void)userptr;
+#endif
+        return exported;
+}
+
+/**
+ * Get the host name and port from the url of an ipservice.
+ * @param host     Buffer for the host name.
+ * @param hostsize The size of the host buffer.
+ * @param port     Set to the port, the default port of the scheme if the url has none.
+ * @return true if the url could be parsed.
+ */
+bool get_host_port_url(const char *url, char *host, size_t hostsize, long *port)
+{
+        bool parsed = false;
+        char *urlhost = NULL;
+        char *urlport = NULL;
+        CURLU *curlurl = curl_url();
+        if (curlurl == NULL) {
+                return false;
+        }
+
+        if (curl_url_set(curlurl, CURLUPART_URL, url, 0) == CURLUE_OK &&
+            curl_url_get(curlurl, CURLUPART_HOST, &urlhost, 0) == CURLUE_OK &&
+            curl_url_get(curlurl, CURLUPART_PORT, &urlport, CURLU_DEFAULT_PORT) == CURLUE_OK &&
+            strlen(urlhost) < hostsize) {
+                strcpy(host, urlhost);
+                *port = atol(urlport);
+                parsed = true;
+        }
+
+        curl_free(urlhost);
+        curl_free(urlport);
+        curl_url_cleanup(curlurl);
+        return parsed;
+}
+
+/**
+ * Set the curl options used for every request to an ipservice.
+ * @param url       The url of the ipservice.
+ * @param response  Where to collect the response body, if NULL the caller sets CURLOPT_WRITEDATA.
+ * @param useragent The useragent to send.
+ * @param unsafehttp Allow the use of unsafe http next to https.
+ */
+void setup_curl_session(CURL *curlsession, const char *url, struct IpResponse *response,
+                        const char *useragent, bool unsafehttp)
+{
+        curl_easy_setopt(curlsession, CURLOPT_URL, url);
+        curl_easy_setopt(curlsession, CURLOPT_HTTPGET, 1L);
+        if (response != NULL) {
+                response->size = 0;
+                response->toobig = false;
+                response->body[0] = '\0';
+                curl_easy_setopt(curlsession, CURLOPT_WRITEFUNCTION, write_ipresponse);
+                curl_easy_setopt(curlsession, CURLOPT_WRITEDATA, response);
+        }
+
+        // Default 300s, changed to max. 90 seconds to connect
+        curl_easy_setopt(curlsession, CURLOPT_CONNECTTIMEOUT, 90L);
+        // Default timeout is 0/never. changed to 90 seconds
+        curl_easy_setopt(curlsession, CURLOPT_TIMEOUT, 90L);
+        // Enable TLS false start. default disabled in curl, more testing needed.
+        //curl_easy_setopt(curlsession, CURLOPT_SSL_FALSESTART, 1L);
+        // Never follow redirects.
+        curl_easy_setopt(curlsession, CURLOPT_FOLLOWLOCATION, 0L);
+        curl_easy_setopt(curlsession, CURLOPT_MAXREDIRS, 0L);
+        if (curlshare != NULL) {
+                // Keep the connection, DNS result and TLS session for the next check.
+                curl_easy_setopt(curlsession, CURLOPT_SHARE, curlshare);
+                curl_easy_setopt(curlsession, CURLOPT_FORBID_REUSE, 0L);
+        } else {
+                // Make libcurl explicitly close the connection when done with the transfer.
+                curl_easy_setopt(curlsession, CURLOPT_FORBID_REUSE, 1L);
+        }
+
+        // limit the connection cache for this handle to no more than 3.
+        // Default 5
+        curl_easy_setopt(curlsession, CURLOPT_MAXCONNECTS, 3L);
+        // enable TCP keep-alive for this transfer
+        // Default 0
+        curl_easy_setopt(curlsession, CURLOPT_TCP_KEEPALIVE, 0L);
+        // TCP Fast Open: Default 0
+        // Beware: the TLS session cache does not work when TCP Fast Open is enabled.
+        // TCP Fast Open is also known to be problematic on or across certain networks.
+        //curl_easy_setopt(curlsession, CURLOPT_TCP_FASTOPEN, 0L);
+        // Resolve host name using IPv4-names only, or IPv6-names only to look up the IPv6 address.
+        curl_easy_setopt(curlsession, CURLOPT_IPRESOLVE,
+                         addressfamily == AF_INET6 ? CURL_IPRESOLVE_V6 : CURL_IPRESOLVE_V4);
+        // Only support TLS 1.2 and later only.
+        curl_easy_setopt(curlsession, CURLOPT_SSLVERSION, CURL_SSLVERSION_TLSv1_2);
+        if (!unsafehttp) {
+                // Only allow https to be used.
+                curl_easy_setopt(curlsession, CURLOPT_PROTOCOLS, CURLPROTO_HTTPS);
+        } else {
+                // Allow https and unsafe http.
+                curl_easy_setopt(curlsession, CURLOPT_PROTOCOLS,
+                                 CURLPROTO_HTTPS | CURLPROTO_HTTP);
+        }
+
+        if (resolvelist != NULL && addressfamily == AF_INET) {
+                // Skip DNS for hosts with an IPv4 address saved by an earlier run.
+                curl_easy_setopt(curlsession, CURLOPT_RESOLVE, resolvelist);
+        }
+
+#ifdef CURLSSLOPT_EARLYDATA
+        if (earlydata) {
+                curl_easy_setopt(curlsession, CURLOPT_SSL_OPTIONS, (long)CURLSSLOPT_EARLYDATA);
+        }
+#endif
+
+        if (sourceinterface != NULL) {
+                curl_easy_setopt(curlsession, CURLOPT_INTERFACE, sourceinterface);
+        }
+
+        curl_easy_setopt(curlsession, CURLOPT_USERAGENT, useragent);
+}
+
+/**
+ * Get the number of milliseconds elapsed since start.
+ */
+static long get_elapsed_ms(const struct timespec *start)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (now.tv_sec - start->tv_sec) * 1000L + (now.tv_nsec - start->tv_nsec) / 1000000L;
+}
+
+/**
+ * Check if the url of an ipservice is asked over UDP instead of over curl.
+ */
+bool is_udp_url(const char *url)
+{
+        return is_dns_url(url) || is_stun_url(url);
+}
+
+/**
+ * Parse the url of a lookup with a dns:// or stun:// url into its query. The name of a STUN
+ * server is resolved with a blocking getaddrinfo(), so this is done before the lookups start
+ * and not when a delayed lookup is started while the others are running.
+ */
+static void prepare_udp_lookup(struct Lookup *lookup)
+{
+        if (addressfamily != AF_INET) {
+                // The DNS and STUN lookups only ask over IPv4.
+                lookup->udpready = false;
+        } else if (is_dns_url(lookup->url)) {
+                lookup->udpready = dns_parse_url(lookup->url, &lookup->udpquery);
+        } else {
+                lookup->udpready = stun_parse_url(lookup->url, &lookup->udpquery);
+        }
+}
+
+/**
+ * Send the DNS query or STUN binding request of a lookup prepared by prepare_udp_lookup().
+ * @return true if the lookup is running.
+ */
+static bool start_udp_lookup(struct Lookup *lookup)
+{
+        if (!lookup->udpready) {
+                lookup->curlcode = CURLE_URL_MALFORMAT;
+                lookup->state = LOOKUPFAILED;
+                return false;
+        }
+
+        lookup->udpquery.interface = sourceinterface;
+        if (!udp_send_query(&lookup->udpquery)) {
+                udp_close(&lookup->udpquery);
+                lookup->curlcode = CURLE_SEND_ERROR;
+                lookup->state = LOOKUPFAILED;
+                return false;
+        }
+
+        inet_ntop(AF_INET, &lookup->udpquery.server.sin_addr, lookup->primaryip,
+                  sizeof(lookup->primaryip));
+        lookup->state = LOOKUPRUNNING;
+        return true;
+}
+
+/**
+ * Create the curl session of a lookup and add it to the multi handle, or send the UDP query
+ * for a lookup with a dns:// or stun:// url.
+ * @param elapsedms The number of milliseconds since the lookups started.
+ * @return true if the lookup is running.
+ */
+static bool start_lookup(CURLM *multi, struct Lookup *lookup, const char *useragent, bool unsafehttp,
+                         const char *proxy, long elapsedms)
+{
+        lookup->startedms = elapsedms;
+        if (is_udp_url(lookup->url)) {
+                return start_udp_lookup(lookup);
+        }
+
+        lookup->curlsession = curl_easy_init();
+        if (lookup->curlsession == NULL) {
+                lookup->curlcode = CURLE_FAILED_INIT;
+                lookup->state = LOOKUPFAILED;
+                return false;
+        }
+
+        setup_curl_session(lookup->curlsession, lookup->url, &lookup->response, useragent, unsafehttp);
+        if (lookup->connecttimeoutms > 0) {
+                curl_easy_setopt(lookup->curlsession, CURLOPT_CONNECTTIMEOUT_MS, lookup->connecttimeoutms);
+        }
+
+        if (lookup->timeoutms > 0) {
+                curl_easy_setopt(lookup->curlsession, CURLOPT_TIMEOUT_MS, lookup->timeoutms);
+        }
+
+        if (proxy != NULL) {
+                curl_easy_setopt(lookup->curlsession, CURLOPT_PROXY, proxy);
+        }
+
+        curl_easy_setopt(lookup->curlsession, CURLOPT_PRIVATE, lookup);
+        curl_multi_add_handle(multi, lookup->curlsession);
+        lookup->state = LOOKUPRUNNING;
+        return true;
+}
+
+/**
+ * Copy the ip address from the response of a lookup if it is a valid address of the family looked up.
+ * An IPv6 address is copied in its shortest form, so the same address always compares equal.
+ * @return LOOKUPVALID if the response is a valid address, otherwise LOOKUPFAILED.
+ */
+static int parse_ipaddr_response(struct Lookup *lookup)
+{
+        // Strip the newline character and anything after it.
+        char *newlinechar = strchr(lookup->response.body, '\n');
+        if (newlinechar != NULL) {
+                *newlinechar = '\0';
+        }
+
+        struct in6_addr addr;
+        if (inet_pton(addressfamily, lookup->response.body, &addr) != 1) {
+                return LOOKUPFAILED;
+        }
+
+        if (inet_ntop(addressfamily, &addr, lookup->ipaddr, sizeof(lookup->ipaddr)) == NULL) {
+                return LOOKUPFAILED;
+        }
+
+        return LOOKUPVALID;
+}
+
+/**
+ * Check the result of a finished lookup and copy the ip address from the response.
+ * @return LOOKUPVALID if the ipservice returned a valid IPv4 address, otherwise LOOKUPFAILED.
+ */
+static int finish_lookup(struct Lookup *lookup, CURLcode curlcode)
+{
+        lookup->curlcode = curlcode;
+        curl_easy_getinfo(lookup->curlsession, CURLINFO_RESPONSE_CODE, &lookup->httpcode);
+        curl_easy_getinfo(lookup->curlsession, CURLINFO_TOTAL_TIME, &lookup->totaltime);
+#if LIBCURL_VERSION_NUM >= 0x074200
+        curl_off_t retryafter = 0;
+        if (curl_easy_getinfo(lookup->curlsession, CURLINFO_RETRY_AFTER, &retryafter) == CURLE_OK) {
+                lookup->retryafter = (long)retryafter;
+        }
+#endif
+        char *primaryip = NULL;
+        curl_easy_getinfo(lookup->curlsession, CURLINFO_PRIMARY_IP, &primaryip);
+        if (primaryip != NULL && strlen(primaryip) < INET6_ADDRSTRLEN) {
+                strcpy(lookup->primaryip, primaryip);
+        }
+
+        curl_easy_getinfo(lookup->curlsession, CURLINFO_NAMELOOKUP_TIME, &lookup->namelookuptime);
+        curl_easy_getinfo(lookup->curlsession, CURLINFO_CONNECT_TIME, &lookup->tcpconnecttime);
+        curl_easy_getinfo(lookup->curlsession, CURLINFO_STARTTRANSFER_TIME, &lookup->starttransfertime);
+        // The connect timeout of curl includes the TLS handshake.
+        curl_easy_getinfo(lookup->curlsession, CURLINFO_APPCONNECT_TIME, &lookup->connecttime);
+        if (lookup->connecttime <= 0.0) {
+                lookup->connecttime = lookup->tcpconnecttime;
+        }
+
+        if (curlcode != CURLE_OK || lookup->httpcode != 200 || lookup->response.size == 0) {
+                return LOOKUPFAILED;
+        }
+
+        struct timespec parsestart;
+        struct timespec parseend;
+        clock_gettime(CLOCK_MONOTONIC, &parsestart);
+        int state = parse_ipaddr_response(lookup);
+        clock_gettime(CLOCK_MONOTONIC, &parseend);
+        lookup->parsetime = (parseend.tv_sec - parsestart.tv_sec) +
+                            (parseend.tv_nsec - parsestart.tv_nsec) / 1e9;
+        return state;
+}
+
+/**
+ * Clear the results of a lookup before it is started.
+ */
+static void reset_lookup(struct Lookup *lookup)
+{
+        lookup->state = LOOKUPPENDING;
+        lookup->curlcode = CURLE_OK;
+        lookup->httpcode = 0;
+        lookup->retryafter = 0;
+        lookup->totaltime = 0.0;
+        lookup->connecttime = 0.0;
+        lookup->namelookuptime = 0.0;
+        lookup->tcpconnecttime = 0.0;
+        lookup->starttransfertime = 0.0;
+        lookup->parsetime = 0.0;
+        lookup->ipaddr[0] = '\0';
+        lookup->primaryip[0] = '\0';
+        lookup->curlsession = NULL;
+        lookup->udpquery.sockfd = -1;
+        lookup->udpready = false;
+        lookup->response.size = 0;
+        lookup->response.toobig = false;
+        lookup->response.body[0] = '\0';
+}
+
+/**
+ * Read the answer of a running UDP lookup, resend the query when no answer came in time and
+ * fail the lookup when the timeout is reached. Failures are mapped on the closest CURLcode.
+ * @param elapsedms The number of milliseconds since the lookups started.
+ * @param waitms    Lowered to the number of milliseconds until the next resend or timeout.
+ * @return LOOKUPRUNNING, LOOKUPVALID or LOOKUPFAILED.
+ */
+static int poll_udp_lookup(struct Lookup *lookup, long elapsedms, long *waitms)
+{
+        long runningms = elapsedms - lookup->startedms;
+        lookup->totaltime = runningms / 1000.0;
+        udp_reply_parser parser = is_dns_url(lookup->url) ? dns_parse_reply : stun_parse_reply;
+        int result = udp_read_answer(&lookup->udpquery, parser, lookup->response.body,
+                                     sizeof(lookup->response.body));
+        if (result == UDPNOANSWERYET) {
+                long timeoutms = lookup->timeoutms > 0 ? lookup->timeoutms : UDPTIMEOUTMS;
+                long resendms = timeoutms / UDPMAXSENDS;
+                if (runningms >= timeoutms) {
+                        lookup->curlcode = CURLE_OPERATION_TIMEDOUT;
+                        udp_close(&lookup->udpquery);
+                        return LOOKUPFAILED;
+                }
+
+                long nextms = timeoutms - runningms;
+                if (lookup->udpquery.numsent < UDPMAXSENDS) {
+                        // UDP can be lost, send the query again.
+                        if (runningms >= lookup->udpquery.numsent * resendms) {
+                                udp_send_query(&lookup->udpquery);
+                        }
+
+                        nextms = lookup->udpquery.numsent * resendms - runningms;
+                }
+
+                if (nextms < *waitms) {
+                        *waitms = nextms > 0 ? nextms : 0;
+                }
+
+                return LOOKUPRUNNING;
+        }
+
+        udp_close(&lookup->udpquery);
+        switch (result) {
+        case UDPANSWER:
+                lookup->response.size = strlen(lookup->response.body);
+                if (lookup->response.size == 0) {
+                        return LOOKUPFAILED;
+                }
+
+                return parse_ipaddr_response(lookup);
+        case UDPERRORNAME:
+                lookup->curlcode = CURLE_REMOTE_FILE_NOT_FOUND;
+                break;
+        case UDPERRORREFUSED:
+                lookup->curlcode = CURLE_REMOTE_ACCESS_DENIED;
+                break;
+        case UDPERRORRESPONSE:
+                lookup->curlcode = CURLE_WEIRD_SERVER_REPLY;
+                break;
+        default:
+                lookup->curlcode = CURLE_COULDNT_CONNECT;
+                break;
+        }
+
+        return LOOKUPFAILED;
+}
+
+/**
+ * Count the ip address of a valid lookup as a vote.
+ * @return true if numagree votes are for the same ip address, ipaddragreed is then set.
+ */
+static bool count_vote(const struct Lookup *lookup, const char *votesipaddr[], int votescount[],
+                       int *numvotes, int *maxvotes, int numagree, char *ipaddragreed)
+{
+        int v = 0;
+        while (v < *numvotes && strcmp(votesipaddr[v], lookup->ipaddr) != 0) {
+                ++v;
+        }
+
+        if (v == *numvotes) {
+                votesipaddr[v] = lookup->ipaddr;
+                votescount[v] = 0;
+                ++*numvotes;
+        }
+
+        ++votescount[v];
+        if (votescount[v] > *maxvotes) {
+                *maxvotes = votescount[v];
+        }
+
+        if (votescount[v] >= numagree) {
+                strcpy(ipaddragreed, votesipaddr[v]);
+                return true;
+        }
+
+        return false;
+}
+
+/**
+ * Ask a number of ipservices for the public IPv4 address at the same time and stop as soon
+ * as numagree of them agree on the same address. The lookups still running at that moment
+ * are cancelled and get state LOOKUPCANCELLED, so they can be told apart from failed lookups.
+ * A lookup with a startdelayms is only started when no answer has been agreed on after that
+ * many milliseconds, or right away when all started lookups have finished without agreement.
+ * @param lookups      The lookups to run, urlnr, url, startdelayms, connecttimeoutms and
+ *                     timeoutms have to be set. A timeout of 0 keeps the static timeout.
+ * @param numlookups   The number of lookups.
+ * @param numagree     The number of ipservices that have to agree (k out of numlookups).
+ * @param seedipaddr   An ip address already known from an other ipservice that counts as one
+ *                     vote, or NULL.
+ * @param ipaddragreed Buffer of INET6_ADDRSTRLEN bytes, set to the ip address agreed on.
+ * @return true if numagree ipservices agreed on the same ip address.
+ */
+bool lookup_quorum(struct Lookup lookups[], int numlookups, int numagree, const char *seedipaddr,
+                   char *ipaddragreed, const char *useragent, bool unsafehttp, bool verbosemode)
+{
+        const char *votesipaddr[numlookups + 1];
+        int votescount[numlookups + 1];
+        int numvotes = 0;
+        int maxvotes = 0;
+        int numrunning = 0;
+        int numpending = 0;
+        bool agreed = false;
+        if (seedipaddr != NULL) {
+                votesipaddr[0] = seedipaddr;
+                votescount[0] = 1;
+                numvotes = 1;
+                maxvotes = 1;
+                if (numagree <= 1) {
+                        strcpy(ipaddragreed, seedipaddr);
+                        return true;
+                }
+        }
+
+        CURLM *multi = curl_multi_init();
+        for (int i = 0; i < numlookups; ++i) {
+                reset_lookup(&lookups[i]);
+                if (is_udp_url(lookups[i].url)) {
+                        prepare_udp_lookup(&lookups[i]);
+                }
+                ++numpending;
+        }
+
+        if (verbosemode) {
+                printf("Asking %d ipservices, %d have to agree.\n", numlookups, numagree);
+        }
+
+        struct timespec starttime;
+        clock_gettime(CLOCK_MONOTONIC, &starttime);
+        int stillrunning = 0;
+        while (!agreed) {
+                long elapsedms = get_elapsed_ms(&starttime);
+                long waitms = 1000;
+                for (int i = 0; i < numlookups; ++i) {
+                        if (lookups[i].state != LOOKUPPENDING) {
+                                continue;
+                        }
+
+                        if (lookups[i].startdelayms > elapsedms && numrunning > 0) {
+                                if (lookups[i].startdelayms - elapsedms < waitms) {
+                                        waitms = lookups[i].startdelayms - elapsedms;
+                                }
+
+                                continue;
+                        }
+
+                        if (verbosemode && lookups[i].startdelayms > 0) {
+                                printf("No answer after %ld ms, also asking %s.\n", elapsedms, lookups[i].url);
+                        }
+
+                        --numpending;
+                        if (start_lookup(multi, &lookups[i], useragent, unsafehttp, NULL, elapsedms)) {
+                                ++numrunning;
+                        }
+                }
+
+                if (numrunning <= 0 && numpending <= 0) {
+                        break;
+                }
+
+                curl_multi_perform(multi, &stillrunning);
+                CURLMsg *msg;
+                int msgsinqueue;
+                while ((msg = curl_multi_info_read(multi, &msgsinqueue)) != NULL) {
+                        if (msg->msg != CURLMSG_DONE) {
+                                continue;
+                        }
+
+                        struct Lookup *lookup;
+                        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&lookup);
+                        lookup->state = finish_lookup(lookup, msg->data.result);
+                        --numrunning;
+                        if (lookup->state != LOOKUPVALID || agreed) {
+                                continue;
+                        }
+
+                        agreed = count_vote(lookup, votesipaddr, votescount, &numvotes, &maxvotes,
+                                            numagree, ipaddragreed);
+                }
+
+                // The UDP lookups are not handled by curl, but their sockets are waited on
+                // together with the curl transfers.
+                struct curl_waitfd udpfds[numlookups];
+                unsigned int numudpfds = 0;
+                elapsedms = get_elapsed_ms(&starttime);
+                for (int i = 0; i < numlookups && !agreed; ++i) {
+                        if (lookups[i].state != LOOKUPRUNNING || lookups[i].curlsession != NULL) {
+                                continue;
+                        }
+
+                        lookups[i].state = poll_udp_lookup(&lookups[i], elapsedms, &waitms);
+                        if (lookups[i].state == LOOKUPRUNNING) {
+                                udpfds[numudpfds].fd = lookups[i].udpquery.sockfd;
+                                udpfds[numudpfds].events = CURL_WAIT_POLLIN;
+                                udpfds[numudpfds].revents = 0;
+                                ++numudpfds;
+                                continue;
+                        }
+
+                        --numrunning;
+                        if (lookups[i].state == LOOKUPVALID) {
+                                agreed = count_vote(&lookups[i], votesipaddr, votescount, &numvotes,
+                                                    &maxvotes, numagree, ipaddragreed);
+                        }
+                }
+
+                if (agreed || maxvotes + numrunning + numpending < numagree) {
+                        break;
+                }
+
+                if (numrunning > 0) {
+                        curl_multi_wait(multi, udpfds, numudpfds, (int)waitms, NULL);
+                }
+        }
+
+        // Cancel the lookups that are not needed anymore.
+        for (int i = 0; i < numlookups; ++i) {
+                if (lookups[i].state == LOOKUPPENDING) {
+                        lookups[i].state = LOOKUPCANCELLED;
+                }
+
+                if (lookups[i].state == LOOKUPRUNNING) {
+                        lookups[i].state = LOOKUPCANCELLED;
+                }
+
+                udp_close(&lookups[i].udpquery);
+                if (lookups[i].curlsession == NULL) {
+                        continue;
+                }
+
+                curl_multi_remove_handle(multi, lookups[i].curlsession);
+                curl_easy_cleanup(lookups[i].curlsession);
+                lookups[i].curlsession = NULL;
+        }
+
+        curl_multi_cleanup(multi);
+        return agreed;
+}
+
+/**
+ * Run many independent lookups over one curl multi handle, every lookup through its own proxy.
+ * At most maxrunning lookups run at the same time, the next one is started as soon as one
+ * finishes. Only http and https ipservices can be asked through a proxy.
+ * @param lookups    The lookups to run, url, proxy, connecttimeoutms and timeoutms have to be
+ *                   set. Afterwards state is LOOKUPVALID with ipaddr set, or LOOKUPFAILED.
+ * @param numlookups The number of lookups.
+ * @param maxrunning The most number of lookups running at the same time.
+ */
+void lookup_batch(struct Lookup lookups[], int numlookups, int maxrunning, const char *useragent,
+                  bool unsafehttp)
+{
+        CURLM *multi = curl_multi_init();
+        int numrunning = 0;
+        int next = 0;
+        for (int i = 0; i < numlookups; ++i) {
+                reset_lookup(&lookups[i]);
+        }
+
+        struct timespec starttime;
+        clock_gettime(CLOCK_MONOTONIC, &starttime);
+        while (next < numlookups || numrunning > 0) {
+                while (next < numlookups && numrunning < maxrunning) {
+                        struct Lookup *lookup = &lookups[next++];
+                        if (is_udp_url(lookup->url)) {
+                                lookup->curlcode = CURLE_UNSUPPORTED_PROTOCOL;
+                                lookup->state = LOOKUPFAILED;
+                                continue;
+                        }
+
+                        if (start_lookup(multi, lookup, useragent, unsafehttp, lookup->proxy,
+                                         get_elapsed_ms(&starttime))) {
+                                ++numrunning;
+                        }
+                }
+
+                int stillrunning = 0;
+                curl_multi_perform(multi, &stillrunning);
+                CURLMsg *msg;
+                int msgsinqueue;
+                while ((msg = curl_multi_info_read(multi, &msgsinqueue)) != NULL) {
+                        if (msg->msg != CURLMSG_DONE) {
+                                continue;
+                        }
+
+                        struct Lookup *lookup;
+                        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&lookup);
+                        lookup->state = finish_lookup(lookup, msg->data.result);
+                        curl_multi_remove_handle(multi, lookup->curlsession);
+                        curl_easy_cleanup(lookup->curlsession);
+                        lookup->curlsession = NULL;
+                        --numrunning;
+                }
+
+                if (numrunning > 0 && (next >= numlookups || numrunning >= maxrunning)) {
+                        curl_multi_wait(multi, NULL, 0, 1000, NULL);
+                }
+        }
+
+        curl_multi_cleanup(multi);
+}
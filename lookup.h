@@ -0,0 +1,112 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+#ifndef LOOKUP_H
+#define LOOKUP_H
+
+#include <stdbool.h>
+#include <arpa/inet.h>
+#include <curl/curl.h>
+#include "udp.h"
+
+#define MAXSIZEIPADDRDOWNLOAD 20
+#define MAXSIZEIPV6ADDRDOWNLOAD 46
+#define MAXLENHOST            255
+#define LOOKUPPENDING         0
+#define LOOKUPRUNNING         1
+#define LOOKUPVALID           2
+#define LOOKUPFAILED          3
+#define LOOKUPCANCELLED       4
+#define UDPTIMEOUTMS          5000
+#define UDPMAXSENDS           3
+
+/* The response body of an ipservice, never more than MAXSIZEIPADDRDOWNLOAD bytes for IPv4 and
+   MAXSIZEIPV6ADDRDOWNLOAD bytes for IPv6. */
+struct IpResponse {
+        char body[MAXSIZEIPV6ADDRDOWNLOAD + 1];
+        size_t size;
+        bool toobig;
+};
+
+/* One request to one ipservice, over curl or for a dns:// or stun:// url over UDP. */
+struct Lookup {
+        int urlnr;
+        const char *url;
+        /* The proxy to ask the ipservice through, only used by lookup_batch(). */
+        const char *proxy;
+        long startdelayms;
+        long connecttimeoutms;
+        long timeoutms;
+        int state;
+        CURLcode curlcode;
+        long httpcode;
+        long retryafter;
+        struct IpResponse response;
+        char ipaddr[INET6_ADDRSTRLEN];
+        char primaryip[INET6_ADDRSTRLEN];
+        double totaltime;
+        double connecttime;
+        /* The phases of the request in seconds since the start, like curl reports them. */
+        double namelookuptime;
+        double tcpconnecttime;
+        double starttransfertime;
+        double parsetime;
+        CURL *curlsession;
+        struct UdpQuery udpquery;
+        /* Set when the udpquery was parsed and its server resolved before the lookups started. */
+        bool udpready;
+        long startedms;
+};
+
+/* Called for every exported TLS session, see lookup_export_tls_sessions(). */
+typedef void (*tls_session_cb)(void *userptr, const char *sessionkey,
+                               const unsigned char *shmac, size_t shmaclen,
+                               const unsigned char *sdata, size_t sdatalen, long validuntil);
+
+void lookup_share_init(void);
+
+void lookup_share_cleanup(void);
+
+void lookup_add_resolve(const char *host, long port, const char *address);
+
+bool lookup_enable_earlydata(void);
+
+void lookup_set_interface(const char *interface);
+
+void lookup_set_family(int family);
+
+bool lookup_import_tls_session(const char *sessionkey, const unsigned char *shmac, size_t shmaclen,
+                               const unsigned char *sdata, size_t sdatalen);
+
+bool lookup_export_tls_sessions(tls_session_cb callback, void *userptr);
+
+bool is_udp_url(const char *url);
+
+bool get_host_port_url(const char *url, char *host, size_t hostsize, long *port);
+
+size_t write_ipresponse(char *data, size_t size, size_t nmemb, void *userdata);
+
+void setup_curl_session(CURL *curlsession, const char *url, struct IpResponse *response,
+                        const char *useragent, bool unsafehttp);
+
+bool lookup_quorum(struct Lookup lookups[], int numlookups, int numagree, const char *seedipaddr,
+                   char *ipaddragreed, const char *useragent, bool unsafehttp, bool verbosemode);
+
+void lookup_batch(struct Lookup lookups[], int numlookups, int maxrunning, const char *useragent,
+                  bool unsafehttp);
+
+#endif
@@ -22,34 +22,119 @@
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/wait.h>
 #include <arpa/inet.h>
 #include <curl/curl.h>
 #include <sqlite3.h>
 #include "db.h"
+#include "lookup.h"
+#include "selector.h"
+#include "netwatch.h"
+#include "publish.h"
+#include "proxypool.h"
+#include "posthook.h"
+#include "dnsupdate.h"
+#include "dyndns.h"
 
 #define PROGRAMNAME           "IpAddressExpress"
 #define PROGRAMVERSION        "1.0.1"
 #define PROGRAMWEBSITE        " (+https://github.com/D9ping/IpAddressExpress)"
 #define DATABASEFILENAME      "ipaddressexpress.db"
+#define STATEFILENAME         "ipaddressexpress.state"
+#define LOCKFILENAME          "ipaddressexpress.lock"
 #define CONFIGNAMEPREVIP      "lastrunip"
 #define CONFIGNAMELASTRUNDT   "lastrundatetime"
-#define SEED_LENGTH           32
+#define CONFIGNAMECONFIRMED   "lastconfirmed"
+#define CONFIGNAMECHANGED     "lastchanged"
+#define CONFIGNAMEPENDING     "pendingip"
 #define IPV6_TEXT_LENGTH      34
 #define MAXNUMSECDELAY        60
-#define MAXSIZEIPADDRDOWNLOAD 20
 #define MAXLENPATHPOSTHOOK    1023
 #define MAXLENURL             1023
 #define MAXSIZEAVOIDURLNRS    4096
 #define MAXPRIORITY           9
 #define MAXCHOOSERETRIES      8
+#define MININTERVAL           10
+#define MAXWARMSTARTENTRIES   64
+#define TIMEOUTP99MULTIPLIER  3
+#define MINTIMEOUTMS          1000
+#define MAXTIMEOUTMS          90000
+#define MAXRETRYAFTER         86400
+#define NETLINKSETTLEMS       250
+#define NETLINKMAXSETTLEMS    2000
+#define MAXINTERFACES         16
+#define NUMFAMILIES           2
+#define MAXPOSTHOOKS          8
+#define MAXLENINTERFACE       15
+#define MAXLENUPLINKCONFIGNAME 31
 #define PROTOCOLDNS           0
 #define PROTOCOLHTTP          1
 #define PROTOCOLHTTPS         2
+#define PROTOCOLSTUN          3
 typedef unsigned int          uint;
 
+static volatile sig_atomic_t stoprequested = 0;
+
+/* Milliseconds spent in every phase of a run, printed with --timings. */
+struct PhaseTimings {
+        double dbopen;
+        double lockwait;
+        double selector;
+        double curlinit;
+        double dns;
+        double connect;
+        double tls;
+        double ttfb;
+        double parse;
+        double lookups;
+        double dbwrite;
+        double dnsupdate;
+        double dyndns;
+        double posthook;
+        double total;
+        bool lookuprecorded;
+};
+
+static struct PhaseTimings timings;
+
+/* A confirmed change, handed to the DNS update, the dyndns providers and the posthooks by
+ * deliver_changes() once the database is written. */
+struct Delivery {
+        /* The IPv4 and the IPv6 address, an empty string if not known. Only the first is used
+         * outside dual-stack mode. */
+        char ipaddrs[NUMFAMILIES][INET6_ADDRSTRLEN];
+        /* Save the address of the family once it is handed over, with --retryposthook. */
+        bool saveips[NUMFAMILIES];
+        /* The uplink given with --interface, NULL for the default route. */
+        const char *uplink;
+        /* The proxy whose egress changed, an empty string for an uplink. */
+        char proxy[MAXLENPROXY + 1];
+        bool dualstack;
+        /* False to only send the dyndns updates that are still pending. */
+        bool changed;
+        bool failed;
+};
+
+static struct Delivery *deliveries = NULL;
+static int numdeliveries = 0;
+
 struct Settings {
         int secondsdelay;
-        int argnposthook;
+        const char *posthooks[MAXPOSTHOOKS];
+        /* The timeout in seconds of every posthook, 0 for no timeout. */
+        int posthooktimeouts[MAXPOSTHOOKS];
+        int numposthooks;
+        /* The timeout for the posthooks given after --posthooktimeout. */
+        int posthooktimeout;
+        const char *dnsupdatefile;
+        const char *dyndnsfile;
         int errorwait;
         bool verbosemode;
         bool silentmode;
@@ -59,7 +144,33 @@ struct Settings {
         bool savelastrun;
         bool unsafehttp;
         bool unsafedns;
+        bool unsafestun;
         bool tripleconfirm;
+        int sparelookups;
+        int hedgedelayms;
+        int interval;
+        bool daemonmode;
+        bool netlink;
+        int warmstartttl;
+        bool earlydata;
+        bool statictimeouts;
+        bool statefile;
+        bool timings;
+        bool cached;
+        int maxage;
+        const char *socketpath;
+        bool shm;
+        bool nowait;
+        const char *interfaces[MAXINTERFACES];
+        int numinterfaces;
+        /* The uplink checked by this process, NULL for the default route. */
+        const char *interface;
+        const char *proxylist;
+        int concurrency;
+        /* Check the IPv4 and the IPv6 address at the same time. */
+        bool dualstack;
+        /* The address family checked by this process, AF_INET or AF_INET6. */
+        int family;
 };
 
 /**
@@ -76,6 +187,47 @@ char * get_current_time_str(char *iso8601timebuf)
         return iso8601timebuf;
 }
 
+/**
+ * Get the time of a monotonic clock in milliseconds, to measure how long something takes.
+ */
+double get_monotonic_ms(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+/**
+ * Record the phases of the first valid lookup of a run in the timings.
+ */
+void record_lookup_timings(const struct Lookup *lookup)
+{
+        if (timings.lookuprecorded) {
+                return;
+        }
+
+        timings.lookuprecorded = true;
+        timings.dns = lookup->namelookuptime * 1000;
+        timings.connect = (lookup->tcpconnecttime - lookup->namelookuptime) * 1000;
+        timings.tls = (lookup->connecttime - lookup->tcpconnecttime) * 1000;
+        timings.ttfb = (lookup->starttransfertime - lookup->connecttime) * 1000;
+        timings.parse = lookup->parsetime * 1000;
+}
+
+/**
+ * Print the timings of the phases of a run as one line of JSON to stderr.
+ * DNS till parse are from the first valid lookup, lookups is the time of all lookups.
+ */
+void print_timings(void)
+{
+        fprintf(stderr, "{\"dbopen\":%.3f,\"lockwait\":%.3f,\"selector\":%.3f,\"curlinit\":%.3f,\
+\"dns\":%.3f,\"connect\":%.3f,\"tls\":%.3f,\"ttfb\":%.3f,\"parse\":%.3f,\"lookups\":%.3f,\
+\"dbwrite\":%.3f,\"dnsupdate\":%.3f,\"dyndns\":%.3f,\"posthook\":%.3f,\"total\":%.3f}\n",
+                timings.dbopen, timings.lockwait, timings.selector, timings.curlinit, timings.dns, timings.connect,
+                timings.tls, timings.ttfb, timings.parse, timings.lookups, timings.dbwrite,
+                timings.dnsupdate, timings.dyndns, timings.posthook, timings.total);
+}
+
 /**
  * Print time and date with an error message to stderr output.
  * @param char[] errormsg
@@ -105,14 +257,25 @@ void print_error_with_url(char * errormsgformat, const char * url)
         }
 }
 
+/**
+ * Get the name of an address family for messages.
+ * @param family AF_INET or AF_INET6.
+ */
+const char * get_family_name(int family)
+{
+        return family == AF_INET6 ? "IPv6" : "IPv4";
+}
+
 /**
  * Print the different results from public ip address services.
+ * @param family AF_INET or AF_INET6, the address family that was looked up.
  */
-void print_detected_difference(char * ipaddrnow, char * ipaddrconfirm, const char * urlipservice, const char * confirmurl)
+void print_detected_difference(char * ipaddrnow, char * ipaddrconfirm, const char * urlipservice,
+                               const char * confirmurl, int family)
 {
         print_dt_error("Alert: one of the ip address services could have lied.\n");
-        fprintf(stderr, "IPv4: %s from %s.\n", ipaddrnow, urlipservice);
-        fprintf(stderr, "IPv4: %s from %s.\n", ipaddrconfirm, confirmurl);
+        fprintf(stderr, "%s: %s from %s.\n", get_family_name(family), ipaddrnow, urlipservice);
+        fprintf(stderr, "%s: %s from %s.\n", get_family_name(family), ipaddrconfirm, confirmurl);
 }
 
 /**
@@ -127,154 +290,92 @@ int is_valid_ipv4_addr(char *ipv4addr)
 }
 
 /**
- * Get a new urlnr that is available to choice.
- * @return A random number between 0 and maxurls.
+ * Load the available ipservices with their statistics once per run into the selector,
+ * so choosing ipservices does not query the database.
+ * @return false if there is no ipservice available.
  */
-int get_new_random_urlnr(sqlite3 *db, bool unsafehttp, bool unsafedns, bool verbosemode, bool silentmode)
+bool load_selector(struct DbContext *db, struct Settings settings)
 {
-        if (verbosemode) {
-                printf("Choose random urlnr.\n");
-        }
-
-        bool needaddlasturl = false;
-        int lasturlnr = get_config_value_int(db, "lasturlnr");
-        if (lasturlnr == -1) {
-                needaddlasturl = true;
+        // Bitmask with a bit for every allowed protocoltype.
+        int allowedprotocoltypes = 1 << PROTOCOLHTTPS;
+        if (settings.unsafehttp || settings.unsafedns) {
+                allowedprotocoltypes |= 1 << PROTOCOLHTTP;
         }
 
-        // Initializes a random number generator using a seed from /dev/urandom */
-        FILE * rand_fd;
-        rand_fd = fopen("/dev/urandom", "r");
-        if (rand_fd == NULL) {
-                if (!silentmode) {
-                        print_dt_error("Error: could not open /dev/urandom\n");
-                }
-
-                exit(EXIT_FAILURE);
+        if (settings.unsafedns) {
+                allowedprotocoltypes |= 1 << PROTOCOLDNS;
         }
 
-        int allowedprotocoltypes = 2;
-        if (unsafehttp) {
-                allowedprotocoltypes = 1;
-        } else if (unsafedns) {
-                allowedprotocoltypes = 0;
-        }
-
-        const int numavailableipservices = get_count_available_ipservices(db, allowedprotocoltypes);
-        int availableurlnrs[numavailableipservices];
-        get_urlnrs_ipservices(db, availableurlnrs, 0, allowedprotocoltypes);
-        uint *seed = (uint *) malloc(SEED_LENGTH * sizeof(uint));
-        int resreadrnd = fread(seed, sizeof(uint), SEED_LENGTH, rand_fd);
-        if (resreadrnd <= 0) {
-                if (!silentmode) {
-                        print_dt_error("Warning: Could not read from /dev/urandom.\n");
-                }
+        if (settings.unsafestun) {
+                allowedprotocoltypes |= 1 << PROTOCOLSTUN;
         }
 
-        srand(*seed);
-        fclose(rand_fd);
-        if (numavailableipservices <= 0) {
-                if (!silentmode) {
-                        print_dt_error("Error: no more ipservices available.\n");
-                }
-
-                exit(EXIT_FAILURE);
+        int families = FAMILYIPV4;
+        if (settings.family == AF_INET6) {
+                // The DNS and STUN lookups only ask over IPv4.
+                allowedprotocoltypes &= (1 << PROTOCOLHTTPS) | (1 << PROTOCOLHTTP);
+                families = FAMILYIPV6;
         }
 
-        // Choose a new random position in availableurlnrs. Between 0 and numavailableipservices.
-        int p = (rand() % numavailableipservices);
-        int urlnr = availableurlnrs[p];
-        if (numavailableipservices > 0 && !needaddlasturl)
-        {
-                int tries = 0;
-                while (urlnr == lasturlnr && tries < MAXCHOOSERETRIES)
-                {
-                        p = (rand() % numavailableipservices);
-                        urlnr = availableurlnrs[p];
-                        ++tries;
-                        int priority = get_priority_ipservice(db, urlnr);
-                        if (priority > 1 && priority <= MAXPRIORITY) {
-                                if (rand() % priority != 0) {
-                                        if (verbosemode) {
-                                                printf("Choose different number again.\n");
-                                        }
-
-                                        p = (rand() % numavailableipservices);
-                                        urlnr = availableurlnrs[p];
-                                }
-                        }
-                }
-
-                if (urlnr == lasturlnr && tries == MAXCHOOSERETRIES && !silentmode) {
-                        print_dt_error("Maximum number of retries to choice different urlnr has been reached.\n\
- Could not avoid to use same urlnr as in last run.\n");
+        int numavailableipservices = get_count_available_ipservices(db, allowedprotocoltypes, families);
+        if (numavailableipservices > 0) {
+                struct IpServiceScore scores[numavailableipservices];
+                numavailableipservices = get_scores_ipservices(db, scores, numavailableipservices,
+                                                               allowedprotocoltypes, families);
+                if (selector_build(scores, numavailableipservices)) {
+                        return true;
                 }
         }
 
-        free(seed);
-        if (needaddlasturl) {
-                add_config_value_int(db, "lasturlnr", urlnr, verbosemode);
-        } else {
-                update_config_value_int(db, "lasturlnr", urlnr, verbosemode);
+        if (!settings.silentmode) {
+                print_dt_error("Error: no more ipservices available.\n");
         }
 
-        return urlnr;
+        return false;
 }
 
 /**
- * Strip everything in the character array from the new line character till the end
- * of the array. So str does not contain any new line character anymore.
+ * Choose a new weighted random ipservice and do not choose it again this run.
+ * @param avoidurlnr The ipservice to avoid if there is another choice, or -1.
+ * @return The ipservice number, or -1 if no ipservice could be chosen.
  */
-void strip_on_newlinechar(char *str, int strlength)
+int get_new_random_urlnr(int avoidurlnr, bool verbosemode, bool silentmode)
 {
-        for (int i = 0; i < strlength; ++i) {
-                if (str[i] == '\n') {
-                        // Added null character here so it's shorter just before first line feed.
-                        str[i] = '\0';
-                        return;
-                }
+        if (verbosemode) {
+                printf("Choose random urlnr.\n");
         }
-}
 
-/**
- * Read a text file with ip address.
- * @return A character array with the ip address without a newline character.
- */
-char * read_file_ipaddr(char *filepathip, bool silentmode)
-{
-        size_t len = 0;
-        ssize_t bytesread;
-        FILE *fpfileip;
-        fpfileip = fopen(filepathip, "r");
-        if (fpfileip == NULL) {
-                if (!silentmode) {
-                        print_dt_error("Error: Could not get public ip address from file.\n");
-                }
-
-                exit(EXIT_FAILURE);
+        int urlnr = selector_choose();
+        int tries = 0;
+        while (urlnr == avoidurlnr && urlnr >= 0 && tries < MAXCHOOSERETRIES) {
+                urlnr = selector_choose();
+                ++tries;
         }
 
-        char *ipaddrstr;
-        bytesread = getline(&ipaddrstr, &len, fpfileip);
-        // A hex text full out written IPv6 address is 34 characters +1 for null character.
-        if (bytesread > IPV6_TEXT_LENGTH) {
-                fclose(fpfileip);
+        if (urlnr < 0) {
                 if (!silentmode) {
-                        print_dt_error("Error: response server too long.\n");
+                        print_dt_error("Error: no more ipservices available.\n");
                 }
 
-                exit(EXIT_FAILURE);
+                return -1;
+        }
+
+        if (urlnr == avoidurlnr && !silentmode) {
+                print_dt_error("Maximum number of retries to choice different urlnr has been reached.\n\
+ Could not avoid to use same urlnr as in last run.\n");
         }
 
-        fclose(fpfileip);
-        strip_on_newlinechar(ipaddrstr, bytesread);
-        return ipaddrstr;
+        selector_exclude(urlnr);
+        return urlnr;
 }
 
 /**
- * Parse http status code.
+ * Parse http status code and open the circuit breaker of the ipservice or disable it forever.
+ * @param retryafter The number of seconds from a Retry-After header, or 0.
+ * @param errorwait  The most number of seconds to wait before retrying an ipservice.
+ * @return true if the ipservice has been disabled because of the http status code.
  */
-void parse_httpcode_status(int httpcode, sqlite3 *db, int urlnr)
+bool parse_httpcode_status(int httpcode, struct DbContext *db, int urlnr, long retryafter, int errorwait)
 {
         char errmsg[128];
         int cw;
@@ -284,10 +385,14 @@ void parse_httpcode_status(int httpcode, sqlite3 *db, int urlnr)
         case 503L:
         case 509L:
                 print_dt_error("Warning: rate limiting active.\
- Avoid the current public ip address service for some time.");
-                // Temporary disable
-                update_disabled_ipsevice(db, urlnr, true);
-                exit(EXIT_FAILURE);
+ Avoid the current public ip address service for some time.\n");
+                if (retryafter > MAXRETRYAFTER) {
+                        retryafter = MAXRETRYAFTER;
+                }
+
+                // Temporary disable, at least as long as the ipservice asked for.
+                open_breaker_ipservice(db, urlnr, (int)retryafter, errorwait);
+                return true;
         case 408L:
         case 500L:
         case 502L:
@@ -301,8 +406,8 @@ void parse_httpcode_status(int httpcode, sqlite3 *db, int urlnr)
                 }
 
                 // Temporary disable
-                update_disabled_ipsevice(db, urlnr, true);
-                break;
+                open_breaker_ipservice(db, urlnr, 0, errorwait);
+                return true;
         case 401L:
         case 403L:
         case 404L:
@@ -310,8 +415,8 @@ void parse_httpcode_status(int httpcode, sqlite3 *db, int urlnr)
                 print_dt_error("Warning: the used public ip address service has quit or does not\
  want automatic use.\nNever use this public ip address service again.\n");
                 // Disable forever
-                update_disabled_ipsevice(db, urlnr, false);
-                break;
+                disable_forever_ipservice(db, urlnr);
+                return true;
         case 301L:
         case 302L:
         case 308L:
@@ -325,167 +430,454 @@ void parse_httpcode_status(int httpcode, sqlite3 *db, int urlnr)
                 }
 
                 // Disable forever
-                update_disabled_ipsevice(db, urlnr, false);
-                break;
+                disable_forever_ipservice(db, urlnr);
+                return true;
         }
+
+        return false;
 }
 
 /**
- * Download the ip address from a ipservice.
- * @return ip address
- */
-char * download_ipaddr_ipservice(char *ipaddr, const char *urlipservice, sqlite3 *db, int urlnr,
-                                 bool unsafehttp, bool silentmode, int * httpcodestatus)
-{
-        //char * downloadtempfilepath;
-        char * downloadtempfilepath = malloc(16 * sizeof(char));
-        downloadtempfilepath = "/tmp/tempip.txt";
-        FILE *fpdownload;
-        // mode w+: truncates the file to zero length if it exists,
-        // otherwise creates a file if it does not exist.
-        fpdownload = fopen(downloadtempfilepath, "w+");
-        curl_global_init(CURL_GLOBAL_DEFAULT);
-        CURL * curlsession = curl_easy_init();
-        if (!curlsession || curlsession == NULL) {
+ * Get the useragent to use for requesting the ipservices.
+ * @param useragent A character array of at least 128 bytes.
+ */
+void get_useragent(char *useragent)
+{
+        strcpy(useragent, PROGRAMNAME);
+        strcat(useragent, "/");
+        strcat(useragent, PROGRAMVERSION);
+        strcat(useragent, PROGRAMWEBSITE);
+}
+
+/**
+ * Report why a lookup did not return a usable ip address and open the circuit breaker of
+ * the ipservice or disable it forever.
+ */
+void report_failed_lookup(struct DbContext *db, struct Lookup *lookup, struct Settings settings)
+{
+        char errmsg[1024];
+        bool silentmode = settings.silentmode;
+        if (lookup->response.toobig) {
                 if (!silentmode) {
-                        print_dt_error("Error: should not setup cUrl session.\n");
+                        snprintf(errmsg,
+                                 1024,
+                                 "Error: response ip service(urlnr = %d) too big.\n",
+                                 lookup->urlnr);
+                        print_dt_error(errmsg);
                 }
 
-                curl_easy_cleanup(curlsession);
-                fclose(fpdownload);
-                exit(EXIT_FAILURE);
+                // Temporary disable
+                open_breaker_ipservice(db, lookup->urlnr, 0, settings.errorwait);
+                return;
         }
 
-        curl_easy_setopt(curlsession, CURLOPT_URL, urlipservice);
-        curl_easy_setopt(curlsession, CURLOPT_HTTPGET, 1L);
-        // Write to fpdownload
-        curl_easy_setopt(curlsession, CURLOPT_WRITEDATA, fpdownload);
-        // Default 300s, changed to max. 90 seconds to connect
-        curl_easy_setopt(curlsession, CURLOPT_CONNECTTIMEOUT, 90L);
-        // Default timeout is 0/never. changed to 90 seconds
-        curl_easy_setopt(curlsession, CURLOPT_TIMEOUT, 90L);
-        // Enable TLS false start. default disabled in curl, more testing needed.
-        //curl_easy_setopt(curlsession, CURLOPT_SSL_FALSESTART, 1L);
-        // Never follow redirects.
-        curl_easy_setopt(curlsession, CURLOPT_FOLLOWLOCATION, 0L);
-        curl_easy_setopt(curlsession, CURLOPT_MAXREDIRS, 0L);
-        // Make libcurl explicitly close the connection when done with the transfer. 
-        curl_easy_setopt(curlsession, CURLOPT_FORBID_REUSE, 1L);
-        // limit the connection cache for this handle to no more than 3.
-        // Default 5
-        curl_easy_setopt(curlsession, CURLOPT_MAXCONNECTS, 3L);
-        // enable TCP keep-alive for this transfer
-        // Default 0
-        curl_easy_setopt(curlsession, CURLOPT_TCP_KEEPALIVE, 0L);
-        // TCP Fast Open: Default 0
-        // Beware: the TLS session cache does not work when TCP Fast Open is enabled. 
-        // TCP Fast Open is also known to be problematic on or across certain networks. 
-        //curl_easy_setopt(curlsession, CURLOPT_TCP_FASTOPEN, 0L);
-        // Resolve host name using IPv4-names only
-        curl_easy_setopt(curlsession, CURLOPT_IPRESOLVE, CURL_IPRESOLVE_V4);
-        // Only support TLS 1.2 and later only.
-        curl_easy_setopt(curlsession, CURLOPT_SSLVERSION, CURL_SSLVERSION_TLSv1_2);
-        if (!unsafehttp) {
-                // Only allow https to be used.
-                curl_easy_setopt(curlsession, CURLOPT_PROTOCOLS, CURLPROTO_HTTPS);
-        } else {
-                // Allow https and unsafe http.
-                curl_easy_setopt(curlsession, CURLOPT_PROTOCOLS,
-                                 CURLPROTO_HTTPS | CURLPROTO_HTTP);
+        if (lookup->curlcode != CURLE_OK) {
+                if (!silentmode) {
+                        snprintf(errmsg,
+                                 1024,
+                                 "Error: %s (urlnr = %d)\n",
+                                 curl_easy_strerror(lookup->curlcode), lookup->urlnr);
+                        print_dt_error(errmsg);
+                }
+
+                open_breaker_ipservice(db, lookup->urlnr, 0, settings.errorwait);
+                return;
         }
 
-        char useragent[128];
-        strcpy(useragent, PROGRAMNAME);
-        strcat(useragent, "/");
-        strcat(useragent, PROGRAMVERSION);
-        strcat(useragent, PROGRAMWEBSITE);
-        curl_easy_setopt(curlsession, CURLOPT_USERAGENT, useragent);
-        // Perform the request, res will get the return code
-        CURLcode res;
-        res = curl_easy_perform(curlsession);
-        // Check for errors
-        if (res != CURLE_OK) {
+        if (parse_httpcode_status(lookup->httpcode, db, lookup->urlnr, lookup->retryafter,
+                                  settings.errorwait)) {
+                return;
+        }
+
+        if (lookup->response.size == 0) {
                 if (!silentmode) {
-                char curlErr[1024];
-                int cw;
-                snprintf(curlErr,
-                         1024,
-                         "Error: %s (urlnr = %d)\n",
-                        curl_easy_strerror(res), urlnr);
-                        print_dt_error(curlErr);
-                }
-
-                curl_easy_cleanup(curlsession);
-                fclose(fpdownload);
-                switch (res) {
-                case CURLE_TOO_MANY_REDIRECTS:
-                case CURLE_REMOTE_ACCESS_DENIED:
-                case CURLE_URL_MALFORMAT:
-                case CURLE_REMOTE_FILE_NOT_FOUND:
-                case CURLE_SSL_CACERT:
-                        update_disabled_ipsevice(db, urlnr, true);
-                        break;
-                default:
-                        // CURLE_OPERATION_TIMEDOUT, CURLE_GOT_NOTHING, CURLE_READ_ERROR, CURLE_RECV_ERROR,
-                        // CURLE_COULDNT_CONNECT, CURLE_COULDNT_RESOLVE_HOST, CURLE_COULDNT_RESOLVE_PROXY,
-                        // CURLE_WRITE_ERROR
-                        update_disabled_ipsevice(db, urlnr, true);
+                        snprintf(errmsg,
+                                 1024,
+                                 "Error: downloaded file is empty(urlnr = %d).\n",
+                                 lookup->urlnr);
+                        print_dt_error(errmsg);
+                }
+
+        } else if ((lookup->httpcode == 200 || is_udp_url(lookup->url)) && !silentmode) {
+                if (settings.family == AF_INET6) {
+                        print_error_with_url("Error: invalid IPv6 address from '%s'.\n", lookup->url);
+                } else {
+                        print_error_with_url("Error: invalid IPv4 address from '%s'.\n", lookup->url);
+                }
+        }
+
+        // Temporary disable
+        open_breaker_ipservice(db, lookup->urlnr, 0, settings.errorwait);
+}
+
+/**
+ * Save the address the host of an ipservice resolved to, so the next run can skip DNS.
+ * @param url     The url of the ipservice.
+ * @param address The ip address that was connected to.
+ * @param ttl     The number of seconds to use the address before resolving the host again.
+ */
+void save_warmstart_address(struct DbContext *db, const char *url, const char *address, int ttl)
+{
+        char host[MAXLENHOST + 1];
+        long port;
+        if (address[0] == '\0' || !get_host_port_url(url, host, sizeof(host), &port)) {
+                return;
+        }
+
+        save_dnscache(db, host, port, address, (int)time(NULL) + ttl);
+}
+
+/**
+ * Forget the saved address of the host of an ipservice.
+ * @param url The url of the ipservice.
+ */
+void forget_warmstart_address(struct DbContext *db, const char *url)
+{
+        char host[MAXLENHOST + 1];
+        long port;
+        if (!get_host_port_url(url, host, sizeof(host), &port)) {
+                return;
+        }
+
+        delete_dnscache(db, host, port);
+}
+
+/**
+ * Feed the addresses and TLS sessions saved by the last run to libcurl.
+ */
+void load_warmstart(struct DbContext *db, bool verbosemode)
+{
+        struct DnsCacheEntry entries[MAXWARMSTARTENTRIES];
+        delete_expired_dnscache(db);
+        int numentries = get_dnscache(db, entries, MAXWARMSTARTENTRIES);
+        for (int i = 0; i < numentries; ++i) {
+                lookup_add_resolve(entries[i].host, entries[i].port, entries[i].address);
+        }
+
+        struct TlsSession sessions[MAXWARMSTARTENTRIES];
+        int numsessions = get_tlssessions(db, sessions, MAXWARMSTARTENTRIES);
+        int numimported = 0;
+        for (int i = 0; i < numsessions; ++i) {
+                if (lookup_import_tls_session(sessions[i].sessionkey, sessions[i].shmac,
+                                              sessions[i].shmaclen, sessions[i].sdata,
+                                              sessions[i].sdatalen)) {
+                        ++numimported;
+                }
+        }
+
+        free_tlssessions(sessions, numsessions);
+        if (verbosemode) {
+                printf("Warm start with %d saved addresses and %d TLS sessions.\n", numentries,
+                       numimported);
+        }
+}
+
+/**
+ * Callback for lookup_export_tls_sessions that saves a TLS session in the database.
+ */
+static void store_tls_session(void *userptr, const char *sessionkey, const unsigned char *shmac,
+                              size_t shmaclen, const unsigned char *sdata, size_t sdatalen,
+                              long validuntil)
+{
+        add_tlssession((struct DbContext *)userptr, sessionkey, shmac, shmaclen, sdata, sdatalen, validuntil);
+}
+
+/**
+ * Replace the saved TLS sessions with the TLS sessions of this run.
+ */
+void save_warmstart_tls_sessions(struct DbContext *db)
+{
+        delete_tlssessions(db);
+        lookup_export_tls_sessions(store_tls_session, db);
+}
+
+/**
+ * Limit a timeout between MINTIMEOUTMS and MAXTIMEOUTMS.
+ */
+long clamp_timeout_ms(long timeoutms)
+{
+        if (timeoutms < MINTIMEOUTMS) {
+                return MINTIMEOUTMS;
+        } else if (timeoutms > MAXTIMEOUTMS) {
+                return MAXTIMEOUTMS;
+        }
+
+        return timeoutms;
+}
+
+/**
+ * Set the timeouts of a lookup to a multiple of the 99th percentile latency measured for its
+ * ipservice, so a dead ipservice fails fast. An ipservice without enough measurements keeps
+ * the static timeouts.
+ */
+void set_adaptive_timeouts(struct DbContext *db, struct Lookup *lookup, struct Settings settings)
+{
+        lookup->connecttimeoutms = 0;
+        lookup->timeoutms = 0;
+        if (settings.statictimeouts) {
+                return;
+        }
+
+        int connectp99ms = 0;
+        int p99ms = get_latency_p99_ipservice(db, lookup->urlnr, &connectp99ms);
+        if (p99ms < 0) {
+                return;
+        }
+
+        lookup->connecttimeoutms = clamp_timeout_ms((long)connectp99ms * TIMEOUTP99MULTIPLIER);
+        lookup->timeoutms = clamp_timeout_ms((long)p99ms * TIMEOUTP99MULTIPLIER);
+        if (settings.verbosemode) {
+                printf("Timeouts for %s: connect %ld ms, total %ld ms.\n", lookup->url,
+                       lookup->connecttimeoutms, lookup->timeoutms);
+        }
+}
+
+/**
+ * Handle the outcome of a finished lookup: disable the ipservice if it failed, or store how
+ * long it took and which address it resolved to if it succeeded.
+ * Cancelled lookups are left alone.
+ */
+void process_lookup_result(struct DbContext *db, struct Lookup *lookup, struct Settings settings)
+{
+        if (lookup->state == LOOKUPFAILED) {
+                report_failed_lookup(db, lookup, settings);
+                add_failure_ipservice(db, lookup->urlnr);
+                if (lookup->curlcode == CURLE_OPERATION_TIMEDOUT && lookup->timeoutms > 0) {
+                        // Count the timeout as a slow answer, so the timeouts grow again if the
+                        // ipservice has become slower instead of timing out every run.
+                        long connectms = (long)(lookup->connecttime * 1000);
+                        if (connectms <= 0) {
+                                connectms = lookup->connecttimeoutms;
+                        }
+
+                        update_latency_ipservice(db, lookup->urlnr, (int)lookup->timeoutms,
+                                                 (int)connectms);
+                }
+
+                if (settings.warmstartttl > 0) {
+                        // The stored address could be the reason, resolve again next run.
+                        forget_warmstart_address(db, lookup->url);
+                }
+        } else if (lookup->state == LOOKUPVALID) {
+                record_lookup_timings(lookup);
+                close_breaker_ipservice(db, lookup->urlnr);
+                update_latency_ipservice(db, lookup->urlnr, (int)(lookup->totaltime * 1000),
+                                         (int)(lookup->connecttime * 1000));
+                if (settings.warmstartttl > 0) {
+                        save_warmstart_address(db, lookup->url, lookup->primaryip, settings.warmstartttl);
+                }
+        }
+}
+
+/**
+ * Choose a number of different ipservices to ask at the same time, that have not been chosen
+ * before this run.
+ * @param urlnrs     Array that is filled with the chosen ipservice numbers.
+ * @param numurlnrs  The number of different ipservices wanted.
+ * @param avoidurlnr The number of the ipservice already used this run, or -1.
+ * @return The number of different ipservices chosen, can be less than numurlnrs.
+ */
+int choose_distinct_urlnrs(int urlnrs[], int numurlnrs, int avoidurlnr)
+{
+        int numchosen = 0;
+        if (avoidurlnr >= 0) {
+                selector_exclude(avoidurlnr);
+        }
+
+        while (numchosen < numurlnrs) {
+                // Every chosen ipservice is excluded, so the next one is always different.
+                int urlnr = selector_choose();
+                if (urlnr < 0) {
                         break;
                 }
 
-                exit(EXIT_FAILURE);
+                selector_exclude(urlnr);
+                urlnrs[numchosen] = urlnr;
+                ++numchosen;
+        }
+
+        return numchosen;
+}
+
+/**
+ * Confirm the public ip address by asking several ipservices at the same time.
+ * @param numconfirm   The number of ipservices that have to agree, next to the seed ip address.
+ * @param avoidurlnr   The ipservice number already used this run, or -1.
+ * @param seedipaddr   The ip address to confirm, or NULL if there is nothing to confirm yet.
+ * @param seedurl      The url of the ipservice that gave seedipaddr.
+ * @param ipaddragreed Buffer of INET6_ADDRSTRLEN bytes, set to the ip address agreed on.
+ * @return true if enough ipservices agreed on the same ip address.
+ */
+bool confirm_with_quorum(struct DbContext *db, int numconfirm, int avoidurlnr, const char *seedipaddr,
+                         const char *seedurl, char *ipaddragreed, struct Settings settings)
+{
+        int numlookups = numconfirm + settings.sparelookups;
+        int urlnrs[numlookups];
+        numlookups = choose_distinct_urlnrs(urlnrs, numlookups, avoidurlnr);
+        if (numlookups < numconfirm) {
+                if (!settings.silentmode) {
+                        print_dt_error("Error: not enough different ipservices available to confirm with.\n");
+                }
+
+                return false;
         }
 
-        int httpcode = 0;
-        curl_easy_getinfo(curlsession, CURLINFO_RESPONSE_CODE, &httpcode);
+        struct Lookup lookups[numlookups];
+        for (int i = 0; i < numlookups; ++i) {
+                lookups[i].urlnr = urlnrs[i];
+                lookups[i].url = get_url_ipservice(db, urlnrs[i]);
+                lookups[i].startdelayms = 0;
+                if (settings.verbosemode) {
+                        printf("Ipservice %s is used to confirm public %s address.\n", lookups[i].url,
+                               get_family_name(settings.family));
+                }
 
-        // Check the filelength of the downloaded file.
-        fclose(fpdownload);
-        fpdownload = fopen(downloadtempfilepath, "r");
-        fseek(fpdownload, 0L, SEEK_END);
-        unsigned long long int downloadedfilesize = ftell(fpdownload);
-        fclose(fpdownload);
+                set_adaptive_timeouts(db, &lookups[i], settings);
+        }
 
-        // Cleanup curl.
-        curl_easy_cleanup(curlsession);
+        char useragent[128];
+        get_useragent(useragent);
+        int numagree = numconfirm;
+        if (seedipaddr != NULL) {
+                ++numagree;
+        }
 
-        // Set HTTP status code.
-        *httpcodestatus = httpcode;
+        double lookupstartms = get_monotonic_ms();
+        bool agreed = lookup_quorum(lookups, numlookups, numagree, seedipaddr, ipaddragreed,
+                                    useragent, settings.unsafehttp, settings.verbosemode);
+        timings.lookups += get_monotonic_ms() - lookupstartms;
+        // Compare every answer with the agreed ip address or else with the first answer.
+        const char *ipaddrcompare = seedipaddr;
+        const char *urlcompare = seedurl;
+        if (agreed && (seedipaddr == NULL || strcmp(seedipaddr, ipaddragreed) != 0)) {
+                ipaddrcompare = ipaddragreed;
+                urlcompare = NULL;
+        }
 
-        // Check filesize
-        if (downloadedfilesize == 0) {
-                if (!silentmode) {
-                        char emptyFileErr[128];
-                        snprintf(emptyFileErr,
-                                 128,
-                                 "Error: downloaded file is empty(urlnr = %d).\n",
-                                 urlnr);
-                        print_dt_error(emptyFileErr);
+        for (int i = 0; i < numlookups; ++i) {
+                process_lookup_result(db, &lookups[i], settings);
+                if (lookups[i].state == LOOKUPVALID) {
+                        if (ipaddrcompare == NULL) {
+                                ipaddrcompare = lookups[i].ipaddr;
+                                urlcompare = lookups[i].url;
+                        } else if (urlcompare == NULL && strcmp(ipaddrcompare, lookups[i].ipaddr) == 0) {
+                                urlcompare = lookups[i].url;
+                        }
                 }
+        }
 
-                // Temporary disable
-                update_disabled_ipsevice(db, urlnr, true);
-                exit(EXIT_FAILURE);
-        } else if (downloadedfilesize > MAXSIZEIPADDRDOWNLOAD) {
-                // Did not return only an ip address.
-                if (!silentmode) {
-                        char responseTooBigErr[128];
-                        snprintf(responseTooBigErr,
-                                 128,
-                                 "Error: response ip service(urlnr = %d) too big.\n",
-                                 urlnr);
-                        print_dt_error(responseTooBigErr);
+        for (int i = 0; i < numlookups; ++i) {
+                if (lookups[i].state == LOOKUPVALID && strcmp(ipaddrcompare, lookups[i].ipaddr) != 0) {
+                        if (agreed) {
+                                add_disagreement_ipservice(db, lookups[i].urlnr);
+                        }
+
+                        if (!settings.silentmode) {
+                                print_detected_difference((char *)ipaddrcompare, lookups[i].ipaddr,
+                                                          urlcompare, lookups[i].url, settings.family);
+                        }
+                }
+        }
+
+        if (agreed && seedipaddr != NULL && strcmp(seedipaddr, ipaddragreed) != 0) {
+                if (avoidurlnr >= 0) {
+                        add_disagreement_ipservice(db, avoidurlnr);
                 }
 
-                // Temporary disable
-                update_disabled_ipsevice(db, urlnr, true);
-                exit(EXIT_FAILURE);
+                if (!settings.silentmode) {
+                        print_detected_difference((char *)seedipaddr, ipaddragreed, seedurl, urlcompare,
+                                                  settings.family);
+                }
+        }
+
+        for (int i = 0; i < numlookups; ++i) {
+                free((char *)lookups[i].url);
         }
 
-        ipaddr = read_file_ipaddr(downloadtempfilepath, silentmode);
-        return ipaddr;
+        return agreed;
 }
 
+/**
+ * Download the ip address from a ipservice.
+ * With --hedge a second ipservice is raced when the first one has not answered within the
+ * hedge delay. The first valid answer is used and the other request is cancelled without
+ * disabling its ipservice. The hedge delay is settings.hedgedelayms, or the 95th percentile
+ * latency measured for the first ipservice when that is shorter.
+ * @param ipaddr       Buffer of INET6_ADDRSTRLEN bytes, set to the ip address.
+ * @param urlnr        Set to the number of the ipservice that answered.
+ * @param urlipservice Set to the url of the ipservice that answered.
+ * @return true if one of the ipservices returned a valid ip address.
+ */
+bool download_ipaddr_ipservice(struct DbContext *db, char *ipaddr, int *urlnr, const char **urlipservice,
+                               struct Settings settings)
+{
+        struct Lookup lookups[2];
+        int hedgeurlnr = -1;
+        int lasturlnr = get_config_value_int(db, "lasturlnr");
+        lookups[0].urlnr = get_new_random_urlnr(lasturlnr, settings.verbosemode, settings.silentmode);
+        if (lookups[0].urlnr < 0) {
+                return false;
+        }
+
+        set_config_value_int(db, "lasturlnr", lookups[0].urlnr, settings.verbosemode);
+
+        lookups[0].startdelayms = 0;
+        int numlookups = 1;
+        if (settings.hedgedelayms >= 0) {
+                numlookups += choose_distinct_urlnrs(&hedgeurlnr, 1, lookups[0].urlnr);
+        }
+
+        long hedgedelayms = settings.hedgedelayms;
+        if (numlookups > 1) {
+                int p95ms = get_latency_p95_ipservice(db, lookups[0].urlnr);
+                if (p95ms >= 0 && p95ms < hedgedelayms) {
+                        hedgedelayms = p95ms;
+                }
+
+                lookups[1].urlnr = hedgeurlnr;
+                lookups[1].startdelayms = hedgedelayms;
+        }
+        for (int i = 0; i < numlookups; ++i) {
+                lookups[i].url = get_url_ipservice(db, lookups[i].urlnr);
+        }
+
+        if (settings.verbosemode) {
+                printf("Using %s for getting public %s address.\n", lookups[0].url,
+                       get_family_name(settings.family));
+                if (numlookups > 1) {
+                        printf("Hedge with %s after %ld ms.\n", lookups[1].url, hedgedelayms);
+                }
+        }
+
+        for (int i = 0; i < numlookups; ++i) {
+                set_adaptive_timeouts(db, &lookups[i], settings);
+        }
+
+        char useragent[128];
+        get_useragent(useragent);
+        double lookupstartms = get_monotonic_ms();
+        bool answered = lookup_quorum(lookups, numlookups, 1, NULL, ipaddr, useragent,
+                                      settings.unsafehttp, settings.verbosemode);
+        timings.lookups += get_monotonic_ms() - lookupstartms;
+        int winner = -1;
+        for (int i = 0; i < numlookups; ++i) {
+                process_lookup_result(db, &lookups[i], settings);
+                if (lookups[i].state == LOOKUPVALID && winner == -1) {
+                        winner = i;
+                }
+        }
+
+        for (int i = 0; i < numlookups; ++i) {
+                if (i == winner) {
+                        *urlnr = lookups[i].urlnr;
+                        *urlipservice = lookups[i].url;
+                } else {
+                        free((char *)lookups[i].url);
+                }
+        }
+
+        return answered;
+}
 
 /**
  * Check if argumentval is a integer and return it, if not output error and exit the program.
@@ -514,7 +906,19 @@ struct Settings parse_commandline_args(int argc, char **argv, struct Settings se
 {
         bool argnumdelaysec = false;
         bool argnumerrorwait = false;
+        bool argnumsparelookups = false;
+        bool argnumhedgedelay = false;
+        bool argnuminterval = false;
+        bool argnumwarmstart = false;
+        bool argnummaxage = false;
+        bool argsocketpath = false;
+        bool arginterface = false;
+        bool argproxylist = false;
+        bool argnumconcurrency = false;
         bool argposthook = false;
+        bool argnumposthooktimeout = false;
+        bool argdnsupdatefile = false;
+        bool argdyndnsfile = false;
         // Parse command-line arguments and set settings struct.
         for (int n = 1; n < argc; ++n) {
                 if (argnumdelaysec) {
@@ -525,8 +929,89 @@ struct Settings parse_commandline_args(int argc, char **argv, struct Settings se
                         argnumerrorwait = false;
                         settings.errorwait = read_commandline_argument_int_value(argv[n], settings.silentmode);
                         continue;
-                } else if (argposthook) {
-                        argposthook = false;
+                } else if (argnumsparelookups) {
+                        argnumsparelookups = false;
+                        settings.sparelookups = read_commandline_argument_int_value(argv[n], settings.silentmode);
+                        continue;
+                } else if (argnumhedgedelay) {
+                        argnumhedgedelay = false;
+                        settings.hedgedelayms = read_commandline_argument_int_value(argv[n], settings.silentmode);
+                        continue;
+                } else if (argnuminterval) {
+                        argnuminterval = false;
+                        settings.interval = read_commandline_argument_int_value(argv[n], settings.silentmode);
+                        if (settings.interval < MININTERVAL) {
+                                if (!settings.silentmode) {
+                                        fprintf(stderr, "Interval raised to the minimum of %d seconds.\n", MININTERVAL);
+                                }
+
+                                settings.interval = MININTERVAL;
+                        }
+
+                        continue;
+                } else if (argnumwarmstart) {
+                        argnumwarmstart = false;
+                        settings.warmstartttl = read_commandline_argument_int_value(argv[n], settings.silentmode);
+                        continue;
+                } else if (argnummaxage) {
+                        argnummaxage = false;
+                        settings.maxage = read_commandline_argument_int_value(argv[n], settings.silentmode);
+                        continue;
+                } else if (argsocketpath) {
+                        argsocketpath = false;
+                        settings.socketpath = argv[n];
+                        continue;
+                } else if (argproxylist) {
+                        argproxylist = false;
+                        settings.proxylist = argv[n];
+                        continue;
+                } else if (argdnsupdatefile) {
+                        argdnsupdatefile = false;
+                        settings.dnsupdatefile = argv[n];
+                        continue;
+                } else if (argdyndnsfile) {
+                        argdyndnsfile = false;
+                        settings.dyndnsfile = argv[n];
+                        continue;
+                } else if (argnumposthooktimeout) {
+                        argnumposthooktimeout = false;
+                        settings.posthooktimeout = read_commandline_argument_int_value(argv[n], settings.silentmode);
+                        if (settings.posthooktimeout < 0) {
+                                settings.posthooktimeout = 0;
+                        }
+
+                        continue;
+                } else if (argnumconcurrency) {
+                        argnumconcurrency = false;
+                        settings.concurrency = read_commandline_argument_int_value(argv[n], settings.silentmode);
+                        if (settings.concurrency < 1) {
+                                settings.concurrency = 1;
+                        }
+
+                        continue;
+                } else if (arginterface) {
+                        arginterface = false;
+                        if (strlen(argv[n]) > MAXLENINTERFACE || strchr(argv[n], '"') != NULL) {
+                                if (!settings.silentmode) {
+                                        print_dt_error("Error: invalid interface.\n");
+                                }
+
+                                exit(EXIT_FAILURE);
+                        }
+
+                        if (settings.numinterfaces >= MAXINTERFACES) {
+                                if (!settings.silentmode) {
+                                        fprintf(stderr, "Ignore interface \"%s\", at most %d interfaces.\n",
+                                                argv[n], MAXINTERFACES);
+                                }
+
+                                continue;
+                        }
+
+                        settings.interfaces[settings.numinterfaces++] = argv[n];
+                        continue;
+                } else if (argposthook) {
+                        argposthook = false;
                         // Check length posthook
                         if (strlen(argv[n]) > MAXLENPATHPOSTHOOK) {
                                 if (!settings.silentmode) {
@@ -536,9 +1021,17 @@ struct Settings parse_commandline_args(int argc, char **argv, struct Settings se
                                 exit(EXIT_FAILURE);
                         }
 
-                        // For now, if multiple posthook's are provided
-                        // override the command with last posthook command.
-                        settings.argnposthook = n;
+                        if (settings.numposthooks >= MAXPOSTHOOKS) {
+                                if (!settings.silentmode) {
+                                        fprintf(stderr, "Ignore posthook \"%s\", at most %d posthooks.\n",
+                                                argv[n], MAXPOSTHOOKS);
+                                }
+
+                                continue;
+                        }
+
+                        settings.posthooktimeouts[settings.numposthooks] = settings.posthooktimeout;
+                        settings.posthooks[settings.numposthooks++] = argv[n];
                         continue;
                 }
 
@@ -548,6 +1041,52 @@ struct Settings parse_commandline_args(int argc, char **argv, struct Settings se
                         argnumdelaysec = true;
                 } else if (strcmp(argv[n], "--errorwait") == 0) {
                         argnumerrorwait = true;
+                } else if (strcmp(argv[n], "--sparelookups") == 0) {
+                        argnumsparelookups = true;
+                } else if (strcmp(argv[n], "--hedge") == 0) {
+                        argnumhedgedelay = true;
+                } else if (strcmp(argv[n], "--daemon") == 0) {
+                        settings.daemonmode = true;
+                } else if (strcmp(argv[n], "--netlink") == 0) {
+                        settings.daemonmode = true;
+                        settings.netlink = true;
+                } else if (strcmp(argv[n], "--interval") == 0) {
+                        argnuminterval = true;
+                } else if (strcmp(argv[n], "--warmstart") == 0) {
+                        argnumwarmstart = true;
+                } else if (strcmp(argv[n], "--earlydata") == 0) {
+                        settings.earlydata = true;
+                } else if (strcmp(argv[n], "--statictimeouts") == 0) {
+                        settings.statictimeouts = true;
+                } else if (strcmp(argv[n], "--statefile") == 0) {
+                        settings.statefile = true;
+                } else if (strcmp(argv[n], "--timings") == 0) {
+                        settings.timings = true;
+                } else if (strcmp(argv[n], "--cached") == 0) {
+                        settings.cached = true;
+                } else if (strcmp(argv[n], "--maxage") == 0) {
+                        settings.cached = true;
+                        argnummaxage = true;
+                } else if (strcmp(argv[n], "--socket") == 0) {
+                        argsocketpath = true;
+                } else if (strcmp(argv[n], "--shm") == 0) {
+                        settings.shm = true;
+                } else if (strcmp(argv[n], "--proxies") == 0) {
+                        argproxylist = true;
+                } else if (strcmp(argv[n], "--concurrency") == 0) {
+                        argnumconcurrency = true;
+                } else if (strcmp(argv[n], "--interface") == 0) {
+                        arginterface = true;
+                } else if (strcmp(argv[n], "--dualstack") == 0) {
+                        settings.dualstack = true;
+                } else if (strcmp(argv[n], "--nowait") == 0) {
+                        settings.nowait = true;
+                } else if (strcmp(argv[n], "--dnsupdate") == 0) {
+                        argdnsupdatefile = true;
+                } else if (strcmp(argv[n], "--dyndns") == 0) {
+                        argdyndnsfile = true;
+                } else if (strcmp(argv[n], "--posthooktimeout") == 0) {
+                        argnumposthooktimeout = true;
                 } else if (strcmp(argv[n], "--retryposthook") == 0) {
                         settings.retryposthook = true;
                 } else if (strcmp(argv[n], "--showip") == 0) {
@@ -558,6 +1097,8 @@ struct Settings parse_commandline_args(int argc, char **argv, struct Settings se
                         settings.savelastrun = false;
                 } else if (strcmp(argv[n], "--unsafedns") == 0) {
                         settings.unsafedns = true;
+                } else if (strcmp(argv[n], "--unsafestun") == 0) {
+                        settings.unsafestun = true;
                 } else if (strcmp(argv[n], "--unsafehttp") == 0) {
                         settings.unsafehttp = true;
                 } else if (strcmp(argv[n], "--tripleconfirm") == 0) {
@@ -570,22 +1111,72 @@ struct Settings parse_commandline_args(int argc, char **argv, struct Settings se
                 } else if (strcmp(argv[n], "-v") == 0 || strcmp(argv[n], "--verbose") == 0) {
                         settings.verbosemode = true;
                 } else if (strcmp(argv[n], "-h") == 0 || strcmp(argv[n], "--help") == 0) {
-                        printf("--posthook      The script or program to run on public IPv4 address change.\n\
-                Put the command between quotes. Spaces in path are currently not supported.\n");
+                        printf("--posthook      The program to run on public IPv4 address change, it is started\n");
+                        printf("                without a shell. Repeat for more posthooks, up to %d, they run\n", MAXPOSTHOOKS);
+                        printf("                at the same time.\n");
+                        printf("--posthooktimeout n Stop the posthooks given after this option if they run longer\n");
+                        printf("                than n seconds, 0 for no timeout. By default %d seconds.\n",
+                               settings.posthooktimeout);
+                        printf("--dnsupdate file Update the A records, and AAAA records with --dualstack, listed\n");
+                        printf("                in file with a TSIG signed DNS UPDATE on a change, before the\n");
+                        printf("                posthooks. See the man page for the format of file.\n");
+                        printf("--dyndns file   Set the address of the hostnames listed in file with their\n");
+                        printf("                dyndns2 providers on a change, before the posthooks. See the\n");
+                        printf("                man page for the format of file.\n");
                         printf("--retryposthook Rerun posthook on next run if posthook command \n\
                 did not return 0 as exit code.\n");
                         printf("--showip        Always print the currently confirmed public IPv4 address.\n");
                         printf("--showlastrun   Show the last date and time %s has been runnend\
  and directly exit.\n", PROGRAMNAME);
+                        printf("--cached        Answer from the last confirmed public IPv4 address without any\n");
+                        printf("                lookup if it was confirmed within --maxage seconds.\n");
+                        printf("--maxage n      How old the confirmed address may be for --cached.\n");
+                        printf("                By default %d seconds.\n", settings.maxage);
                         printf("--nosavelastrun Don't save the date and time of current run.\n");
                         printf("--unsafehttp    Allow the use of http public ip services, no TLS/SSL.\n");
+                        printf("--unsafedns     Allow the use of dns and http public ip services, no TLS/SSL.\n");
+                        printf("--unsafestun    Allow the use of STUN servers as public ip services, no TLS/SSL.\n");
                         printf("--delay 1-59    Delay the execution of this program with X number of seconds.\n");
-                        printf("--errorwait n   The number of seconds that an ipservice that causes a temporary error\n");
-                        printf("                has to wait before it being able to be used again.\n");
+                        printf("--errorwait n   The most number of seconds that an ipservice that causes a temporary error\n");
+                        printf("                has to wait before it is tried again. The wait starts at one minute\n");
+                        printf("                and doubles with every consecutive error.\n");
                         int errorwaithours = settings.errorwait / 3600;
                         printf("                By default %d seconds (%d hours).\n", settings.errorwait, errorwaithours);
+                        printf("--hedge ms      Also ask a second ipservice if the first has not answered within\n");
+                        printf("                ms milliseconds, or within its usual 95th percentile response time.\n");
+                        printf("--daemon        Keep running and check the public IPv4 address every interval.\n");
+                        printf("--netlink       Daemon mode that also checks right away when an address, the default\n");
+                        printf("                route or an interface changes, like on a PPP reconnect.\n");
+                        printf("--interval n    The number of seconds between two checks in daemon mode.\n");
+                        printf("                By default %d seconds, at least %d seconds.\n", settings.interval, MININTERVAL);
+                        printf("--warmstart n   Save the addresses of the ipservices for n seconds and the TLS\n");
+                        printf("                sessions, so the next run can skip DNS and resume TLS sessions.\n");
+                        printf("--earlydata     Send the request as TLS 1.3 early data (0-RTT) when resuming.\n");
+                        printf("--statictimeouts Always wait up to 90 seconds for an ipservice, instead of a\n");
+                        printf("                multiple of its usual 99th percentile response time.\n");
+                        printf("--statefile     Keep the state between runs in a small memory mapped file instead\n");
+                        printf("                of the database. The database is only read after it is edited.\n");
+                        printf("--socket path   Answer queries for the confirmed address on a Unix socket in\n");
+                        printf("                daemon mode: ip, confirmed, changed or all.\n");
+                        printf("--shm           Publish the confirmed address in %s for\n", SHMFILENAME);
+                        printf("                lock-free readers.\n");
+                        printf("--interface name Check the public IPv4 address of this network interface or\n");
+                        printf("                IPv4 source address. Repeat for every uplink, all are checked\n");
+                        printf("                at the same time. The posthook gets the uplink as second argument.\n");
+                        printf("--dualstack     Check the public IPv4 and IPv6 address at the same time. The\n");
+                        printf("                posthook is run once with both addresses as arguments.\n");
+                        printf("--proxies file  Check the egress IPv4 address of every proxy in file instead,\n");
+                        printf("                one proxy url per line. The posthook gets the proxy as second argument.\n");
+                        printf("--concurrency n The most number of lookups through proxies at the same time.\n");
+                        printf("                By default %d.\n", settings.concurrency);
+                        printf("--nowait        If an other run is checking, do not wait for its result but\n");
+                        printf("                use the last confirmed address and exit.\n");
+                        printf("--timings       Print the milliseconds spent in every phase of a run as JSON\n");
+                        printf("                to stderr.\n");
                         printf("--failsilent    Fail silently do not print issues to stderr.\n");
                         printf("--tripleconfirm Confirm ip address change with a additional third ip service.\n");
+                        printf("--sparelookups n Ask n more ipservices at the same time when confirming, so\n");
+                        printf("                one failing ipservice does not fail the confirmation. Default 0.\n");
                         printf("--version       Print the version of this program and exit.\n");
                         printf("-v --verbose    Run in verbose mode, output what this program does.\n");
                         printf("-h --help       Print this help message.\n");
@@ -598,203 +1189,362 @@ struct Settings parse_commandline_args(int argc, char **argv, struct Settings se
         return settings;
 }
 
-int main(int argc, char **argv)
+/**
+ * Get the name of a config value that is kept for every uplink and address family: the name
+ * itself for IPv4 over the default route, with a 6 appended for IPv6 and with @interface
+ * appended for an uplink given with --interface, like lastrunip6@eth1.
+ * @param uplinkname Set to the name, at least MAXLENUPLINKCONFIGNAME + 1 bytes.
+ * @param family     AF_INET or AF_INET6.
+ */
+void get_uplink_config_name(char *uplinkname, const char *name, const char *interface, int family)
 {
-        struct Settings settings;
-        // Set default values:
-        settings.secondsdelay = 0;
-        settings.argnposthook = 0;
-        settings.errorwait = 14400;  // 4 hours
-        settings.retryposthook = false;
-        settings.unsafehttp = false;
-        settings.unsafedns = false;
-        settings.tripleconfirm = false;
-        settings.showip = false;
-        settings.silentmode = false;
-        settings.verbosemode = false;
-        settings.showlastrun = false;
-        settings.savelastrun = true;
-        settings = parse_commandline_args(argc, argv, settings);
+        const char *familysuffix = family == AF_INET6 ? "6" : "";
+        if (interface == NULL) {
+                snprintf(uplinkname, MAXLENUPLINKCONFIGNAME + 1, "%s%s", name, familysuffix);
+        } else {
+                snprintf(uplinkname, MAXLENUPLINKCONFIGNAME + 1, "%s%s@%s", name, familysuffix,
+                         interface);
+        }
+}
 
-        if (settings.secondsdelay > 0 && settings.secondsdelay < 60) {
-                if (settings.verbosemode) {
-                        printf("Delay %d seconds.\n", settings.secondsdelay);
+/**
+ * Print an ip address for --showip. With --interface every uplink gets its own line, so
+ * the checks that run at the same time can be told apart.
+ */
+void show_ip(const char *ipaddr, struct Settings settings)
+{
+        if (settings.interface != NULL) {
+                printf("%s %s\n", settings.interface, ipaddr);
+        } else {
+                printf("%s", ipaddr);
+        }
+}
+
+/**
+ * Start every posthook with the new ip address as argument. The posthooks run at the same
+ * time, each with its own timeout, they are collected after the database is written.
+ * @param args    The arguments: the new ip address, in dual-stack mode followed by the IPv6
+ *                address, and the uplink or proxy the ip address belongs to, so one posthook
+ *                can serve all of them. A NULL argument is left out.
+ * @param numargs The number of arguments.
+ * @param failed  Set to true when a posthook fails.
+ */
+void start_posthooks(struct Settings settings, const char *args[], int numargs, bool *failed)
+{
+        for (int h = 0; h < settings.numposthooks; ++h) {
+                posthook_start(settings.posthooks[h], args, numargs, settings.posthooktimeouts[h],
+                               failed, settings.silentmode);
+        }
+}
+
+/**
+ * Update the records in the --dnsupdate file to the new ip addresses of an uplink, after the
+ * change is confirmed and the database is written, before the posthooks are started.
+ * @param ipv4addr The new IPv4 address, or NULL.
+ * @param ipv6addr The new IPv6 address, or NULL.
+ * @param uplink   The uplink of the ip addresses, NULL for the default route.
+ * @return false if the update has to be sent again on the next check, because it failed
+ *         with --retryposthook.
+ */
+bool run_dnsupdate(struct Settings settings, const char *ipv4addr, const char *ipv6addr,
+                   const char *uplink)
+{
+        if (settings.dnsupdatefile == NULL) {
+                return true;
+        }
+
+        double dnsupdatestartms = get_monotonic_ms();
+        bool updated = dnsupdate_send(ipv4addr, ipv6addr, uplink, settings.verbosemode,
+                                      settings.silentmode);
+        timings.dnsupdate += get_monotonic_ms() - dnsupdatestartms;
+        if (!updated && !settings.silentmode) {
+                print_dt_error("Error: DNS update failed.\n");
+        }
+
+        return updated || !settings.retryposthook;
+}
+
+/**
+ * Set the address of the hostnames in the --dyndns file for an uplink, after the change is
+ * confirmed and the database is written, before the posthooks are started. After a provider
+ * answered it has trouble, that provider is not asked again until its wait is over, the wait
+ * doubles with every failure in a row, up to a day. An update that did not reach a provider
+ * is sent again when its wait is over. A provider that refused the login or the client is
+ * not asked again until its url or user is changed.
+ * The backoff of every provider is saved under its own name with the unix time to wait for
+ * as integer and "failures pending blocked" as text. The providers are asked without a
+ * transaction, the backoffs are written in a short transaction afterwards.
+ * @param ipv4addr The new IPv4 address, or NULL.
+ * @param ipv6addr The new IPv6 address, or NULL.
+ * @param uplink   The uplink of the ip addresses, NULL for the default route.
+ * @param changed  The ip address changed, false to only send the updates that are pending.
+ * @return false if the update has to be sent again on the next check, because it failed
+ *         with --retryposthook.
+ */
+bool run_dyndns(struct DbContext *db, struct Settings settings, const char *ipv4addr,
+                const char *ipv6addr, const char *uplink, bool changed)
+{
+        if (settings.dyndnsfile == NULL) {
+                return true;
+        }
+
+        int numproviders = dyndns_count_providers();
+        struct DyndnsBackoff backoffs[MAXDYNDNSPROVIDERS];
+        char backoffnames[MAXDYNDNSPROVIDERS][MAXLENUPLINKCONFIGNAME + 1];
+        for (int p = 0; p < numproviders; ++p) {
+                char name[LENDYNDNSBACKOFFNAME + 1];
+                dyndns_get_backoff_name(p, name);
+                get_uplink_config_name(backoffnames[p], name, uplink, AF_INET);
+                int retryat = get_config_value_int(db, backoffnames[p]);
+                char *state = get_config_value_str(db, backoffnames[p]);
+                int failures = 0;
+                int pending = 0;
+                int blocked = 0;
+                sscanf(state, "%d %d %d", &failures, &pending, &blocked);
+                free(state);
+                backoffs[p].retryat = retryat > 0 ? retryat : 0;
+                backoffs[p].failures = failures;
+                backoffs[p].pending = pending != 0;
+                backoffs[p].blocked = blocked != 0;
+                backoffs[p].changed = false;
+        }
+
+        char useragent[128];
+        get_useragent(useragent);
+        double dyndnsstartms = get_monotonic_ms();
+        bool updated = dyndns_send(ipv4addr, ipv6addr, uplink, changed, useragent,
+                                   settings.unsafehttp, backoffs, settings.verbosemode,
+                                   settings.silentmode);
+        timings.dyndns += get_monotonic_ms() - dyndnsstartms;
+        bool begun = false;
+        for (int p = 0; p < numproviders; ++p) {
+                if (!backoffs[p].changed) {
+                        continue;
                 }
 
-                sleep(settings.secondsdelay);
-        } else if (settings.secondsdelay >= MAXNUMSECDELAY && !settings.silentmode) {
-                char errormsg[128];
-                int cw;
-                cw = snprintf(errormsg,
-                              128,
-                              "Ignoring secondsdelay. secondsdelay has to be less than %d seconds.\n",
-                              MAXNUMSECDELAY);
-                if (cw >= 0 && cw <= 128) {
-                        print_dt_error(errormsg);
+                if (!begun) {
+                        begin_transaction(db);
+                        begun = true;
                 }
+
+                char state[32];
+                snprintf(state, sizeof(state), "%d %d %d", backoffs[p].failures,
+                         backoffs[p].pending ? 1 : 0, backoffs[p].blocked ? 1 : 0);
+                set_config_value_int(db, backoffnames[p], backoffs[p].retryat, settings.verbosemode);
+                set_config_value_str(db, backoffnames[p], state, settings.verbosemode);
         }
 
-        bool dbsetup = false;
-        if (access(DATABASEFILENAME, F_OK) == -1 ) {
-                dbsetup = true;
-                if (settings.verbosemode) {
-                        printf("%s does not exists. Creating %s.\n", DATABASEFILENAME, DATABASEFILENAME);
-                }
+        if (begun) {
+                commit_transaction(db);
         }
 
-        /* Setup database connection */
-        sqlite3 *db;
-        int rc;
-        rc = sqlite3_open(DATABASEFILENAME, &db);
-        if (rc) {
-                print_dt_error("Can't open database file.\n");
-                exit(EXIT_FAILURE);
-        } else if (settings.verbosemode) {
-                printf("Opened database successfully.\n");
+        if (!updated && !settings.silentmode) {
+                print_dt_error("Error: dyndns update failed.\n");
         }
 
-        if (dbsetup) {
-                create_table_ipservice(db, settings.verbosemode);
-                create_table_config(db, settings.verbosemode);
-                add_config_value_int(db, "lasturlnr", -2, settings.verbosemode);
-                /* added default ipservice records */
-                add_ipservice(db, 0, "https://ipinfo.io/ip", false, PROTOCOLHTTPS, 1, settings.verbosemode);
-                add_ipservice(db, 1, "https://api.ipify.org/?format=text", false, PROTOCOLHTTPS, 1, settings.verbosemode);
-                add_ipservice(db, 2, "https://wtfismyip.com/text", false, PROTOCOLHTTPS, 1, settings.verbosemode);
-                add_ipservice(db, 3, "https://v4.ident.me/", false, PROTOCOLHTTPS, 1, settings.verbosemode);
-                add_ipservice(db, 4, "https://ipv4.icanhazip.com/", false, PROTOCOLHTTPS, 1, settings.verbosemode);
-                add_ipservice(db, 5, "https://checkip.amazonaws.com/", false, PROTOCOLHTTPS, 1, settings.verbosemode);
-                // Dns does not response anymore, api seems gone
-                add_ipservice(db, 6, "https://bot.whatismyipaddress.com/", true, PROTOCOLHTTPS, 2, settings.verbosemode);
-                add_ipservice(db, 7, "https://secure.informaction.com/ipecho/", false, PROTOCOLHTTPS, 1, settings.verbosemode);
-                add_ipservice(db, 8, "https://l2.io/ip", false, PROTOCOLHTTPS, 1, settings.verbosemode);
-                add_ipservice(db, 9, "https://www.trackip.net/ip", false, PROTOCOLHTTPS, 1, settings.verbosemode);
-                // Has https connect error.
-                add_ipservice(db, 10, "https://ip4.seeip.org/", true, PROTOCOLHTTPS, 2, settings.verbosemode);
-                // Page not found:
-                add_ipservice(db, 11, "https://locate.now.sh/ip", true, PROTOCOLHTTPS, 2, settings.verbosemode);
-                // Response returns more than only IPv4 address now.
-                add_ipservice(db, 12, "https://tnx.nl/ip", true, PROTOCOLHTTPS, 2, settings.verbosemode);
-                // Page not found:
-                add_ipservice(db, 13, "https://diagnostic.opendns.com/myip", true, PROTOCOLHTTPS, 2, settings.verbosemode);
-                // Can give: 429 error
-                add_ipservice(db, 14, "http://myip.dnsomatic.com/", false, PROTOCOLHTTP, 2, settings.verbosemode);
-                add_ipservice(db, 15, "http://whatismyip.akamai.com/", false, PROTOCOLHTTP, 1, settings.verbosemode);
-                add_ipservice(db, 16, "http://myexternalip.com/raw", false, PROTOCOLHTTP, 1, settings.verbosemode);
-                add_ipservice(db, 17, "https://ipecho.net/plain", false, PROTOCOLHTTPS, 1, settings.verbosemode);
-                // Error page:
-                add_ipservice(db, 18, "http://plain-text-ip.com/", true, PROTOCOLHTTP, 2, settings.verbosemode);
+        return updated || !settings.retryposthook;
+}
+
+/**
+ * Queue a confirmed change for deliver_changes().
+ * @param uplink  The uplink given with --interface, NULL for the default route or a proxy.
+ * @param changed The ip address changed, false to only send the dyndns updates that are
+ *                pending for the uplink.
+ * @return The queued change without ip addresses, or NULL if there is no memory.
+ */
+struct Delivery * queue_delivery(const char *uplink, bool changed)
+{
+        struct Delivery *grown = realloc(deliveries, (numdeliveries + 1) * sizeof(struct Delivery));
+        if (grown == NULL) {
+                return NULL;
         }
 
-        if (settings.showlastrun) {
-                char *lastrundt;
-                lastrundt = get_config_value_str(db, CONFIGNAMELASTRUNDT);
-                if (settings.verbosemode) {
-                        printf("Last run on: ");
+        deliveries = grown;
+        struct Delivery *delivery = &deliveries[numdeliveries++];
+        memset(delivery, 0, sizeof(struct Delivery));
+        delivery->uplink = uplink;
+        delivery->changed = changed;
+        return delivery;
+}
+
+/**
+ * Save a change that was handed over successfully with --retryposthook: the new ip address of
+ * an uplink with its change and confirmation time, or the new egress of a proxy.
+ */
+void save_delivery(struct DbContext *db, struct Settings settings, const struct Delivery *delivery,
+                   int now)
+{
+        if (delivery->proxy[0] != '\0') {
+                save_egress_proxy(db, delivery->proxy, delivery->ipaddrs[0], now);
+                return;
+        }
+
+        const int families[NUMFAMILIES] = { AF_INET, AF_INET6 };
+        for (int f = 0; f < NUMFAMILIES; ++f) {
+                if (!delivery->saveips[f]) {
+                        continue;
                 }
 
-                printf("%s\n", lastrundt);
-                exit(EXIT_SUCCESS);
+                char previpname[MAXLENUPLINKCONFIGNAME + 1];
+                char changedname[MAXLENUPLINKCONFIGNAME + 1];
+                get_uplink_config_name(previpname, CONFIGNAMEPREVIP, delivery->uplink, families[f]);
+                get_uplink_config_name(changedname, CONFIGNAMECHANGED, delivery->uplink, families[f]);
+                set_config_value_str(db, previpname, delivery->ipaddrs[f], settings.verbosemode);
+                set_config_value_int(db, changedname, now, settings.verbosemode);
+                if (!delivery->dualstack) {
+                        // In dual-stack mode the checks confirmed both address families already.
+                        char confirmedname[MAXLENUPLINKCONFIGNAME + 1];
+                        get_uplink_config_name(confirmedname, CONFIGNAMECONFIRMED, delivery->uplink,
+                                               families[f]);
+                        set_config_value_int(db, confirmedname, now, settings.verbosemode);
+                }
+        }
+}
+
+/**
+ * Hand the changes queued by the checks to the DNS update, the dyndns providers and the
+ * posthooks. This is done after the database is written, so a slow server or posthook does
+ * not hold the write lock. The posthooks of all changes run at the same time. Without
+ * --retryposthook the changes are saved already and main() collects the posthooks. With
+ * --retryposthook the run waits for the posthooks, and only the changes that were handed over
+ * successfully are saved, in a transaction of their own. The next check finds the other
+ * changes again.
+ * @return false if a change could not be handed over with --retryposthook.
+ */
+bool deliver_changes(struct DbContext *db, struct Settings settings)
+{
+        bool anychanged = false;
+        for (int d = 0; d < numdeliveries; ++d) {
+                struct Delivery *delivery = &deliveries[d];
+                const char *ipv4addr = delivery->ipaddrs[0][0] != '\0' ? delivery->ipaddrs[0] : NULL;
+                const char *ipv6addr = delivery->ipaddrs[1][0] != '\0' ? delivery->ipaddrs[1] : NULL;
+                if (delivery->proxy[0] == '\0') {
+                        bool updated = !delivery->changed ||
+                                       run_dnsupdate(settings, ipv4addr, ipv6addr, delivery->uplink);
+                        updated = run_dyndns(db, settings, ipv4addr, ipv6addr, delivery->uplink,
+                                             delivery->changed) && updated;
+                        delivery->failed = !updated;
+                }
+
+                if (!delivery->changed) {
+                        continue;
+                }
+
+                anychanged = true;
+                if (delivery->dualstack) {
+                        const char *args[] = { delivery->ipaddrs[0], delivery->ipaddrs[1],
+                                               delivery->uplink };
+                        start_posthooks(settings, args, NUMFAMILIES + 1, &delivery->failed);
+                } else {
+                        const char *args[] = { delivery->ipaddrs[0], delivery->proxy[0] != '\0' ?
+                                               delivery->proxy : delivery->uplink };
+                        start_posthooks(settings, args, 2, &delivery->failed);
+                }
+        }
+
+        bool success = true;
+        if (settings.retryposthook && anychanged) {
+                // The posthooks have to end before it is known which changes can be saved.
+                double posthookstartms = get_monotonic_ms();
+                posthook_wait_all(settings.silentmode);
+                timings.posthook += get_monotonic_ms() - posthookstartms;
+                int now = (int)time(NULL);
+                begin_transaction(db);
+                for (int d = 0; d < numdeliveries; ++d) {
+                        if (!deliveries[d].changed) {
+                                continue;
+                        }
+
+                        if (deliveries[d].failed) {
+                                success = false;
+                        } else {
+                                save_delivery(db, settings, &deliveries[d], now);
+                        }
+                }
+
+                commit_transaction(db);
         }
 
+        free(deliveries);
+        deliveries = NULL;
+        numdeliveries = 0;
+        return success;
+}
+
+/**
+ * Check the public ip address once: get it from an ipservice, compare it with the ip address
+ * of the last run, confirm a change with other ipservices and run the posthook on a change.
+ * @return EXIT_SUCCESS or EXIT_FAILURE.
+ */
+int run_check(struct DbContext *db, struct Settings settings)
+{
+        int checkstatus = EXIT_FAILURE;
+        int urlnr = -1;
+        const char *urlipservice = NULL;
+        char * ipaddrnow;
+        char ipaddrdownload[INET6_ADDRSTRLEN];
+        char *ipaddrconfirm = NULL;
+        char ipaddrfirstrun[INET6_ADDRSTRLEN];
+        char previpname[MAXLENUPLINKCONFIGNAME + 1];
+        char confirmedname[MAXLENUPLINKCONFIGNAME + 1];
+        char changedname[MAXLENUPLINKCONFIGNAME + 1];
+        char pendingname[MAXLENUPLINKCONFIGNAME + 1];
+        get_uplink_config_name(previpname, CONFIGNAMEPREVIP, settings.interface, settings.family);
+        get_uplink_config_name(confirmedname, CONFIGNAMECONFIRMED, settings.interface, settings.family);
+        get_uplink_config_name(changedname, CONFIGNAMECHANGED, settings.interface, settings.family);
+        get_uplink_config_name(pendingname, CONFIGNAMEPENDING, settings.interface, settings.family);
         int  num_all_urls = get_count_all_ipservices(db);
         if (num_all_urls < 2) {
                 if (!settings.silentmode) {
                         print_dt_error("No enough ipservices added to the database. Need at least 2 ipservices.\n");
-                        exit(EXIT_FAILURE);
+                        goto out;
                 }
         }
 
-        int urlnr = get_new_random_urlnr(db, settings.unsafehttp, settings.unsafedns,
-                                         settings.verbosemode, settings.silentmode);
-        const char *urlipservice;
-        urlipservice = get_url_ipservice(db, urlnr);
-        if (settings.verbosemode) {
-                printf("Using %s for getting public IPv4 address.\n", urlipservice);
-        }
-
-        int httpcodestatus = 0;
-        char * ipaddrnow;  // FIXME: uninitialized variable ipaddrnow
-        ipaddrnow = download_ipaddr_ipservice(ipaddrnow,
-                                              urlipservice,
-                                              db,
-                                              urlnr,
-                                              settings.unsafehttp,
-                                              settings.silentmode,
-                                              &httpcodestatus);
-        parse_httpcode_status(httpcodestatus, db, urlnr);
-        if (is_valid_ipv4_addr(ipaddrnow) != 1) {
-                free(ipaddrnow);
-                if (!settings.silentmode) {
-                        print_error_with_url("Error: invalid IPv4 address from '%s'.\n",
-                                             urlipservice);
-                }
-
-                exit(EXIT_FAILURE);
+        double selectorstartms = get_monotonic_ms();
+        bool selectorloaded = load_selector(db, settings);
+        timings.selector = get_monotonic_ms() - selectorstartms;
+        if (!selectorloaded) {
+                goto out;
         }
 
-        char *ipaddrconfirm;
-        if (is_config_exists(db, CONFIGNAMEPREVIP) == true) {
-                ipaddrconfirm = get_config_value_str(db, CONFIGNAMEPREVIP);
+        if (is_config_exists(db, previpname) == true) {
+                if (!download_ipaddr_ipservice(db, ipaddrdownload, &urlnr, &urlipservice, settings)) {
+                        goto out;
+                }
+
+                ipaddrnow = ipaddrdownload;
+                ipaddrconfirm = get_config_value_str(db, previpname);
         } else {
                 if (settings.verbosemode) {
                         printf("First run of %s.\n", PROGRAMNAME);
                 }
 
-                const char *confirmurl;
-                urlnr = get_new_random_urlnr(db, settings.unsafehttp, settings.unsafedns,
-                                             settings.verbosemode, settings.silentmode);
-                confirmurl = get_url_ipservice(db, urlnr);
-                if (settings.verbosemode) {
-                        printf("Using %s to confirm current public IPv4 address with.\n", confirmurl);
-                }
-
-                int httpcodeconfirm = -1;
-                // FIXME: uninitialized variable ipaddrconfirm
-                ipaddrconfirm = download_ipaddr_ipservice(ipaddrconfirm,
-                                                          confirmurl,
-                                                          db,
-                                                          urlnr,
-                                                          settings.unsafehttp,
-                                                          settings.silentmode,
-                                                          &httpcodeconfirm);
-                parse_httpcode_status(httpcodeconfirm, db, urlnr);
-                if (is_valid_ipv4_addr(ipaddrconfirm) != 1) {
-                        free(ipaddrconfirm);
+                // Nothing to compare with yet, so two ipservices have to agree right away.
+                if (!confirm_with_quorum(db, 2, -1, NULL, NULL, ipaddrfirstrun, settings)) {
                         if (!settings.silentmode) {
-                                print_error_with_url("Error: invalid IPv4 address for first run confirmation from %s.\n",
-                                                     confirmurl);
+                                printf("Try getting current public %s address again on next run.\n",
+                                       get_family_name(settings.family));
                         }
 
-                        exit(EXIT_FAILURE);
+                        goto out;
                 }
 
-                // Check for ip address difference between the two requested services on first run.
-                if (strcmp(ipaddrnow, ipaddrconfirm) != 0) {
-                        if (!settings.silentmode) {
-                                print_detected_difference(ipaddrnow, ipaddrconfirm, urlipservice, confirmurl);
-                                printf("Try getting current public IPv4 address again on next run.\n");
-                        }
-
-                        exit(EXIT_FAILURE);
-                }
+                ipaddrnow = ipaddrfirstrun;
+                ipaddrconfirm = ipaddrfirstrun;
         }
 
         if (settings.savelastrun) {
-                char * lastrundt = malloc(20 * sizeof(char));
-                lastrundt = get_current_time_str(lastrundt);
-                if (is_config_exists(db, CONFIGNAMELASTRUNDT)) {
-                        update_config_value_str(db, CONFIGNAMELASTRUNDT, lastrundt, settings.verbosemode);
-                } else {
-                        add_config_value_str(db, CONFIGNAMELASTRUNDT, lastrundt, settings.verbosemode);
-                }
+                char lastrundt[20];
+                get_current_time_str(lastrundt);
+                set_config_value_str(db, CONFIGNAMELASTRUNDT, lastrundt, settings.verbosemode);
         }
 
         if (strcmp(ipaddrnow, ipaddrconfirm) != 0) {
                 // Ip address has changed.
                 if (settings.verbosemode) {
-                        printf("Public ip change detected, IPv4 address different from last\
- run.\n");
+                        printf("Public ip change detected, %s address different from last\
+ run.\n", get_family_name(settings.family));
                 }
 
                 int additionalconfirmruns = 1;
@@ -802,142 +1552,1004 @@ int main(int argc, char **argv)
                         additionalconfirmruns = 2;
                 }
 
-                for (int i = 0; i < additionalconfirmruns; ++i) {
-                        urlnr = get_new_random_urlnr(db,
-                                                     settings.unsafehttp,
-                                                     settings.unsafedns,
-                                                     settings.verbosemode,
-                                                     settings.silentmode);
-                        const char *confirmchangeurl;
-                        confirmchangeurl = get_url_ipservice(db, urlnr);
-                        if (settings.verbosemode) {
-                                printf("Ipservice %s is used to confirm public IPv4 address.\n", confirmchangeurl);
-                        }
-
-                        char *ipaddrconfirmchange;
-                        int httpcodeconfirmchange = -2;
-                        // FIXME: uninitialized variable ipaddrconfirmchange
-                        ipaddrconfirmchange = download_ipaddr_ipservice(ipaddrconfirmchange,
-                                                                        confirmchangeurl,
-                                                                        db,
-                                                                        urlnr,
-                                                                        settings.unsafehttp,
-                                                                        settings.silentmode,
-                                                                        &httpcodeconfirmchange);
-                        parse_httpcode_status(httpcodeconfirmchange, db, urlnr);
-
-                        if (is_valid_ipv4_addr(ipaddrconfirmchange) != 1) {
-                                if (!settings.silentmode) {
-                                        print_error_with_url("Error: invalid IP(IPv4) address returned from confirm ipservice: %s\n",
-                                                             confirmchangeurl);
-                                }
-
-                                if (settings.showip) {
-                                        // Show old valid ip address.
-                                        printf("%s", ipaddrconfirm);
-                                }
-
-                                exit(EXIT_FAILURE);
+                // Check if new ip address with different services is the same new ip address.
+                char ipaddrconfirmchange[INET6_ADDRSTRLEN];
+                if (!confirm_with_quorum(db, additionalconfirmruns, urlnr, ipaddrnow, urlipservice,
+                                         ipaddrconfirmchange, settings) ||
+                    strcmp(ipaddrnow, ipaddrconfirmchange) != 0) {
+                        if (!settings.silentmode) {
+                                print_dt_error("It's now unknown if public ip address has actually changed.\n");
                         }
 
-                        // Check if new ip address with different service is the same new ip address.
-                        if (strcmp(ipaddrnow, ipaddrconfirmchange) != 0) {
-                                if (!settings.silentmode) {
-                                        print_detected_difference(ipaddrnow,
-                                                                  ipaddrconfirmchange,
-                                                                  urlipservice,
-                                                                  confirmchangeurl);
-                                        print_dt_error("It's now unknown if public ip address has actually changed.\n");
-                                }
+                        if (settings.showip) {
+                                // Show old valid ip address.
+                                show_ip(ipaddrconfirm, settings);
+                        }
 
-                                if (settings.showip) {
-                                        // Show old ip address.
-                                        printf("%s", ipaddrconfirm);
-                                }
+                        goto out;
+                }
 
-                                exit(EXIT_FAILURE);
-                        }
+                if (settings.dualstack) {
+                        // The posthook is run once for both address families by finish_dual_stack().
+                        set_config_value_str(db, pendingname, ipaddrnow, settings.verbosemode);
+                        goto confirmed;
                 }
 
                 if (settings.verbosemode) {
                         printf("Execute posthook command with \"%s\" as argument.\n", ipaddrnow);
                 }
 
-                if (settings.argnposthook <= 1) {
+                if (settings.numposthooks == 0 && settings.dnsupdatefile == NULL &&
+                    settings.dyndnsfile == NULL) {
                         if (!settings.silentmode) {
                                 print_dt_error("Error: no posthook provided.\n");
                                 if (settings.showip) {
                                         // Show current ip address.
-                                        printf("%s", ipaddrnow);
+                                        show_ip(ipaddrnow, settings);
                                 }
                         }
 
-                        exit(EXIT_FAILURE);
+                        goto out;
                 }
 
-                char cmdposthook[MAXLENPATHPOSTHOOK + 1];
-                if (strchr(ipaddrnow, '"') != NULL) {
-                        if (!settings.silentmode) {
-                                print_dt_error("Error: quote(s) in ip address.\n");
-                        }
+                struct Delivery *delivery = queue_delivery(settings.interface, true);
+                if (delivery == NULL) {
+                        goto out;
+                }
 
-                        exit(EXIT_FAILURE);
-                } else if (strchr(argv[settings.argnposthook], '"') != NULL) {
-                        if (!settings.silentmode) {
-                                print_dt_error("Error: quote in posthook command.\n");
+                snprintf(delivery->ipaddrs[0], INET6_ADDRSTRLEN, "%s", ipaddrnow);
+                if (settings.retryposthook) {
+                        // Saved by deliver_changes() if the posthooks succeed, else the posthooks
+                        // run next time again because CONFIGNAMEPREVIP is not updated.
+                        delivery->saveips[0] = true;
+                        if (settings.showip) {
+                                // Do show new ip address.
+                                show_ip(ipaddrnow, settings);
                         }
 
-                        exit(EXIT_FAILURE);
+                        checkstatus = EXIT_SUCCESS;
+                        goto out;
                 }
 
-                snprintf(cmdposthook, MAXLENPATHPOSTHOOK, "\"%s\" \"%s\"",
-                         argv[settings.argnposthook], ipaddrnow);
-                /* printf("cmdposthook = [ %s ]\n", cmdposthook); // DEBUG */
-                unsigned short exitcode = system(cmdposthook);
-                if (exitcode != 0) {
-                        if (!settings.silentmode) {
-                                char errormsg[64];
-                                int cw;
-                                cw = snprintf(errormsg,
-                                              64,
-                                              "Error: script returned error (exitcode %hu).\n",
-                                              exitcode);
-                                if (cw >= 0 && cw <= 64) {
-                                        print_dt_error(errormsg);
-                                }
+                set_config_value_str(db, previpname, ipaddrnow, settings.verbosemode);
+                set_config_value_int(db, changedname, (int)time(NULL), settings.verbosemode);
+        } else {
+                if (settings.verbosemode) {
+                        printf("The current public ip is the same as the public ip from last ipservice.\n");
+                }
+
+                if (is_config_exists(db, previpname) == false) {
+                        // Readded missing CONFIGNAMEPREVIP config value.
+                        set_config_value_str(db, previpname, ipaddrnow, settings.verbosemode);
+                        set_config_value_int(db, changedname, (int)time(NULL), settings.verbosemode);
+                }
+
+                if (settings.dyndnsfile != NULL && !settings.dualstack) {
+                        // A dyndns update that failed before is sent when its wait is over.
+                        struct Delivery *delivery = queue_delivery(settings.interface, false);
+                        if (delivery != NULL) {
+                                snprintf(delivery->ipaddrs[0], INET6_ADDRSTRLEN, "%s", ipaddrnow);
                         }
+                }
+        }
 
-                        if (settings.retryposthook) {
-                                if (settings.showip) {
-                                        // Do show new ip address.
-                                        printf("%s", ipaddrnow);
-                                }
+confirmed:
+        // Remember when the ip address was last confirmed for --cached.
+        set_config_value_int(db, confirmedname, (int)time(NULL), settings.verbosemode);
+        if (settings.showip) {
+                // Show current ip address.
+                show_ip(ipaddrnow, settings);
+        }
 
-                                // Run posthook next time again because CONFIGNAMEPREVIP is
-                                // not updated to new ip in database.
-                                exit(EXIT_FAILURE);
+        checkstatus = EXIT_SUCCESS;
+out:
+        selector_free();
+        free((char *)urlipservice);
+        if (ipaddrconfirm != ipaddrfirstrun) {
+                free(ipaddrconfirm);
+        }
+
+        return checkstatus;
+}
+
+/**
+ * Answer from the ip addresses of the last run if they have been confirmed within
+ * settings.maxage seconds, without initializing curl or doing any lookup. With --interface
+ * every uplink, and with --dualstack both address families, must have been confirmed.
+ * The egress addresses of proxies are not answered from the cache.
+ * @return true if answered, false if there is no recent enough confirmed ip address and a
+ *         real check has to be done.
+ */
+bool answer_from_cache(struct DbContext *db, struct Settings settings)
+{
+        if (settings.proxylist != NULL) {
+                return false;
+        }
+
+        const int families[NUMFAMILIES] = { AF_INET, AF_INET6 };
+        int numfamilies = settings.dualstack ? NUMFAMILIES : 1;
+        const char *uplinks[MAXINTERFACES] = { NULL };
+        int numuplinks = 1;
+        if (settings.numinterfaces > 0) {
+                numuplinks = settings.numinterfaces;
+                memcpy(uplinks, settings.interfaces, sizeof(uplinks));
+        }
+
+        char *ipaddrscached[MAXINTERFACES * NUMFAMILIES] = { NULL };
+        int numcached = 0;
+        long oldestage = 0;
+        bool answered = true;
+        for (int i = 0; i < numuplinks * numfamilies && answered; ++i) {
+                char confirmedname[MAXLENUPLINKCONFIGNAME + 1];
+                char previpname[MAXLENUPLINKCONFIGNAME + 1];
+                get_uplink_config_name(confirmedname, CONFIGNAMECONFIRMED, uplinks[i / numfamilies],
+                                       families[i % numfamilies]);
+                get_uplink_config_name(previpname, CONFIGNAMEPREVIP, uplinks[i / numfamilies],
+                                       families[i % numfamilies]);
+                int confirmed = get_config_value_int(db, confirmedname);
+                // A confirmation in the future means the clock was turned back, do not trust it.
+                long age = (long)time(NULL) - confirmed;
+                if (confirmed <= 0 || age < 0 || age > settings.maxage) {
+                        if (confirmed > 0 && settings.verbosemode) {
+                                printf("Cached ip address is too old, checking now.\n");
                         }
+
+                        answered = false;
+                        break;
                 }
 
-                if (is_config_exists(db, CONFIGNAMEPREVIP) == true) {
-                        update_config_value_str(db, CONFIGNAMEPREVIP, ipaddrnow, settings.verbosemode);
-                } else {
-                        add_config_value_str(db, CONFIGNAMEPREVIP, ipaddrnow, settings.verbosemode);
+                if (age > oldestage) {
+                        oldestage = age;
                 }
-        } else if (settings.verbosemode) {
-                printf("The current public ip is the same as the public ip from last ipservice.\n");
-                if (is_config_exists(db, CONFIGNAMEPREVIP) == false) {
-                        // Readded missing CONFIGNAMEPREVIP config value.
-                        add_config_value_str(db, CONFIGNAMEPREVIP, ipaddrnow, settings.verbosemode);
+
+                ipaddrscached[numcached++] = get_config_value_str(db, previpname);
+                answered = ipaddrscached[numcached - 1][0] != '\0';
+        }
+
+        if (answered && settings.verbosemode) {
+                printf("Using ip address confirmed %ld seconds ago.\n", oldestage);
+        }
+
+        for (int u = 0; u < numuplinks && answered && settings.showip; ++u) {
+                if (settings.dualstack) {
+                        if (uplinks[u] != NULL) {
+                                printf("%s ", uplinks[u]);
+                        }
+
+                        printf("%s %s\n", ipaddrscached[u * numfamilies],
+                               ipaddrscached[u * numfamilies + 1]);
+                } else {
+                        settings.interface = uplinks[u];
+                        show_ip(ipaddrscached[u], settings);
                 }
         }
 
-        if (settings.showip) {
-                // Show current ip address.
-                printf("%s", ipaddrnow);
+        for (int i = 0; i < numcached; ++i) {
+                free(ipaddrscached[i]);
         }
 
-        reenable_expired_disabled_ipservices(db, settings.errorwait);
-        return EXIT_SUCCESS;
+        return answered;
 }
 
+/**
+ * Publish the ip address of the last run with its confirmation and change time on the
+ * socket and in the shared memory.
+ */
+void publish_last_run(struct DbContext *db)
+{
+        char *ipaddrlastrun = get_config_value_str(db, CONFIGNAMEPREVIP);
+        int confirmed = get_config_value_int(db, CONFIGNAMECONFIRMED);
+        int changed = get_config_value_int(db, CONFIGNAMECHANGED);
+        publish_address(ipaddrlastrun, confirmed > 0 ? confirmed : 0, changed > 0 ? changed : 0);
+        free(ipaddrlastrun);
+}
+
+/**
+ * Queue the posthook once for both address families of an uplink in dual-stack mode, after
+ * both are checked. The checks store a confirmed change as pending instead of running the
+ * posthook. The posthook gets the IPv4 and the IPv6 address, and the uplink if it is given
+ * with --interface. An address family without a known address is passed as empty argument.
+ * The posthook is run by deliver_changes() after the database is written.
+ * @param uplink The interface given with --interface, or NULL for the default route.
+ * @return false if a change can't be handed to the posthook.
+ */
+bool finish_dual_stack(struct DbContext *db, struct Settings settings, const char *uplink)
+{
+        const int families[NUMFAMILIES] = { AF_INET, AF_INET6 };
+        char previpnames[NUMFAMILIES][MAXLENUPLINKCONFIGNAME + 1];
+        char pendingnames[NUMFAMILIES][MAXLENUPLINKCONFIGNAME + 1];
+        char *ipaddrslastrun[NUMFAMILIES];
+        char *ipaddrspending[NUMFAMILIES];
+        const char *args[NUMFAMILIES + 1];
+        bool changed = false;
+        for (int f = 0; f < NUMFAMILIES; ++f) {
+                get_uplink_config_name(previpnames[f], CONFIGNAMEPREVIP, uplink, families[f]);
+                get_uplink_config_name(pendingnames[f], CONFIGNAMEPENDING, uplink, families[f]);
+                ipaddrslastrun[f] = get_config_value_str(db, previpnames[f]);
+                ipaddrspending[f] = get_config_value_str(db, pendingnames[f]);
+                if (ipaddrspending[f][0] != '\0') {
+                        args[f] = ipaddrspending[f];
+                        changed = true;
+                } else {
+                        args[f] = ipaddrslastrun[f];
+                }
+        }
+
+        args[NUMFAMILIES] = uplink;
+        bool success = true;
+        if (changed) {
+                if (settings.numposthooks == 0 && settings.dnsupdatefile == NULL &&
+                    settings.dyndnsfile == NULL) {
+                        if (!settings.silentmode) {
+                                print_dt_error("Error: no posthook provided.\n");
+                        }
+
+                        success = false;
+                } else {
+                        if (settings.verbosemode) {
+                                printf("Execute posthook command with \"%s\" \"%s\" as arguments.\n",
+                                       args[0], args[1]);
+                        }
+
+                        struct Delivery *delivery = queue_delivery(uplink, true);
+                        success = delivery != NULL;
+                        for (int f = 0; f < NUMFAMILIES && success; ++f) {
+                                snprintf(delivery->ipaddrs[f], INET6_ADDRSTRLEN, "%s", args[f]);
+                                delivery->saveips[f] = settings.retryposthook &&
+                                                       ipaddrspending[f][0] != '\0';
+                        }
+
+                        if (success) {
+                                delivery->dualstack = true;
+                        }
+                }
+
+                for (int f = 0; f < NUMFAMILIES; ++f) {
+                        if (ipaddrspending[f][0] == '\0') {
+                                continue;
+                        }
+
+                        // With --retryposthook the change is saved by deliver_changes() if the
+                        // posthooks succeed, else they run again on the next check.
+                        if (success && !settings.retryposthook) {
+                                char changedname[MAXLENUPLINKCONFIGNAME + 1];
+                                get_uplink_config_name(changedname, CONFIGNAMECHANGED, uplink, families[f]);
+                                set_config_value_str(db, previpnames[f], ipaddrspending[f],
+                                                     settings.verbosemode);
+                                set_config_value_int(db, changedname, (int)time(NULL),
+                                                     settings.verbosemode);
+                        }
+
+                        // Not updated, the next check finds the change again.
+                        set_config_value_str(db, pendingnames[f], "", settings.verbosemode);
+                }
+        } else if (settings.dyndnsfile != NULL) {
+                // A dyndns update that failed before is sent when its wait is over.
+                struct Delivery *delivery = queue_delivery(uplink, false);
+                for (int f = 0; f < NUMFAMILIES && delivery != NULL; ++f) {
+                        snprintf(delivery->ipaddrs[f], INET6_ADDRSTRLEN, "%s", args[f]);
+                }
+        }
+
+        if (settings.showip) {
+                if (uplink != NULL) {
+                        printf("%s ", uplink);
+                }
+
+                printf("%s %s\n", args[0][0] != '\0' ? args[0] : "unknown",
+                       args[1][0] != '\0' ? args[1] : "unknown");
+        }
+
+        for (int f = 0; f < NUMFAMILIES; ++f) {
+                free(ipaddrslastrun[f]);
+                free(ipaddrspending[f]);
+        }
+
+        return success;
+}
+
+/**
+ * Check the public ip address of every uplink given with --interface, and in dual-stack mode
+ * of both address families, at the same time. Every check is done by its own child process
+ * with its own database connection, so the checks share the ipservices and their health, but
+ * keep their own ip address. The checks of an uplink run the posthook on their own, or in
+ * dual-stack mode once together afterwards. The children do not use a transaction, that would
+ * make them wait for each other.
+ * @param db The database connection of this process, closed while the children run and
+ *           opened again afterwards.
+ * @return EXIT_SUCCESS if every uplink was checked successfully.
+ */
+int run_check_uplinks(struct DbContext **db, struct Settings settings)
+{
+        int checkstatus = EXIT_SUCCESS;
+        const int families[NUMFAMILIES] = { AF_INET, AF_INET6 };
+        int numfamilies = settings.dualstack ? NUMFAMILIES : 1;
+        const char *uplinks[MAXINTERFACES] = { NULL };
+        int numuplinks = 1;
+        if (settings.numinterfaces > 0) {
+                numuplinks = settings.numinterfaces;
+                memcpy(uplinks, settings.interfaces, sizeof(uplinks));
+        }
+
+        int numchecks = numuplinks * numfamilies;
+        pid_t pids[MAXINTERFACES * NUMFAMILIES];
+        // A database connection must not be used on both sides of a fork.
+        db_close(*db);
+        fflush(stdout);
+        fflush(stderr);
+        for (int i = 0; i < numchecks; ++i) {
+                pids[i] = fork();
+                if (pids[i] == 0) {
+                        settings.interface = uplinks[i / numfamilies];
+                        settings.family = families[i % numfamilies];
+                        lookup_set_interface(settings.interface);
+                        lookup_set_family(settings.family);
+                        if (settings.dualstack) {
+                                // Shown by finish_dual_stack() with both address families.
+                                settings.showip = false;
+                        }
+
+                        if (settings.family == AF_INET6) {
+                                // Only the IPv4 addresses of the ipservices are saved.
+                                settings.warmstartttl = 0;
+                        }
+
+                        struct DbContext *uplinkdb = db_open(DATABASEFILENAME, NULL);
+                        if (uplinkdb == NULL) {
+                                print_dt_error("Can't open database file.\n");
+                                exit(EXIT_FAILURE);
+                        }
+
+                        int uplinkstatus = run_check(uplinkdb, settings);
+                        if (!deliver_changes(uplinkdb, settings)) {
+                                uplinkstatus = EXIT_FAILURE;
+                        }
+
+                        db_close(uplinkdb);
+                        posthook_wait_all(settings.silentmode);
+                        exit(uplinkstatus);
+                } else if (pids[i] < 0) {
+                        if (!settings.silentmode) {
+                                print_dt_error("Error: can't start the check of an interface.\n");
+                        }
+
+                        checkstatus = EXIT_FAILURE;
+                }
+        }
+
+        for (int i = 0; i < numchecks; ++i) {
+                if (pids[i] <= 0) {
+                        continue;
+                }
+
+                int status;
+                pid_t retpid;
+                while ((retpid = waitpid(pids[i], &status, 0)) < 0 && errno == EINTR) {
+                }
+
+                if (retpid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+                        checkstatus = EXIT_FAILURE;
+                }
+        }
+
+        *db = db_open(DATABASEFILENAME, settings.statefile ? STATEFILENAME : NULL);
+        if (*db == NULL) {
+                print_dt_error("Can't open database file.\n");
+                exit(EXIT_FAILURE);
+        }
+
+        if (settings.dualstack) {
+                begin_transaction(*db);
+                for (int u = 0; u < numuplinks; ++u) {
+                        if (!finish_dual_stack(*db, settings, uplinks[u])) {
+                                checkstatus = EXIT_FAILURE;
+                        }
+                }
+
+                commit_transaction(*db);
+        }
+
+        return checkstatus;
+}
+
+/**
+ * Check the egress ip address of every proxy in the proxy list at the same time, with the
+ * same consensus as the first run: two ipservices have to agree. The lookups are spread
+ * evenly over the available http and https ipservices. For every proxy a line with the
+ * proxy and its egress ip address, or unknown, is printed. The posthook is run for every
+ * proxy with an other egress ip address than at the last check.
+ * @return EXIT_SUCCESS if the egress ip address of every proxy is known.
+ */
+int run_check_proxies(struct DbContext *db, struct Settings settings)
+{
+        struct ProxyCheck *checks = NULL;
+        int numchecks = proxypool_read(settings.proxylist, &checks);
+        if (numchecks < 0) {
+                if (!settings.silentmode) {
+                        print_dt_error("Error: can't read the proxy list.\n");
+                }
+
+                return EXIT_FAILURE;
+        }
+
+        // Only http and https can be asked through a proxy.
+        int allowedprotocoltypes = 1 << PROTOCOLHTTPS;
+        if (settings.unsafehttp) {
+                allowedprotocoltypes |= 1 << PROTOCOLHTTP;
+        }
+
+        int numurls = get_count_available_ipservices(db, allowedprotocoltypes, FAMILYIPV4);
+        struct IpServiceScore scores[numurls > 0 ? numurls : 1];
+        numurls = get_scores_ipservices(db, scores, numurls, allowedprotocoltypes, FAMILYIPV4);
+        if (numurls < PROXYNUMAGREE) {
+                if (!settings.silentmode) {
+                        print_dt_error("Error: not enough http(s) ipservices available.\n");
+                }
+
+                free(checks);
+                return EXIT_FAILURE;
+        }
+
+        int urlnrs[numurls];
+        const char *urls[numurls];
+        for (int u = 0; u < numurls; ++u) {
+                urlnrs[u] = scores[u].urlnr;
+                urls[u] = get_url_ipservice(db, urlnrs[u]);
+        }
+
+        char useragent[128];
+        get_useragent(useragent);
+        double lookupsstartms = get_monotonic_ms();
+        int numagreed = proxypool_check(checks, numchecks, urlnrs, urls, numurls, settings.concurrency,
+                                        useragent, settings.unsafehttp, settings.verbosemode);
+        timings.lookups = get_monotonic_ms() - lookupsstartms;
+        int now = (int)time(NULL);
+        for (int c = 0; c < numchecks; ++c) {
+                if (checks[c].ipaddr[0] == '\0') {
+                        printf("%s unknown\n", checks[c].proxy);
+                        continue;
+                }
+
+                printf("%s %s\n", checks[c].proxy, checks[c].ipaddr);
+                char ipaddrlastrun[INET6_ADDRSTRLEN];
+                bool checkedbefore = get_egress_proxy(db, checks[c].proxy, ipaddrlastrun);
+                if (!checkedbefore || strcmp(ipaddrlastrun, checks[c].ipaddr) == 0 ||
+                    settings.numposthooks == 0) {
+                        save_egress_proxy(db, checks[c].proxy, checks[c].ipaddr, now);
+                        continue;
+                }
+
+                if (settings.verbosemode) {
+                        printf("Egress of proxy %s changed, execute posthook.\n", checks[c].proxy);
+                }
+
+                struct Delivery *delivery = queue_delivery(NULL, true);
+                if (delivery == NULL) {
+                        continue;
+                }
+
+                snprintf(delivery->ipaddrs[0], INET6_ADDRSTRLEN, "%s", checks[c].ipaddr);
+                snprintf(delivery->proxy, sizeof(delivery->proxy), "%s", checks[c].proxy);
+                // With --retryposthook the egress is saved by deliver_changes() if the posthooks
+                // succeed, else they run for this proxy next time again.
+                if (settings.retryposthook) {
+                        delivery->saveips[0] = true;
+                } else {
+                        save_egress_proxy(db, checks[c].proxy, checks[c].ipaddr, now);
+                }
+        }
+
+        for (int u = 0; u < numurls; ++u) {
+                free((char *)urls[u]);
+        }
+
+        free(checks);
+        return numagreed == numchecks ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Take the lock that lets only one run at a time check the public ip address, so runs that
+ * overlap do not ask the ipservices twice or run the posthook twice.
+ * @param wait      Wait for the lock if an other run holds it.
+ * @param contended Set to true if an other run held the lock.
+ * @return The file descriptor holding the lock, release it with unlock_check(). -1 if
+ *         not locked, because an other run holds it and wait is false, or because the
+ *         lock file can't be opened, then contended tells which.
+ */
+int lock_check(bool wait, bool *contended)
+{
+        *contended = false;
+        int lockfd = open(LOCKFILENAME, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (lockfd < 0) {
+                return -1;
+        }
+
+        if (flock(lockfd, LOCK_EX | LOCK_NB) == 0) {
+                return lockfd;
+        }
+
+        *contended = true;
+        if (wait) {
+                int retcode;
+                while ((retcode = flock(lockfd, LOCK_EX)) != 0 && errno == EINTR) {
+                }
+
+                if (retcode == 0) {
+                        return lockfd;
+                }
+        }
+
+        close(lockfd);
+        return -1;
+}
+
+/**
+ * Release the lock from lock_check().
+ */
+void unlock_check(int lockfd)
+{
+        if (lockfd >= 0) {
+                close(lockfd);
+        }
+}
+
+/**
+ * Signal handler for SIGTERM and SIGINT, stop the daemon after the current check.
+ */
+static void handle_stop_signal(int signum)
+{
+        (void)signum;
+        stoprequested = 1;
+}
+
+/**
+ * Sleep for the interval between two checks, with up to 10% random jitter so daemons that
+ * are started at the same moment do not keep asking the ipservices at the same moment.
+ * Returns early when a stop signal is received, or when netlinkfd is open and an address,
+ * default route or interface changes. Changes that quickly follow each other, like during
+ * a PPP reconnect, are waited out for up to NETLINKMAXSETTLEMS. Queries on socketfd are
+ * answered while sleeping.
+ * @param intervalseconds The number of seconds between two checks.
+ * @param netlinkfd       The netlink socket from netwatch_open(), or -1.
+ * @param socketfd        The query socket from publish_socket_open(), or -1.
+ * @return true if the sleep ended early because of a network change.
+ */
+bool sleep_interval_jittered(int intervalseconds, int netlinkfd, int socketfd)
+{
+        long sleepms = intervalseconds * 1000L;
+        long jitterms = intervalseconds * 100L;
+        if (jitterms > 0) {
+                sleepms += (rand() % (2 * jitterms + 1)) - jitterms;
+        }
+
+        if (netlinkfd < 0 && socketfd < 0) {
+                struct timespec sleeptime;
+                sleeptime.tv_sec = sleepms / 1000;
+                sleeptime.tv_nsec = (sleepms % 1000) * 1000000L;
+                while (!stoprequested && nanosleep(&sleeptime, &sleeptime) == -1 && errno == EINTR) {
+                }
+
+                return false;
+        }
+
+        struct timespec starttime;
+        clock_gettime(CLOCK_MONOTONIC, &starttime);
+        // A negative fd is ignored by poll().
+        struct pollfd fds[2];
+        fds[0].fd = netlinkfd;
+        fds[0].events = POLLIN;
+        fds[1].fd = socketfd;
+        fds[1].events = POLLIN;
+        long changedms = -1;
+        while (!stoprequested) {
+                struct timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                long elapsedms = (now.tv_sec - starttime.tv_sec) * 1000L +
+                                 (now.tv_nsec - starttime.tv_nsec) / 1000000L;
+                long waitms = sleepms - elapsedms;
+                if (changedms >= 0) {
+                        // Wait until the changes settle.
+                        waitms = NETLINKSETTLEMS;
+                        if (elapsedms - changedms >= NETLINKMAXSETTLEMS) {
+                                return true;
+                        }
+                }
+
+                if (waitms <= 0) {
+                        return false;
+                }
+
+                fds[0].revents = 0;
+                fds[1].revents = 0;
+                int ready = poll(fds, 2, (int)waitms);
+                if (ready == 0 && changedms >= 0) {
+                        return true;
+                }
+
+                if ((fds[1].revents & POLLIN) != 0) {
+                        publish_socket_answer(socketfd);
+                }
+
+                if ((fds[0].revents & POLLIN) != 0 && netwatch_read_changes(netlinkfd) &&
+                    changedms < 0) {
+                        changedms = elapsedms;
+                }
+        }
+
+        return false;
+}
+
+int main(int argc, char **argv)
+{
+        double mainstartms = get_monotonic_ms();
+        struct Settings settings;
+        // Set default values:
+        settings.secondsdelay = 0;
+        settings.numposthooks = 0;
+        settings.posthooktimeout = 60;
+        settings.dnsupdatefile = NULL;
+        settings.dyndnsfile = NULL;
+        settings.errorwait = 14400;  // 4 hours
+        settings.retryposthook = false;
+        settings.unsafehttp = false;
+        settings.unsafedns = false;
+        settings.unsafestun = false;
+        settings.tripleconfirm = false;
+        settings.sparelookups = 0;
+        settings.hedgedelayms = -1;
+        settings.interval = 600;  // 10 minutes
+        settings.daemonmode = false;
+        settings.netlink = false;
+        settings.warmstartttl = 0;
+        settings.earlydata = false;
+        settings.statictimeouts = false;
+        settings.statefile = false;
+        settings.timings = false;
+        settings.cached = false;
+        settings.maxage = 300;  // 5 minutes
+        settings.socketpath = NULL;
+        settings.shm = false;
+        settings.nowait = false;
+        settings.numinterfaces = 0;
+        settings.interface = NULL;
+        settings.proxylist = NULL;
+        settings.concurrency = 64;
+        settings.dualstack = false;
+        settings.family = AF_INET;
+        settings.showip = false;
+        settings.silentmode = false;
+        settings.verbosemode = false;
+        settings.showlastrun = false;
+        settings.savelastrun = true;
+        settings = parse_commandline_args(argc, argv, settings);
+        if ((settings.numinterfaces > 0 || settings.dualstack || settings.proxylist != NULL) &&
+            settings.statefile) {
+                // Every uplink and address family is checked by its own process, they can't share
+                // one state file. The egress ip addresses of proxies are only kept in the database.
+                if (!settings.silentmode) {
+                        print_dt_error("Warning: --statefile is not used with --interface, --dualstack or --proxies.\n");
+                }
+
+                settings.statefile = false;
+        }
+
+        if (settings.dnsupdatefile != NULL && !dnsupdate_read(settings.dnsupdatefile)) {
+                print_dt_error("Can't read the DNS update file.\n");
+                exit(EXIT_FAILURE);
+        }
+
+        if (settings.dyndnsfile != NULL && !dyndns_read(settings.dyndnsfile)) {
+                print_dt_error("Can't read the dyndns file.\n");
+                exit(EXIT_FAILURE);
+        }
+
+        if (settings.secondsdelay > 0 && settings.secondsdelay < 60) {
+                if (settings.verbosemode) {
+                        printf("Delay %d seconds.\n", settings.secondsdelay);
+                }
+
+                sleep(settings.secondsdelay);
+        } else if (settings.secondsdelay >= MAXNUMSECDELAY && !settings.silentmode) {
+                char errormsg[128];
+                int cw;
+                cw = snprintf(errormsg,
+                              128,
+                              "Ignoring secondsdelay. secondsdelay has to be less than %d seconds.\n",
+                              MAXNUMSECDELAY);
+                if (cw >= 0 && cw <= 128) {
+                        print_dt_error(errormsg);
+                }
+        }
+
+        bool dbsetup = false;
+        if (access(DATABASEFILENAME, F_OK) == -1 ) {
+                dbsetup = true;
+                if (settings.verbosemode) {
+                        printf("%s does not exists. Creating %s.\n", DATABASEFILENAME, DATABASEFILENAME);
+                }
+        }
+
+        /* Setup database connection */
+        double dbstartms = get_monotonic_ms();
+        struct DbContext *db = db_open(DATABASEFILENAME, settings.statefile ? STATEFILENAME : NULL);
+        if (db == NULL) {
+                print_dt_error("Can't open database file.\n");
+                exit(EXIT_FAILURE);
+        } else if (settings.verbosemode) {
+                printf("Opened database successfully.\n");
+        }
+
+        // Upgrading the schema and adding the default ipservices is written to disk at once.
+        begin_transaction(db);
+        if (!migrate_schema(db, settings.errorwait, settings.verbosemode)) {
+                print_dt_error("Can't upgrade database.\n");
+                db_close(db);
+                exit(EXIT_FAILURE);
+        }
+
+        if (dbsetup) {
+                set_config_value_int(db, "lasturlnr", -2, settings.verbosemode);
+                /* added default ipservice records */
+                add_ipservice(db, 0, "https://ipinfo.io/ip", false, PROTOCOLHTTPS, 1, FAMILYIPV4, settings.verbosemode);
+                add_ipservice(db, 1, "https://api.ipify.org/?format=text", false, PROTOCOLHTTPS, 1, FAMILYIPV4, settings.verbosemode);
+                add_ipservice(db, 2, "https://wtfismyip.com/text", false, PROTOCOLHTTPS, 1, FAMILYIPV4, settings.verbosemode);
+                add_ipservice(db, 3, "https://v4.ident.me/", false, PROTOCOLHTTPS, 1, FAMILYIPV4, settings.verbosemode);
+                add_ipservice(db, 4, "https://ipv4.icanhazip.com/", false, PROTOCOLHTTPS, 1, FAMILYIPV4, settings.verbosemode);
+                add_ipservice(db, 5, "https://checkip.amazonaws.com/", false, PROTOCOLHTTPS, 1, FAMILYIPV4, settings.verbosemode);
+                // Dns does not response anymore, api seems gone
+                add_ipservice(db, 6, "https://bot.whatismyipaddress.com/", true, PROTOCOLHTTPS, 2, FAMILYIPV4, settings.verbosemode);
+                add_ipservice(db, 7, "https://secure.informaction.com/ipecho/", false, PROTOCOLHTTPS, 1, FAMILYIPV4, settings.verbosemode);
+                add_ipservice(db, 8, "https://l2.io/ip", false, PROTOCOLHTTPS, 1, FAMILYIPV4, settings.verbosemode);
+                add_ipservice(db, 9, "https://www.trackip.net/ip", false, PROTOCOLHTTPS, 1, FAMILYIPV4, settings.verbosemode);
+                // Has https connect error.
+                add_ipservice(db, 10, "https://ip4.seeip.org/", true, PROTOCOLHTTPS, 2, FAMILYIPV4, settings.verbosemode);
+                // Page not found:
+                add_ipservice(db, 11, "https://locate.now.sh/ip", true, PROTOCOLHTTPS, 2, FAMILYIPV4, settings.verbosemode);
+                // Response returns more than only IPv4 address now.
+                add_ipservice(db, 12, "https://tnx.nl/ip", true, PROTOCOLHTTPS, 2, FAMILYIPV4, settings.verbosemode);
+                // Page not found:
+                add_ipservice(db, 13, "https://diagnostic.opendns.com/myip", true, PROTOCOLHTTPS, 2, FAMILYIPV4, settings.verbosemode);
+                // Can give: 429 error
+                add_ipservice(db, 14, "http://myip.dnsomatic.com/", false, PROTOCOLHTTP, 2, FAMILYIPV4, settings.verbosemode);
+                add_ipservice(db, 15, "http://whatismyip.akamai.com/", false, PROTOCOLHTTP, 1, FAMILYIPV4, settings.verbosemode);
+                add_ipservice(db, 16, "http://myexternalip.com/raw", false, PROTOCOLHTTP, 1, FAMILYIPV4, settings.verbosemode);
+                add_ipservice(db, 17, "https://ipecho.net/plain", false, PROTOCOLHTTPS, 1, FAMILYIPV4, settings.verbosemode);
+                // Error page:
+                add_ipservice(db, 18, "http://plain-text-ip.com/", true, PROTOCOLHTTP, 2, FAMILYIPV4, settings.verbosemode);
+                // resolver1.opendns.com
+                add_ipservice(db, 19, "dns://208.67.222.222/myip.opendns.com", false, PROTOCOLDNS, 1, FAMILYIPV4, settings.verbosemode);
+                // ns1.google.com
+                add_ipservice(db, 20, "dns://216.239.32.10/o-o.myaddr.l.google.com?type=TXT", false, PROTOCOLDNS, 1, FAMILYIPV4, settings.verbosemode);
+                add_ipservice(db, 21, "dns://1.1.1.1/whoami.cloudflare?type=TXT&class=CH", false, PROTOCOLDNS, 1, FAMILYIPV4, settings.verbosemode);
+                add_ipservice(db, 22, "stun://stun.l.google.com:19302", false, PROTOCOLSTUN, 1, FAMILYIPV4, settings.verbosemode);
+                add_ipservice(db, 23, "stun://stun1.l.google.com:19302", false, PROTOCOLSTUN, 1, FAMILYIPV4, settings.verbosemode);
+                add_ipservice(db, 24, "stun://stun.cloudflare.com:3478", false, PROTOCOLSTUN, 1, FAMILYIPV4, settings.verbosemode);
+                add_ipservice(db, 25, "stun://stun.nextcloud.com:443", false, PROTOCOLSTUN, 1, FAMILYIPV4, settings.verbosemode);
+                add_ipservice(db, 26, "https://api6.ipify.org/", false, PROTOCOLHTTPS, 1, FAMILYIPV6, settings.verbosemode);
+                add_ipservice(db, 27, "https://ipv6.icanhazip.com/", false, PROTOCOLHTTPS, 1, FAMILYIPV6, settings.verbosemode);
+                add_ipservice(db, 28, "https://v6.ident.me/", false, PROTOCOLHTTPS, 1, FAMILYIPV6, settings.verbosemode);
+                add_ipservice(db, 29, "https://v6.ipinfo.io/ip", false, PROTOCOLHTTPS, 1, FAMILYIPV6, settings.verbosemode);
+        }
+
+        commit_transaction(db);
+        timings.dbopen = get_monotonic_ms() - dbstartms;
+        if (settings.showlastrun) {
+                char *lastrundt;
+                lastrundt = get_config_value_str(db, CONFIGNAMELASTRUNDT);
+                if (settings.verbosemode) {
+                        printf("Last run on: ");
+                }
+
+                printf("%s\n", lastrundt);
+                exit(EXIT_SUCCESS);
+        }
+
+        if (settings.cached && !settings.daemonmode && settings.numinterfaces == 0 &&
+            settings.proxylist == NULL && !settings.dualstack && answer_from_cache(db, settings)) {
+                if (settings.timings) {
+                        timings.total = get_monotonic_ms() - mainstartms;
+                        print_timings();
+                }
+
+                db_close(db);
+                return EXIT_SUCCESS;
+        }
+
+        // Runs that overlap wait for the run that is checking and reuse its result.
+        int lockfd = -1;
+        if (!settings.daemonmode) {
+                time_t lockstart = time(NULL);
+                bool contended;
+                double lockstartms = get_monotonic_ms();
+                lockfd = lock_check(!settings.nowait, &contended);
+                timings.lockwait = get_monotonic_ms() - lockstartms;
+                if (contended) {
+                        if (settings.verbosemode) {
+                                printf("An other run was checking, waited %.1f ms.\n", timings.lockwait);
+                        }
+
+                        // With --nowait the last confirmed ip address of any age is used.
+                        settings.maxage = INT_MAX;
+                        if (lockfd >= 0) {
+                                // Only a confirmation by the other run is reused.
+                                settings.maxage = (int)(time(NULL) - lockstart);
+                                db_close(db);
+                                db = db_open(DATABASEFILENAME, settings.statefile ? STATEFILENAME : NULL);
+                                if (db == NULL) {
+                                        print_dt_error("Can't open database file.\n");
+                                        exit(EXIT_FAILURE);
+                                }
+                        }
+
+                        bool answered = answer_from_cache(db, settings);
+                        if (answered || lockfd < 0) {
+                                if (settings.timings) {
+                                        timings.total = get_monotonic_ms() - mainstartms;
+                                        print_timings();
+                                }
+
+                                unlock_check(lockfd);
+                                db_close(db);
+                                return answered ? EXIT_SUCCESS : EXIT_FAILURE;
+                        }
+                }
+        }
+
+        double curlinitstartms = get_monotonic_ms();
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+        timings.curlinit = get_monotonic_ms() - curlinitstartms;
+        if (settings.earlydata && !lookup_enable_earlydata() && !settings.silentmode) {
+                print_dt_error("Warning: libcurl has no support for TLS early data.\n");
+        }
+
+        // Only used for the jitter of the interval and to spread the lookups through proxies.
+        srand((uint)time(NULL) ^ (uint)getpid());
+        if (settings.shm && !publish_shm_open() && !settings.silentmode) {
+                print_dt_error("Warning: could not open " SHMFILENAME ".\n");
+        }
+
+        if (!settings.daemonmode) {
+                if (settings.socketpath != NULL && !settings.silentmode) {
+                        print_dt_error("Warning: --socket is only used in daemon mode.\n");
+                }
+
+                begin_transaction(db);
+                if (settings.warmstartttl > 0) {
+                        lookup_share_init();
+                        load_warmstart(db, settings.verbosemode);
+                }
+
+                int checkstatus;
+                if (settings.proxylist != NULL) {
+                        checkstatus = run_check_proxies(db, settings);
+                } else if (settings.numinterfaces > 0 || settings.dualstack) {
+                        // The checks of the uplinks write to the database themselves.
+                        commit_transaction(db);
+                        checkstatus = run_check_uplinks(&db, settings);
+                } else {
+                        checkstatus = run_check(db, settings);
+                        if (settings.warmstartttl > 0) {
+                                save_warmstart_tls_sessions(db);
+                        }
+                }
+
+                if (settings.warmstartttl > 0) {
+                        lookup_share_cleanup();
+                }
+
+                double dbwritestartms = get_monotonic_ms();
+                commit_transaction(db);
+                timings.dbwrite = get_monotonic_ms() - dbwritestartms;
+                if (!deliver_changes(db, settings)) {
+                        checkstatus = EXIT_FAILURE;
+                }
+
+                if (settings.shm) {
+                        publish_last_run(db);
+                        publish_shm_close();
+                }
+
+                unlock_check(lockfd);
+                // The posthooks ran while the rest of the run finished, now collect how they ended.
+                double posthookstartms = get_monotonic_ms();
+                posthook_wait_all(settings.silentmode);
+                timings.posthook += get_monotonic_ms() - posthookstartms;
+                if (settings.timings) {
+                        timings.total = get_monotonic_ms() - mainstartms;
+                        print_timings();
+                }
+
+                db_close(db);
+                curl_global_cleanup();
+                return checkstatus;
+        }
+
+        struct sigaction stopaction;
+        memset(&stopaction, 0, sizeof(stopaction));
+        stopaction.sa_handler = handle_stop_signal;
+        sigemptyset(&stopaction.sa_mask);
+        sigaction(SIGTERM, &stopaction, NULL);
+        sigaction(SIGINT, &stopaction, NULL);
+        lookup_share_init();
+        int netlinkfd = -1;
+        if (settings.netlink) {
+                netlinkfd = netwatch_open();
+                if (netlinkfd < 0 && !settings.silentmode) {
+                        print_dt_error("Warning: could not subscribe to netlink, only checking on interval.\n");
+                }
+        }
+
+        int socketfd = -1;
+        if (settings.socketpath != NULL) {
+                socketfd = publish_socket_open(settings.socketpath);
+                if (socketfd < 0 && !settings.silentmode) {
+                        print_dt_error("Warning: could not listen on the query socket.\n");
+                }
+        }
+
+        // Answer with the ip address of the last run until the first check is done.
+        publish_last_run(db);
+        if (settings.verbosemode) {
+                printf("Running as daemon, checking every %d seconds.\n", settings.interval);
+        }
+
+        while (!stoprequested) {
+                double checkstartms = get_monotonic_ms();
+                bool contended;
+                lockfd = lock_check(true, &contended);
+                timings.lockwait = get_monotonic_ms() - checkstartms;
+                if ((settings.numinterfaces > 0 || settings.dualstack) && settings.proxylist == NULL) {
+                        run_check_uplinks(&db, settings);
+                } else {
+                        begin_transaction(db);
+                        if (settings.proxylist != NULL) {
+                                run_check_proxies(db, settings);
+                        } else {
+                                run_check(db, settings);
+                        }
+
+                        double dbwritestartms = get_monotonic_ms();
+                        commit_transaction(db);
+                        timings.dbwrite = get_monotonic_ms() - dbwritestartms;
+                }
+
+                deliver_changes(db, settings);
+                unlock_check(lockfd);
+                publish_last_run(db);
+                double posthookstartms = get_monotonic_ms();
+                posthook_wait_all(settings.silentmode);
+                timings.posthook += get_monotonic_ms() - posthookstartms;
+                if (settings.timings) {
+                        timings.total = get_monotonic_ms() - checkstartms;
+                        print_timings();
+                }
+
+                // Opening the database and initializing curl is only done once.
+                memset(&timings, 0, sizeof(timings));
+                fflush(stdout);
+                if (sleep_interval_jittered(settings.interval, netlinkfd, socketfd)) {
+                        if (settings.verbosemode) {
+                                printf("Network change detected, checking now.\n");
+                        }
+
+                        // Connections and DNS results from before the change can be stale.
+                        lookup_share_cleanup();
+                        lookup_share_init();
+                }
+        }
+
+        netwatch_close(netlinkfd);
+        publish_socket_close(socketfd, settings.socketpath);
+        publish_shm_close();
+
+        if (settings.verbosemode) {
+                printf("Stopping daemon.\n");
+        }
+
+        lookup_share_cleanup();
+        db_close(db);
+        curl_global_cleanup();
+        return EXIT_SUCCESS;
+}
+
+
@@ -0,0 +1,122 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include "netwatch.h"
+
+#define NETLINKBUFSIZE 8192
+
+/**
+ * Subscribe to the rtnetlink changes of IPv4 addresses, IPv4 routes and interfaces.
+ * A PPP reconnect or a new DHCP lease shows up as one or more of these.
+ * @return The non-blocking netlink socket, or -1 on error.
+ */
+int netwatch_open(void)
+{
+        int netlinkfd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+        if (netlinkfd < 0) {
+                return -1;
+        }
+
+        struct sockaddr_nl addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.nl_family = AF_NETLINK;
+        addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE;
+        if (bind(netlinkfd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+                close(netlinkfd);
+                return -1;
+        }
+
+        return netlinkfd;
+}
+
+/**
+ * Check if a netlink message is a change that can change the public ip address: an address
+ * on an interface other than loopback, the default route, or an interface going up or down.
+ */
+static bool is_relevant_change(const struct nlmsghdr *msg)
+{
+        switch (msg->nlmsg_type) {
+        case RTM_NEWADDR:
+        case RTM_DELADDR: {
+                const struct ifaddrmsg *ifa = NLMSG_DATA(msg);
+                return ifa->ifa_scope == RT_SCOPE_UNIVERSE;
+        }
+        case RTM_NEWROUTE:
+        case RTM_DELROUTE: {
+                const struct rtmsg *rtm = NLMSG_DATA(msg);
+                return rtm->rtm_dst_len == 0 && rtm->rtm_table == RT_TABLE_MAIN;
+        }
+        case RTM_NEWLINK:
+        case RTM_DELLINK: {
+                const struct ifinfomsg *ifi = NLMSG_DATA(msg);
+                return (ifi->ifi_flags & IFF_LOOPBACK) == 0 && ifi->ifi_change != 0;
+        }
+        }
+
+        return false;
+}
+
+/**
+ * Read all pending netlink messages without blocking.
+ * @return true if one of them is a change that can change the public ip address.
+ */
+bool netwatch_read_changes(int netlinkfd)
+{
+        char buf[NETLINKBUFSIZE] __attribute__((aligned(__alignof__(struct nlmsghdr))));
+        bool changed = false;
+        while (true) {
+                ssize_t len = recv(netlinkfd, buf, sizeof(buf), 0);
+                if (len < 0) {
+                        // ENOBUFS means messages were lost, the change could have been in them.
+                        if (errno == ENOBUFS) {
+                                changed = true;
+                                continue;
+                        }
+
+                        break;
+                }
+
+                for (struct nlmsghdr *msg = (struct nlmsghdr *)buf; NLMSG_OK(msg, (size_t)len);
+                     msg = NLMSG_NEXT(msg, len)) {
+                        if (is_relevant_change(msg)) {
+                                changed = true;
+                        }
+                }
+        }
+
+        return changed;
+}
+
+/**
+ * Close the netlink socket.
+ */
+void netwatch_close(int netlinkfd)
+{
+        if (netlinkfd >= 0) {
+                close(netlinkfd);
+        }
+}
@@ -0,0 +1,250 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "posthook.h"
+
+#define MAXPOSTHOOKARGS   8
+#define KILLGRACEMS       1000
+/* How often to check for posthooks that exited, if no pidfd can be opened for them. */
+#define NOPIDFDPOLLMS     10
+
+extern char **environ;
+
+/* A posthook that has been started and not collected yet. */
+struct RunningPosthook {
+        const char *command;
+        pid_t pid;
+        int pidfd;
+        int timeoutseconds;
+        /* When to kill the posthook, 0 for no timeout. */
+        long deadlinems;
+        bool terminated;
+        /* Set to true if the posthook fails, or NULL. */
+        bool *failed;
+};
+
+static struct RunningPosthook running[MAXRUNNINGPOSTHOOKS];
+static int numrunning = 0;
+static int numfailed = 0;
+
+static long get_now_ms(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+/**
+ * Get a file descriptor that becomes readable when the process exits.
+ * @return The pidfd, or -1 if the kernel has no pidfd support.
+ */
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+        return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+        (void)pid;
+        return -1;
+#endif
+}
+
+/**
+ * Check if a posthook exited and report how. A posthook that is past its deadline is sent
+ * SIGTERM, and SIGKILL if it is still running KILLGRACEMS later. The whole process group
+ * is signalled, so programs started by the posthook stop too.
+ * @return true if the posthook exited and is collected.
+ */
+static bool collect_posthook(struct RunningPosthook *hook, long nowms, bool silentmode)
+{
+        int status;
+        pid_t retpid = waitpid(hook->pid, &status, WNOHANG);
+        if (retpid == 0) {
+                if (hook->deadlinems > 0 && nowms >= hook->deadlinems) {
+                        kill(-hook->pid, hook->terminated ? SIGKILL : SIGTERM);
+                        if (!hook->terminated && !silentmode) {
+                                fprintf(stderr, "Posthook %s timed out after %d seconds, stopping it.\n",
+                                        hook->command, hook->timeoutseconds);
+                        }
+
+                        hook->terminated = true;
+                        hook->deadlinems = nowms + KILLGRACEMS;
+                }
+
+                return false;
+        } else if (retpid < 0 && errno == EINTR) {
+                return false;
+        }
+
+        if (retpid < 0 || hook->terminated || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                ++numfailed;
+                if (hook->failed != NULL) {
+                        *hook->failed = true;
+                }
+
+                if (retpid > 0 && !hook->terminated && !silentmode) {
+                        if (WIFEXITED(status)) {
+                                fprintf(stderr, "Posthook %s returned error (exitcode %d).\n",
+                                        hook->command, WEXITSTATUS(status));
+                        } else if (WIFSIGNALED(status)) {
+                                fprintf(stderr, "Posthook %s was killed by signal %d.\n",
+                                        hook->command, WTERMSIG(status));
+                        }
+                }
+        }
+
+        if (hook->pidfd >= 0) {
+                close(hook->pidfd);
+        }
+
+        return true;
+}
+
+/**
+ * Collect the posthooks that exited and kill the ones past their timeout.
+ * @param waitms How long to wait for a posthook to exit, 0 to only collect the ones that
+ *               already exited.
+ */
+static void collect_posthooks(long waitms, bool silentmode)
+{
+        long nowms = get_now_ms();
+        struct pollfd pollfds[MAXRUNNINGPOSTHOOKS];
+        int numpollfds = 0;
+        for (int i = 0; i < numrunning; ++i) {
+                if (running[i].deadlinems > 0 && running[i].deadlinems - nowms < waitms) {
+                        waitms = running[i].deadlinems > nowms ? running[i].deadlinems - nowms : 0;
+                }
+
+                if (running[i].pidfd >= 0) {
+                        pollfds[numpollfds].fd = running[i].pidfd;
+                        pollfds[numpollfds].events = POLLIN;
+                        ++numpollfds;
+                } else if (waitms > NOPIDFDPOLLMS) {
+                        waitms = NOPIDFDPOLLMS;
+                }
+        }
+
+        if (waitms > 0) {
+                poll(pollfds, numpollfds, (int)waitms);
+                nowms = get_now_ms();
+        }
+
+        int i = 0;
+        while (i < numrunning) {
+                if (collect_posthook(&running[i], nowms, silentmode)) {
+                        running[i] = running[--numrunning];
+                } else {
+                        ++i;
+                }
+        }
+}
+
+/**
+ * Start a posthook without a shell, in its own process group, and do not wait for it. The
+ * posthook runs at the same time as the check and as the other posthooks, collect it with
+ * posthook_wait_all(). If MAXRUNNINGPOSTHOOKS posthooks are running, this first waits until
+ * one of them exits.
+ * @param command        The program to run, looked up in PATH if it has no slash.
+ * @param args           The arguments, a NULL argument is left out.
+ * @param numargs        The number of arguments, at most MAXPOSTHOOKARGS.
+ * @param timeoutseconds Stop the posthook if it runs longer, 0 to never stop it.
+ * @param failed         Set to true when the posthook fails, or NULL. It has to stay valid
+ *                       until the posthook is collected.
+ * @param silentmode     Do not print why a posthook failed.
+ * @return false if the posthook could not be started, it is then counted as failed.
+ */
+bool posthook_start(const char *command, const char *args[], int numargs, int timeoutseconds,
+                    bool *failed, bool silentmode)
+{
+        char *argv[MAXPOSTHOOKARGS + 2];
+        int argc = 0;
+        argv[argc++] = (char *)command;
+        for (int a = 0; a < numargs && a < MAXPOSTHOOKARGS; ++a) {
+                if (args[a] != NULL) {
+                        argv[argc++] = (char *)args[a];
+                }
+        }
+
+        argv[argc] = NULL;
+        while (numrunning >= MAXRUNNINGPOSTHOOKS) {
+                collect_posthooks(KILLGRACEMS, silentmode);
+        }
+
+        posix_spawnattr_t attr;
+        posix_spawnattr_init(&attr);
+        // A process group of its own, so a timeout stops everything the posthook started.
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+        posix_spawnattr_setpgroup(&attr, 0);
+        pid_t pid;
+        // Output written before the posthook starts must come before the output of the posthook.
+        fflush(stdout);
+        fflush(stderr);
+        int retcode = posix_spawnp(&pid, command, NULL, &attr, argv, environ);
+        posix_spawnattr_destroy(&attr);
+        if (retcode != 0) {
+                if (!silentmode) {
+                        fprintf(stderr, "Can't start posthook %s: %s.\n", command, strerror(retcode));
+                }
+
+                ++numfailed;
+                if (failed != NULL) {
+                        *failed = true;
+                }
+
+                return false;
+        }
+
+        struct RunningPosthook *hook = &running[numrunning++];
+        hook->command = command;
+        hook->pid = pid;
+        hook->pidfd = open_pidfd(pid);
+        hook->timeoutseconds = timeoutseconds;
+        hook->deadlinems = timeoutseconds > 0 ? get_now_ms() + timeoutseconds * 1000L : 0;
+        hook->terminated = false;
+        hook->failed = failed;
+        return true;
+}
+
+/**
+ * Wait until every started posthook has exited or has been stopped after its timeout.
+ * @param silentmode Do not print why a posthook failed.
+ * @return The number of posthooks that failed, timed out or could not be started since the
+ *         last call.
+ */
+int posthook_wait_all(bool silentmode)
+{
+        while (numrunning > 0) {
+                collect_posthooks(KILLGRACEMS, silentmode);
+        }
+
+        int failed = numfailed;
+        numfailed = 0;
+        return failed;
+}
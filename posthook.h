@@ -0,0 +1,30 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+#ifndef POSTHOOK_H
+#define POSTHOOK_H
+
+#include <stdbool.h>
+
+#define MAXRUNNINGPOSTHOOKS 64
+
+bool posthook_start(const char *command, const char *args[], int numargs, int timeoutseconds,
+                    bool *failed, bool silentmode);
+
+int posthook_wait_all(bool silentmode);
+
+#endif
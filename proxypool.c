@@ -0,0 +1,226 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "lookup.h"
+#include "proxypool.h"
+
+#define PROXYCONNECTTIMEOUTMS 10000
+#define PROXYTIMEOUTMS        20000
+
+/**
+ * Read the proxy list, one proxy url like http://host:port or socks5h://host:port per line.
+ * Empty lines and lines starting with # are skipped.
+ * @param path   The path of the proxy list.
+ * @param checks Set to an allocated array with a check for every proxy, free it with free().
+ * @return The number of proxies, or -1 if the list can't be read or has an invalid line.
+ */
+int proxypool_read(const char *path, struct ProxyCheck **checks)
+{
+        FILE *fp = fopen(path, "r");
+        if (fp == NULL) {
+                return -1;
+        }
+
+        int numchecks = 0;
+        *checks = calloc(MAXPROXIES, sizeof(struct ProxyCheck));
+        char line[MAXLENPROXY + 2];
+        while (*checks != NULL && fgets(line, sizeof(line), fp) != NULL) {
+                size_t len = strcspn(line, "\r\n");
+                if (line[len] == '\0' && !feof(fp)) {
+                        fprintf(stderr, "Proxy too long, maximum %d characters allowed.\n", MAXLENPROXY);
+                        numchecks = -1;
+                        break;
+                }
+
+                line[len] = '\0';
+                while (len > 0 && isspace((unsigned char)line[len - 1])) {
+                        line[--len] = '\0';
+                }
+
+                char *proxy = line;
+                while (isspace((unsigned char)*proxy)) {
+                        ++proxy;
+                }
+
+                if (*proxy == '\0' || *proxy == '#') {
+                        continue;
+                }
+
+                // The proxy is passed on quoted to the posthook.
+                if (strchr(proxy, '"') != NULL || numchecks >= MAXPROXIES) {
+                        fprintf(stderr, "Invalid proxy or more than %d proxies: %s\n", MAXPROXIES, proxy);
+                        numchecks = -1;
+                        break;
+                }
+
+                strcpy((*checks)[numchecks].proxy, proxy);
+                ++numchecks;
+        }
+
+        fclose(fp);
+        if (*checks == NULL || numchecks < 0) {
+                free(*checks);
+                *checks = NULL;
+                return -1;
+        }
+
+        return numchecks;
+}
+
+/**
+ * Choose the ipservice used the least so far that the proxy has not asked yet, so the lookups
+ * of all proxies are spread evenly over the ipservices. Ties go to the first one from
+ * startindex, which differs per proxy.
+ * @return The index of the ipservice, or -1 if the proxy has asked all ipservices.
+ */
+static int choose_spread_ipservice(const struct ProxyCheck *check, const int urlnrs[], int numurls,
+                                   int usecounts[], int startindex)
+{
+        int chosen = -1;
+        for (int n = 0; n < numurls; ++n) {
+                int u = (startindex + n) % numurls;
+                bool asked = false;
+                for (int a = 0; a < check->numasked; ++a) {
+                        asked = asked || check->urlnrsasked[a] == urlnrs[u];
+                }
+
+                if (!asked && (chosen < 0 || usecounts[u] < usecounts[chosen])) {
+                        chosen = u;
+                }
+        }
+
+        if (chosen >= 0) {
+                ++usecounts[chosen];
+        }
+
+        return chosen;
+}
+
+/**
+ * Check if PROXYNUMAGREE answers of a proxy are the same ip address.
+ */
+static bool is_agreed(struct ProxyCheck *check)
+{
+        for (int i = 0; i < check->numanswers; ++i) {
+                int votes = 0;
+                for (int j = 0; j < check->numanswers; ++j) {
+                        votes += strcmp(check->answers[i], check->answers[j]) == 0;
+                }
+
+                if (votes >= PROXYNUMAGREE) {
+                        strcpy(check->ipaddr, check->answers[i]);
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+/**
+ * Find the egress ip address of every proxy. Every proxy first asks PROXYNUMAGREE different
+ * ipservices, all proxies at the same time over one curl multi handle. A proxy that got
+ * different answers, or one answer and a failure, asks one more ipservice in the next round,
+ * up to PROXYMAXLOOKUPS ipservices. A proxy without any answer is not asked again, it is
+ * most likely down.
+ * @param urlnrs     The numbers of the available http and https ipservices.
+ * @param urls       The urls of these ipservices.
+ * @param numurls    The number of ipservices, at least PROXYNUMAGREE.
+ * @param maxrunning The most number of lookups running at the same time.
+ * @return The number of proxies with an agreed egress ip address.
+ */
+int proxypool_check(struct ProxyCheck checks[], int numchecks, const int urlnrs[],
+                    const char *urls[], int numurls, int maxrunning, const char *useragent,
+                    bool unsafehttp, bool verbosemode)
+{
+        int usecounts[numurls];
+        memset(usecounts, 0, sizeof(usecounts));
+        int startoffset = rand();
+        struct Lookup *lookups = calloc((size_t)numchecks * PROXYNUMAGREE, sizeof(struct Lookup));
+        int *checknrs = calloc((size_t)numchecks * PROXYNUMAGREE, sizeof(int));
+        if (lookups == NULL || checknrs == NULL) {
+                free(lookups);
+                free(checknrs);
+                return 0;
+        }
+
+        int numagreed = 0;
+        for (int round = 0; PROXYNUMAGREE + round <= PROXYMAXLOOKUPS; ++round) {
+                int numlookups = 0;
+                for (int c = 0; c < numchecks; ++c) {
+                        struct ProxyCheck *check = &checks[c];
+                        if (check->ipaddr[0] != '\0' || (round > 0 && check->numanswers == 0)) {
+                                continue;
+                        }
+
+                        int numask = round == 0 ? PROXYNUMAGREE : 1;
+                        for (int k = 0; k < numask; ++k) {
+                                int u = choose_spread_ipservice(check, urlnrs, numurls, usecounts,
+                                                                (startoffset + c) % numurls);
+                                if (u < 0) {
+                                        break;
+                                }
+
+                                check->urlnrsasked[check->numasked++] = urlnrs[u];
+                                lookups[numlookups].urlnr = urlnrs[u];
+                                lookups[numlookups].url = urls[u];
+                                lookups[numlookups].proxy = check->proxy;
+                                lookups[numlookups].startdelayms = 0;
+                                lookups[numlookups].connecttimeoutms = PROXYCONNECTTIMEOUTMS;
+                                lookups[numlookups].timeoutms = PROXYTIMEOUTMS;
+                                checknrs[numlookups] = c;
+                                ++numlookups;
+                        }
+                }
+
+                if (numlookups == 0) {
+                        break;
+                }
+
+                if (verbosemode) {
+                        printf("Round %d: %d lookups through proxies, at most %d at the same time.\n",
+                               round + 1, numlookups, maxrunning);
+                }
+
+                lookup_batch(lookups, numlookups, maxrunning, useragent, unsafehttp);
+                for (int i = 0; i < numlookups; ++i) {
+                        struct ProxyCheck *check = &checks[checknrs[i]];
+                        if (lookups[i].state == LOOKUPVALID) {
+                                strcpy(check->answers[check->numanswers++], lookups[i].ipaddr);
+                        } else if (verbosemode) {
+                                printf("Proxy %s: %s failed (%s, http %ld).\n", check->proxy,
+                                       lookups[i].url, curl_easy_strerror(lookups[i].curlcode),
+                                       lookups[i].httpcode);
+                        }
+                }
+
+                for (int c = 0; c < numchecks; ++c) {
+                        if (checks[c].ipaddr[0] == '\0' && is_agreed(&checks[c])) {
+                                ++numagreed;
+                        }
+                }
+        }
+
+        free(lookups);
+        free(checknrs);
+        return numagreed;
+}
@@ -0,0 +1,46 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+#ifndef PROXYPOOL_H
+#define PROXYPOOL_H
+
+#include <stdbool.h>
+#include <arpa/inet.h>
+
+#define MAXPROXIES         4096
+#define MAXLENPROXY        255
+#define PROXYNUMAGREE      2
+#define PROXYMAXLOOKUPS    4
+
+/* The egress ip address check of one proxy from the proxy list. */
+struct ProxyCheck {
+        char proxy[MAXLENPROXY + 1];
+        /* The ip address PROXYNUMAGREE ipservices agreed on, empty if they did not agree. */
+        char ipaddr[INET_ADDRSTRLEN];
+        char answers[PROXYMAXLOOKUPS][INET_ADDRSTRLEN];
+        int numanswers;
+        int urlnrsasked[PROXYMAXLOOKUPS];
+        int numasked;
+};
+
+int proxypool_read(const char *path, struct ProxyCheck **checks);
+
+int proxypool_check(struct ProxyCheck checks[], int numchecks, const int urlnrs[],
+                    const char *urls[], int numurls, int maxrunning, const char *useragent,
+                    bool unsafehttp, bool verbosemode);
+
+#endif
@@ -0,0 +1,240 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "publish.h"
+
+#define SOCKETBACKLOG    16
+#define QUERYTIMEOUTMS   100
+/* The most time spent on answering clients per call, the rest are answered on the next call. */
+#define ANSWERTIMEOUTMS  500
+#define MAXLENQUERY      32
+#define MAXLENANSWER     128
+
+/* The last published address, answered on the socket. */
+static struct PublishedAddress current;
+static struct PublishedAddress *shm = NULL;
+
+/**
+ * Listen for queries on a Unix domain socket. A socket file left behind by an earlier run
+ * is replaced.
+ * @param path The path of the socket file.
+ * @return The non-blocking listening socket, or -1 on error.
+ */
+int publish_socket_open(const char *path)
+{
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+                return -1;
+        }
+
+        strcpy(addr.sun_path, path);
+        int socketfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (socketfd < 0) {
+                return -1;
+        }
+
+        struct stat st;
+        if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+                unlink(path);
+        }
+
+        if (bind(socketfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(socketfd, SOCKETBACKLOG) != 0) {
+                close(socketfd);
+                return -1;
+        }
+
+        return socketfd;
+}
+
+/**
+ * Get the answer to one query.
+ * @param query The query without line ending: ip, confirmed, changed or empty for all.
+ * @return The number of bytes in answer.
+ */
+static int answer_query(const char *query, char *answer)
+{
+        if (strcmp(query, "ip") == 0) {
+                return snprintf(answer, MAXLENANSWER, "%s\n", current.ipaddr);
+        } else if (strcmp(query, "confirmed") == 0) {
+                return snprintf(answer, MAXLENANSWER, "%lld\n", (long long)current.confirmedon);
+        } else if (strcmp(query, "changed") == 0) {
+                return snprintf(answer, MAXLENANSWER, "%lld\n", (long long)current.changedon);
+        } else if (query[0] == '\0' || strcmp(query, "all") == 0) {
+                return snprintf(answer, MAXLENANSWER, "ip=%s\nconfirmed=%lld\nchanged=%lld\n",
+                                current.ipaddr, (long long)current.confirmedon,
+                                (long long)current.changedon);
+        }
+
+        return snprintf(answer, MAXLENANSWER, "error unknown query\n");
+}
+
+/**
+ * Get the current time of the monotonic clock in milliseconds.
+ */
+static long get_now_ms(void)
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+/**
+ * Accept the waiting clients and answer their query. A client that sends no query within
+ * QUERYTIMEOUTMS in total, or closes its side right away, gets all values. Clients are only
+ * accepted for ANSWERTIMEOUTMS, so a client that keeps reconnecting can't stall the caller.
+ * @param socketfd The socket from publish_socket_open().
+ */
+void publish_socket_answer(int socketfd)
+{
+        long answerdeadlinems = get_now_ms() + ANSWERTIMEOUTMS;
+        int clientfd;
+        while (get_now_ms() < answerdeadlinems &&
+               (clientfd = accept4(socketfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                char query[MAXLENQUERY + 1];
+                size_t querylen = 0;
+                struct pollfd clientpoll;
+                clientpoll.fd = clientfd;
+                clientpoll.events = POLLIN;
+                long querydeadlinems = get_now_ms() + QUERYTIMEOUTMS;
+                long waitms;
+                while (querylen < MAXLENQUERY && memchr(query, '\n', querylen) == NULL &&
+                       (waitms = querydeadlinems - get_now_ms()) > 0 &&
+                       poll(&clientpoll, 1, (int)waitms) > 0) {
+                        ssize_t numread = read(clientfd, query + querylen, MAXLENQUERY - querylen);
+                        if (numread < 0 && (errno == EAGAIN || errno == EINTR)) {
+                                continue;
+                        }
+
+                        if (numread <= 0) {
+                                break;
+                        }
+
+                        querylen += numread;
+                }
+
+                query[querylen] = '\0';
+                query[strcspn(query, "\r\n")] = '\0';
+                char answer[MAXLENANSWER];
+                int answerlen = answer_query(query, answer);
+                if (answerlen > 0 && answerlen < MAXLENANSWER) {
+                        send(clientfd, answer, answerlen, MSG_NOSIGNAL | MSG_DONTWAIT);
+                }
+
+                close(clientfd);
+        }
+}
+
+/**
+ * Stop listening and remove the socket file.
+ */
+void publish_socket_close(int socketfd, const char *path)
+{
+        if (socketfd >= 0) {
+                close(socketfd);
+                unlink(path);
+        }
+}
+
+/**
+ * Map SHMFILENAME to publish the address in. An existing file keeps its sequence number,
+ * so readers that still have it mapped keep working.
+ * @return true if mapped.
+ */
+bool publish_shm_open(void)
+{
+        int shmfd = open(SHMFILENAME, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+        if (shmfd < 0) {
+                return false;
+        }
+
+        if (ftruncate(shmfd, sizeof(struct PublishedAddress)) != 0) {
+                close(shmfd);
+                return false;
+        }
+
+        void *map = mmap(NULL, sizeof(struct PublishedAddress), PROT_READ | PROT_WRITE, MAP_SHARED,
+                         shmfd, 0);
+        close(shmfd);
+        if (map == MAP_FAILED) {
+                return false;
+        }
+
+        shm = map;
+        if (shm->magic != PUBLISHMAGIC || shm->version != PUBLISHVERSION) {
+                memset(shm, 0, sizeof(*shm));
+                shm->magic = PUBLISHMAGIC;
+                shm->version = PUBLISHVERSION;
+        }
+
+        // A writer that stopped halfway left an odd sequence number.
+        shm->sequence += shm->sequence & 1;
+        return true;
+}
+
+/**
+ * Unmap SHMFILENAME. The file is kept, the confirmation time tells readers its age.
+ */
+void publish_shm_close(void)
+{
+        if (shm != NULL) {
+                munmap(shm, sizeof(struct PublishedAddress));
+                shm = NULL;
+        }
+}
+
+/**
+ * Publish the confirmed ip address on the socket and in the shared memory.
+ * @param ipaddr      The confirmed ip address, empty if not known yet.
+ * @param confirmedon The unix time the ip address was last confirmed.
+ * @param changedon   The unix time the ip address last changed.
+ */
+void publish_address(const char *ipaddr, long confirmedon, long changedon)
+{
+        memset(current.ipaddr, 0, sizeof(current.ipaddr));
+        strncpy(current.ipaddr, ipaddr, sizeof(current.ipaddr) - 1);
+        current.confirmedon = confirmedon;
+        current.changedon = changedon;
+        if (shm == NULL) {
+                return;
+        }
+
+        uint32_t sequence = shm->sequence;
+        __atomic_store_n(&shm->sequence, sequence + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        shm->confirmedon = current.confirmedon;
+        shm->changedon = current.changedon;
+        memcpy(shm->ipaddr, current.ipaddr, sizeof(shm->ipaddr));
+        __atomic_store_n(&shm->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
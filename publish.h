@@ -0,0 +1,58 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+#ifndef PUBLISH_H
+#define PUBLISH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#define SHMFILENAME    "/dev/shm/ipaddressexpress"
+#define PUBLISHMAGIC   0x50415049
+#define PUBLISHVERSION 1
+
+/*
+ * The layout of SHMFILENAME, for programs that map it read only. The writer makes sequence
+ * odd, writes the other fields and makes sequence even again. A reader loads sequence with
+ * acquire ordering, retries while it is odd, copies the fields, issues an acquire fence and
+ * loads sequence again. The copy is consistent if both loads are equal.
+ */
+struct PublishedAddress {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t sequence;
+        uint32_t reserved;
+        /* Unix times, 0 if not known yet. */
+        int64_t confirmedon;
+        int64_t changedon;
+        char ipaddr[INET6_ADDRSTRLEN];
+};
+
+int publish_socket_open(const char *path);
+
+void publish_socket_answer(int socketfd);
+
+void publish_socket_close(int socketfd, const char *path);
+
+bool publish_shm_open(void);
+
+void publish_shm_close(void);
+
+void publish_address(const char *ipaddr, long confirmedon, long changedon);
+
+#endif
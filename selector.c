@@ -0,0 +1,228 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <sqlite3.h>
+#include "db.h"
+#include "selector.h"
+
+#define UNKNOWNLATENCYMS    1000.0
+#define MAXSELECTORRETRIES  16
+
+static int numservices = 0;
+static int *urlnrs = NULL;
+static double *probabilities = NULL;
+static int *aliases = NULL;
+static bool *excluded = NULL;
+static uint64_t randomstate = 0;
+
+/**
+ * Get the next number of a xorshift64* random number generator,
+ * seeded once from getrandom().
+ */
+static uint64_t next_random(void)
+{
+        if (randomstate == 0) {
+                if (getrandom(&randomstate, sizeof(randomstate), 0) != sizeof(randomstate) ||
+                    randomstate == 0) {
+                        randomstate = ((uint64_t)time(NULL) << 32) ^ (uint64_t)getpid() ^
+                                      0x9E3779B97F4A7C15ULL;
+                }
+        }
+
+        randomstate ^= randomstate >> 12;
+        randomstate ^= randomstate << 25;
+        randomstate ^= randomstate >> 27;
+        return randomstate * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * Get the weight of an ipservice. Ipservices with a low priority number, a low latency,
+ * few failures and few disagreements with the other ipservices are chosen more often.
+ */
+static double get_weight_ipservice(const struct IpServiceScore *score)
+{
+        double weight = 1.0;
+        if (score->priority > 1) {
+                weight /= score->priority;
+        }
+
+        double latencyms = UNKNOWNLATENCYMS;
+        if (score->p95ms >= 0) {
+                latencyms = score->p95ms;
+        }
+
+        weight *= UNKNOWNLATENCYMS / (UNKNOWNLATENCYMS + latencyms);
+        // Success rate and agreement rate, with one success and one failure assumed up front
+        // so a new ipservice is not ruled out after a single bad answer.
+        double samples = score->samples;
+        weight *= (samples + 1.0) / (samples + score->failures + 2.0);
+        double agreement = (samples - score->disagreements + 1.0) / (samples + 2.0);
+        if (agreement < 0.01) {
+                agreement = 0.01;
+        }
+
+        // Lying weighs heavier than failing.
+        weight *= agreement * agreement;
+        return weight;
+}
+
+/**
+ * Build the alias table (Vose's method) to choose ipservices weighted in constant time.
+ * @param scores    The available ipservices with their measured statistics.
+ * @param numscores The number of available ipservices.
+ * @return false if there is no ipservice or there is not enough memory.
+ */
+bool selector_build(const struct IpServiceScore scores[], int numscores)
+{
+        selector_free();
+        if (numscores <= 0) {
+                return false;
+        }
+
+        urlnrs = malloc(numscores * sizeof(int));
+        probabilities = malloc(numscores * sizeof(double));
+        aliases = malloc(numscores * sizeof(int));
+        excluded = calloc(numscores, sizeof(bool));
+        int *small = malloc(numscores * sizeof(int));
+        int *large = malloc(numscores * sizeof(int));
+        if (urlnrs == NULL || probabilities == NULL || aliases == NULL || excluded == NULL ||
+            small == NULL || large == NULL) {
+                free(small);
+                free(large);
+                selector_free();
+                return false;
+        }
+
+        double totalweight = 0.0;
+        for (int i = 0; i < numscores; ++i) {
+                urlnrs[i] = scores[i].urlnr;
+                probabilities[i] = get_weight_ipservice(&scores[i]);
+                totalweight += probabilities[i];
+        }
+
+        int numsmall = 0;
+        int numlarge = 0;
+        for (int i = 0; i < numscores; ++i) {
+                // Scale so the average probability is 1.
+                probabilities[i] = probabilities[i] * numscores / totalweight;
+                aliases[i] = i;
+                if (probabilities[i] < 1.0) {
+                        small[numsmall++] = i;
+                } else {
+                        large[numlarge++] = i;
+                }
+        }
+
+        while (numsmall > 0 && numlarge > 0) {
+                int s = small[--numsmall];
+                int l = large[--numlarge];
+                aliases[s] = l;
+                probabilities[l] -= 1.0 - probabilities[s];
+                if (probabilities[l] < 1.0) {
+                        small[numsmall++] = l;
+                } else {
+                        large[numlarge++] = l;
+                }
+        }
+
+        // What is left over is 1 except for rounding errors.
+        while (numlarge > 0) {
+                probabilities[large[--numlarge]] = 1.0;
+        }
+
+        while (numsmall > 0) {
+                probabilities[small[--numsmall]] = 1.0;
+        }
+
+        free(small);
+        free(large);
+        numservices = numscores;
+        return true;
+}
+
+/**
+ * Get the number of ipservices in the selector.
+ */
+int selector_count(void)
+{
+        return numservices;
+}
+
+/**
+ * Choose a weighted random ipservice.
+ * @return The ipservice number, or -1 if there is no ipservice left to choose from.
+ */
+int selector_choose(void)
+{
+        if (numservices <= 0) {
+                return -1;
+        }
+
+        for (int tries = 0; tries < MAXSELECTORRETRIES; ++tries) {
+                uint64_t r = next_random();
+                int column = (int)((r >> 32) % (uint64_t)numservices);
+                double coin = (double)(r & 0xFFFFFFFFULL) / 4294967296.0;
+                int i = coin < probabilities[column] ? column : aliases[column];
+                if (!excluded[i]) {
+                        return urlnrs[i];
+                }
+        }
+
+        // Many ipservices are excluded, take the first one that is left.
+        for (int i = 0; i < numservices; ++i) {
+                if (!excluded[i]) {
+                        return urlnrs[i];
+                }
+        }
+
+        return -1;
+}
+
+/**
+ * Do not choose an ipservice again, for example because it has failed during this run.
+ */
+void selector_exclude(int urlnr)
+{
+        for (int i = 0; i < numservices; ++i) {
+                if (urlnrs[i] == urlnr) {
+                        excluded[i] = true;
+                }
+        }
+}
+
+/**
+ * Free the selector.
+ */
+void selector_free(void)
+{
+        free(urlnrs);
+        free(probabilities);
+        free(aliases);
+        free(excluded);
+        urlnrs = NULL;
+        probabilities = NULL;
+        aliases = NULL;
+        excluded = NULL;
+        numservices = 0;
+}
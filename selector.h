@@ -0,0 +1,35 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+#ifndef SELECTOR_H
+#define SELECTOR_H
+
+#include <stdbool.h>
+
+struct IpServiceScore;
+
+bool selector_build(const struct IpServiceScore scores[], int numscores);
+
+int selector_count(void);
+
+int selector_choose(void);
+
+void selector_exclude(int urlnr);
+
+void selector_free(void);
+
+#endif
@@ -0,0 +1,197 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+#define _GNU_SOURCE
+#include <string.h>
+#include "sha256.h"
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t roundconstants[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/**
+ * Mix one block of 64 bytes into the state (FIPS 180-4, 6.2.2).
+ */
+static void sha256_transform(struct Sha256 *ctx, const unsigned char *block)
+{
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+                w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+                       (uint32_t)block[i * 4 + 2] << 8 | (uint32_t)block[i * 4 + 3];
+        }
+
+        for (int i = 16; i < 64; ++i) {
+                uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = ctx->state[0];
+        uint32_t b = ctx->state[1];
+        uint32_t c = ctx->state[2];
+        uint32_t d = ctx->state[3];
+        uint32_t e = ctx->state[4];
+        uint32_t f = ctx->state[5];
+        uint32_t g = ctx->state[6];
+        uint32_t h = ctx->state[7];
+        for (int i = 0; i < 64; ++i) {
+                uint32_t s1 = ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25);
+                uint32_t ch = (e & f) ^ (~e & g);
+                uint32_t t1 = h + s1 + ch + roundconstants[i] + w[i];
+                uint32_t s0 = ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22);
+                uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+                uint32_t t2 = s0 + maj;
+                h = g;
+                g = f;
+                f = e;
+                e = d + t1;
+                d = c;
+                c = b;
+                b = a;
+                a = t1 + t2;
+        }
+
+        ctx->state[0] += a;
+        ctx->state[1] += b;
+        ctx->state[2] += c;
+        ctx->state[3] += d;
+        ctx->state[4] += e;
+        ctx->state[5] += f;
+        ctx->state[6] += g;
+        ctx->state[7] += h;
+}
+
+/**
+ * Start a SHA-256 hash.
+ */
+void sha256_init(struct Sha256 *ctx)
+{
+        static const uint32_t initialstate[8] = {
+                0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+        memcpy(ctx->state, initialstate, sizeof(initialstate));
+        ctx->length = 0;
+        ctx->blocklen = 0;
+}
+
+/**
+ * Add data to a SHA-256 hash.
+ */
+void sha256_update(struct Sha256 *ctx, const void *data, size_t len)
+{
+        const unsigned char *p = data;
+        ctx->length += len;
+        while (len > 0) {
+                size_t n = SHA256BLOCKSIZE - ctx->blocklen;
+                if (n > len) {
+                        n = len;
+                }
+
+                memcpy(ctx->block + ctx->blocklen, p, n);
+                ctx->blocklen += n;
+                p += n;
+                len -= n;
+                if (ctx->blocklen == SHA256BLOCKSIZE) {
+                        sha256_transform(ctx, ctx->block);
+                        ctx->blocklen = 0;
+                }
+        }
+}
+
+/**
+ * Pad the data and get the SHA-256 hash.
+ */
+void sha256_final(struct Sha256 *ctx, unsigned char digest[SHA256DIGESTSIZE])
+{
+        uint64_t bitlength = ctx->length * 8;
+        unsigned char padding[SHA256BLOCKSIZE + 8];
+        // A 1 bit, zeros until 8 bytes before the end of a block, then the length in bits.
+        size_t padlen = (ctx->blocklen < 56 ? 56 : 120) - ctx->blocklen;
+        memset(padding, 0, padlen);
+        padding[0] = 0x80;
+        for (int i = 0; i < 8; ++i) {
+                padding[padlen + i] = (unsigned char)(bitlength >> (56 - i * 8));
+        }
+
+        sha256_update(ctx, padding, padlen + 8);
+        for (int i = 0; i < 8; ++i) {
+                digest[i * 4] = (unsigned char)(ctx->state[i] >> 24);
+                digest[i * 4 + 1] = (unsigned char)(ctx->state[i] >> 16);
+                digest[i * 4 + 2] = (unsigned char)(ctx->state[i] >> 8);
+                digest[i * 4 + 3] = (unsigned char)ctx->state[i];
+        }
+}
+
+/**
+ * Start a HMAC-SHA256, a key longer than a block is hashed first.
+ */
+void hmac_sha256_init(struct HmacSha256 *ctx, const unsigned char *key, size_t keylen)
+{
+        unsigned char keyblock[SHA256BLOCKSIZE];
+        memset(keyblock, 0, sizeof(keyblock));
+        if (keylen > SHA256BLOCKSIZE) {
+                struct Sha256 keyhash;
+                sha256_init(&keyhash);
+                sha256_update(&keyhash, key, keylen);
+                sha256_final(&keyhash, keyblock);
+        } else {
+                memcpy(keyblock, key, keylen);
+        }
+
+        unsigned char pad[SHA256BLOCKSIZE];
+        for (int i = 0; i < SHA256BLOCKSIZE; ++i) {
+                pad[i] = keyblock[i] ^ 0x36;
+        }
+
+        sha256_init(&ctx->inner);
+        sha256_update(&ctx->inner, pad, sizeof(pad));
+        for (int i = 0; i < SHA256BLOCKSIZE; ++i) {
+                pad[i] = keyblock[i] ^ 0x5c;
+        }
+
+        sha256_init(&ctx->outer);
+        sha256_update(&ctx->outer, pad, sizeof(pad));
+}
+
+/**
+ * Add data to a HMAC-SHA256.
+ */
+void hmac_sha256_update(struct HmacSha256 *ctx, const void *data, size_t len)
+{
+        sha256_update(&ctx->inner, data, len);
+}
+
+/**
+ * Get the HMAC-SHA256 of all data added.
+ */
+void hmac_sha256_final(struct HmacSha256 *ctx, unsigned char mac[SHA256DIGESTSIZE])
+{
+        unsigned char innerdigest[SHA256DIGESTSIZE];
+        sha256_final(&ctx->inner, innerdigest);
+        sha256_update(&ctx->outer, innerdigest, sizeof(innerdigest));
+        sha256_final(&ctx->outer, mac);
+}
@@ -0,0 +1,52 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256DIGESTSIZE 32
+#define SHA256BLOCKSIZE  64
+
+struct Sha256 {
+        uint32_t state[8];
+        uint64_t length;
+        unsigned char block[SHA256BLOCKSIZE];
+        size_t blocklen;
+};
+
+/* HMAC-SHA256 (RFC 2104), for the TSIG signature of a DNS UPDATE. */
+struct HmacSha256 {
+        struct Sha256 inner;
+        struct Sha256 outer;
+};
+
+void sha256_init(struct Sha256 *ctx);
+
+void sha256_update(struct Sha256 *ctx, const void *data, size_t len);
+
+void sha256_final(struct Sha256 *ctx, unsigned char digest[SHA256DIGESTSIZE]);
+
+void hmac_sha256_init(struct HmacSha256 *ctx, const unsigned char *key, size_t keylen);
+
+void hmac_sha256_update(struct HmacSha256 *ctx, const void *data, size_t len);
+
+void hmac_sha256_final(struct HmacSha256 *ctx, unsigned char mac[SHA256DIGESTSIZE]);
+
+#endif
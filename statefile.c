@@ -0,0 +1,438 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "statefile.h"
+
+#define STATEMAGIC   0x45415049
+#define STATEVERSION 3
+
+/*
+ * The state file is this header followed by numservices StateService records, in the byte
+ * order of the machine. The checksum covers everything after the checksum itself.
+ */
+struct StateHeader {
+        uint32_t magic;
+        uint32_t checksum;
+        uint32_t version;
+        uint32_t numservices;
+        /* The modification time and size of the database the state file was built from. */
+        int64_t dbmtimens;
+        int64_t dbsize;
+        /* The same for the write-ahead log of the database, 0 if there was none. */
+        int64_t walmtimens;
+        int64_t walsize;
+        struct StateConfig configs[STATEMAXCONFIGS];
+        struct StateDnsCache dnscache[STATEMAXDNSCACHE];
+};
+
+/* A state file in memory, mapped from disk or built from the database. */
+struct StateFile {
+        char *path;
+        unsigned char *data;
+        size_t size;
+        bool mapped;
+        bool dirty;
+};
+
+/**
+ * Calculate the CRC-32 (IEEE 802.3) of a buffer.
+ */
+static uint32_t crc32(const unsigned char *buf, size_t len)
+{
+        uint32_t crc = 0xFFFFFFFF;
+        for (size_t i = 0; i < len; ++i) {
+                crc ^= buf[i];
+                for (int bit = 0; bit < 8; ++bit) {
+                        crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+                }
+        }
+
+        return ~crc;
+}
+
+static struct StateHeader * get_header(struct StateFile *state)
+{
+        return (struct StateHeader *)state->data;
+}
+
+static uint32_t calc_checksum(struct StateFile *state)
+{
+        size_t offset = offsetof(struct StateHeader, version);
+        return crc32(state->data + offset, state->size - offset);
+}
+
+static struct StateFile * alloc_statefile(const char *path)
+{
+        struct StateFile *state = calloc(1, sizeof(struct StateFile));
+        if (state == NULL) {
+                return NULL;
+        }
+
+        state->path = malloc(strlen(path) + 1);
+        if (state->path == NULL) {
+                free(state);
+                return NULL;
+        }
+
+        strcpy(state->path, path);
+        return state;
+}
+
+/**
+ * Map a state file into memory. Changes are only made in memory, copy on write,
+ * until statefile_save() replaces the file.
+ * @param path The path of the state file.
+ * @return The state file, or NULL if it does not exist or is damaged or from another version.
+ */
+struct StateFile * statefile_open(const char *path)
+{
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+                return NULL;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct StateHeader)) {
+                close(fd);
+                return NULL;
+        }
+
+        void *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+                return NULL;
+        }
+
+        struct StateFile *state = alloc_statefile(path);
+        if (state == NULL) {
+                munmap(data, st.st_size);
+                return NULL;
+        }
+
+        state->data = data;
+        state->size = st.st_size;
+        state->mapped = true;
+        struct StateHeader *header = get_header(state);
+        if (header->magic != STATEMAGIC || header->version != STATEVERSION ||
+            state->size != sizeof(struct StateHeader) +
+                           (size_t)header->numservices * sizeof(struct StateService) ||
+            header->checksum != calc_checksum(state)) {
+                statefile_close(state);
+                return NULL;
+        }
+
+        return state;
+}
+
+/**
+ * Create an empty state file in memory, it is written on statefile_save().
+ * @param path The path of the state file.
+ */
+struct StateFile * statefile_new(const char *path)
+{
+        struct StateFile *state = alloc_statefile(path);
+        if (state == NULL) {
+                return NULL;
+        }
+
+        state->data = calloc(1, sizeof(struct StateHeader));
+        if (state->data == NULL) {
+                statefile_close(state);
+                return NULL;
+        }
+
+        state->size = sizeof(struct StateHeader);
+        get_header(state)->magic = STATEMAGIC;
+        get_header(state)->version = STATEVERSION;
+        state->dirty = true;
+        return state;
+}
+
+/**
+ * Get the modification time in nanoseconds and the size of a file.
+ * @return false if the file does not exist.
+ */
+static bool get_file_version(const char *path, int64_t *mtimens, int64_t *size)
+{
+        struct stat st;
+        if (stat(path, &st) != 0) {
+                return false;
+        }
+
+        *mtimens = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        *size = st.st_size;
+        return true;
+}
+
+/**
+ * Get the modification time in nanoseconds and the size of the write-ahead log of the
+ * database. Changes are written to the log first and only later to the database file itself,
+ * so an edit can leave the database file as it was.
+ * @return false if the database has no write-ahead log, both are then 0.
+ */
+static bool get_wal_version(const char *dbpath, int64_t *mtimens, int64_t *size)
+{
+        char walpath[PATH_MAX];
+        *mtimens = 0;
+        *size = 0;
+        int cw = snprintf(walpath, sizeof(walpath), "%s-wal", dbpath);
+        return cw > 0 && cw < (int)sizeof(walpath) && get_file_version(walpath, mtimens, size);
+}
+
+/**
+ * Check if the state file was built from the database as it is now, so the ipservices
+ * have not been edited since.
+ * @param dbpath The path of the database file.
+ */
+bool statefile_is_built_from(struct StateFile *state, const char *dbpath)
+{
+        int64_t mtimens;
+        int64_t size;
+        int64_t walmtimens;
+        int64_t walsize;
+        get_wal_version(dbpath, &walmtimens, &walsize);
+        return get_file_version(dbpath, &mtimens, &size) &&
+               get_header(state)->dbmtimens == mtimens && get_header(state)->dbsize == size &&
+               get_header(state)->walmtimens == walmtimens && get_header(state)->walsize == walsize;
+}
+
+/**
+ * Remember the database as it is now as the database the state file was built from.
+ * @param dbpath The path of the database file.
+ */
+void statefile_set_built_from(struct StateFile *state, const char *dbpath)
+{
+        int64_t mtimens = 0;
+        int64_t size = 0;
+        get_file_version(dbpath, &mtimens, &size);
+        get_header(state)->dbmtimens = mtimens;
+        get_header(state)->dbsize = size;
+        get_wal_version(dbpath, &get_header(state)->walmtimens, &get_header(state)->walsize);
+        state->dirty = true;
+}
+
+/**
+ * Write the state file if it has changed. It is written to a temporary file first which
+ * then replaces the state file, so the state file is never left half written.
+ * @return false if the state file could not be written.
+ */
+bool statefile_save(struct StateFile *state)
+{
+        if (!state->dirty) {
+                return true;
+        }
+
+        char tmppath[strlen(state->path) + 5];
+        snprintf(tmppath, sizeof(tmppath), "%s.tmp", state->path);
+        get_header(state)->checksum = calc_checksum(state);
+        int fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0) {
+                return false;
+        }
+
+        size_t written = 0;
+        while (written < state->size) {
+                ssize_t n = write(fd, state->data + written, state->size - written);
+                if (n < 0) {
+                        break;
+                }
+
+                written += n;
+        }
+
+        bool saved = written == state->size && fsync(fd) == 0;
+        close(fd);
+        if (!saved || rename(tmppath, state->path) != 0) {
+                unlink(tmppath);
+                return false;
+        }
+
+        state->dirty = false;
+        return true;
+}
+
+/**
+ * Free a state file without saving it.
+ */
+void statefile_close(struct StateFile *state)
+{
+        if (state == NULL) {
+                return;
+        }
+
+        if (state->mapped) {
+                munmap(state->data, state->size);
+        } else {
+                free(state->data);
+        }
+
+        free(state->path);
+        free(state);
+}
+
+/**
+ * Mark the state file as changed, so statefile_save() writes it.
+ */
+void statefile_changed(struct StateFile *state)
+{
+        state->dirty = true;
+}
+
+int statefile_count_services(struct StateFile *state)
+{
+        return get_header(state)->numservices;
+}
+
+/**
+ * Get an ipservice by its position in the state file.
+ * @param index From 0 till statefile_count_services().
+ */
+struct StateService * statefile_get_service(struct StateFile *state, int index)
+{
+        return (struct StateService *)(state->data + sizeof(struct StateHeader)) + index;
+}
+
+/**
+ * Find an ipservice by its number.
+ * @return The ipservice, or NULL if there is no ipservice with that number.
+ */
+struct StateService * statefile_find_service(struct StateFile *state, int urlnr)
+{
+        for (int i = 0; i < statefile_count_services(state); ++i) {
+                struct StateService *service = statefile_get_service(state, i);
+                if (service->nr == urlnr) {
+                        return service;
+                }
+        }
+
+        return NULL;
+}
+
+/**
+ * Add an ipservice to the end of the state file.
+ * @return false if out of memory.
+ */
+bool statefile_add_service(struct StateFile *state, const struct StateService *service)
+{
+        size_t newsize = state->size + sizeof(struct StateService);
+        unsigned char *newdata;
+        if (state->mapped) {
+                newdata = malloc(newsize);
+                if (newdata != NULL) {
+                        memcpy(newdata, state->data, state->size);
+                        munmap(state->data, state->size);
+                        state->mapped = false;
+                }
+        } else {
+                newdata = realloc(state->data, newsize);
+        }
+
+        if (newdata == NULL) {
+                return false;
+        }
+
+        memcpy(newdata + state->size, service, sizeof(struct StateService));
+        state->data = newdata;
+        state->size = newsize;
+        get_header(state)->numservices++;
+        state->dirty = true;
+        return true;
+}
+
+/**
+ * Find a config value by its name.
+ * @param name The name of the config.
+ * @param add  Take a free config if the name does not exist yet.
+ * @return The config, or NULL if it does not exist or there is no free config left.
+ */
+struct StateConfig * statefile_find_config(struct StateFile *state, const char *name, bool add)
+{
+        struct StateConfig *configs = get_header(state)->configs;
+        struct StateConfig *unused = NULL;
+        for (int i = 0; i < STATEMAXCONFIGS; ++i) {
+                if (strcmp(configs[i].name, name) == 0 && configs[i].name[0] != '\0') {
+                        return &configs[i];
+                } else if (configs[i].name[0] == '\0' && unused == NULL) {
+                        unused = &configs[i];
+                }
+        }
+
+        if (!add || unused == NULL || strlen(name) > STATEMAXLENCONFIGNAME) {
+                return NULL;
+        }
+
+        memset(unused, 0, sizeof(struct StateConfig));
+        strcpy(unused->name, name);
+        state->dirty = true;
+        return unused;
+}
+
+/**
+ * Get the STATEMAXDNSCACHE saved addresses.
+ */
+struct StateDnsCache * statefile_dnscache(struct StateFile *state)
+{
+        return get_header(state)->dnscache;
+}
+
+/**
+ * Take over everything that changes while running from an older state file: the config
+ * values, the saved addresses, the latency statistics of the same ipservices, and their
+ * circuit breaker if it was not changed in the database in the meantime.
+ * @param from The older state file.
+ */
+void statefile_copy_runtime(struct StateFile *state, struct StateFile *from)
+{
+        memcpy(get_header(state)->configs, get_header(from)->configs,
+               sizeof(get_header(state)->configs));
+        memcpy(get_header(state)->dnscache, get_header(from)->dnscache,
+               sizeof(get_header(state)->dnscache));
+        for (int i = 0; i < statefile_count_services(state); ++i) {
+                struct StateService *service = statefile_get_service(state, i);
+                struct StateService *old = statefile_find_service(from, service->nr);
+                if (old == NULL || strcmp(old->url, service->url) != 0) {
+                        continue;
+                }
+
+                service->samples = old->samples;
+                service->srttms = old->srttms;
+                service->rttvarms = old->rttvarms;
+                service->connectsrttms = old->connectsrttms;
+                service->connectrttvarms = old->connectrttvarms;
+                service->failures = old->failures;
+                service->disagreements = old->disagreements;
+                if (service->dbdisabled == old->dbdisabled) {
+                        service->disabled = old->disabled;
+                        service->consecutivefailures = old->consecutivefailures;
+                        service->lasterroron = old->lasterroron;
+                        service->retryafter = old->retryafter;
+                }
+        }
+
+        state->dirty = true;
+}
@@ -0,0 +1,100 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+#ifndef STATEFILE_H
+#define STATEFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define STATEMAXLENURL        255
+#define STATEMAXCONFIGS       16
+#define STATEMAXLENCONFIGNAME 31
+#define STATEMAXLENCONFIGSTR  255
+#define STATEMAXDNSCACHE      32
+#define STATEMAXLENHOST       255
+
+/* An ipservice with its circuit breaker and latency statistics. */
+struct StateService {
+        int32_t nr;
+        int32_t disabled;
+        /* The disabled value in the database when the state file was built. */
+        int32_t dbdisabled;
+        int32_t protocoltype;
+        int32_t priority;
+        /* FAMILYIPV4 and/or FAMILYIPV6. */
+        int32_t families;
+        int32_t consecutivefailures;
+        int64_t lasterroron;
+        /* 0 if not set. */
+        int64_t retryafter;
+        int32_t samples;
+        int32_t srttms;
+        int32_t rttvarms;
+        int32_t connectsrttms;
+        int32_t connectrttvarms;
+        int32_t failures;
+        int32_t disagreements;
+        char url[STATEMAXLENURL + 1];
+};
+
+/* A config value, unused if the name is empty. */
+struct StateConfig {
+        char name[STATEMAXLENCONFIGNAME + 1];
+        int32_t valueint;
+        char valuestr[STATEMAXLENCONFIGSTR + 1];
+};
+
+/* A saved address of an ipservice host, unused if the host is empty. */
+struct StateDnsCache {
+        char host[STATEMAXLENHOST + 1];
+        int32_t port;
+        char address[46];
+        int64_t expireson;
+};
+
+struct StateFile;
+
+struct StateFile * statefile_open(const char *path);
+
+struct StateFile * statefile_new(const char *path);
+
+bool statefile_is_built_from(struct StateFile *state, const char *dbpath);
+
+void statefile_set_built_from(struct StateFile *state, const char *dbpath);
+
+bool statefile_save(struct StateFile *state);
+
+void statefile_close(struct StateFile *state);
+
+void statefile_changed(struct StateFile *state);
+
+int statefile_count_services(struct StateFile *state);
+
+struct StateService * statefile_get_service(struct StateFile *state, int index);
+
+struct StateService * statefile_find_service(struct StateFile *state, int urlnr);
+
+bool statefile_add_service(struct StateFile *state, const struct StateService *service);
+
+struct StateConfig * statefile_find_config(struct StateFile *state, const char *name, bool add);
+
+struct StateDnsCache * statefile_dnscache(struct StateFile *state);
+
+void statefile_copy_runtime(struct StateFile *state, struct StateFile *from);
+
+#endif
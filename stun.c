@@ -0,0 +1,175 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "udp.h"
+#include "stun.h"
+
+#define STUNPORT                 3478
+#define STUNHEADERSIZE           20
+#define STUNMAGICCOOKIE          0x2112A442UL
+#define STUNBINDINGREQUEST       0x0001
+#define STUNBINDINGSUCCESS       0x0101
+#define STUNBINDINGERROR         0x0111
+#define STUNATTRMAPPEDADDR       0x0001
+#define STUNATTRXORMAPPEDADDR    0x0020
+#define STUNFAMILYIPV4           0x01
+#define MAXLENSTUNHOST           255
+
+/**
+ * Check if the url of an ipservice is a STUN url.
+ */
+bool is_stun_url(const char *url)
+{
+        return strncmp(url, "stun://", 7) == 0;
+}
+
+/**
+ * Parse a STUN url of an ipservice and prepare a binding request (RFC 5389).
+ * The format is stun://server[:port], the server is resolved to an IPv4 address.
+ * @return false if the url is not a valid STUN url or the server cannot be resolved.
+ */
+bool stun_parse_url(const char *url, struct UdpQuery *query)
+{
+        char host[MAXLENSTUNHOST + 1];
+        udp_init_query(query);
+        if (!is_stun_url(url)) {
+                return false;
+        }
+
+        const char *hostpart = url + 7;
+        size_t hostlen = strcspn(hostpart, ":/");
+        if (hostlen == 0 || hostlen > MAXLENSTUNHOST) {
+                return false;
+        }
+
+        memcpy(host, hostpart, hostlen);
+        host[hostlen] = '\0';
+        long port = STUNPORT;
+        if (hostpart[hostlen] == ':') {
+                char *portend;
+                port = strtol(hostpart + hostlen + 1, &portend, 10);
+                if ((*portend != '\0' && *portend != '/') || port <= 0 || port > 65535) {
+                        return false;
+                }
+        }
+
+        query->server.sin_family = AF_INET;
+        query->server.sin_port = htons((uint16_t)port);
+        if (inet_pton(AF_INET, host, &query->server.sin_addr) != 1) {
+                struct addrinfo hints;
+                struct addrinfo *result = NULL;
+                memset(&hints, 0, sizeof(hints));
+                hints.ai_family = AF_INET;
+                hints.ai_socktype = SOCK_DGRAM;
+                if (getaddrinfo(host, NULL, &hints, &result) != 0 || result == NULL) {
+                        return false;
+                }
+
+                query->server.sin_addr = ((struct sockaddr_in *)result->ai_addr)->sin_addr;
+                freeaddrinfo(result);
+        }
+
+        unsigned char *p = query->querymsg;
+        memset(p, 0, STUNHEADERSIZE);
+        p[0] = STUNBINDINGREQUEST >> 8;
+        p[1] = STUNBINDINGREQUEST & 0xFF;
+        // No attributes, so the message length stays 0.
+        p[4] = (STUNMAGICCOOKIE >> 24) & 0xFF;
+        p[5] = (STUNMAGICCOOKIE >> 16) & 0xFF;
+        p[6] = (STUNMAGICCOOKIE >> 8) & 0xFF;
+        p[7] = STUNMAGICCOOKIE & 0xFF;
+        if (getrandom(p + 8, 12, 0) != 12) {
+                for (int i = 8; i < STUNHEADERSIZE; ++i) {
+                        p[i] = (unsigned char)rand();
+                }
+        }
+
+        query->querylen = STUNHEADERSIZE;
+        return true;
+}
+
+/**
+ * Parse a STUN binding response to the query and copy the mapped IPv4 address to answer.
+ * XOR-MAPPED-ADDRESS is preferred, MAPPED-ADDRESS is used for servers of the older RFC 3489.
+ * @return UDPANSWER, UDPNOANSWERYET if the reply is not for this query, or a UDPERROR code.
+ */
+int stun_parse_reply(const struct UdpQuery *query, const unsigned char *msg, size_t msglen,
+                     char *answer, size_t answersize)
+{
+        // The magic cookie and transaction id have to be the ones of the request.
+        if (msglen < STUNHEADERSIZE || memcmp(msg + 4, query->querymsg + 4, 16) != 0) {
+                return UDPNOANSWERYET;
+        }
+
+        unsigned int type = (msg[0] << 8) | msg[1];
+        size_t length = (msg[2] << 8) | msg[3];
+        if (type == STUNBINDINGERROR) {
+                return UDPERRORREFUSED;
+        } else if (type != STUNBINDINGSUCCESS) {
+                return UDPNOANSWERYET;
+        } else if (STUNHEADERSIZE + length > msglen) {
+                return UDPERRORRESPONSE;
+        }
+
+        bool found = false;
+        answer[0] = '\0';
+        size_t pos = STUNHEADERSIZE;
+        while (pos + 4 <= STUNHEADERSIZE + length) {
+                unsigned int attrtype = (msg[pos] << 8) | msg[pos + 1];
+                size_t attrlength = (msg[pos + 2] << 8) | msg[pos + 3];
+                const unsigned char *value = msg + pos + 4;
+                // Attributes are padded to a multiple of 4 bytes.
+                pos += 4 + ((attrlength + 3) & ~(size_t)3);
+                if (pos > STUNHEADERSIZE + length) {
+                        return UDPERRORRESPONSE;
+                }
+
+                if ((attrtype != STUNATTRXORMAPPEDADDR && (attrtype != STUNATTRMAPPEDADDR || found)) ||
+                    attrlength < 8 || value[1] != STUNFAMILYIPV4) {
+                        continue;
+                }
+
+                unsigned char addr[4];
+                memcpy(addr, value + 4, 4);
+                if (attrtype == STUNATTRXORMAPPEDADDR) {
+                        for (int i = 0; i < 4; ++i) {
+                                addr[i] ^= msg[4 + i];
+                        }
+                }
+
+                if (inet_ntop(AF_INET, addr, answer, answersize) == NULL) {
+                        return UDPERRORRESPONSE;
+                }
+
+                found = true;
+                if (attrtype == STUNATTRXORMAPPEDADDR) {
+                        break;
+                }
+        }
+
+        return UDPANSWER;
+}
@@ -0,0 +1,32 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+#ifndef STUN_H
+#define STUN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "udp.h"
+
+bool is_stun_url(const char *url);
+
+bool stun_parse_url(const char *url, struct UdpQuery *query);
+
+int stun_parse_reply(const struct UdpQuery *query, const unsigned char *msg, size_t msglen,
+                     char *answer, size_t answersize);
+
+#endif
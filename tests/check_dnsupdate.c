@@ -0,0 +1,297 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+/*
+ * Checks HMAC-SHA256 against the vectors of RFC 4231 and the TSIG signing of DNS UPDATE
+ * messages and the checking of their replies (RFC 8945). The source is included to reach the
+ * static functions of dnsupdate.c.
+ */
+#include "../dnsupdate.c"
+
+static int numchecks = 0;
+static int numfailed = 0;
+
+/**
+ * Count a check and print it when it failed.
+ */
+static void check(bool passed, const char *name)
+{
+        ++numchecks;
+        if (!passed) {
+                ++numfailed;
+                printf("FAILED: %s\n", name);
+        }
+}
+
+/**
+ * Convert a hexadecimal string to bytes.
+ * @return The number of bytes.
+ */
+static size_t from_hex(const char *hex, unsigned char *out)
+{
+        size_t len = strlen(hex) / 2;
+        for (size_t i = 0; i < len; ++i) {
+                unsigned int byte;
+                sscanf(hex + 2 * i, "%2x", &byte);
+                out[i] = (unsigned char)byte;
+        }
+
+        return len;
+}
+
+/**
+ * Check the HMAC-SHA256 test cases 1 to 7 of RFC 4231. Test case 5 is truncated to 128 bits.
+ */
+static void check_hmac_sha256(void)
+{
+        unsigned char key[131];
+        unsigned char data[152];
+        unsigned char expected[SHA256DIGESTSIZE];
+        unsigned char mac[SHA256DIGESTSIZE];
+        struct {
+                const char *name;
+                unsigned char keybyte;
+                size_t keylen;
+                const char *data;
+                unsigned char databyte;
+                size_t datalen;
+                const char *mac;
+        } cases[] = {
+                { "RFC 4231 test case 1", 0x0b, 20, "Hi There", 0, 0,
+                  "b0344c61d8db38535ca8afceaf0bf12b881dc200c9833da726e9376c2e32cff7" },
+                { "RFC 4231 test case 2", 0, 0, "what do ya want for nothing?", 0, 0,
+                  "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec3843" },
+                { "RFC 4231 test case 3", 0xaa, 20, NULL, 0xdd, 50,
+                  "773ea91e36800e46854db8ebd09181a72959098b3ef8c122d9635514ced565fe" },
+                { "RFC 4231 test case 4", 0, 25, NULL, 0xcd, 50,
+                  "82558a389a443c0ea4cc819899f2083a85f0faa3e578f8077a2e3ff46729665b" },
+                { "RFC 4231 test case 5", 0x0c, 20, "Test With Truncation", 0, 0,
+                  "a3b6167473100ee06e0c796c2955552b" },
+                { "RFC 4231 test case 6", 0xaa, 131,
+                  "Test Using Larger Than Block-Size Key - Hash Key First", 0, 0,
+                  "60e431591ee0b67f0d8a26aacbf5b77f8e0bc6213728c5140546040f0ee37f54" },
+                { "RFC 4231 test case 7", 0xaa, 131,
+                  "This is a test using a larger than block-size key and a larger than block-size "
+                  "data. The key needs to be hashed before being used by the HMAC algorithm.", 0, 0,
+                  "9b09ffa71b942fcb27635fbcd5b0e944bfdc63644f0713938a7f51535c3a35e2" }
+        };
+        for (int i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); ++i) {
+                size_t keylen = cases[i].keylen;
+                if (i == 1) {
+                        keylen = 4;
+                        memcpy(key, "Jefe", keylen);
+                } else if (i == 3) {
+                        // 0x01 up to 0x19.
+                        for (size_t k = 0; k < keylen; ++k) {
+                                key[k] = (unsigned char)(k + 1);
+                        }
+                } else {
+                        memset(key, cases[i].keybyte, keylen);
+                }
+
+                size_t datalen = cases[i].datalen;
+                if (cases[i].data != NULL) {
+                        datalen = strlen(cases[i].data);
+                        memcpy(data, cases[i].data, datalen);
+                } else {
+                        memset(data, cases[i].databyte, datalen);
+                }
+
+                size_t maclen = from_hex(cases[i].mac, expected);
+                struct HmacSha256 hmac;
+                hmac_sha256_init(&hmac, key, keylen);
+                // Split the data to check that it can be added in parts.
+                hmac_sha256_update(&hmac, data, datalen / 3);
+                hmac_sha256_update(&hmac, data + datalen / 3, datalen - datalen / 3);
+                hmac_sha256_final(&hmac, mac);
+                check(memcmp(mac, expected, maclen) == 0, cases[i].name);
+        }
+}
+
+/**
+ * Build a reply to an UPDATE as a server does, with a TSIG record signed with secret.
+ * @param secret    The key to sign with, NULL to add a TSIG record with an empty MAC.
+ * @param tsigerror The TSIG error of the TSIG record.
+ * @return The length of the reply.
+ */
+static size_t build_reply(const struct ZoneUpdate *update, int rcode, const unsigned char *secret,
+                          size_t secretlen, uint16_t tsigerror, unsigned char *reply)
+{
+        size_t pos = DNSHEADERSIZE;
+        dns_skip_name(update->msg, update->msglen, &pos);
+        pos += 4;
+        memcpy(reply, update->msg, pos);
+        write_uint16(reply + 2, (uint16_t)(DNSFLAGQR | DNSOPCODEUPDATE | rcode));
+        write_uint16(reply + 8, 0);
+        write_uint16(reply + 10, 0);
+
+        unsigned char keyname[MAXLENDNSNAME + 2];
+        unsigned char algorithm[MAXLENDNSNAME + 2];
+        size_t keynamelen = dns_encode_name(keyname, sizeof(keyname), update->zone->keyname);
+        size_t algorithmlen = dns_encode_name(algorithm, sizeof(algorithm), TSIGALGORITHM);
+        uint64_t now = (uint64_t)time(NULL);
+        unsigned char timefudge[8];
+        write_uint16(timefudge, (uint16_t)(now >> 32));
+        write_uint32(timefudge + 2, (uint32_t)now);
+        write_uint16(timefudge + 6, TSIGFUDGE);
+        unsigned char errorother[4] = { 0, 0, 0, 0 };
+        write_uint16(errorother, tsigerror);
+        unsigned char mac[SHA256DIGESTSIZE];
+        size_t macsize = 0;
+        if (secret != NULL) {
+                unsigned char requestmacsize[2];
+                unsigned char classttl[6] = { 0, DNSCLASSANY, 0, 0, 0, 0 };
+                write_uint16(requestmacsize, SHA256DIGESTSIZE);
+                struct HmacSha256 hmac;
+                hmac_sha256_init(&hmac, secret, secretlen);
+                hmac_sha256_update(&hmac, requestmacsize, sizeof(requestmacsize));
+                hmac_sha256_update(&hmac, update->mac, SHA256DIGESTSIZE);
+                hmac_sha256_update(&hmac, reply, pos);
+                hmac_sha256_update(&hmac, keyname, keynamelen);
+                hmac_sha256_update(&hmac, classttl, sizeof(classttl));
+                hmac_sha256_update(&hmac, algorithm, algorithmlen);
+                hmac_sha256_update(&hmac, timefudge, sizeof(timefudge));
+                hmac_sha256_update(&hmac, errorother, sizeof(errorother));
+                hmac_sha256_final(&hmac, mac);
+                macsize = SHA256DIGESTSIZE;
+        }
+
+        memcpy(reply + pos, keyname, keynamelen);
+        pos += keynamelen;
+        write_uint16(reply + pos, DNSTYPETSIG);
+        write_uint16(reply + pos + 2, DNSCLASSANY);
+        write_uint32(reply + pos + 4, 0);
+        write_uint16(reply + pos + 8, (uint16_t)(algorithmlen + 10 + macsize + 6));
+        pos += 10;
+        memcpy(reply + pos, algorithm, algorithmlen);
+        pos += algorithmlen;
+        memcpy(reply + pos, timefudge, sizeof(timefudge));
+        write_uint16(reply + pos + 8, (uint16_t)macsize);
+        pos += 10;
+        memcpy(reply + pos, mac, macsize);
+        pos += macsize;
+        memcpy(reply + pos, update->msg, 2);
+        memcpy(reply + pos + 2, errorother, sizeof(errorother));
+        pos += 6;
+        write_uint16(reply + 10, 1);
+        return pos;
+}
+
+/**
+ * Build a signed UPDATE, check its TSIG record and check how the replies a server can send
+ * to it are taken.
+ */
+static void check_tsig(void)
+{
+        static unsigned char msg[MAXSIZEUPDATE];
+        unsigned char reply[MAXSIZEUPDATEREPLY];
+        struct DnsUpdateZone zone;
+        memset(&zone, 0, sizeof(zone));
+        strcpy(zone.name, "example.com");
+        strcpy(zone.keyname, "update-key.example.com");
+        zone.secretlen = from_hex("5c0d9a4f3e7b21c68e19f0a2b4d6c8e07a3f51d29c4b6e8a0d2f4c6b8e1a3c5d",
+                                  zone.secret);
+        strcpy(zone.records[0].name, "home.example.com");
+        zone.records[0].ttl = DEFAULTDNSUPDATETTL;
+        zone.numrecords = 1;
+
+        struct ZoneUpdate update;
+        memset(&update, 0, sizeof(update));
+        update.zone = &zone;
+        update.msg = msg;
+        check(build_update(&update, "192.0.2.1", "2001:db8::1", NULL) == 1, "build signed UPDATE");
+        check(read_uint16(msg + 10) == 1, "UPDATE has one additional record");
+
+        // The request MAC covers the message without the TSIG record and the TSIG variables.
+        size_t tsigstart = find_last_additional(msg, update.msglen);
+        struct TsigRecord tsig;
+        check(tsigstart > 0 && parse_tsig(msg, update.msglen, tsigstart, &tsig) &&
+              tsig.macsize == SHA256DIGESTSIZE, "UPDATE has a TSIG record");
+        unsigned char keyname[MAXLENDNSNAME + 2];
+        size_t keynamelen = dns_encode_name(keyname, sizeof(keyname), zone.keyname);
+        unsigned char header[DNSHEADERSIZE];
+        memcpy(header, msg, DNSHEADERSIZE);
+        write_uint16(header + 10, 0);
+        struct HmacSha256 hmac;
+        unsigned char mac[SHA256DIGESTSIZE];
+        hmac_sha256_init(&hmac, zone.secret, zone.secretlen);
+        hmac_sha256_update(&hmac, header, DNSHEADERSIZE);
+        hmac_sha256_update(&hmac, msg + DNSHEADERSIZE, tsigstart - DNSHEADERSIZE);
+        sign_tsig_variables(&hmac, keyname, keynamelen, tsig.algorithm, tsig.algorithmlen,
+                            tsig.timefudge, tsig.errorother, 4 + tsig.otherlen);
+        hmac_sha256_final(&hmac, mac);
+        check(memcmp(mac, tsig.mac, SHA256DIGESTSIZE) == 0 &&
+              memcmp(mac, update.mac, SHA256DIGESTSIZE) == 0, "UPDATE TSIG MAC");
+
+        size_t replylen = build_reply(&update, 0, zone.secret, zone.secretlen, 0, reply);
+        update.done = false;
+        check(check_reply(&update, reply, replylen, true) && update.done && update.updated,
+              "signed NOERROR reply is taken");
+
+        replylen = build_reply(&update, 0, zone.secret, zone.secretlen, 0, reply);
+        reply[replylen - 10] ^= 0x01;
+        update.done = false;
+        check(!check_reply(&update, reply, replylen, true) && !update.done,
+              "reply with a changed MAC is ignored");
+
+        unsigned char wrongsecret[SHA256DIGESTSIZE];
+        memset(wrongsecret, 0x42, sizeof(wrongsecret));
+        update.done = false;
+        update.updated = false;
+        replylen = build_reply(&update, 0, wrongsecret, sizeof(wrongsecret), 0, reply);
+        check(!check_reply(&update, reply, replylen, true) && !update.done,
+              "reply signed with another key is ignored");
+
+        update.done = false;
+        update.updated = false;
+        // Leave the TSIG record out, like a forged reply.
+        replylen = build_reply(&update, 0, NULL, 0, 0, reply);
+        replylen = find_last_additional(reply, replylen);
+        write_uint16(reply + 10, 0);
+        check(!check_reply(&update, reply, replylen, true) && !update.done,
+              "unsigned NOERROR reply is ignored");
+
+        update.done = false;
+        update.updated = false;
+        replylen = build_reply(&update, 0, zone.secret, zone.secretlen, 0, reply);
+        reply[0] ^= 0xff;
+        check(!check_reply(&update, reply, replylen, true) && !update.done,
+              "reply with another id is ignored");
+
+        update.done = false;
+        update.updated = false;
+        replylen = build_reply(&update, DNSRCODENOTAUTH, NULL, 0, 16, reply);
+        const char *tsigerror = get_tsig_error(reply, replylen,
+                                               find_last_additional(reply, replylen));
+        check(tsigerror != NULL && strcmp(tsigerror, "BADSIG") == 0, "NOTAUTH reply has BADSIG");
+        check(check_reply(&update, reply, replylen, true) && update.done && !update.updated,
+              "unsigned NOTAUTH reply ends the UPDATE");
+
+        replylen = build_reply(&update, 0, NULL, 0, 0, reply);
+        write_uint16(reply + 2, DNSFLAGQR | DNSOPCODEUPDATE | DNSFLAGTC);
+        update.done = false;
+        check(check_reply(&update, reply, replylen, true) && update.done && update.truncated,
+              "truncated reply makes the UPDATE go over TCP");
+}
+
+int main(void)
+{
+        check_hmac_sha256();
+        check_tsig();
+        printf("check_dnsupdate: %d checks, %d failed.\n", numchecks, numfailed);
+        return numfailed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
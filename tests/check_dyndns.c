@@ -0,0 +1,111 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+/*
+ * Checks how the replies of a dyndns2 provider are taken and how long the provider is not
+ * asked again after them. The source is included to reach the static functions of dyndns.c.
+ */
+#include "../dyndns.c"
+
+/* A reply of the provider to a request with numhosts hostnames and what it has to lead to. */
+struct ReplyCase {
+        const char *reply;
+        int numhosts;
+        bool proceed;
+        int result;
+        /* The hostnames per request after the reply, 0 if the request is not sent again. */
+        int maxhosts;
+        bool blocked;
+        bool pending;
+        bool waits;
+};
+
+static const struct ReplyCase replycases[] = {
+        { "good 192.0.2.1", 1, true, DYNDNSOK, 0, false, false, false },
+        { "nochg 192.0.2.1", 1, true, DYNDNSOK, 0, false, false, false },
+        { "good 192.0.2.1\r\nnochg 192.0.2.1\r\n", 2, true, DYNDNSOK, 0, false, false, false },
+        { "good 192.0.2.1", 3, true, DYNDNSOK, 0, false, false, false },
+        { "good 192.0.2.1\nnohost", 2, true, DYNDNSHOSTFAILED, 0, false, false, false },
+        { "notfqdn", 1, true, DYNDNSHOSTFAILED, 0, false, false, false },
+        { "badauth", 1, false, DYNDNSBLOCKED, 0, true, false, false },
+        { "badagent", 2, false, DYNDNSBLOCKED, 0, true, false, false },
+        { "abuse", 1, false, DYNDNSBLOCKED, 0, true, false, false },
+        { "!donator", 1, false, DYNDNSBLOCKED, 0, true, false, false },
+        { "911", 1, false, DYNDNSRETRYLATER, 0, false, true, true },
+        { "dnserr", 2, false, DYNDNSRETRYLATER, 0, false, true, true },
+        { "numhost", 4, true, DYNDNSOK, 2, false, false, false },
+        { "numhost", 1, true, DYNDNSHOSTFAILED, 0, false, false, false },
+        { "unknown answer", 1, true, DYNDNSFAILED, 0, false, true, false }
+};
+
+int main(void)
+{
+        static struct DyndnsProvider provider;
+        int numfailed = 0;
+        int numcases = (int)(sizeof(replycases) / sizeof(replycases[0]));
+        strcpy(provider.url, "https://members.example.com/nic/update");
+        provider.maxhosts = DEFAULTDYNDNSMAXHOSTS;
+        provider.numhosts = 4;
+        for (int h = 0; h < provider.numhosts; ++h) {
+                snprintf(provider.hosts[h].name, sizeof(provider.hosts[h].name),
+                         "host%d.example.com", h + 1);
+        }
+
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+        for (int i = 0; i < numcases; ++i) {
+                const struct ReplyCase *replycase = &replycases[i];
+                static struct ProviderUpdate update;
+                struct DyndnsBackoff backoff = { 0, 0, false, false, false };
+                memset(&update, 0, sizeof(update));
+                update.provider = &provider;
+                update.backoff = &backoff;
+                // Without a transfer curl reports no HTTP status, the reply text decides.
+                update.curlsession = curl_easy_init();
+                for (int h = 0; h < provider.numhosts; ++h) {
+                        update.hostnrs[h] = h;
+                }
+
+                update.numhosts = provider.numhosts;
+                update.numinrequest = replycase->numhosts;
+                update.maxhosts = provider.maxhosts;
+                strcpy(update.reply, replycase->reply);
+                update.replysize = strlen(update.reply);
+                bool proceed = finish_request(&update, CURLE_OK, false, true);
+                set_backoff(&update, 1000000, true);
+                curl_easy_cleanup(update.curlsession);
+                bool passed = proceed == replycase->proceed && update.result == replycase->result &&
+                              backoff.blocked == replycase->blocked &&
+                              backoff.pending == replycase->pending &&
+                              (backoff.retryat > 1000000) == replycase->waits;
+                if (replycase->maxhosts > 0) {
+                        passed = passed && update.maxhosts == replycase->maxhosts &&
+                                 update.numinrequest == 0;
+                }
+
+                if (!passed) {
+                        ++numfailed;
+                        printf("FAILED: reply \"%s\" to %d hostnames: proceed %d, result %d, "
+                               "blocked %d, pending %d, retryat %d.\n", replycase->reply,
+                               replycase->numhosts, proceed, update.result, backoff.blocked,
+                               backoff.pending, backoff.retryat);
+                }
+        }
+
+        curl_global_cleanup();
+        printf("check_dyndns: %d checks, %d failed.\n", numcases, numfailed);
+        return numfailed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
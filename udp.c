@@ -0,0 +1,124 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include "udp.h"
+
+/**
+ * Clear a query, without an open socket.
+ */
+void udp_init_query(struct UdpQuery *query)
+{
+        memset(query, 0, sizeof(*query));
+        query->sockfd = -1;
+}
+
+/**
+ * Bind a socket to the network interface or IPv4 source address the query is sent from.
+ * Binding to an interface by name needs CAP_NET_RAW on older kernels.
+ * @return false if the socket could not be bound.
+ */
+static bool bind_interface(int sockfd, const char *interface)
+{
+        struct sockaddr_in source;
+        memset(&source, 0, sizeof(source));
+        source.sin_family = AF_INET;
+        if (inet_pton(AF_INET, interface, &source.sin_addr) == 1) {
+                return bind(sockfd, (struct sockaddr *)&source, sizeof(source)) == 0;
+        }
+
+        return setsockopt(sockfd, SOL_SOCKET, SO_BINDTODEVICE, interface,
+                          strnlen(interface, IFNAMSIZ)) == 0;
+}
+
+/**
+ * Send the query to the server, the first time a connected non-blocking UDP socket is
+ * opened so only datagrams from the server are received. Sending again is a retry.
+ * @return false if the query could not be sent.
+ */
+bool udp_send_query(struct UdpQuery *query)
+{
+        if (query->sockfd < 0) {
+                query->sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                if (query->sockfd < 0) {
+                        return false;
+                }
+
+                if (query->interface != NULL && !bind_interface(query->sockfd, query->interface)) {
+                        udp_close(query);
+                        return false;
+                }
+
+                if (connect(query->sockfd, (struct sockaddr *)&query->server, sizeof(query->server)) != 0) {
+                        udp_close(query);
+                        return false;
+                }
+        }
+
+        ++query->numsent;
+        return send(query->sockfd, query->querymsg, query->querylen, 0) == (ssize_t)query->querylen;
+}
+
+/**
+ * Read the reply of the server without blocking.
+ * Datagrams that are not a reply to the query are ignored.
+ * @param parser     The function that parses a reply of the protocol.
+ * @param answer     Set to the ip address text from the reply.
+ * @param answersize The size of the answer buffer.
+ * @return UDPANSWER, UDPNOANSWERYET or a UDPERROR code.
+ */
+int udp_read_answer(struct UdpQuery *query, udp_reply_parser parser, char *answer, size_t answersize)
+{
+        unsigned char msg[MAXSIZEUDPREPLY];
+        while (query->sockfd >= 0) {
+                ssize_t msglen = recv(query->sockfd, msg, sizeof(msg), 0);
+                if (msglen < 0) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                                return UDPNOANSWERYET;
+                        }
+
+                        // For example connection refused if nothing listens on the port.
+                        return UDPERRORSOCKET;
+                }
+
+                int result = parser(query, msg, (size_t)msglen, answer, answersize);
+                if (result != UDPNOANSWERYET) {
+                        return result;
+                }
+        }
+
+        return UDPERRORSOCKET;
+}
+
+/**
+ * Close the socket of the query.
+ */
+void udp_close(struct UdpQuery *query)
+{
+        if (query->sockfd >= 0) {
+                close(query->sockfd);
+                query->sockfd = -1;
+        }
+}
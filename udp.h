@@ -0,0 +1,57 @@
+/***************************************************************************
+ *    Copyright (C) 2018-2020 D9ping
+ *
+ * IpAddressExpress is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * IpAddressExpress is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with IpAddressExpress. If not, see <http://www.gnu.org/licenses/>.
+ *
+ ***************************************************************************/
+#ifndef UDP_H
+#define UDP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#define MAXSIZEUDPQUERY    272
+#define MAXSIZEUDPREPLY    512
+#define UDPANSWER          0
+#define UDPNOANSWERYET     1
+#define UDPERRORSOCKET     -1
+#define UDPERRORRESPONSE   -2
+#define UDPERRORNAME       -3
+#define UDPERRORREFUSED    -4
+
+/* A single datagram query to one server, for the ipservices that are not asked over curl. */
+struct UdpQuery {
+        struct sockaddr_in server;
+        unsigned char querymsg[MAXSIZEUDPQUERY];
+        size_t querylen;
+        int sockfd;
+        int numsent;
+        /* The network interface name or IPv4 source address to send from, or NULL. */
+        const char *interface;
+};
+
+/* Parses a reply, returns UDPNOANSWERYET if the datagram is not a reply to the query. */
+typedef int (*udp_reply_parser)(const struct UdpQuery *query, const unsigned char *msg,
+                                size_t msglen, char *answer, size_t answersize);
+
+void udp_init_query(struct UdpQuery *query);
+
+bool udp_send_query(struct UdpQuery *query);
+
+int udp_read_answer(struct UdpQuery *query, udp_reply_parser parser, char *answer, size_t answersize);
+
+void udp_close(struct UdpQuery *query);
+
+#endif